@@ -0,0 +1,781 @@
+//mrcc-bench - part of mrcc
+//Zhiqiang Ma https://www.ericzma.com
+
+#include <stdarg.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <string.h>
+#include <time.h>
+#include <ctype.h>
+#include <assert.h>
+#include <fcntl.h>
+
+#include <sys/fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <signal.h>
+
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "mrcc-bench.h"
+#include "traceenv.h"
+#include "trace.h"
+#include "utils.h"
+#include "stringutils.h"
+#include "tempfile.h"
+#include "exec.h"
+#include "events.h"
+
+/**
+ * @file
+ * @brief Build throughput benchmark.
+ *
+ * mrcc-bench writes a synthetic project, DIR/src, and builds it with
+ * make at several -j levels through each backend it is asked for,
+ * timing every build.  The project is FILES translation units of
+ * about LINES lines each, every one including FANOUT of HEADERS
+ * headers, and ERRORS percent of them do not compile; all of it is
+ * made from SEED, so that two runs build the same project.
+ *
+ * The backends are in bench_backends[]: plain gcc for the baseline,
+ * an mrccd started on this machine, the same in pump mode,
+ * MapReduce through whatever hadoop mrcc runs, and MapReduce on the
+ * cluster mrcc-hadoop emulates on this machine.  Every mrcc build gets
+ * MRCC_DIR and MRCC_EVENTS of its own under DIR, and the event log
+ * (see events.c) gives the time spent in each phase and the number of
+ * compiles that fell back to this machine.
+ *
+ * Every build prints one line of JSON on stdout, so that the numbers
+ * before and after a change can be compared by a script.
+ **/
+
+const char* mrcc_bench_version = "0.1.0";
+
+const char* rs_program_name = "mrcc-bench";
+
+// what to build, and how
+struct bench_opts {
+    int files;
+    int lines;
+    int headers;
+    int fanout;
+    int errors;                 // percent of files that do not compile
+    int cxx;
+    unsigned seed;
+    int jobs[16];
+    int n_jobs;
+    int repeat;
+    int port;
+    const char* dir;
+    const char* bin;            // where mrcc and mrccd are, or NULL
+};
+
+// one way to build, see bench_backends[]
+struct bench_backend {
+    const char* name;
+    int uses_mrcc;
+    int (*start)(const struct bench_opts* o);
+    void (*stop)(void);
+};
+
+static pid_t bench_mrccd_pid = 0;
+
+static void bench_show_version()
+{
+    printf(
+"mrcc-bench %s built at %s, %s\n"
+"Copyright (C) 2009 by Zhiqiang Ma.\n"
+"mrcc-bench comes with ABSOLUTELY NO WARRANTY. mrcc-bench is free software,\n"
+"and you may use, modify and redistribute it under the terms of the GNU\n"
+"General Public License version 2.\n"
+"Please report bugs to eric.zq.ma [at] gmail.com.\n"
+"\n"
+        ,
+        mrcc_bench_version, __TIME__, __DATE__);
+}
+
+static void bench_show_usage()
+{
+    printf(
+"Usage:\n"
+"   mrcc-bench [OPTIONS] [BACKEND...]\n"
+"\n"
+"Options:\n"
+"   --dir DIR                  where to write the project and the logs\n"
+"                              (default mrcc-bench.out)\n"
+"   --bin DIR                  where mrcc and mrccd are (default: $PATH)\n"
+"   --files N                  translation units (default 64)\n"
+"   --lines N                  lines of each of them (default 400)\n"
+"   --headers N                headers (default 32)\n"
+"   --fanout N                 headers each unit includes (default 8)\n"
+"   --errors PERCENT           units that do not compile (default 0)\n"
+"   --lang c|c++               language of the project (default c)\n"
+"   --seed N                   make a different project\n"
+"   --jobs N[,N...]            make -j levels (default 1,4,16)\n"
+"   --repeat N                 builds at each level (default 1)\n"
+"   --port PORT                port of the mrccd it starts (default 3733)\n"
+"   --help                     explain usage and exit\n"
+"   --version                  show version and exit\n"
+"\n"
+"Backends:\n"
+"   gcc                        the compiler alone, as the baseline\n"
+"   mrccd                      mrcc and an mrccd on this machine\n"
+"   mrccd-pump                 the same with the mrccd preprocessing\n"
+"   mapreduce                  mrcc and MapReduce, as configured\n"
+"   emulated                   mrcc and MapReduce on the cluster that\n"
+"                              mrcc-hadoop emulates here, as MRCC_EMU_*\n"
+"                              say\n"
+"(default: gcc mrccd)\n"
+"\n"
+"mrcc-bench is part of mrcc.  It prints a line of JSON for every\n"
+"build: its wall time, the time of each phase, how many compiles fell\n"
+"back to this machine and how many objects it made.\n"
+        );
+}
+
+/* The next number of the project, from a linear congruential
+ * generator, so that every SEED gives the same project everywhere. */
+static unsigned bench_rand(unsigned* state)
+{
+    *state = *state * 1103515245u + 12345u;
+    return (*state >> 16) & 0x7fff;
+}
+
+/* Write @p name in the project from @p fmt. */
+static int bench_write(const struct bench_opts* o, const char* name,
+                       const char* fmt, ...)
+{
+    char* path = NULL;
+    FILE* f;
+    va_list va;
+
+    if (asprintf(&path, "%s/src/%s", o->dir, name) == -1)
+        return EXIT_OUT_OF_MEMORY;
+    if ((f = fopen(path, "w")) == NULL) {
+        rs_log_error("failed to create %s: %s", path, strerror(errno));
+        free(path);
+        return EXIT_IO_ERROR;
+    }
+    va_start(va, fmt);
+    vfprintf(f, fmt, va);
+    va_end(va);
+    if (fclose(f) != 0) {
+        rs_log_error("failed to write %s: %s", path, strerror(errno));
+        free(path);
+        return EXIT_IO_ERROR;
+    }
+    free(path);
+    return 0;
+}
+
+/* Header @p h: a few declarations, and an inline function for cpp and
+ * the compiler to chew on. */
+static int bench_gen_header(const struct bench_opts* o, int h)
+{
+    char name[32];
+
+    snprintf(name, sizeof name, "h%04d.h", h);
+    return bench_write(o, name,
+"#ifndef H%04d_H\n"
+"#define H%04d_H\n"
+"#include \"common.h\"\n"
+"\n"
+"struct s%04d { int a[8]; long b; double c; };\n"
+"#define H%04d_MIX(x) ((x) * %d + (x) / %d)\n"
+"extern int g%04d;\n"
+"\n"
+"static inline long h%04d_sum(const struct s%04d *s)\n"
+"{\n"
+"    long r = s->b;\n"
+"    int i;\n"
+"\n"
+"    for (i = 0; i < 8; i++)\n"
+"        r += H%04d_MIX(s->a[i]);\n"
+"    return r + (long) s->c;\n"
+"}\n"
+"#endif\n",
+        h, h, h, h, h % 7 + 3, h % 5 + 2, h, h, h, h);
+}
+
+/* Translation unit @p n, including @p o->fanout of the headers. */
+static int bench_gen_unit(const struct bench_opts* o, int n, unsigned* rnd)
+{
+    char name[32];
+    char* text = NULL;
+    char* more;
+    int i, h, len, broken;
+
+    if (asprintf(&text, "#include \"common.h\"\n") == -1)
+        return EXIT_OUT_OF_MEMORY;
+    for (i = 0; i < o->fanout && o->headers > 0; i++) {
+        h = bench_rand(rnd) % o->headers;
+        if (asprintf(&more, "%s#include \"h%04d.h\"\n", text, h) == -1)
+            goto oom;
+        free(text);
+        text = more;
+    }
+    if (o->cxx) {
+        if (asprintf(&more,
+"%s\n"
+"template <typename T> struct acc%04d {\n"
+"    T v;\n"
+"    acc%04d() : v() {}\n"
+"    void add(T x) { v += x * 3 - x / 2; }\n"
+"};\n", text, n, n) == -1)
+            goto oom;
+        free(text);
+        text = more;
+    }
+
+    broken = (int) (bench_rand(rnd) % 100) < o->errors;
+    /* a function is 12 lines */
+    len = o->lines / 12 > 0 ? o->lines / 12 : 1;
+    for (i = 0; i < len; i++) {
+        if (asprintf(&more,
+"%s\n"
+"long u%04d_f%d(int n, const int *v)\n"
+"{\n"
+"    long r = %d;\n"
+"    int i;\n"
+"\n"
+"    for (i = 0; i < n; i++) {\n"
+"        r = r * %d + v[i];\n"
+"        if (r > %d)\n"
+"            r %%= %d;\n"
+"    }\n"
+"    return r%s;\n"
+"}\n", text, n, i, (int) bench_rand(rnd), (int) bench_rand(rnd) % 31 + 2,
+            (int) bench_rand(rnd) + 1000, (int) bench_rand(rnd) + 7,
+            broken && i == len / 2 ? " +" : "") == -1)
+            goto oom;
+        free(text);
+        text = more;
+    }
+
+    snprintf(name, sizeof name, "u%04d.%s", n, o->cxx ? "cc" : "c");
+    i = bench_write(o, name, "%s", text);
+    free(text);
+    return i;
+
+oom:
+    free(text);
+    return EXIT_OUT_OF_MEMORY;
+}
+
+/* Write the project: headers, units and the Makefile. */
+static int bench_generate(const struct bench_opts* o)
+{
+    char* dir = NULL;
+    char* objs = NULL;
+    char* more;
+    unsigned rnd = o->seed;
+    int i, ret;
+
+    if (asprintf(&dir, "%s/src", o->dir) == -1)
+        return EXIT_OUT_OF_MEMORY;
+    /* a project of other options may be there */
+    mrcc_remove_tree(dir);
+    ret = mrcc_mkdir_p(dir);
+    free(dir);
+    if (ret)
+        return ret;
+
+    if ((ret = bench_write(o, "common.h",
+"#ifndef COMMON_H\n"
+"#define COMMON_H\n"
+"#include <stddef.h>\n"
+"#include <string.h>\n"
+"#include <stdlib.h>\n"
+"#endif\n")) != 0)
+        return ret;
+    for (i = 0; i < o->headers; i++) {
+        if ((ret = bench_gen_header(o, i)) != 0)
+            return ret;
+    }
+
+    if ((objs = strdup("")) == NULL)
+        return EXIT_OUT_OF_MEMORY;
+    for (i = 0; i < o->files; i++) {
+        if ((ret = bench_gen_unit(o, i, &rnd)) != 0)
+            goto out;
+        if (asprintf(&more, "%s u%04d.o", objs, i) == -1) {
+            ret = EXIT_OUT_OF_MEMORY;
+            goto out;
+        }
+        free(objs);
+        objs = more;
+    }
+
+    ret = bench_write(o, "Makefile",
+"# made by mrcc-bench\n"
+"CFLAGS = -O2 -I.\n"
+"CXXFLAGS = -O2 -I.\n"
+"OBJS =%s\n"
+"\n"
+"all: $(OBJS)\n"
+"\n"
+"%%.o: %%.c\n"
+"\t$(CC) $(CFLAGS) -c $< -o $@\n"
+"\n"
+"%%.o: %%.cc\n"
+"\t$(CXX) $(CXXFLAGS) -c $< -o $@\n"
+"\n"
+"clean:\n"
+"\trm -f $(OBJS)\n", objs);
+
+out:
+    free(objs);
+    return ret;
+}
+
+/* @p prog of --bin, or as found in $PATH. */
+static char* bench_prog(const struct bench_opts* o, const char* prog)
+{
+    char* path = NULL;
+
+    if (o->bin == NULL)
+        return strdup(prog);
+    if (asprintf(&path, "%s/%s", o->bin, prog) == -1)
+        return NULL;
+    return path;
+}
+
+static int bench_start_none(const struct bench_opts* o)
+{
+    (void) o;
+    return 0;
+}
+
+static void bench_stop_none(void)
+{
+}
+
+/* Start an mrccd on --port, and wait until it takes connections. */
+static int bench_start_mrccd_on(const struct bench_opts* o, int pump)
+{
+    struct sockaddr_in sa;
+    char port[16];
+    char hosts[64];
+    char* prog;
+    char* log = NULL;
+    char* argv[6];
+    int i, fd, log_fd, ret;
+
+    if ((prog = bench_prog(o, "mrccd")) == NULL
+            || asprintf(&log, "%s/mrccd.log", o->dir) == -1) {
+        free(prog);
+        return EXIT_OUT_OF_MEMORY;
+    }
+    log_fd = open(log, O_WRONLY|O_CREAT|O_APPEND|O_CLOEXEC, 0666);
+    if (log_fd == -1)
+        rs_log_warning("failed to open %s: %s", log, strerror(errno));
+    snprintf(port, sizeof port, "%d", o->port);
+    argv[0] = prog;
+    argv[1] = "--port";
+    argv[2] = port;
+    argv[3] = NULL;
+    ret = spawn_command(argv, &bench_mrccd_pid, -1, log_fd, log_fd);
+    if (log_fd != -1)
+        close(log_fd);
+    free(prog);
+    free(log);
+    if (ret)
+        return ret;
+
+    memset(&sa, 0, sizeof sa);
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons(o->port);
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    for (i = 0; i < 100; i++) {
+        if ((fd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+            break;
+        ret = connect(fd, (struct sockaddr*) &sa, sizeof sa);
+        close(fd);
+        if (ret == 0)
+            break;
+        usleep(50000);
+    }
+    if (ret != 0) {
+        rs_log_error("mrccd did not come up on port %d", o->port);
+        return EXIT_CONNECT_FAILED;
+    }
+
+    snprintf(hosts, sizeof hosts, "127.0.0.1:%d%s", o->port,
+             pump ? ",cpp" : "");
+    setenv("MRCC_HOSTS", hosts, 1);
+    return 0;
+}
+
+static int bench_start_mrccd(const struct bench_opts* o)
+{
+    return bench_start_mrccd_on(o, 0);
+}
+
+static int bench_start_pump(const struct bench_opts* o)
+{
+    return bench_start_mrccd_on(o, 1);
+}
+
+static void bench_stop_mrccd(void)
+{
+    int status;
+
+    unsetenv("MRCC_HOSTS");
+    if (bench_mrccd_pid == 0)
+        return;
+    kill(bench_mrccd_pid, SIGTERM);
+    while (waitpid(bench_mrccd_pid, &status, 0) == -1 && errno == EINTR)
+        ;
+    bench_mrccd_pid = 0;
+}
+
+static int bench_start_mapreduce(const struct bench_opts* o)
+{
+    (void) o;
+    unsetenv("MRCC_HOSTS");
+    return 0;
+}
+
+/* MapReduce on the cluster mrcc-hadoop emulates here */
+static int bench_start_emulated(const struct bench_opts* o)
+{
+    char* hadoop = bench_prog(o, "mrcc-hadoop");
+    char* mapper = bench_prog(o, "mrcc-map");
+    int ret = EXIT_OUT_OF_MEMORY;
+
+    if (hadoop && mapper) {
+        unsetenv("MRCC_HOSTS");
+        setenv("MRCC_HADOOP", hadoop, 1);
+        setenv("MRCC_MAPPER", mapper, 1);
+        ret = 0;
+    }
+    free(mapper);
+    free(hadoop);
+    return ret;
+}
+
+static void bench_stop_emulated(void)
+{
+    unsetenv("MRCC_HADOOP");
+    unsetenv("MRCC_MAPPER");
+}
+
+static const struct bench_backend bench_backends[] = {
+    { "gcc", 0, bench_start_none, bench_stop_none },
+    { "mrccd", 1, bench_start_mrccd, bench_stop_mrccd },
+    { "mrccd-pump", 1, bench_start_pump, bench_stop_mrccd },
+    { "mapreduce", 1, bench_start_mapreduce, bench_stop_none },
+    { "emulated", 1, bench_start_emulated, bench_stop_emulated },
+    { NULL, 0, NULL, NULL }
+};
+
+static const struct bench_backend* bench_find_backend(const char* name)
+{
+    int i;
+
+    for (i = 0; bench_backends[i].name; i++) {
+        if (!strcmp(bench_backends[i].name, name))
+            return &bench_backends[i];
+    }
+    return NULL;
+}
+
+/* Objects the last build made. */
+static int bench_count_objects(const struct bench_opts* o)
+{
+    char* path = NULL;
+    struct stat st;
+    int i, n = 0;
+
+    for (i = 0; i < o->files; i++) {
+        if (asprintf(&path, "%s/src/u%04d.o", o->dir, i) == -1)
+            break;
+        n += stat(path, &st) == 0;
+        free(path);
+    }
+    return n;
+}
+
+/* Print the phases in the event log @p fname as JSON, and count the
+ * compiles and the fallbacks. */
+static void bench_print_phases(const char* fname, int* compiles,
+                               int* fallbacks)
+{
+    long long count[EVENT_N], total[EVENT_N], max[EVENT_N], bytes[EVENT_N];
+    long long start, dur, b;
+    char line[1024];
+    char phase[32];
+    int result, i;
+    long id;
+    FILE* f;
+
+    memset(count, 0, sizeof count);
+    memset(total, 0, sizeof total);
+    memset(max, 0, sizeof max);
+    memset(bytes, 0, sizeof bytes);
+    if ((f = fopen(fname, "r")) != NULL) {
+        while (fgets(line, sizeof line, f)) {
+            if (sscanf(line, "%lld %lld %31s %d %lld %ld", &start, &dur,
+                       phase, &result, &b, &id) != 6)
+                continue;
+            for (i = 0; i < EVENT_N; i++) {
+                if (strcmp(event_names[i], phase))
+                    continue;
+                count[i]++;
+                total[i] += dur;
+                bytes[i] += b;
+                if (dur > max[i])
+                    max[i] = dur;
+            }
+        }
+        fclose(f);
+    }
+    *compiles = (int) count[EVENT_SCAN_ARGS];
+    *fallbacks = (int) count[EVENT_FALLBACK];
+
+    printf("\"phases\":{");
+    for (i = 0; i < EVENT_N; i++) {
+        printf("%s\"%s\":{\"count\":%lld,\"total_ms\":%.3f,\"max_ms\":%.3f,"
+               "\"bytes\":%lld}", i ? "," : "", event_names[i], count[i],
+               total[i] / 1000.0, max[i] / 1000.0, bytes[i]);
+    }
+    printf("}");
+}
+
+/* Build the project once with @p jobs through @p b. */
+static int bench_build(const struct bench_opts* o,
+                       const struct bench_backend* b, int jobs, int run)
+{
+    char* src = NULL;
+    char* events = NULL;
+    char* mrcc_dir = NULL;
+    char* out = NULL;
+    char* err = NULL;
+    char* mrcc = NULL;
+    char* cc = NULL;
+    char* cxx = NULL;
+    char j[16];
+    char* argv[8];
+    struct timespec t0, t1;
+    int status = -1;
+    int compiles = 0, fallbacks = 0;
+    int ret = EXIT_OUT_OF_MEMORY;
+
+    if (asprintf(&src, "%s/src", o->dir) == -1
+            || asprintf(&events, "%s/events-%s-j%d-%d", o->dir, b->name,
+                        jobs, run) == -1
+            || asprintf(&mrcc_dir, "%s/mrcc-%s", o->dir, b->name) == -1
+            || asprintf(&out, "%s/build.out", o->dir) == -1
+            || asprintf(&err, "%s/build.err", o->dir) == -1
+            || (mrcc = bench_prog(o, "mrcc")) == NULL)
+        goto out;
+    if (b->uses_mrcc) {
+        if (asprintf(&cc, "CC=%s gcc", mrcc) == -1
+                || asprintf(&cxx, "CXX=%s g++", mrcc) == -1)
+            goto out;
+    } else if ((cc = strdup("CC=gcc")) == NULL
+               || (cxx = strdup("CXX=g++")) == NULL) {
+        goto out;
+    }
+
+    argv[0] = "make";
+    argv[1] = "-s";
+    argv[2] = "-C";
+    argv[3] = src;
+    argv[4] = "clean";
+    argv[5] = NULL;
+    if ((ret = run_command("make", argv, out, err, NULL, NULL, 0,
+                           &status)) != 0)
+        goto out;
+
+    /* the compiles of this build only, with nothing from before */
+    unlink(events);
+    if ((ret = mrcc_mkdir_p(mrcc_dir)) != 0)
+        goto out;
+    setenv("MRCC_EVENTS", events, 1);
+    setenv("MRCC_DIR", mrcc_dir, 1);
+    setenv("MRCC_COST_MODEL", "0", 1);
+
+    snprintf(j, sizeof j, "-j%d", jobs);
+    argv[0] = "make";
+    argv[1] = "-s";
+    argv[2] = "-k";
+    argv[3] = j;
+    argv[4] = "-C";
+    argv[5] = src;
+    argv[6] = o->cxx ? cxx : cc;
+    argv[7] = NULL;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    ret = run_command("make", argv, out, err, NULL, NULL, 0, &status);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    if (ret)
+        goto out;
+
+    printf("{\"backend\":\"%s\",\"jobs\":%d,\"run\":%d,\"files\":%d,"
+           "\"lines\":%d,\"headers\":%d,\"fanout\":%d,\"errors\":%d,"
+           "\"lang\":\"%s\",\"seed\":%u,\"wall_ms\":%.3f,"
+           "\"make_status\":%d,\"objects\":%d,",
+           b->name, jobs, run, o->files, o->lines, o->headers, o->fanout,
+           o->errors, o->cxx ? "c++" : "c", o->seed,
+           (t1.tv_sec - t0.tv_sec) * 1000.0
+           + (t1.tv_nsec - t0.tv_nsec) / 1000000.0,
+           WIFEXITED(status) ? WEXITSTATUS(status) : -1,
+           bench_count_objects(o));
+    bench_print_phases(events, &compiles, &fallbacks);
+    printf(",\"compiles\":%d,\"fallbacks\":%d}\n", compiles, fallbacks);
+    fflush(stdout);
+
+out:
+    unsetenv("MRCC_EVENTS");
+    free(src);
+    free(events);
+    free(mrcc_dir);
+    free(out);
+    free(err);
+    free(mrcc);
+    free(cc);
+    free(cxx);
+    return ret;
+}
+
+/* Parse the list of -j levels @p s into @p o. */
+static int bench_parse_jobs(struct bench_opts* o, const char* s)
+{
+    char* end;
+    long n;
+
+    o->n_jobs = 0;
+    while (*s) {
+        n = strtol(s, &end, 10);
+        if (end == s || n <= 0
+                || o->n_jobs == (int) (sizeof(o->jobs) / sizeof(o->jobs[0])))
+            return EXIT_BAD_ARGUMENTS;
+        o->jobs[o->n_jobs++] = (int) n;
+        s = *end == ',' ? end + 1 : end;
+        if (*end != ',' && *end != '\0')
+            return EXIT_BAD_ARGUMENTS;
+    }
+    return o->n_jobs ? 0 : EXIT_BAD_ARGUMENTS;
+}
+
+int main(int argc, char* argv[])
+{
+    struct bench_opts o;
+    const struct bench_backend* chosen[8];
+    int n_chosen = 0;
+    int b, j, r, i, ret = 0;
+
+    memset(&o, 0, sizeof o);
+    o.files = 64;
+    o.lines = 400;
+    o.headers = 32;
+    o.fanout = 8;
+    o.seed = 1;
+    o.repeat = 1;
+    o.port = 3733;
+    o.dir = "mrcc-bench.out";
+    bench_parse_jobs(&o, "1,4,16");
+
+    for (i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--help")) {
+            bench_show_version();
+            bench_show_usage();
+            return 0;
+        } else if (!strcmp(argv[i], "--version")) {
+            bench_show_version();
+            return 0;
+        } else if (i + 1 < argc && argv[i][0] == '-') {
+            const char* opt = argv[i];
+            const char* val = argv[++i];
+
+            if (!strcmp(opt, "--dir")) {
+                o.dir = val;
+            } else if (!strcmp(opt, "--bin")) {
+                o.bin = val;
+            } else if (!strcmp(opt, "--files")) {
+                o.files = atoi(val);
+            } else if (!strcmp(opt, "--lines")) {
+                o.lines = atoi(val);
+            } else if (!strcmp(opt, "--headers")) {
+                o.headers = atoi(val);
+            } else if (!strcmp(opt, "--fanout")) {
+                o.fanout = atoi(val);
+            } else if (!strcmp(opt, "--errors")) {
+                o.errors = atoi(val);
+            } else if (!strcmp(opt, "--lang") && !strcmp(val, "c")) {
+                o.cxx = 0;
+            } else if (!strcmp(opt, "--lang") && !strcmp(val, "c++")) {
+                o.cxx = 1;
+            } else if (!strcmp(opt, "--seed")) {
+                o.seed = (unsigned) strtoul(val, NULL, 10);
+            } else if (!strcmp(opt, "--jobs")) {
+                if (bench_parse_jobs(&o, val) != 0) {
+                    bench_show_usage();
+                    return EXIT_BAD_ARGUMENTS;
+                }
+            } else if (!strcmp(opt, "--repeat")) {
+                o.repeat = atoi(val);
+            } else if (!strcmp(opt, "--port")) {
+                o.port = atoi(val);
+            } else {
+                bench_show_usage();
+                return EXIT_BAD_ARGUMENTS;
+            }
+        } else if (argv[i][0] != '-' && bench_find_backend(argv[i])
+                   && n_chosen < (int) (sizeof(chosen) / sizeof(chosen[0]))) {
+            chosen[n_chosen++] = bench_find_backend(argv[i]);
+        } else {
+            bench_show_usage();
+            return EXIT_BAD_ARGUMENTS;
+        }
+    }
+    if (n_chosen == 0) {
+        chosen[n_chosen++] = bench_find_backend("gcc");
+        chosen[n_chosen++] = bench_find_backend("mrccd");
+    }
+    if (o.files <= 0 || o.lines <= 0 || o.headers < 0 || o.fanout < 0
+            || o.errors < 0 || o.errors > 100 || o.repeat <= 0) {
+        bench_show_usage();
+        return EXIT_BAD_ARGUMENTS;
+    }
+
+    set_trace_from_env();
+    ignore_sigpipe(1);
+
+    /* make runs the compiles in DIR/src, so the names must not be
+     * relative */
+    if ((ret = mrcc_mkdir_p(o.dir)) != 0)
+        return ret;
+    if ((o.dir = realpath(o.dir, NULL)) == NULL
+            || (o.bin && (o.bin = realpath(o.bin, NULL)) == NULL)) {
+        rs_log_error("failed to find %s: %s", o.bin ? o.bin : "--dir",
+                     strerror(errno));
+        return EXIT_NO_SUCH_FILE;
+    }
+
+    if ((ret = bench_generate(&o)) != 0)
+        return ret;
+
+    for (b = 0; b < n_chosen && ret == 0; b++) {
+        if ((ret = chosen[b]->start(&o)) != 0) {
+            rs_log_error("backend %s did not start", chosen[b]->name);
+            chosen[b]->stop();
+            break;
+        }
+        for (j = 0; j < o.n_jobs && ret == 0; j++) {
+            for (r = 1; r <= o.repeat && ret == 0; r++)
+                ret = bench_build(&o, chosen[b], o.jobs[j], r);
+        }
+        chosen[b]->stop();
+    }
+    return ret;
+}
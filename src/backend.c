@@ -0,0 +1,547 @@
+// mrcc - A C Compiler system on MapReduce
+// Zhiqiang Ma, https://www.ericzma.com
+
+#include <stdarg.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <string.h>
+#include <time.h>
+#include <ctype.h>
+#include <assert.h>
+#include <fcntl.h>
+
+#include <sys/fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <signal.h>
+
+#include <sys/wait.h>
+
+#include "utils.h"
+#include "trace.h"
+#include "args.h"
+#include "exec.h"
+#include "lock.h"
+#include "netfsutils.h"
+#include "stringutils.h"
+#include "fscache.h"
+#include "compress.h"
+#include "rpc.h"
+#include "deadline.h"
+#include "events.h"
+#include "batch.h"
+#include "backend.h"
+
+/**
+ * @file
+ * @brief The ways of running compiles elsewhere.
+ *
+ * compile_remote() hands every compile to a backend (see struct
+ * backend), so that the work can go wherever there is capacity:
+ *
+ *     hadoop   a Hadoop streaming job, one map task running mrcc-map
+ *              (see mrutils.c); the default
+ *     local    mrcc-map run on this machine, within the slots of local
+ *              compiles (MRCC_LOCAL_SLOTS)
+ *     cmd      mrcc-map run by the command MRCC_BACKEND_CMD, for batch
+ *              schedulers and the like
+ *     tcp      an mrccd host (see remote.c)
+ *
+ * MRCC_BACKEND names the backend; a host of MRCC_HOSTS that compile.c
+ * picked always goes to mrccd.  Those that run mrcc-map take the .i
+ * from net fs and leave the object there, as a map task does, so they
+ * work wherever the net fs can be reached.
+ *
+ * MRCC_BACKEND_CMD is run with /bin/sh -c after "%c" in it is replaced
+ * by the mrcc-map command line, quoted for the shell, "%j" by a name
+ * for the job made of the host name and pid, and "%%" by "%", for
+ * example "srun -J %j %c" or "ssh builder %c".  The command must not return before mrcc-map has
+ * finished, and must fail if mrcc-map does.  If the job has to be
+ * taken back, the command is killed, and MRCC_BACKEND_CANCEL, if set,
+ * is run the same way, for example "scancel -n %j".
+ **/
+
+/**
+ * @brief The mapper mrcc-map runs as: $MRCC_MAPPER if it is set,
+ * otherwise /usr/bin/mrcc-map.  It may have options after it.
+ */
+const char *backend_mapper(void)
+{
+    const char *cmd = getenv("MRCC_MAPPER");
+
+    return cmd && cmd[0] ? cmd : "/usr/bin/mrcc-map";
+}
+
+/**
+ * @brief Set up @p job with nothing in it.
+ */
+void backend_job_init(struct backend_job *job)
+{
+    memset(job, 0, sizeof(*job));
+    job->cpp_fd = -1;
+    job->local_cpu_lock_fd = -1;
+    job->state = BACKEND_IDLE;
+    job->cmd.pid = 0;
+    job->cmd.rfd = -1;
+    job->cmd.err_fd = -1;
+    job->fd = -1;
+    job->lock_fd = -1;
+}
+
+/**
+ * @brief Free what backend_map_job() and the backend left in @p job.
+ * The job itself must be over.
+ */
+void backend_job_free(struct backend_job *job)
+{
+    if (job->map_argv)
+        free_argv(job->map_argv);
+    if (job->map_options)
+        free_argv(job->map_options);
+    free(job->map_output_fname);
+    if (job->own_log && job->log_fname)
+        unlink(job->log_fname);
+    if (job->own_log)
+        free(job->log_fname);
+    free(job->name);
+    job->map_argv = NULL;
+    job->map_options = NULL;
+    job->map_output_fname = NULL;
+    job->log_fname = NULL;
+    job->own_log = 0;
+    job->name = NULL;
+}
+
+/**
+ * @brief Work out what mrcc-map is to do for @p job: the compiler
+ * command on the .i, writing the object under the name the backends
+ * take it back from, and the options that tell mrcc-map where our
+ * files are and what it is going to get.
+ * @return 0 on success, otherwise error return code.
+ */
+int backend_map_job(struct backend_job *job)
+{
+    enum compress compr = compress_from_env();
+    enum protover protover;
+    const char *fs_dir;
+    char *option = NULL;
+    char *fsname;
+    int i;
+
+    if ((job->map_options = calloc(4, sizeof(char *))) == NULL)
+        return EXIT_OUT_OF_MEMORY;
+    if ((fs_dir = fs_work_dir()) == NULL
+            || asprintf(&option, "--fs-dir=%s", fs_dir) == -1)
+        return EXIT_OUT_OF_MEMORY;
+    job->map_options[0] = option;
+    if (compr != MRCC_COMPRESS_NONE
+            && get_protover_from_features(compr,
+                                          MRCC_CPP_ON_CLIENT, &protover) > 0) {
+        if (asprintf(&option, "--protover=%d", protover) == -1)
+            return EXIT_OUT_OF_MEMORY;
+        job->map_options[1] = option;
+    }
+    if (job->cache_key && fscache_enabled()) {
+        fsname = fscache_name(job->cache_key);
+        if (fsname == NULL
+                || asprintf(&option, "--cache-to=%s", fsname) == -1) {
+            free(fsname);
+            return EXIT_OUT_OF_MEMORY;
+        }
+        free(fsname);
+        job->map_options[argv_len(job->map_options)] = option;
+    }
+
+    job->map_output_fname = name_local_cpp_to_local_outfile(job->cpp_fname);
+    if (job->map_output_fname == NULL
+            || copy_argv(job->argv, &job->map_argv, 0) != 0)
+        return EXIT_OUT_OF_MEMORY;
+    for (i = 0; job->map_argv[i]; i++) {
+        if (str_equal(job->map_argv[i], job->input_fname)) {
+            free(job->map_argv[i]);
+            job->map_argv[i] = strdup(job->cpp_fname);
+        } else if (str_equal(job->map_argv[i], job->output_fname)) {
+            free(job->map_argv[i]);
+            job->map_argv[i] = strdup(job->map_output_fname);
+        }
+        if (job->map_argv[i] == NULL)
+            return EXIT_OUT_OF_MEMORY;
+    }
+    return 0;
+}
+
+/**
+ * @brief The whole mrcc-map command line of @p job, made ready by
+ * backend_map_job(): the mapper, split into its words as streaming
+ * does, the options, the .i, the object and the compiler command.
+ * @return the vector, to be freed with free_argv(), or NULL.
+ */
+char **backend_map_command(struct backend_job *job)
+{
+    const char *mapper = backend_mapper();
+    const char *s;
+    char **argv;
+    size_t len;
+    int n = 0;
+    int i;
+
+    /* no more words in the mapper than it has characters */
+    argv = calloc(strlen(mapper) + argv_len(job->map_options)
+                  + argv_len(job->map_argv) + 3, sizeof(char *));
+    if (argv == NULL)
+        return NULL;
+    for (s = mapper; *s; s += len) {
+        while (isspace((unsigned char) *s))
+            s++;
+        for (len = 0; s[len] && !isspace((unsigned char) s[len]); len++)
+            ;
+        if (len && (argv[n++] = strndup(s, len)) == NULL)
+            goto fail;
+    }
+    for (i = 0; job->map_options[i]; i++) {
+        if ((argv[n++] = strdup(job->map_options[i])) == NULL)
+            goto fail;
+    }
+    if ((argv[n++] = strdup(job->cpp_fname)) == NULL
+            || (argv[n++] = strdup(job->map_output_fname)) == NULL)
+        goto fail;
+    for (i = 0; job->map_argv[i]; i++) {
+        if ((argv[n++] = strdup(job->map_argv[i])) == NULL)
+            goto fail;
+    }
+    return argv;
+
+fail:
+    free_argv(argv);
+    return NULL;
+}
+
+/*
+ * The job of a backend that runs a command, which job->cmd holds, is
+ * submitted; the remote phase begins.
+ */
+static void backend_started(struct backend_job *job)
+{
+    job->state = BACKEND_RUNNING;
+    event_end(EVENT_SUBMIT, 0, 0);
+    event_begin(EVENT_REMOTE);
+}
+
+/*
+ * Wait for the command of @p job to end, within the deadline.  If it
+ * takes too long it is killed, but the job stays BACKEND_RUNNING for
+ * cancel(), as there may be more to take back.
+ */
+static int backend_wait_command(struct backend_job *job)
+{
+    long left = deadline_left_ms();
+    int status = 0;
+    int ret;
+
+    ret = command_wait(&job->cmd, NULL, left < 0 ? 0 : left + 1, &status);
+    if (job->lock_fd != -1) {
+        mrcc_unlock(job->lock_fd);
+        job->lock_fd = -1;
+    }
+    if (ret == EXIT_TIMEOUT)
+        return ret;
+    job->state = BACKEND_DONE;
+    if (ret == 0 && status != 0) {
+        rs_log_error("%s failed with status %#x", job->cmd.what, status);
+        ret = EXIT_CALL_MAPPER_FAILED;
+    }
+    return ret;
+}
+
+/* Is the command of @p job still running? */
+static enum backend_state backend_command_status(struct backend_job *job)
+{
+    if (job->state == BACKEND_RUNNING && job->cmd.pid != 0
+            && command_done(&job->cmd))
+        return BACKEND_DONE;
+    return job->state;
+}
+
+/* Kill the command of @p job. */
+static void backend_kill_command(struct backend_job *job)
+{
+    command_kill(&job->cmd);
+    if (job->lock_fd != -1) {
+        mrcc_unlock(job->lock_fd);
+        job->lock_fd = -1;
+    }
+}
+
+/*
+ * Run mrcc-map on this machine.  It takes a slot of the local
+ * compiles, like any compile here; mrcc-map takes none itself.
+ */
+static int local_submit(struct backend_job *job)
+{
+    char **argv;
+    int ret;
+
+    if ((ret = lock_local(&job->lock_fd)) != 0) {
+        job->lock_fd = -1;
+        return ret;
+    }
+    if ((argv = backend_map_command(job)) == NULL) {
+        ret = EXIT_OUT_OF_MEMORY;
+        goto out;
+    }
+    ret = command_start(&job->cmd, "mrcc-map", argv, -1, NULL, NULL, NULL);
+    free_argv(argv);
+
+out:
+    if (ret != 0) {
+        mrcc_unlock(job->lock_fd);
+        job->lock_fd = -1;
+        return ret;
+    }
+    backend_started(job);
+    return 0;
+}
+
+static int local_wait(struct backend_job *job)
+{
+    return backend_wait_command(job);
+}
+
+static int local_cancel(struct backend_job *job)
+{
+    backend_kill_command(job);
+    job->state = BACKEND_IDLE;
+    return 0;
+}
+
+/**
+ * @brief @p argv as one shell word each, quoted with '', which only '
+ * itself has to get out of.
+ * Caller is responsible for free()ing the returned string.
+ * @return the command line, or NULL on failure.
+ */
+char *backend_cmd_quote(char **argv)
+{
+    size_t len = 1;
+    char *line, *o;
+    const char *s;
+    int i;
+
+    for (i = 0; argv[i]; i++)
+        len += strlen(argv[i]) * 4 + 3;
+    if ((line = o = malloc(len)) == NULL)
+        return NULL;
+    for (i = 0; argv[i]; i++) {
+        if (i)
+            *o++ = ' ';
+        *o++ = '\'';
+        for (s = argv[i]; *s; s++) {
+            if (*s == '\'') {
+                memcpy(o, "'\\''", 4);
+                o += 4;
+            } else {
+                *o++ = *s;
+            }
+        }
+        *o++ = '\'';
+    }
+    *o = '\0';
+    return line;
+}
+
+/**
+ * @brief Fill in the template @p tmpl for @p job, see the top of the
+ * file.
+ * Caller is responsible for free()ing the returned string.
+ * @param command what goes for "%c", or NULL if there is none.
+ * @return the command line, or NULL on failure.
+ */
+char *backend_cmd_expand(const char *tmpl, struct backend_job *job,
+                         const char *command)
+{
+    const char *s, *with;
+    size_t len = 1;
+    char *line, *o;
+
+    for (s = tmpl; *s; s++) {
+        if (s[0] == '%' && s[1] == 'c' && command)
+            len += strlen(command);
+        else if (s[0] == '%' && s[1] == 'j')
+            len += strlen(job->name);
+        len++;
+    }
+    if ((line = o = malloc(len)) == NULL)
+        return NULL;
+    for (s = tmpl; *s; s++) {
+        with = NULL;
+        if (s[0] == '%' && s[1] == 'c' && command)
+            with = command;
+        else if (s[0] == '%' && s[1] == 'j')
+            with = job->name;
+        else if (s[0] == '%' && s[1] == '%')
+            with = "%";
+        if (with) {
+            strcpy(o, with);
+            o += strlen(with);
+            s++;
+        } else {
+            *o++ = *s;
+        }
+    }
+    *o = '\0';
+    return line;
+}
+
+/* Run the template @p tmpl for @p job with /bin/sh, see command_start(). */
+static int cmd_start(struct backend_job *job, const char *tmpl,
+                     const char *command)
+{
+    char *argv[4];
+    int ret;
+
+    if ((argv[2] = backend_cmd_expand(tmpl, job, command)) == NULL)
+        return EXIT_OUT_OF_MEMORY;
+    argv[0] = "/bin/sh";
+    argv[1] = "-c";
+    argv[3] = NULL;
+    rs_log_info("%s: %s", job->name, argv[2]);
+    ret = command_start(&job->cmd, "MRCC_BACKEND_CMD", argv, -1, NULL, NULL,
+                        NULL);
+    free(argv[2]);
+    return ret;
+}
+
+/*
+ * A name for a job of this process, "mrcc_HOST_PID", so that "%j" is
+ * not shared with another client of the same scheduler.  It goes into
+ * a shell command as it is, so anything but [A-Za-z0-9.-] becomes '_'.
+ */
+static char *cmd_job_name(void)
+{
+    char host[256];
+    char *name = NULL, *p;
+
+    if (gethostname(host, sizeof host) == -1)
+        strcpy(host, "localhost");
+    host[sizeof host - 1] = '\0';
+    if (asprintf(&name, "mrcc_%s_%ld", host, (long) getpid()) == -1)
+        return NULL;
+    for (p = name; *p; p++) {
+        if (!isalnum((unsigned char) *p) && *p != '.' && *p != '-')
+            *p = '_';
+    }
+    return name;
+}
+
+/* Run mrcc-map with the command MRCC_BACKEND_CMD. */
+static int cmd_submit(struct backend_job *job)
+{
+    const char *tmpl = getenv("MRCC_BACKEND_CMD");
+    char **argv = NULL;
+    char *command = NULL;
+    int ret;
+
+    if (tmpl == NULL || tmpl[0] == '\0') {
+        rs_log_error("MRCC_BACKEND=cmd, but MRCC_BACKEND_CMD is not set");
+        return EXIT_BAD_ARGUMENTS;
+    }
+    if ((job->name = cmd_job_name()) == NULL)
+        return EXIT_OUT_OF_MEMORY;
+    if ((argv = backend_map_command(job)) == NULL
+            || (command = backend_cmd_quote(argv)) == NULL) {
+        ret = EXIT_OUT_OF_MEMORY;
+        goto out;
+    }
+    if ((ret = cmd_start(job, tmpl, command)) == 0)
+        backend_started(job);
+
+out:
+    if (argv)
+        free_argv(argv);
+    free(command);
+    return ret;
+}
+
+static int cmd_wait(struct backend_job *job)
+{
+    return backend_wait_command(job);
+}
+
+/*
+ * Kill the command and run MRCC_BACKEND_CANCEL, which gets the time it
+ * needs, however late it is.
+ */
+static int cmd_cancel(struct backend_job *job)
+{
+    const char *tmpl = getenv("MRCC_BACKEND_CANCEL");
+    int status = 0;
+    int ret = 0;
+
+    backend_kill_command(job);
+    if (tmpl && tmpl[0] && job->name) {
+        rs_log_info("cancelling %s", job->name);
+        deadline_stop();
+        ret = cmd_start(job, tmpl, NULL);
+        if (ret == 0)
+            ret = command_wait(&job->cmd, NULL, 0, &status);
+        if (ret == 0 && status != 0)
+            ret = EXIT_MRCC_FAILED;
+    }
+    job->state = BACKEND_IDLE;
+    return ret;
+}
+
+static const struct backend backend_local = {
+    "local", BACKEND_CAP_NETFS | BACKEND_CAP_CANCEL,
+    local_submit, local_wait, local_cancel, backend_command_status
+};
+
+static const struct backend backend_cmd = {
+    "cmd", BACKEND_CAP_NETFS | BACKEND_CAP_CANCEL,
+    cmd_submit, cmd_wait, cmd_cancel, backend_command_status
+};
+
+static const struct backend *const backends[] = {
+    &backend_hadoop, &backend_local, &backend_cmd, &backend_tcp, NULL
+};
+
+/**
+ * @brief The backend called @p name, or NULL if there is none.
+ */
+const struct backend *backend_find(const char *name)
+{
+    int i;
+
+    for (i = 0; backends[i]; i++) {
+        if (str_equal(backends[i]->name, name))
+            return backends[i];
+    }
+    return NULL;
+}
+
+/**
+ * @brief The backend a compile sent to @p host goes to: mrccd for a
+ * host of MRCC_HOSTS, otherwise the one MRCC_BACKEND names, hadoop if
+ * none or an unknown one is named.
+ */
+const struct backend *backend_for(struct hostdef *host)
+{
+    const char *name = getenv("MRCC_BACKEND");
+    const struct backend *b = &backend_hadoop;
+
+    if (host && host->mode == MRCC_MODE_TCP) {
+        b = &backend_tcp;
+    } else if (name && name[0] && (b = backend_find(name)) == NULL) {
+        rs_log_warning("unknown MRCC_BACKEND \"%s\", using hadoop", name);
+        b = &backend_hadoop;
+    }
+    if (!(b->caps & BACKEND_CAP_BATCH) && batch_enabled())
+        rs_trace("the %s backend runs every compile on its own", b->name);
+    return b;
+}
@@ -0,0 +1,87 @@
+// mrcc - A C Compiler system on MapReduce
+// Zhiqiang Ma, https://www.ericzma.com
+#pragma once
+
+#include <sys/types.h>
+
+#include "exec.h"
+
+// what a backend can do, see struct backend
+// the .i goes to net fs first and the object comes back from there
+#define BACKEND_CAP_NETFS   0x01
+// a job that was submitted can be taken back
+#define BACKEND_CAP_CANCEL  0x02
+// compiles may share one job, see batch.c
+#define BACKEND_CAP_BATCH   0x04
+
+// where a job is, see struct backend
+enum backend_state {
+    BACKEND_IDLE = 0,       // not submitted, or all cleaned up
+    BACKEND_RUNNING,        // submitted, and not known to be over
+    BACKEND_DONE            // over; wait() has its result
+};
+
+// one compile handed to a backend, see compile_remote()
+struct backend_job {
+    // the compile, as compile_remote() got it
+    char **argv;
+    char *input_fname;
+    char *cpp_fname;
+    char **files;
+    char *output_fname;
+    char *server_stderr_fname;
+    char *cache_key;
+    pid_t cpp_pid;
+    int cpp_fd;
+    int local_cpu_lock_fd;
+    struct hostdef *host;
+    int *status;
+
+    // for BACKEND_CAP_NETFS: the compiler command on the .i, the name
+    // the object is written under and the options of mrcc-map
+    char **map_argv;
+    char *map_output_fname;
+    char **map_options;
+
+    // kept by the backend while the job runs
+    enum backend_state state;
+    struct command cmd;
+    int fd;
+    int lock_fd;
+    char *log_fname;
+    int own_log;
+    char *name;
+};
+
+/*
+ * A way of running compiles elsewhere, picked by MRCC_BACKEND.
+ *
+ * submit() hands the job over without waiting for it; wait() sees it
+ * to its end, within the deadline of the phase under way (see
+ * deadline.c), and leaves its result where compile_remote() expects
+ * it.  When either fails, the job is over unless status() says it is
+ * still running, and then cancel() takes it back.
+ */
+struct backend {
+    const char *name;
+    unsigned caps;
+    int (*submit)(struct backend_job *job);
+    int (*wait)(struct backend_job *job);
+    int (*cancel)(struct backend_job *job);
+    enum backend_state (*status)(struct backend_job *job);
+};
+
+extern const struct backend backend_hadoop;
+extern const struct backend backend_tcp;
+
+void backend_job_init(struct backend_job *job);
+void backend_job_free(struct backend_job *job);
+int backend_map_job(struct backend_job *job);
+char **backend_map_command(struct backend_job *job);
+char *backend_cmd_quote(char **argv);
+char *backend_cmd_expand(const char *tmpl, struct backend_job *job,
+                         const char *command);
+
+const char *backend_mapper(void);
+const struct backend *backend_find(const char *name);
+const struct backend *backend_for(struct hostdef *host);
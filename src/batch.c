@@ -0,0 +1,689 @@
+// mrcc - A C Compiler system on MapReduce
+// Zhiqiang Ma, https://www.ericzma.com
+
+#include <stdarg.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <string.h>
+#include <time.h>
+#include <ctype.h>
+#include <assert.h>
+#include <fcntl.h>
+
+#include <sys/fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <signal.h>
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <sys/poll.h>
+
+#include <sys/file.h>
+#include <dirent.h>
+
+#include "utils.h"
+#include "trace.h"
+#include "io.h"
+#include "args.h"
+#include "stringutils.h"
+#include "tempfile.h"
+#include "mrutils.h"
+#include "deadline.h"
+#include "batch.h"
+
+/**
+ * @file
+ * @brief Coalesce concurrent compiles into one MapReduce job.
+ *
+ * Submitting a streaming job costs many seconds of scheduling, which is
+ * paid once per source file when every mrcc runs its own job.  With
+ * $MRCC_BATCH=1, each mrcc instead drops a request into a spool
+ * directory and one of them, the leader, submits a single job for all
+ * the requests that arrived within $MRCC_BATCH_WINDOW milliseconds (at
+ * most $MRCC_BATCH_MAX of them).  The job's input lists one compile per
+ * line and is split with NLineInputFormat, so every compile still gets
+ * its own map task.
+ *
+ * The spool directory is $MRCC_DIR/batch.  For a request NAME, whose
+ * name starts with the pid of the mrcc that made it:
+ *
+ *   NAME.req   waiting for a leader; holds the mapper's command line
+ *   NAME.run   claimed by a leader; holds the leader's pid
+ *   NAME.done  finished; holds the exit status of the job
+ *
+ * A leader holds a shared lock on the NAME.run files it wrote until
+ * their NAME.done is there, so a waiting mrcc can tell when it is
+ * gone, and then submits its compile on its own.  So it does if the
+ * leader takes longer than the batch window and the limit of the
+ * remote phase together.
+ *
+ * Whoever holds leader.lock may claim requests.  The leader only keeps
+ * the lock while collecting, so the next batch can be collected while
+ * the previous job runs.  Every waiting mrcc blocks on the lock, and
+ * takes over as leader if its own request is still unclaimed when it
+ * gets the lock.
+ **/
+
+// how often a waiting mrcc looks for its result, in milliseconds
+static const int batch_poll_interval = 50;
+
+/**
+ * @brief Whether compiles should be batched.
+ * @return 1 if $MRCC_BATCH is set to 1, otherwise 0.
+ */
+int batch_enabled(void)
+{
+    return getenv_bool("MRCC_BATCH", 0);
+}
+
+/* Read a positive integer setting from the environment. */
+static int batch_getenv_int(const char *name, int default_value)
+{
+    const char *e;
+    char *end;
+    long v;
+
+    e = getenv(name);
+    if (e == NULL || e[0] == '\0')
+        return default_value;
+    v = strtol(e, &end, 10);
+    if (*end != '\0' || v <= 0 || v > 1000000) {
+        rs_log_warning("ignoring bad %s=\"%s\"", name, e);
+        return default_value;
+    }
+    return (int) v;
+}
+
+static long batch_now_ms(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (long) tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+/**
+ * @brief Join @p argv into one line, so that it can be carried as one
+ * record of the job's input.
+ * Characters that would split a word or the line are %-escaped.
+ * Caller is responsible for free()ing the returned string.
+ * @param argv NULL terminated argument vector.
+ * @return the line, without a newline, or NULL on failure.
+ */
+char* batch_argv_toline(char** argv)
+{
+    static const char hex[] = "0123456789abcdef";
+    size_t len = 1;
+    char *line, *o;
+    const char *s;
+    int i;
+
+    for (i = 0; argv[i]; i++)
+        len += strlen(argv[i]) * 3 + 1;
+    line = o = malloc(len);
+    if (line == NULL)
+        return NULL;
+
+    for (i = 0; argv[i]; i++) {
+        if (i)
+            *o++ = ' ';
+        for (s = argv[i]; *s; s++) {
+            unsigned char c = (unsigned char) *s;
+            if (c == '%' || isspace(c) || !isprint(c)) {
+                *o++ = '%';
+                *o++ = hex[c >> 4];
+                *o++ = hex[c & 15];
+            } else {
+                *o++ = c;
+            }
+        }
+    }
+    *o = '\0';
+    return line;
+}
+
+static int batch_hexval(int c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    c = tolower(c);
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    return -1;
+}
+
+/**
+ * @brief Split a line made by batch_argv_toline() back into words.
+ * @p line is decoded in place; the returned vector points into it.
+ * Caller is responsible for free()ing the returned vector, but not the
+ * strings in it.
+ * @param line line to split, without the newline.
+ * @param argv_ret pointer to receive the NULL terminated vector.
+ * @return 0 on success, or error return code.
+ */
+int batch_line_toargv(char* line, char*** argv_ret)
+{
+    char **argv;
+    char *r, *w;
+    int argc = 0;
+    int hi, lo;
+
+    argv = malloc((strlen(line) / 2 + 2) * sizeof(char *));
+    if (argv == NULL)
+        return EXIT_OUT_OF_MEMORY;
+
+    r = w = line;
+    while (*r) {
+        while (*r == ' ')
+            r++;
+        if (*r == '\0')
+            break;
+        argv[argc++] = w;
+        for (; *r && *r != ' '; r++) {
+            if (*r != '%') {
+                *w++ = *r;
+                continue;
+            }
+            if ((hi = batch_hexval(r[1])) < 0 || (lo = batch_hexval(r[2])) < 0) {
+                rs_log_error("bad escape in batch line \"%s\"", line);
+                free(argv);
+                return EXIT_PROTOCOL_ERROR;
+            }
+            *w++ = (char) (hi << 4 | lo);
+            r += 2;
+        }
+        if (*r)
+            r++;
+        *w++ = '\0';
+    }
+    argv[argc] = NULL;
+    *argv_ret = argv;
+    return 0;
+}
+
+
+/**********************************************************************
+ * Spool directory
+ **********************************************************************/
+
+/* Return the malloc'd name of file NAME.SUFFIX in the spool dir. */
+static char* batch_path(const char *spool, const char *name, const char *suffix)
+{
+    char *path = NULL;
+
+    if (asprintf(&path, "%s/%s.%s", spool, name, suffix) == -1)
+        return NULL;
+    return path;
+}
+
+/*
+ * Write @p text to NAME.SUFFIX so that readers never see it half done.
+ * If @p hold_fd is not NULL, the file is locked shared before it
+ * appears, and the descriptor holding the lock goes there.
+ */
+static int batch_write(const char *spool, const char *name,
+                       const char *suffix, const char *text, int *hold_fd)
+{
+    char *tmp = NULL, *path;
+    int fd, ret = 0;
+
+    path = batch_path(spool, name, suffix);
+    if (path == NULL || asprintf(&tmp, "%s.tmp%ld", path, (long) getpid()) == -1) {
+        free(path);
+        return EXIT_OUT_OF_MEMORY;
+    }
+
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd == -1) {
+        rs_log_error("failed to create \"%s\": %s", tmp, strerror(errno));
+        ret = EXIT_IO_ERROR;
+    } else {
+        ret = writex(fd, text, strlen(text));
+        if (ret == 0 && hold_fd && flock(fd, LOCK_SH) == -1) {
+            rs_log_error("failed to lock \"%s\": %s", tmp, strerror(errno));
+            ret = EXIT_IO_ERROR;
+        }
+        if (ret == 0 && rename(tmp, path) == -1) {
+            rs_log_error("failed to rename \"%s\": %s", tmp, strerror(errno));
+            ret = EXIT_IO_ERROR;
+        }
+        if (ret == 0 && hold_fd) {
+            *hold_fd = fd;
+        } else if (mrcc_close(fd) != 0 && ret == 0) {
+            unlink(path);
+            ret = EXIT_IO_ERROR;
+        }
+        if (ret)
+            unlink(tmp);
+    }
+    free(tmp);
+    free(path);
+    return ret;
+}
+
+/* Read all of NAME.SUFFIX into a malloc'd string, or return NULL. */
+static char* batch_read(const char *spool, const char *name, const char *suffix)
+{
+    char *path, *text = NULL;
+    struct stat st;
+    int fd;
+
+    path = batch_path(spool, name, suffix);
+    if (path == NULL)
+        return NULL;
+    fd = open(path, O_RDONLY);
+    free(path);
+    if (fd == -1)
+        return NULL;
+    if (fstat(fd, &st) == 0 && (text = malloc(st.st_size + 1)) != NULL) {
+        if (readx(fd, text, st.st_size) == 0) {
+            text[st.st_size] = '\0';
+        } else {
+            free(text);
+            text = NULL;
+        }
+    }
+    close(fd);
+    return text;
+}
+
+static void batch_unlink(const char *spool, const char *name, const char *suffix)
+{
+    char *path = batch_path(spool, name, suffix);
+
+    if (path) {
+        unlink(path);
+        free(path);
+    }
+}
+
+/* Remove @p fname from the spool dir. */
+static void batch_unlink_path(const char *spool, const char *fname)
+{
+    char *path = NULL;
+
+    if (asprintf(&path, "%s/%s", spool, fname) != -1) {
+        unlink(path);
+        free(path);
+    }
+}
+
+/* Whether NAME.SUFFIX exists. */
+static int batch_exists(const char *spool, const char *name, const char *suffix)
+{
+    char *path = batch_path(spool, name, suffix);
+    int ret;
+
+    ret = path != NULL && access(path, F_OK) == 0;
+    free(path);
+    return ret;
+}
+
+/* Whether the mrcc that made request @p name is still alive. */
+static int batch_owner_alive(const char *name)
+{
+    pid_t pid = (pid_t) strtol(name, NULL, 10);
+
+    return pid > 0 && (kill(pid, 0) == 0 || errno != ESRCH);
+}
+
+/**
+ * Collect the names of up to @p max pending requests, @p self first.
+ * Requests left behind by mrcc processes that died are thrown away.
+ */
+static int batch_scan(const char *spool, const char *self, int max,
+                      char ***names_ret, int *n_ret)
+{
+    char **names;
+    struct dirent *de;
+    DIR *d;
+    size_t len;
+    int n = 0;
+
+    names = calloc(max + 1, sizeof(char *));
+    if (names == NULL)
+        return EXIT_OUT_OF_MEMORY;
+    if ((names[n++] = strdup(self)) == NULL)
+        goto oom;
+
+    if ((d = opendir(spool)) == NULL) {
+        rs_log_error("failed to open \"%s\": %s", spool, strerror(errno));
+        free_argv(names);
+        return EXIT_IO_ERROR;
+    }
+    while (n < max && (de = readdir(d)) != NULL) {
+        len = strlen(de->d_name);
+        if (len > 4 && strcmp(de->d_name + len - 4, ".run") == 0
+                && !batch_owner_alive(de->d_name)) {
+            /*
+             * NAME is the requester, whose mrcc died before it could
+             * take its result; a live one removes its own claim however
+             * its leader ends, see batch_wait().  A leader that dies
+             * with its own request leaves one of these too.
+             */
+            rs_trace("dropping stale batch claim %s", de->d_name);
+            batch_unlink_path(spool, de->d_name);
+            continue;
+        }
+        if (len <= 4 || strcmp(de->d_name + len - 4, ".req") != 0)
+            continue;
+        if ((names[n] = strndup(de->d_name, len - 4)) == NULL) {
+            closedir(d);
+            goto oom;
+        }
+        if (str_equal(names[n], self)) {
+            free(names[n]);
+        } else if (!batch_owner_alive(names[n])) {
+            rs_trace("dropping stale batch request %s", names[n]);
+            batch_unlink(spool, names[n], "req");
+            free(names[n]);
+        } else {
+            n++;
+        }
+        names[n] = NULL;
+    }
+    closedir(d);
+
+    *names_ret = names;
+    *n_ret = n;
+    return 0;
+
+oom:
+    free_argv(names);
+    return EXIT_OUT_OF_MEMORY;
+}
+
+/**
+ * Lead one batch: wait for the window to close, claim the pending
+ * requests, release the lock, run the job and hand out the result.
+ * @return the job's status, which is also our own request's status.
+ */
+static int batch_lead(const char *spool, const char *self, int lock_fd)
+{
+    int window = batch_getenv_int("MRCC_BATCH_WINDOW", BATCH_DEFAULT_WINDOW);
+    int max = batch_getenv_int("MRCC_BATCH_MAX", BATCH_DEFAULT_MAX);
+    long deadline = batch_now_ms() + window;
+    char **names = NULL;
+    char *list_fname = NULL, *line, pid_str[32];
+    int *run_fds = NULL;
+    int list_fd = -1;
+    int n = 0, i, claimed = 0;
+    int ret;
+
+    /* Give the other compiles started by make a moment to turn up. */
+    for (;;) {
+        if ((ret = batch_scan(spool, self, max, &names, &n)))
+            goto out;
+        if (n >= max || batch_now_ms() >= deadline)
+            break;
+        free_argv(names);
+        names = NULL;
+        usleep(10 * 1000);
+    }
+
+    /* the locks that tell the others we are still at it */
+    if ((run_fds = malloc(n * sizeof(int))) == NULL) {
+        ret = EXIT_OUT_OF_MEMORY;
+        goto out;
+    }
+    for (i = 0; i < n; i++)
+        run_fds[i] = -1;
+
+    if ((ret = make_tmpnam("mrcc_batch", ".lst", &list_fname)))
+        goto out;
+    if ((list_fd = open(list_fname, O_WRONLY | O_TRUNC)) == -1) {
+        rs_log_error("failed to open \"%s\": %s", list_fname, strerror(errno));
+        ret = EXIT_IO_ERROR;
+        goto out;
+    }
+
+    snprintf(pid_str, sizeof pid_str, "%ld", (long) getpid());
+    for (i = 0; i < n; i++) {
+        line = batch_read(spool, names[i], "req");
+        if (line == NULL) {
+            /* its owner gave up on it meanwhile */
+            names[i][0] = '\0';
+            continue;
+        }
+        ret = writex(list_fd, line, strlen(line));
+        if (ret == 0)
+            ret = writex(list_fd, "\n", 1);
+        if (ret == 0)
+            ret = batch_write(spool, names[i], "run", pid_str, &run_fds[i]);
+        free(line);
+        if (ret)
+            goto out;
+        batch_unlink(spool, names[i], "req");
+        claimed++;
+    }
+    if (mrcc_close(list_fd) != 0) {
+        list_fd = -1;
+        ret = EXIT_IO_ERROR;
+        goto out;
+    }
+    list_fd = -1;
+
+    /* Let the next leader start collecting while our job runs. */
+    flock(lock_fd, LOCK_UN);
+
+    rs_log_info("submitting batch of %d compiles", claimed);
+    ret = mr_exec_batch(list_fname);
+
+out:
+    if (list_fd != -1)
+        close(list_fd);
+    /* Whatever happened, nobody else is going to run what we claimed. */
+    snprintf(pid_str, sizeof pid_str, "%d", ret);
+    for (i = 1; names && i < n; i++) {
+        if (names[i][0] == '\0')
+            continue;
+        if (batch_owner_alive(names[i]))
+            batch_write(spool, names[i], "done", pid_str, NULL);
+        else
+            batch_unlink(spool, names[i], "run");
+    }
+    batch_unlink(spool, self, "run");
+    for (i = 0; run_fds && i < n; i++) {
+        if (run_fds[i] != -1)
+            close(run_fds[i]);
+    }
+    free(run_fds);
+    free_argv(names);
+    free(list_fname);
+    return ret;
+}
+
+/*
+ * Has the leader that claimed request @p name gone away?  It holds a
+ * lock on NAME.run until it has written NAME.done, and the lock goes
+ * with it however it ends, even on SIGKILL.
+ */
+static int batch_leader_gone(const char *spool, const char *name)
+{
+    char *path = batch_path(spool, name, "run");
+    int fd, gone;
+
+    if (path == NULL)
+        return 0;
+    fd = open(path, O_RDONLY);
+    free(path);
+    if (fd == -1)
+        return errno == ENOENT;
+    gone = flock(fd, LOCK_EX | LOCK_NB) == 0;
+    close(fd);
+    return gone;
+}
+
+/*
+ * Wait for the leader that claimed request @p name to finish.  It gets
+ * the batch window and the limit of the remote phase (see deadline.c)
+ * for it, if there is one.
+ * @return 0 with the job's status in @p status; EXIT_GONE if the
+ * leader went away, or EXIT_TIMEOUT if it took too long, and then the
+ * request is dropped.
+ */
+static int batch_wait(const char *spool, const char *name, int *status)
+{
+    int window = batch_getenv_int("MRCC_BATCH_WINDOW", BATCH_DEFAULT_WINDOW);
+    long remote_ms = deadline_limit_ms(DEADLINE_REMOTE);
+    long end = remote_ms > 0 ? batch_now_ms() + window + remote_ms : 0;
+    char *text;
+    int ret;
+
+    for (;;) {
+        if ((text = batch_read(spool, name, "done")) != NULL) {
+            *status = atoi(text);
+            free(text);
+            batch_unlink(spool, name, "done");
+            batch_unlink(spool, name, "run");
+            return 0;
+        }
+        ret = 0;
+        /* it may have finished just before it went away */
+        if (batch_leader_gone(spool, name)
+                && !batch_exists(spool, name, "done")) {
+            rs_log_error("the batch leader of %s went away", name);
+            ret = EXIT_GONE;
+        } else if (end && batch_now_ms() >= end) {
+            rs_log_error("the batch leader of %s took longer than %ldms",
+                         name, window + remote_ms);
+            ret = EXIT_TIMEOUT;
+        }
+        if (ret) {
+            batch_unlink(spool, name, "run");
+            return ret;
+        }
+        usleep(batch_poll_interval * 1000);
+    }
+}
+
+/*
+ * Submit the compile of request @p name, whose mapper command line is
+ * @p line, in a batch of its own.
+ * @return the job's status.
+ */
+static int batch_alone(const char *name, const char *line)
+{
+    char *list_fname = NULL;
+    int fd, ret;
+
+    rs_log_warning("submitting %s on its own", name);
+    if ((ret = make_tmpnam("mrcc_batch", ".lst", &list_fname)))
+        return ret;
+    if ((fd = open(list_fname, O_WRONLY | O_TRUNC)) == -1) {
+        rs_log_error("failed to open \"%s\": %s", list_fname, strerror(errno));
+        free(list_fname);
+        return EXIT_IO_ERROR;
+    }
+    ret = writex(fd, line, strlen(line));
+    if (ret == 0)
+        ret = writex(fd, "\n", 1);
+    if (mrcc_close(fd) != 0 && ret == 0)
+        ret = EXIT_IO_ERROR;
+    if (ret == 0) {
+        /* what the leader had of the remote phase is used up */
+        deadline_start(DEADLINE_REMOTE);
+        ret = mr_exec_batch(list_fname);
+    }
+    free(list_fname);
+    return ret;
+}
+
+/**
+ * @brief Run one remote compile as part of a batch.
+ * Like a job of its own, this returns once the job that ran the compile has
+ * finished, successfully or not.
+ * @param argv compiler command to run on the mapper.
+ * @param map_options NULL-terminated options for mrcc-map.
+ * @param cpp_fname filename of the preprocessed source, already on net fs.
+ * @param out_fname filename of the object the mapper is to put to net fs.
+ * @return 0 if the job succeeded, otherwise error return code.
+ */
+int batch_exec(char** argv, char** map_options, char* cpp_fname, char* out_fname)
+{
+    char **map_argv = NULL;
+    char *spool = NULL, *lock_path = NULL, *line = NULL;
+    char name[64];
+    struct timeval tv;
+    int lock_fd = -1;
+    int status = EXIT_CALL_MAPPER_FAILED;
+    int i, n, ret;
+
+    if ((ret = get_subdir("batch", &spool)))
+        return ret;
+
+    /* the mapper's own arguments come first */
+    map_argv = calloc(argv_len(map_options) + argv_len(argv) + 3, sizeof(char *));
+    if (map_argv == NULL) {
+        ret = EXIT_OUT_OF_MEMORY;
+        goto out;
+    }
+    n = 0;
+    for (i = 0; map_options[i]; i++)
+        map_argv[n++] = map_options[i];
+    map_argv[n++] = cpp_fname;
+    map_argv[n++] = out_fname;
+    for (i = 0; argv[i]; i++)
+        map_argv[n++] = argv[i];
+    if ((line = batch_argv_toline(map_argv)) == NULL) {
+        ret = EXIT_OUT_OF_MEMORY;
+        goto out;
+    }
+
+    gettimeofday(&tv, NULL);
+    snprintf(name, sizeof name, "%ld-%lx", (long) getpid(),
+             (unsigned long) (tv.tv_sec * 1000000 + tv.tv_usec));
+
+    if (asprintf(&lock_path, "%s/leader.lock", spool) == -1) {
+        ret = EXIT_OUT_OF_MEMORY;
+        goto out;
+    }
+    if ((lock_fd = open(lock_path, O_RDWR | O_CREAT, 0600)) == -1) {
+        rs_log_error("failed to open \"%s\": %s", lock_path, strerror(errno));
+        ret = EXIT_IO_ERROR;
+        goto out;
+    }
+
+    if ((ret = batch_write(spool, name, "req", line, NULL)))
+        goto out;
+    rs_trace("queued batch request %s", name);
+
+    while (flock(lock_fd, LOCK_EX) == -1) {
+        if (errno != EINTR) {
+            rs_log_error("failed to lock \"%s\": %s", lock_path, strerror(errno));
+            batch_unlink(spool, name, "req");
+            ret = EXIT_IO_ERROR;
+            goto out;
+        }
+    }
+
+    /* Still unclaimed, so nobody is collecting: lead a batch ourselves. */
+    if (batch_exists(spool, name, "req")) {
+        rs_trace("leading batch for %s", name);
+        status = batch_lead(spool, name, lock_fd);
+        ret = 0;
+    } else {
+        flock(lock_fd, LOCK_UN);
+        ret = batch_wait(spool, name, &status);
+        if (ret == EXIT_GONE || ret == EXIT_TIMEOUT) {
+            status = batch_alone(name, line);
+            ret = 0;
+        }
+    }
+
+out:
+    if (lock_fd != -1)
+        close(lock_fd);
+    free(lock_path);
+    free(line);
+    free(map_argv);
+    free(spool);
+    return ret ? ret : status;
+}
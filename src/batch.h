@@ -0,0 +1,16 @@
+// mrcc - A C Compiler system on MapReduce
+// Zhiqiang Ma, https://www.ericzma.com
+#pragma once
+
+// default time the batch leader waits for more compiles, in milliseconds
+#define BATCH_DEFAULT_WINDOW 500
+
+// default maximum number of compiles in one MapReduce job
+#define BATCH_DEFAULT_MAX 64
+
+int batch_enabled(void);
+
+int batch_exec(char** argv, char** map_options, char* cpp_fname, char* out_fname);
+
+char* batch_argv_toline(char** argv);
+int batch_line_toargv(char* line, char*** argv_ret);
@@ -0,0 +1,293 @@
+// mrcc - A C Compiler system on MapReduce
+// Zhiqiang Ma, https://www.ericzma.com
+
+#include <stdarg.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <string.h>
+#include <time.h>
+#include <ctype.h>
+#include <assert.h>
+#include <fcntl.h>
+
+#include <sys/fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <signal.h>
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <sys/poll.h>
+
+#include "utils.h"
+#include "trace.h"
+#include "io.h"
+#include "args.h"
+#include "stringutils.h"
+#include "tempfile.h"
+#include "hash.h"
+#include "cache.h"
+
+/**
+ * @file
+ * @brief Local cache of compile results, addressed by content.
+ *
+ * Rebuilding a tree after "make clean" sends every file to the cluster
+ * again, although nothing changed.  With $MRCC_CACHE=1 the object file
+ * of every successful remote compile is kept under a key that is the
+ * SHA-256 of
+ *
+ *   - the compiler: its path, size and modification time,
+ *   - the command line sent to the server, with the names of the input
+ *     and output files replaced by placeholders, and
+ *   - the preprocessed source.
+ *
+ * A later compile with the same key gets the object from the cache and
+ * does not go to the network at all.
+ *
+ * Entries are $MRCC_CACHE_DIR/xx/KEY.o (default $MRCC_DIR/cache), where
+ * xx are the first two digits of the key, with the compiler's messages
+ * in KEY.stderr next to it.  Entries are written to a temporary file
+ * and renamed, so concurrent compiles never see half an object.
+ **/
+
+// bump this when the key computation changes
+static const char *cache_version = "mrcc cache 1";
+
+/**
+ * @brief Whether the result cache should be used.
+ * @return 1 if $MRCC_CACHE is set to 1, otherwise 0.
+ */
+int cache_enabled(void)
+{
+    return getenv_bool("MRCC_CACHE", 0);
+}
+
+/* Return the cache directory, creating it if needed. */
+static int cache_dir(char **dir_ret)
+{
+    static char *cached;
+    const char *env;
+    int ret;
+
+    if (cached) {
+        *dir_ret = cached;
+        return 0;
+    }
+
+    env = getenv("MRCC_CACHE_DIR");
+    if (env && env[0]) {
+        if ((cached = strdup(env)) == NULL)
+            return EXIT_OUT_OF_MEMORY;
+        if ((ret = mrcc_mkdir_p(cached))) {
+            free(cached);
+            cached = NULL;
+            return ret;
+        }
+    } else if ((ret = get_subdir("cache", &cached))) {
+        return ret;
+    }
+
+    *dir_ret = cached;
+    return 0;
+}
+
+/* Return the malloc'd name of the cache file for @p key. */
+static char *cache_path(const char *key, const char *suffix, int mkdirs)
+{
+    char *dir, *path = NULL;
+
+    if (cache_dir(&dir))
+        return NULL;
+    if (asprintf(&path, "%s/%.2s", dir, key) == -1)
+        return NULL;
+    if (mkdirs && mrcc_mkdir(path)) {
+        free(path);
+        return NULL;
+    }
+    free(path);
+    if (asprintf(&path, "%s/%.2s/%s%s", dir, key, key, suffix) == -1)
+        return NULL;
+    return path;
+}
+
+/**
+ * Find the file the shell would run for @p name, so that a changed
+ * compiler gives a different key.
+ */
+static int cache_stat_compiler(const char *name, char **path_ret, struct stat *st)
+{
+    const char *path, *p, *end;
+    char *candidate = NULL;
+
+    if (strchr(name, '/')) {
+        if (stat(name, st) == -1)
+            return EXIT_COMPILER_MISSING;
+        *path_ret = strdup(name);
+        return *path_ret ? 0 : EXIT_OUT_OF_MEMORY;
+    }
+
+    path = getenv("PATH");
+    for (p = path ? path : ""; *p; p = *end ? end + 1 : end) {
+        end = strchr(p, ':');
+        if (end == NULL)
+            end = p + strlen(p);
+        if (asprintf(&candidate, "%.*s/%s", (int) (end - p), p, name) == -1)
+            return EXIT_OUT_OF_MEMORY;
+        if (stat(candidate, st) == 0 && S_ISREG(st->st_mode)
+                && access(candidate, X_OK) == 0) {
+            *path_ret = candidate;
+            return 0;
+        }
+        free(candidate);
+    }
+    rs_log_warning("compiler \"%s\" not found on PATH", name);
+    return EXIT_COMPILER_MISSING;
+}
+
+/**
+ * @brief Compute the cache key of a compile.
+ * @param argv command line that will be sent to the server.
+ * @param input_fname name of the source file in @p argv.
+ * @param cpp_fname preprocessed source; cpp must have finished.
+ * @param output_fname name of the object file in @p argv.
+ * @param key receives the key as a hex string.
+ * @return 0 on success, or error return code.
+ */
+int cache_key(char **argv, const char *input_fname, const char *cpp_fname,
+              const char *output_fname, char key[HASH_HEX_LEN + 1])
+{
+    struct hash_ctx ctx;
+    struct stat st;
+    char *compiler, buf[64];
+    int i, ret;
+
+    if ((ret = cache_stat_compiler(argv[0], &compiler, &st)))
+        return ret;
+
+    hash_init(&ctx);
+    hash_string(&ctx, cache_version);
+    hash_string(&ctx, compiler);
+    snprintf(buf, sizeof buf, "%lld %lld",
+             (long long) st.st_size, (long long) st.st_mtime);
+    hash_string(&ctx, buf);
+    free(compiler);
+
+    snprintf(buf, sizeof buf, "%d", argv_len(argv));
+    hash_string(&ctx, buf);
+    for (i = 1; argv[i]; i++) {
+        if (str_equal(argv[i], input_fname))
+            hash_string(&ctx, "<input>");
+        else if (str_equal(argv[i], output_fname))
+            hash_string(&ctx, "<output>");
+        else
+            hash_string(&ctx, argv[i]);
+    }
+
+    if ((ret = hash_file(&ctx, cpp_fname)))
+        return ret;
+    hash_final_hex(&ctx, key);
+    rs_trace("cache key of %s is %s", input_fname, key);
+    return 0;
+}
+
+/* Copy @p from to @p to through a temporary file and a rename. */
+static int cache_copy(const char *from, const char *to)
+{
+    char *tmp = NULL;
+    int fd, ret;
+
+    if (asprintf(&tmp, "%s.tmp%ld", to, (long) getpid()) == -1)
+        return EXIT_OUT_OF_MEMORY;
+
+    fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC|O_BINARY, 0666);
+    if (fd == -1) {
+        rs_log_error("failed to create %s: %s", tmp, strerror(errno));
+        free(tmp);
+        return EXIT_IO_ERROR;
+    }
+    ret = copy_file_to_fd(from, fd);
+    if (mrcc_close(fd) && ret == 0)
+        ret = EXIT_IO_ERROR;
+    if (ret == 0 && rename(tmp, to) == -1) {
+        rs_log_error("failed to rename %s to %s: %s", tmp, to, strerror(errno));
+        ret = EXIT_IO_ERROR;
+    }
+    if (ret)
+        unlink(tmp);
+    free(tmp);
+    return ret;
+}
+
+/**
+ * @brief Look up a compile result and deliver it.
+ * On a hit, the object is written to @p output_fname and the messages
+ * the compiler gave at the time are shown on stderr.
+ * @param key cache key from cache_key().
+ * @param output_fname where the object file should go.
+ * @return 0 on a hit, EXIT_NO_SUCH_FILE on a miss, or another error
+ * return code.
+ */
+int cache_fetch(const char *key, const char *output_fname)
+{
+    char *obj, *err = NULL;
+    int ret;
+
+    if ((obj = cache_path(key, ".o", 0)) == NULL
+            || (err = cache_path(key, ".stderr", 0)) == NULL) {
+        free(obj);
+        return EXIT_OUT_OF_MEMORY;
+    }
+
+    if (access(obj, R_OK) == -1) {
+        rs_trace("cache miss for %s", key);
+        ret = EXIT_NO_SUCH_FILE;
+    } else if ((ret = cache_copy(obj, output_fname)) == 0) {
+        rs_log_info("cache hit for %s", output_fname);
+        /* keep the time of last use for whoever trims the cache */
+        utimes(obj, NULL);
+        if (copy_file_to_fd(err, STDERR_FILENO))
+            rs_log_warning("could not show cached compiler messages");
+    }
+
+    free(obj);
+    free(err);
+    return ret;
+}
+
+/**
+ * @brief Remember the result of a successful compile.
+ * @param key cache key from cache_key().
+ * @param output_fname object file made by the compile.
+ * @param stderr_fname messages of the compiler, or NULL.
+ * @return 0 on success, or error return code.
+ */
+int cache_store(const char *key, const char *output_fname,
+                const char *stderr_fname)
+{
+    char *obj, *err = NULL;
+    int ret;
+
+    if ((obj = cache_path(key, ".o", 1)) == NULL
+            || (err = cache_path(key, ".stderr", 0)) == NULL) {
+        free(obj);
+        return EXIT_OUT_OF_MEMORY;
+    }
+
+    /* the messages go first, so that a visible object always has them */
+    ret = cache_copy(stderr_fname ? stderr_fname : "/dev/null", err);
+    if (ret == 0)
+        ret = cache_copy(output_fname, obj);
+    if (ret == 0)
+        rs_trace("stored %s in cache as %s", output_fname, key);
+
+    free(obj);
+    free(err);
+    return ret;
+}
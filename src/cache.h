@@ -0,0 +1,14 @@
+// mrcc - A C Compiler system on MapReduce
+// Zhiqiang Ma, https://www.ericzma.com
+#pragma once
+
+#include "hash.h"
+
+int cache_enabled(void);
+
+int cache_key(char **argv, const char *input_fname, const char *cpp_fname,
+              const char *output_fname, char key[HASH_HEX_LEN + 1]);
+
+int cache_fetch(const char *key, const char *output_fname);
+int cache_store(const char *key, const char *output_fname,
+                const char *stderr_fname);
@@ -28,6 +28,9 @@
 #include "trace.h"
 #include "utils.h"
 #include "netfsutils.h"
+#include "exec.h"
+#include "tempfile.h"
+#include "events.h"
 
 /**************************************/
 
@@ -41,6 +44,48 @@ volatile int cleanups_size = 0; /* The length of the array. */
 volatile int n_cleanups = 0;    /* The number of entries used. */
 
 
+/**
+ * Delete files on net fs, all with one command.
+ *
+ * Unless $MRCC_ASYNC_CLEANUP is set to "0", that is left to a detached
+ * background process, because by the time we clean up the object is
+ * already in place, and make should not have to wait for the deletes.
+ */
+static void
+cleanup_fs(char **fnames, int n)
+{
+    pid_t pid;
+    int status;
+
+    if (n == 0)
+        return;
+
+    if (getenv_bool("MRCC_ASYNC_CLEANUP", 1)) {
+        pid = fork();
+        if (pid == 0) {
+            /* Detach completely: a new session, reparented to init,
+             * and none of the pipes make may be waiting on. */
+            setsid();
+            if (fork() != 0)
+                _exit(0);
+            redirect_fds("/dev/null", "/dev/null", "/dev/null");
+            del_files_fs(fnames, n);
+            _exit(0);
+        }
+        if (pid != -1) {
+            while (waitpid(pid, &status, 0) == -1 && errno == EINTR)
+                ;
+            rs_trace("left %d net fs files to the reaper", n);
+            return;
+        }
+        rs_log_warning("failed to fork: %s", strerror(errno));
+    }
+
+    if (del_files_fs(fnames, n) != 0)
+        rs_log_error("cleanup of %d files on net fs failed.", n);
+}
+
+
 /**
  * You can call this at any time, or hook it into atexit().  It is
  * safe to call repeatedly.
@@ -58,14 +103,23 @@ volatile int n_cleanups = 0;    /* The number of entries used. */
  * deleted, which can be good for debugging.  However, we still need
  * to remove them from the list, otherwise it will eventually overflow
  * in prefork mode.
+ *
+ * Files on net fs are deleted together by cleanup_fs() after the
+ * local ones, except from a signal handler, where they are deleted one
+ * by one.
  */
 static void
 cleanup_tempfiles_inner(int from_signal_handler)
 {
-    int i;
+    int i, fd;
     int done = 0;
     int fs_done = 0;
     int save = getenv_bool("MRCC_SAVE_TEMPS", 0);
+    char **fs_names = NULL;
+    int n_fs = 0;
+
+    if (!from_signal_handler && n_cleanups > 0)
+        fs_names = malloc(n_cleanups * sizeof(char *));
 
     /* do the unlinks from the last to the first file.
      * This way, directories get deleted after their files. */
@@ -85,11 +139,18 @@ cleanup_tempfiles_inner(int from_signal_handler)
          * if both fail. */
 
         if (is_cleanup_on_fs(cleanups[i])) {
-            if (cleanup_file_fs(cleanups[i]) != 0) {
+            if (fs_names != NULL
+                    && (fs_names[n_fs] = strdup(cleanups[i] + 1)) != NULL) {
+                n_fs++;
+            } else if (cleanup_file_fs(cleanups[i]) != 0) {
                 rs_log_error("cleanup %s on net fs failed.", cleanups[i]);
             }
             fs_done++;
         }
+        else if ((fd = tmpmem_fd(cleanups[i])) != -1) {
+            /* in memory, see make_tmpmem() */
+            close(fd);
+        }
         else if ((rmdir(cleanups[i]) == -1) &&
                 (unlink(cleanups[i]) == -1) &&
                 (errno != ENOENT)) {
@@ -111,6 +172,13 @@ cleanup_tempfiles_inner(int from_signal_handler)
         cleanups[i] = NULL;
     }
 
+    if (fs_names != NULL) {
+        cleanup_fs(fs_names, n_fs);
+        for (i = 0; i < n_fs; i++)
+            free(fs_names[i]);
+        free(fs_names);
+    }
+
     rs_trace("deleted %d local and %d net fs temporary files",
             done, fs_done);
 }
@@ -159,6 +227,16 @@ add_cleanup(const char *filename)
 
 
 
+/**
+ * Forget the files to delete, leaving them to someone else.  For a
+ * child that only cleans up after itself.
+ **/
+void forget_cleanups(void)
+{
+    n_cleanups = 0;
+}
+
+
 void cleanup_tempfiles_from_signal_handler(void)
 {
     cleanup_tempfiles_inner(1);
@@ -167,5 +245,7 @@ void cleanup_tempfiles_from_signal_handler(void)
 
 void cleanup_tempfiles(void)
 {
+    event_begin(EVENT_CLEANUP);
     cleanup_tempfiles_inner(0);
+    event_end(EVENT_CLEANUP, 0, 0);
 }
@@ -4,6 +4,8 @@
 
 int add_cleanup(const char *filename);
 
+void forget_cleanups(void);
+
 void cleanup_tempfiles_from_signal_handler(void);
 
 void cleanup_tempfiles(void);
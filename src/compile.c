@@ -29,7 +29,9 @@
 #include "exec.h"
 #include "compile.h"
 //#include "state.h"
-//#include "lock.h"
+#include "lock.h"
+#include "hosts.h"
+#include "include.h"
 #include "utils.h"
 #include "args.h"
 #include "tempfile.h"
@@ -37,6 +39,12 @@
 #include "remote.h"
 #include "stringutils.h"
 #include "io.h"
+#include "cache.h"
+#include "fscache.h"
+#include "cost.h"
+#include "hedge.h"
+#include "deadline.h"
+#include "events.h"
 
 
 struct hostdef mrcc_local = {
@@ -86,9 +94,14 @@ struct hostdef *hostdef_local = &mrcc_local;
  * wait for @p cpp_fid to exit before the output is complete.  This
  * allows us to overlap opening the TCP socket, which probably doesn't
  * use many cycles, with running the preprocessor.
+ *
+ * If @p cpp_fd is not NULL, the output goes into a pipe whose read end
+ * is returned there instead, and nothing is written to @p cpp_fname;
+ * the name is still reserved, for the copy on net fs.  @p cpp_fd is
+ * set to -1 if the input needs no preprocessing.
  **/
 int cpp_maybe(char **argv, char *input_fname, char **cpp_fname,
-          pid_t *cpp_pid)
+          pid_t *cpp_pid, int *cpp_fd)
 {
     char **cpp_argv;
     int ret;
@@ -96,6 +109,8 @@ int cpp_maybe(char **argv, char *input_fname, char **cpp_fname,
     const char *output_exten;
 
     *cpp_pid = 0;
+    if (cpp_fd)
+        *cpp_fd = -1;
 
     if (is_preprocessed(input_fname)) {
         /* TODO: Perhaps also consider the option that says not to use cpp.
@@ -129,13 +144,17 @@ int cpp_maybe(char **argv, char *input_fname, char **cpp_fname,
      * can fix it by specifying -MF.  */
 
     ret = strip_dasho(argv, &cpp_argv);
-    if (ret = 0)
+    if (ret == 0)
         ret = set_action_opt(cpp_argv, "-E");
     if (ret)
         return ret;
 
     /* FIXME: cpp_argv is leaked */
 
+    /* ended by wait_for_cpp() */
+    event_begin(EVENT_CPP);
+    if (cpp_fd)
+        return spawn_child_pipe(cpp_argv, cpp_pid, "/dev/null", cpp_fd, NULL);
     return spawn_child(cpp_argv, cpp_pid, "/dev/null", *cpp_fname, NULL);
 }
 
@@ -170,7 +189,7 @@ static int compile_local(char *argv[], char *input_name)
     if (ret)
         return ret;
 
-    ret = collect_child("cc", pid, &status, timeout_null_fd);
+    ret = collect_child("cc", pid, &status, timeout_null_fd, 0);
     if (ret)
         return ret;
 
@@ -219,7 +238,8 @@ static int compile_local(char *argv[], char *input_name)
  * host after local preprocessing/include scanning is finished
  * and the local cpu lock is released.
  */
-static int build_somewhere(char *argv[], int sg_level, int *status)
+static int build_somewhere(char *argv[], int sg_level, int *status,
+                           struct cost_run *run)
 {
 
 /**
@@ -231,20 +251,27 @@ static int build_somewhere(char *argv[], int sg_level, int *status)
     static int _scan_includes = 0;
 
 
-    char *input_fname = NULL, *output_fname, *cpp_fname, *deps_fname = NULL;
-    char **files;
+    char *input_fname = NULL, *output_fname, *cpp_fname = NULL, *deps_fname = NULL;
+    char **files = NULL;
     char **server_side_argv = NULL;
     int server_side_argv_deep_copied = 0;
     char *server_stderr_fname = NULL;
     int needs_dotd = 0;
     //int sets_dotd_target = 0;
     pid_t cpp_pid = 0;
+    int cpp_fd = -1;
     int cpu_lock_fd = -1, local_cpu_lock_fd = -1;
-    int ret;
+    int i, ret;
     int remote_ret = 0;
-    struct hostdef *host = NULL;
+    struct hostdef *host = NULL, *hostlist = NULL;
+    int host_lock_fd = -1;
     char *_discrepancy_filename = NULL;
     char **new_argv;
+    char cache_key_str[HASH_HEX_LEN + 1];
+    char *cache_key_ptr = NULL;
+    int use_cache = 0;
+    int hedge_ms = -1, speculate_ms = -1, local_won = 0;
+    int fallback = 0;
 
     ret = expand_preprocessor_options(&argv);
     if (ret)
@@ -261,16 +288,19 @@ static int build_somewhere(char *argv[], int sg_level, int *status)
 
     /* FIXME: this may leak memory for argv. */
 
+    event_begin(EVENT_SCAN_ARGS);
     ret = scan_args(argv, &input_fname, &output_fname, &new_argv);
     free_argv(argv);
     argv = new_argv;
+    event_set_input(input_fname);
+    event_end(EVENT_SCAN_ARGS, 0, ret);
     if (ret) {
         /* we need to scan the arguments even if we already know it's
          * local, so that we can pick up mrcc client options. */
         goto lock_local;
     }
 
-    ret = make_tmpnam("mrcc_server_stderr", ".txt", &server_stderr_fname);
+    ret = make_tmpmem("mrcc_server_stderr", ".txt", &server_stderr_fname);
     if (ret) {
         /* So we are failing locally to make a temp file to store the
          * server-side errors in; it's unlikely anything else will
@@ -281,24 +311,70 @@ static int build_somewhere(char *argv[], int sg_level, int *status)
 
     // begin to compile on MapReduce now
 
+    /* With mrccd hosts listed, send it to one of them rather than
+     * starting a MapReduce job.  The host is chosen first, because it
+     * decides where cpp runs; that also keeps the remote lock before
+     * the local one. */
+    ret = get_hostlist(&hostlist);
+    if (ret)
+        goto fallback;
+    /* A compile that is done here before it would get there is not
+     * sent at all. */
+    if (!_scan_includes
+            && cost_choose_local(argv, input_fname, hostlist != NULL, run))
+        goto lock_local;
+    /* the .i is not there yet; what it is expected to be will do */
+    deadline_set_size(run->isize);
+    if (hostlist) {
+        ret = pick_host(hostlist, &host, &host_lock_fd);
+        if (ret)
+            goto fallback;
+    }
+
+    hedge_ms = hedge_delay(host);
+    speculate_ms = speculate_delay(host, run->remote_usec);
+
     /* Lock the local CPU, since we're going to be doing preprocessing
      * or include scanning. */
-    /*
     ret = lock_local_cpp(&local_cpu_lock_fd);
     if (ret) {
         goto fallback;
     }
-    */
 
     if (_scan_includes) {
-        ret = 0; /*approximate_includes(host, argv);*/
+        ret = approximate_includes(argv, input_fname, &files);
+        for (i = 0; ret == 0 && files[i]; i++)
+            printf("%s\n", files[i]);
         goto unlock_and_clean_up;
     }
 
-    if (1) {
-        files = NULL;
+    if (host && host->cpp_where == MRCC_CPP_ON_SERVER
+            && !cache_enabled() && !fscache_enabled()) {
+        /* Pump mode: the host preprocesses, given the source and every
+         * header it reads.  If we cannot tell which those are, cpp
+         * runs here after all. */
+        ret = approximate_includes(argv, input_fname, &files);
+        if (ret == 0) {
+            mrcc_unlock(local_cpu_lock_fd);
+            local_cpu_lock_fd = -1;
+            ret = copy_argv(argv, &server_side_argv, 0);
+            if (ret)
+                goto fallback;
+            server_side_argv_deep_copied = 1;
+        } else if (ret != EXIT_MRCC_FAILED) {
+            goto fallback;
+        }
+    }
 
-        ret = cpp_maybe(argv, input_fname, &cpp_fname, &cpp_pid);
+    if (files == NULL) {
+        /* Unless the caches need the whole .i to look for the result,
+         * or another try of the compile may need it, upload it while
+         * cpp is still writing it. */
+        ret = cpp_maybe(argv, input_fname, &cpp_fname, &cpp_pid,
+                        cache_enabled() || fscache_enabled()
+                        || hedge_ms >= 0 || speculate_ms >= 0
+                        || !getenv_bool("MRCC_STREAM_CPP", 1)
+                        ? NULL : &cpp_fd);
         if (ret)
             goto fallback;
 
@@ -307,15 +383,62 @@ static int build_somewhere(char *argv[], int sg_level, int *status)
             goto fallback;
     }
 
-    ret = compile_remote(server_side_argv,
-                          input_fname,
-                          cpp_fname,
-                          files,
-                          output_fname,
-                          needs_dotd ? deps_fname : NULL,
-                          server_stderr_fname,
-                          cpp_pid, local_cpu_lock_fd,
-                          host, status);
+    if (cache_enabled() || fscache_enabled()) {
+        /* The key covers the preprocessed source, so cpp has to
+         * finish before we can look. */
+        *status = 0;
+        ret = wait_for_cpp(cpp_pid, status, input_fname);
+        cpp_pid = 0;
+        mrcc_unlock(local_cpu_lock_fd);
+        local_cpu_lock_fd = -1;
+        if (ret)
+            goto fallback;
+        if (*status == 0
+                && cache_key(server_side_argv, input_fname, cpp_fname,
+                             output_fname, cache_key_str) == 0) {
+            cache_key_ptr = cache_key_str;
+            use_cache = cache_enabled();
+            if (use_cache && cache_fetch(cache_key_str, output_fname) == 0) {
+                ret = 0;
+                goto clean_up;
+            }
+        }
+    }
+
+    if (hedge_ms >= 0 || speculate_ms >= 0) {
+        /* Both sides of the race start from the finished .i. */
+        *status = 0;
+        ret = wait_for_cpp(cpp_pid, status, input_fname);
+        cpp_pid = 0;
+        if (local_cpu_lock_fd != -1) {
+            mrcc_unlock(local_cpu_lock_fd);
+            local_cpu_lock_fd = -1;
+        }
+        if (ret == 0 && *status != 0)
+            ret = EXIT_MRCC_FAILED;
+        if (ret == 0)
+            ret = compile_hedged(server_side_argv, input_fname, cpp_fname,
+                                 files, output_fname, server_stderr_fname,
+                                 cache_key_ptr, host, hostlist, hedge_ms,
+                                 speculate_ms, status, &local_won);
+    } else {
+        ret = compile_remote(server_side_argv,
+                              input_fname,
+                              cpp_fname,
+                              files,
+                              output_fname,
+                              needs_dotd ? deps_fname : NULL,
+                              server_stderr_fname,
+                              cache_key_ptr,
+                              cpp_pid, cpp_fd, local_cpu_lock_fd,
+                              host, status);
+    }
+    /* compile_remote() consumed the pipe from cpp. */
+    cpp_fd = -1;
+    if (host_lock_fd != -1) {
+        mrcc_unlock(host_lock_fd);
+        host_lock_fd = -1;
+    }
     if (ret) {
         /* Returns zero if we successfully ran the compiler, even if
          * the compiler itself bombed out. */
@@ -328,10 +451,6 @@ static int build_somewhere(char *argv[], int sg_level, int *status)
 
     /* compile_remote() already unlocked local_cpu_lock_fd. */
     local_cpu_lock_fd = -1;
-    /*
-    mrcc_unlock(cpu_lock_fd);
-    cpu_lock_fd = -1;
-    */
     ret = critique_status(*status, "compile", input_fname, host, 1);
     if (ret == 0) {
         /* Try to copy the server-side errors on stderr.
@@ -343,11 +462,19 @@ static int build_somewhere(char *argv[], int sg_level, int *status)
          * operation will work, and this makes the mistake of
          * blaming the server for what is (clearly?) a local failure.
          */
-        ret = copy_file_to_fd(server_stderr_fname, STDERR_FILENO);
-        if (ret) {
-            rs_log_warning("Could not show server-side errors");
-            goto fallback;
+        if (!local_won) {
+            ret = copy_file_to_fd(server_stderr_fname, STDERR_FILENO);
+            if (ret) {
+                rs_log_warning("Could not show server-side errors");
+                goto fallback;
+            }
         }
+        if (use_cache
+                && cache_store(cache_key_str, output_fname, server_stderr_fname))
+            rs_log_warning("could not store %s in cache", output_fname);
+        if (!local_won)
+            cost_set_remote(run, host ? COST_MRCCD : COST_MAPRED,
+                            files ? NULL : cpp_fname);
         /* SUCCESS! */
         goto clean_up;
     }
@@ -372,12 +499,22 @@ static int build_somewhere(char *argv[], int sg_level, int *status)
 
 fallback:
 
+    if (cpp_fd != -1) {
+        /* nobody is going to read the rest of its output */
+        close(cpp_fd);
+        cpp_fd = -1;
+    }
+
+    if (host_lock_fd != -1) {
+        mrcc_unlock(host_lock_fd);
+        host_lock_fd = -1;
+    }
     if (cpu_lock_fd != -1) {
-        // mrcc_unlock(cpu_lock_fd);
+        mrcc_unlock(cpu_lock_fd);
         cpu_lock_fd = -1;
     }
     if (local_cpu_lock_fd != -1) {
-        // mrcc_unlock(local_cpu_lock_fd);
+        mrcc_unlock(local_cpu_lock_fd);
         local_cpu_lock_fd = -1;
     }
 
@@ -398,14 +535,20 @@ fallback:
     /* At this point, we can abandon the remote errors. */
 
     rs_log_warning("failed to distribute, running locally instead");
+    event_begin(EVENT_FALLBACK);
+    fallback = 1;
 
 lock_local:
-    // lock_local(&cpu_lock_fd);
+    /* Without a slot the compile still has to be done, so go ahead. */
+    if (lock_local(&cpu_lock_fd) != 0)
+        cpu_lock_fd = -1;
 
 run_local:
     /* Either compile locally, after remote failure, or simply do other cc tasks
        as assembling, linking, etc. */
     ret = compile_local(argv, input_fname);
+    if (fallback)
+        event_end(EVENT_FALLBACK, 0, ret);
 //    if (remote_ret != 0 && remote_ret != ret) {
         /* Oops! it seems what we did remotely is not the same as what we did
           locally. We normally send email in such situations (if emailing is
@@ -421,16 +564,21 @@ run_local:
     */
 unlock_and_clean_up:
     if (cpu_lock_fd != -1) {
-        // mrcc_unlock(cpu_lock_fd);
+        mrcc_unlock(cpu_lock_fd);
         cpu_lock_fd = -1; /* Not really needed, just for consistency. */
     }
     /* For the --scan_includes case. */
     if (local_cpu_lock_fd != -1) {
-        // mrcc_unlock(local_cpu_lock_fd);
+        mrcc_unlock(local_cpu_lock_fd);
         local_cpu_lock_fd = -1; /* Not really needed, just for consistency. */
     }
 
 clean_up:
+    if (host_lock_fd != -1)
+        mrcc_unlock(host_lock_fd);
+    free_hostlist(hostlist);
+    if (files)
+        free_argv(files);
     free_argv(argv);
     if (server_side_argv_deep_copied) {
         if (server_side_argv != NULL) {
@@ -451,12 +599,14 @@ clean_up:
 int build_somewhere_timed(char *argv[], int sg_level, int *status)
 {
     struct timeval before, after, delta;
+    struct cost_run run;
     int ret;
 
+    memset(&run, 0, sizeof run);
     if (gettimeofday(&before, NULL))
         rs_log_warning("gettimeofday failed");
 
-    ret = build_somewhere(argv, sg_level, status);
+    ret = build_somewhere(argv, sg_level, status, &run);
 
     if (gettimeofday(&after, NULL)) {
         rs_log_warning("gettimeofday failed");
@@ -467,7 +617,11 @@ int build_somewhere_timed(char *argv[], int sg_level, int *status)
         rs_log(RS_LOG_INFO|RS_LOG_NONAME,
              "elapsed compilation time %ld.%06lds",
              delta.tv_sec, (long) delta.tv_usec);
+        /* learn from what went well */
+        if (ret == 0)
+            cost_record(&run, delta.tv_sec * 1000000L + delta.tv_usec);
     }
+    cost_free(&run);
 
     return ret;
 }
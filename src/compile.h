@@ -11,4 +11,5 @@ extern struct hostdef *hostdef_local;
 int build_somewhere_timed(char *argv[], int sg_level, int *status);
 
 int discrepancy_filename(char **filename);
-int cpp_maybe(char **argv, char *input_fname, char **cpp_fname, pid_t *cpp_pid);
+int cpp_maybe(char **argv, char *input_fname, char **cpp_fname, pid_t *cpp_pid,
+              int *cpp_fd);
@@ -0,0 +1,517 @@
+// mrcc - A C Compiler system on MapReduce
+// Zhiqiang Ma, https://www.ericzma.com
+
+#include <stdarg.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <string.h>
+#include <time.h>
+#include <ctype.h>
+#include <assert.h>
+#include <fcntl.h>
+
+#include <sys/fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <stdint.h>
+
+#include "utils.h"
+#include "trace.h"
+#include "io.h"
+#include "compress.h"
+
+/**
+ * @file
+ * @brief Compression of files sent over the net fs.
+ *
+ * Preprocessed sources are megabytes of very redundant text.  With
+ * $MRCC_COMPRESS=lz4 they are compressed before they are put to the net
+ * fs, and mrcc-map decompresses them before compiling.
+ *
+ * The codec is an implementation of the LZ4 block format, chosen for
+ * speed: compressing must cost less than the upload it saves.  A
+ * compressed file is framed as
+ *
+ *   "MRCZ" version(1) codec(1) 0 0
+ *   { raw_len(4) stored_len(4) data } ...
+ *   0(4) 0(4)
+ *
+ * with lengths in network byte order.  The top bit of stored_len marks
+ * a block stored raw because it did not compress.  The codec is recorded
+ * in the header, so a mapper can tell what it got without being told.
+ **/
+
+#define COMPRESS_VERSION 1
+
+// codec numbers used in the file header
+#define COMPRESS_CODEC_LZ4 1
+
+#define COMPRESS_STORED 0x80000000U
+
+// LZ4 block format limits
+#define LZ4_MIN_MATCH 4
+#define LZ4_LAST_LITERALS 5
+#define LZ4_MF_LIMIT 12
+#define LZ4_MAX_OFFSET 65535
+#define LZ4_HASH_LOG 14
+
+/**
+ * @brief Which codec to compress with, from $MRCC_COMPRESS.
+ * @return MRCC_COMPRESS_LZ4 if it is "lz4", otherwise MRCC_COMPRESS_NONE.
+ */
+enum compress compress_from_env(void)
+{
+    const char *e = getenv("MRCC_COMPRESS");
+
+    if (e == NULL || e[0] == '\0' || !strcmp(e, "none"))
+        return MRCC_COMPRESS_NONE;
+    if (!strcmp(e, "lz4"))
+        return MRCC_COMPRESS_LZ4;
+    rs_log_warning("unsupported MRCC_COMPRESS \"%s\", not compressing", e);
+    return MRCC_COMPRESS_NONE;
+}
+
+const char *compress_name(enum compress compr)
+{
+    switch (compr) {
+    case MRCC_COMPRESS_NONE:
+        return "none";
+    case MRCC_COMPRESS_LZO1X:
+        return "lzo";
+    case MRCC_COMPRESS_LZ4:
+        return "lz4";
+    }
+    return "unknown";
+}
+
+static uint32_t read32(const unsigned char *p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, sizeof v);
+    return v;
+}
+
+static uint32_t lz4_hash(uint32_t v)
+{
+    return (v * 2654435761U) >> (32 - LZ4_HASH_LOG);
+}
+
+/**
+ * @brief Largest size of LZ4 data for @p n bytes of input.
+ */
+size_t lz4_compress_bound(size_t n)
+{
+    return n + n / 255 + 16;
+}
+
+/* Write a length continuation, as used for long literal runs and matches. */
+static unsigned char *lz4_put_length(unsigned char *op, size_t len)
+{
+    for (; len >= 255; len -= 255)
+        *op++ = 255;
+    *op++ = (unsigned char) len;
+    return op;
+}
+
+/* Bytes lz4_put_length() writes for @p len past the 15 of the token. */
+static size_t lz4_length_size(size_t len)
+{
+    return len >= 15 ? (len - 15) / 255 + 1 : 0;
+}
+
+/* Emit one sequence; return NULL if it would not fit before @p oend. */
+static unsigned char *lz4_put_sequence(unsigned char *op, unsigned char *oend,
+                                       const unsigned char *lit, size_t lit_len,
+                                       size_t offset, size_t match_len)
+{
+    unsigned char *token;
+    size_t ml = match_len ? match_len - LZ4_MIN_MATCH : 0;
+    size_t need = 1 + lz4_length_size(lit_len) + lit_len;
+
+    if (match_len)
+        need += 2 + lz4_length_size(ml);
+    if ((size_t) (oend - op) < need)
+        return NULL;
+
+    token = op++;
+    *token = (unsigned char) ((lit_len >= 15 ? 15 : lit_len) << 4);
+    if (lit_len >= 15)
+        op = lz4_put_length(op, lit_len - 15);
+    memcpy(op, lit, lit_len);
+    op += lit_len;
+    if (match_len == 0)
+        return op;
+
+    *op++ = (unsigned char) offset;
+    *op++ = (unsigned char) (offset >> 8);
+    *token |= (unsigned char) (ml >= 15 ? 15 : ml);
+    if (ml >= 15)
+        op = lz4_put_length(op, ml - 15);
+    return op;
+}
+
+/**
+ * @brief Compress one block into the LZ4 block format.
+ * @param src data to compress.
+ * @param n length of @p src.
+ * @param dst output buffer.
+ * @param cap size of @p dst.
+ * @return length of the compressed data, or 0 if it would not fit
+ * into @p cap bytes.
+ */
+size_t lz4_compress_block(const unsigned char *src, size_t n,
+                          unsigned char *dst, size_t cap)
+{
+    static uint32_t table[1 << LZ4_HASH_LOG];
+    unsigned char *op = dst, *oend = dst + cap;
+    size_t ip = 0, anchor = 0, ref, len, limit;
+    unsigned misses = 0;
+    uint32_t h;
+
+    memset(table, 0, sizeof table);
+    limit = n > LZ4_MF_LIMIT ? n - LZ4_MF_LIMIT : 0;
+
+    while (ip < limit) {
+        h = lz4_hash(read32(src + ip));
+        ref = table[h];
+        table[h] = (uint32_t) ip;
+
+        if (ref >= ip || ip - ref > LZ4_MAX_OFFSET
+                || read32(src + ref) != read32(src + ip)) {
+            /* skip faster through data that does not compress */
+            ip += 1 + (misses++ >> 6);
+            continue;
+        }
+        misses = 0;
+
+        len = LZ4_MIN_MATCH;
+        while (ip + len < n - LZ4_LAST_LITERALS && src[ref + len] == src[ip + len])
+            len++;
+
+        op = lz4_put_sequence(op, oend, src + anchor, ip - anchor, ip - ref, len);
+        if (op == NULL)
+            return 0;
+        ip += len;
+        anchor = ip;
+        if (ip - 2 < limit)
+            table[lz4_hash(read32(src + ip - 2))] = (uint32_t) (ip - 2);
+    }
+
+    op = lz4_put_sequence(op, oend, src + anchor, n - anchor, 0, 0);
+    return op ? (size_t) (op - dst) : 0;
+}
+
+/**
+ * @brief Decompress one block of the LZ4 block format.
+ * @param src compressed data.
+ * @param n length of @p src.
+ * @param dst output buffer of @p raw_len bytes.
+ * @param raw_len exact length of the decompressed data.
+ * @return 0 on success, or EXIT_PROTOCOL_ERROR if the data is corrupt.
+ */
+int lz4_decompress_block(const unsigned char *src, size_t n,
+                         unsigned char *dst, size_t raw_len)
+{
+    const unsigned char *ip = src, *iend = src + n;
+    unsigned char *op = dst, *oend = dst + raw_len;
+    const unsigned char *match;
+    size_t lit, ml, offset;
+    unsigned token;
+
+    while (ip < iend) {
+        token = *ip++;
+
+        lit = token >> 4;
+        if (lit == 15) {
+            do {
+                if (ip >= iend)
+                    goto corrupt;
+                lit += *ip;
+            } while (*ip++ == 255);
+        }
+        if ((size_t) (iend - ip) < lit || (size_t) (oend - op) < lit)
+            goto corrupt;
+        memcpy(op, ip, lit);
+        ip += lit;
+        op += lit;
+        if (ip == iend)
+            break;
+
+        if (iend - ip < 2)
+            goto corrupt;
+        offset = ip[0] | (size_t) ip[1] << 8;
+        ip += 2;
+        if (offset == 0 || offset > (size_t) (op - dst))
+            goto corrupt;
+
+        ml = token & 15;
+        if (ml == 15) {
+            do {
+                if (ip >= iend)
+                    goto corrupt;
+                ml += *ip;
+            } while (*ip++ == 255);
+        }
+        ml += LZ4_MIN_MATCH;
+        if ((size_t) (oend - op) < ml)
+            goto corrupt;
+        /* the match may overlap what it produces */
+        for (match = op - offset; ml > 0; ml--)
+            *op++ = *match++;
+    }
+
+    if (op == oend)
+        return 0;
+
+corrupt:
+    rs_log_error("corrupt compressed data");
+    return EXIT_PROTOCOL_ERROR;
+}
+
+static void put_be32(unsigned char *p, uint32_t v)
+{
+    p[0] = (unsigned char) (v >> 24);
+    p[1] = (unsigned char) (v >> 16);
+    p[2] = (unsigned char) (v >> 8);
+    p[3] = (unsigned char) v;
+}
+
+static uint32_t get_be32(const unsigned char *p)
+{
+    return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16
+        | (uint32_t) p[2] << 8 | p[3];
+}
+
+/* Read up to @p len bytes; return how many, stopping early only at EOF. */
+static ssize_t read_full(int fd, unsigned char *buf, size_t len)
+{
+    size_t done = 0;
+    ssize_t r;
+
+    while (done < len) {
+        r = read(fd, buf + done, len - done);
+        if (r == -1 && errno == EINTR)
+            continue;
+        if (r == -1) {
+            rs_log_error("failed to read fd%d: %s", fd, strerror(errno));
+            return -1;
+        }
+        if (r == 0)
+            break;
+        done += r;
+    }
+    return (ssize_t) done;
+}
+
+/**
+ * @brief Whether @p fname starts with the magic of a compressed file.
+ */
+int is_compressed_file(const char *fname)
+{
+    unsigned char magic[4];
+    int fd, ret;
+
+    fd = open(fname, O_RDONLY|O_BINARY);
+    if (fd == -1)
+        return 0;
+    ret = read_full(fd, magic, sizeof magic) == sizeof magic
+        && !memcmp(magic, COMPRESS_MAGIC, sizeof magic);
+    close(fd);
+    return ret;
+}
+
+/**
+ * @brief Compress everything read from a file descriptor.
+ * The compressed data is handed to @p sink as it is produced, so it can
+ * go out while the input is still being written, e.g. through a pipe.
+ * @param compr codec to use.
+ * @param ifd file descriptor to read until eof.
+ * @param sink called with each piece of compressed data; returns 0 on
+ * success, or an error return code that stops compression.
+ * @param arg passed to @p sink.
+ * @return 0 on success, or error return code.
+ */
+int compress_stream(enum compress compr, int ifd,
+                    int (*sink)(void *arg, const void *buf, size_t n),
+                    void *arg)
+{
+    unsigned char hdr[8], *raw = NULL, *packed = NULL;
+    size_t packed_len;
+    ssize_t raw_len;
+    int ret = 0;
+
+    if (compr != MRCC_COMPRESS_LZ4) {
+        rs_log_error("cannot compress with %s", compress_name(compr));
+        return EXIT_PROTOCOL_ERROR;
+    }
+
+    raw = malloc(COMPRESS_BLOCK_SIZE);
+    packed = malloc(lz4_compress_bound(COMPRESS_BLOCK_SIZE));
+    if (raw == NULL || packed == NULL) {
+        ret = EXIT_OUT_OF_MEMORY;
+        goto out;
+    }
+
+    memcpy(hdr, COMPRESS_MAGIC, 4);
+    hdr[4] = COMPRESS_VERSION;
+    hdr[5] = COMPRESS_CODEC_LZ4;
+    hdr[6] = hdr[7] = 0;
+    if ((ret = sink(arg, hdr, sizeof hdr)))
+        goto out;
+
+    while ((raw_len = read_full(ifd, raw, COMPRESS_BLOCK_SIZE)) > 0) {
+        packed_len = lz4_compress_block(raw, raw_len, packed,
+                                        raw_len - raw_len / 16);
+        put_be32(hdr, (uint32_t) raw_len);
+        if (packed_len)
+            put_be32(hdr + 4, (uint32_t) packed_len);
+        else
+            put_be32(hdr + 4, (uint32_t) raw_len | COMPRESS_STORED);
+        if ((ret = sink(arg, hdr, sizeof hdr)))
+            goto out;
+        if (packed_len)
+            ret = sink(arg, packed, packed_len);
+        else
+            ret = sink(arg, raw, raw_len);
+        if (ret)
+            goto out;
+    }
+    if (raw_len < 0) {
+        ret = EXIT_IO_ERROR;
+        goto out;
+    }
+
+    memset(hdr, 0, sizeof hdr);
+    ret = sink(arg, hdr, sizeof hdr);
+
+out:
+    free(raw);
+    free(packed);
+    return ret;
+}
+
+static int compress_sink_fd(void *arg, const void *buf, size_t n)
+{
+    return writex(*(int *) arg, buf, n);
+}
+
+/**
+ * @brief Compress a file.
+ * @param compr codec to use.
+ * @param in_fname file to compress.
+ * @param out_fname where the compressed file goes.
+ * @return 0 on success, or error return code.
+ */
+int compress_file(enum compress compr, const char *in_fname, const char *out_fname)
+{
+    int ifd, ofd;
+    int ret;
+
+    if ((ifd = open(in_fname, O_RDONLY|O_BINARY)) == -1) {
+        rs_log_error("failed to open %s: %s", in_fname, strerror(errno));
+        return EXIT_IO_ERROR;
+    }
+    if ((ofd = open(out_fname, O_WRONLY|O_CREAT|O_TRUNC|O_BINARY, 0600)) == -1) {
+        rs_log_error("failed to create %s: %s", out_fname, strerror(errno));
+        close(ifd);
+        return EXIT_IO_ERROR;
+    }
+
+    ret = compress_stream(compr, ifd, compress_sink_fd, &ofd);
+
+    close(ifd);
+    if (mrcc_close(ofd) && ret == 0)
+        ret = EXIT_IO_ERROR;
+    return ret;
+}
+
+/**
+ * @brief Decompress a file made by compress_file().
+ * @param in_fname compressed file.
+ * @param out_fname where the decompressed data goes.
+ * @return 0 on success, or error return code.
+ */
+int decompress_file(const char *in_fname, const char *out_fname)
+{
+    unsigned char hdr[8], *raw = NULL, *packed = NULL;
+    uint32_t raw_len, stored_len;
+    size_t len;
+    int ifd = -1, ofd = -1;
+    int ret = 0;
+
+    raw = malloc(COMPRESS_BLOCK_SIZE);
+    packed = malloc(lz4_compress_bound(COMPRESS_BLOCK_SIZE));
+    if (raw == NULL || packed == NULL) {
+        ret = EXIT_OUT_OF_MEMORY;
+        goto out;
+    }
+    if ((ifd = open(in_fname, O_RDONLY|O_BINARY)) == -1) {
+        rs_log_error("failed to open %s: %s", in_fname, strerror(errno));
+        ret = EXIT_IO_ERROR;
+        goto out;
+    }
+    if (read_full(ifd, hdr, sizeof hdr) != sizeof hdr
+            || memcmp(hdr, COMPRESS_MAGIC, 4) != 0) {
+        rs_log_error("%s is not a compressed file", in_fname);
+        ret = EXIT_PROTOCOL_ERROR;
+        goto out;
+    }
+    if (hdr[4] != COMPRESS_VERSION || hdr[5] != COMPRESS_CODEC_LZ4) {
+        rs_log_error("%s: unsupported version %d or codec %d",
+                     in_fname, hdr[4], hdr[5]);
+        ret = EXIT_PROTOCOL_ERROR;
+        goto out;
+    }
+    if ((ofd = open(out_fname, O_WRONLY|O_CREAT|O_TRUNC|O_BINARY, 0600)) == -1) {
+        rs_log_error("failed to create %s: %s", out_fname, strerror(errno));
+        ret = EXIT_IO_ERROR;
+        goto out;
+    }
+
+    for (;;) {
+        if (read_full(ifd, hdr, sizeof hdr) != sizeof hdr) {
+            ret = EXIT_TRUNCATED;
+            break;
+        }
+        raw_len = get_be32(hdr);
+        stored_len = get_be32(hdr + 4);
+        if (raw_len == 0)
+            break;
+        len = stored_len & ~COMPRESS_STORED;
+        if (raw_len > COMPRESS_BLOCK_SIZE
+                || len > lz4_compress_bound(COMPRESS_BLOCK_SIZE)
+                || ((stored_len & COMPRESS_STORED) && len != raw_len)) {
+            rs_log_error("%s: bad block header", in_fname);
+            ret = EXIT_PROTOCOL_ERROR;
+            break;
+        }
+        if (read_full(ifd, packed, len) != (ssize_t) len) {
+            ret = EXIT_TRUNCATED;
+            break;
+        }
+        if (stored_len & COMPRESS_STORED)
+            ret = writex(ofd, packed, len);
+        else if ((ret = lz4_decompress_block(packed, len, raw, raw_len)) == 0)
+            ret = writex(ofd, raw, raw_len);
+        if (ret)
+            break;
+    }
+    if (ret == EXIT_TRUNCATED)
+        rs_log_error("%s is truncated", in_fname);
+
+out:
+    if (ifd != -1)
+        close(ifd);
+    if (ofd != -1 && mrcc_close(ofd) && ret == 0)
+        ret = EXIT_IO_ERROR;
+    free(raw);
+    free(packed);
+    return ret;
+}
@@ -0,0 +1,29 @@
+// mrcc - A C Compiler system on MapReduce
+// Zhiqiang Ma, https://www.ericzma.com
+#pragma once
+
+#include <stddef.h>
+
+#include "utils.h"
+
+// magic at the start of a compressed file
+#define COMPRESS_MAGIC "MRCZ"
+
+// bytes of raw data compressed as one block
+#define COMPRESS_BLOCK_SIZE (256 * 1024)
+
+enum compress compress_from_env(void);
+const char *compress_name(enum compress compr);
+
+size_t lz4_compress_bound(size_t n);
+size_t lz4_compress_block(const unsigned char *src, size_t n,
+                          unsigned char *dst, size_t cap);
+int lz4_decompress_block(const unsigned char *src, size_t n,
+                         unsigned char *dst, size_t raw_len);
+
+int is_compressed_file(const char *fname);
+int compress_stream(enum compress compr, int ifd,
+                    int (*sink)(void *arg, const void *buf, size_t n),
+                    void *arg);
+int compress_file(enum compress compr, const char *in_fname, const char *out_fname);
+int decompress_file(const char *in_fname, const char *out_fname);
@@ -0,0 +1,445 @@
+// mrcc - A C Compiler system on MapReduce
+// Zhiqiang Ma, https://www.ericzma.com
+
+#include <stdarg.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <string.h>
+#include <time.h>
+#include <ctype.h>
+#include <assert.h>
+#include <fcntl.h>
+
+#include <sys/fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <sys/file.h>
+
+#include "utils.h"
+#include "trace.h"
+#include "io.h"
+#include "stringutils.h"
+#include "tempfile.h"
+#include "lock.h"
+#include "cost.h"
+
+/**
+ * @file
+ * @brief Guess whether a compile is done sooner here or remotely.
+ *
+ * A MapReduce job takes some 20 seconds before it compiles anything,
+ * while a small file compiles locally in a few milliseconds.  So
+ * before anything is sent, mrcc estimates both:
+ *
+ *   local  = size of the .i * compile speed for the flags,
+ *            stretched if all local cores are busy
+ *   remote = round trip overhead + size of the .i * compile speed
+ *
+ * and compiles locally if that is not slower.  It learns as it goes:
+ * every compile it sends or keeps appends a line to
+ * $MRCC_DIR/state/timings, as timed by build_somewhere_timed():
+ *
+ *     WHERE USEC ISIZE SRCSIZE CLASS SOURCE
+ *
+ * The compile speed for each class of flags is the median over local
+ * compiles, and the overhead of a route (MapReduce or mrccd) the
+ * median over its last remote compiles of the time that speed does
+ * not explain.  Until there are enough lines, rough defaults stand in.
+ *
+ * The .i does not exist yet when this is decided, so its size is the
+ * one this source had last time, or else the size of the source times
+ * the usual growth in cpp.
+ *
+ * $MRCC_COST_MODEL=0 sends every compile remote, as before; the
+ * history is still kept, for the expected round trip that
+ * speculate_delay() goes by.
+ **/
+
+// bytes at the end of the history that are read
+#define COST_TAIL (64 * 1024)
+
+// the history is cut back to COST_TAIL once it is bigger than this
+#define COST_MAX_SIZE (256 * 1024)
+
+// remote compiles the overhead of a route is taken from
+#define COST_WINDOW 16
+
+// local compiles of a class needed before its speed is believed
+#define COST_MIN_SAMPLES 3
+
+/* One line of the history. */
+struct cost_sample {
+    enum cost_where where;
+    long long usec, isize, srcsize;
+    int flags_class;
+    const char *input;
+};
+
+static const char *const cost_names[] = { "none", "local", "mapred", "mrccd" };
+
+/* Compile speed until measured, in usec per KB of .i, by -O level. */
+static const long long cost_default_rate[3] = { 400, 800, 1200 };
+
+/* Overhead of a remote compile until measured, in usec, by route. */
+static const long long cost_default_overhead[] = { 0, 0, 20000000, 50000 };
+
+/* The .i is this many times the size of the source until measured. */
+#define COST_DEFAULT_GROWTH 25
+
+/*
+ * Sort the flags into classes of similar compile speed: the -O level
+ * (0, 1 or 2 and up), plus 3 with debug info.
+ */
+static int cost_flags_class(char **argv)
+{
+    int opt = 0, debug = 0, i;
+    const char *a;
+
+    for (i = 1; argv[i]; i++) {
+        a = argv[i];
+        if (str_startswith("-O", a)) {
+            if (str_equal(a, "-O0"))
+                opt = 0;
+            else if (a[2] == '\0' || a[2] == '1' || a[2] == 'g'
+                     || a[2] == 's' || a[2] == 'z')
+                opt = 1;
+            else
+                opt = 2;
+        } else if (str_startswith("-g", a)) {
+            debug = !str_equal(a, "-g0");
+        }
+    }
+    return opt + 3 * debug;
+}
+
+static char *cost_history_name(void)
+{
+    char *state, *name = NULL;
+
+    if (get_state_dir(&state) || asprintf(&name, "%s/timings", state) == -1)
+        return NULL;
+    return name;
+}
+
+/* Read the last COST_TAIL bytes of the history file @p fd into @p buf. */
+static int cost_read_tail(int fd, char **buf, size_t *len)
+{
+    struct stat st;
+    off_t start;
+
+    if (fstat(fd, &st) == -1)
+        return EXIT_IO_ERROR;
+    start = st.st_size > COST_TAIL ? st.st_size - COST_TAIL : 0;
+    *len = st.st_size - start;
+    if ((*buf = malloc(*len + 1)) == NULL)
+        return EXIT_OUT_OF_MEMORY;
+    if (lseek(fd, start, SEEK_SET) == -1 || readx(fd, *buf, *len) != 0) {
+        free(*buf);
+        *buf = NULL;
+        return EXIT_IO_ERROR;
+    }
+    (*buf)[*len] = '\0';
+    return 0;
+}
+
+/*
+ * Read the recent history into @p samples, oldest first, pointing into
+ * @p buf.  No history is an empty one.
+ */
+static int cost_load(struct cost_sample **samples, int *n, char **buf)
+{
+    struct cost_sample c;
+    char where[16];
+    char *name, *p, *eol;
+    size_t len;
+    int fd, pos, k, max;
+
+    *samples = NULL;
+    *n = 0;
+    *buf = NULL;
+    if ((name = cost_history_name()) == NULL)
+        return 0;
+    fd = open(name, O_RDONLY|O_BINARY);
+    free(name);
+    if (fd == -1)
+        return 0;
+    if (cost_read_tail(fd, buf, &len) != 0) {
+        close(fd);
+        return 0;
+    }
+    close(fd);
+
+    for (max = 0, p = *buf; (p = strchr(p, '\n')) != NULL; p++)
+        max++;
+    if ((*samples = malloc((max + 1) * sizeof **samples)) == NULL)
+        return EXIT_OUT_OF_MEMORY;
+
+    /* the first line may be cut */
+    p = *buf;
+    if (len == COST_TAIL && (p = strchr(p, '\n')) != NULL)
+        p++;
+    for (; p && (eol = strchr(p, '\n')) != NULL; p = eol + 1) {
+        *eol = '\0';
+        pos = -1;
+        if (sscanf(p, "%15s %lld %lld %lld %d %n", where, &c.usec, &c.isize,
+                   &c.srcsize, &c.flags_class, &pos) != 5 || pos < 0
+                || c.usec < 0 || c.isize <= 0 || c.srcsize < 0)
+            continue;
+        for (k = COST_LOCAL; k <= COST_MRCCD; k++) {
+            if (str_equal(where, cost_names[k]))
+                break;
+        }
+        if (k > COST_MRCCD)
+            continue;
+        c.where = (enum cost_where) k;
+        c.input = p + pos;
+        (*samples)[(*n)++] = c;
+    }
+    return 0;
+}
+
+static int cost_cmp(const void *a, const void *b)
+{
+    long long x = *(const long long *) a, y = *(const long long *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* The median of @p n values, which get sorted. */
+static long long cost_median(long long *v, int n)
+{
+    qsort(v, n, sizeof *v, cost_cmp);
+    return v[n / 2];
+}
+
+/* Local compile speed for @p flags_class, usec per KB of .i. */
+static long long cost_rate(struct cost_sample *samples, int n,
+                           long long *v, int flags_class)
+{
+    long long rate;
+    int i, k = 0;
+
+    for (i = 0; i < n; i++) {
+        if (samples[i].where == COST_LOCAL
+                && samples[i].flags_class == flags_class)
+            v[k++] = samples[i].usec * 1024 / samples[i].isize;
+    }
+    if (k >= COST_MIN_SAMPLES)
+        return cost_median(v, k);
+    rate = cost_default_rate[flags_class % 3];
+    return flags_class >= 3 ? rate * 5 / 4 : rate;
+}
+
+/*
+ * Overhead of a compile sent @p where: what the compile speed does not
+ * explain of its recent round trips.  *n_used is set to how many.
+ */
+static long long cost_overhead(struct cost_sample *samples, int n,
+                               long long *v, enum cost_where where,
+                               int *n_used)
+{
+    long long *rates = v + n, compile;
+    int i, k = 0;
+
+    for (i = n - 1; i >= 0 && k < COST_WINDOW; i--) {
+        if (samples[i].where != where)
+            continue;
+        compile = samples[i].isize
+                  * cost_rate(samples, n, rates, samples[i].flags_class) / 1024;
+        v[k++] = samples[i].usec > compile ? samples[i].usec - compile : 0;
+    }
+    *n_used = k;
+    if (k == 0)
+        return cost_default_overhead[where];
+    return cost_median(v, k);
+}
+
+/*
+ * The size of the .i of @p input: what it was last time, or what cpp
+ * usually makes of a source of @p srcsize.
+ */
+static long long cost_isize(struct cost_sample *samples, int n,
+                            long long *v, const char *input,
+                            long long srcsize, int *known)
+{
+    int i, k = 0;
+
+    *known = 0;
+    for (i = n - 1; i >= 0; i--) {
+        if (str_equal(samples[i].input, input)) {
+            *known = 1;
+            return samples[i].isize;
+        }
+    }
+    /* only remote compiles measured the .i */
+    for (i = 0; i < n; i++) {
+        if (samples[i].where != COST_LOCAL && samples[i].srcsize > 0)
+            v[k++] = samples[i].isize * 1000 / samples[i].srcsize;
+    }
+    if (k == 0)
+        return srcsize * COST_DEFAULT_GROWTH;
+    return srcsize * cost_median(v, k) / 1000;
+}
+
+/**
+ * @brief Decide whether compiling @p input_fname here is cheaper than
+ * sending it.
+ * @param argv the compiler command.
+ * @param mrccd nonzero if it would go to an mrccd host, else MapReduce.
+ * @param run receives what cost_record() needs later; to be given to
+ * cost_free() in any case.
+ * @return 1 to compile locally, 0 to send it.
+ */
+int cost_choose_local(char **argv, const char *input_fname, int mrccd,
+                      struct cost_run *run)
+{
+    struct cost_sample *samples = NULL;
+    struct stat st;
+    enum cost_where route = mrccd ? COST_MRCCD : COST_MAPRED;
+    long long *v = NULL;
+    long long rate, compile, local, overhead, remote;
+    double load;
+    long ncpus;
+    char *buf = NULL;
+    int n, n_used, known, busy, n_slots;
+    int ret = 0;
+
+    memset(run, 0, sizeof *run);
+    if (stat(input_fname, &st) == -1)
+        return 0;
+    if ((run->input = strdup(abspath(input_fname, 0))) == NULL)
+        return 0;
+    run->srcsize = st.st_size;
+    run->flags_class = cost_flags_class(argv);
+
+    if (cost_load(&samples, &n, &buf) != 0
+            || (v = malloc((2 * n + 1) * sizeof *v)) == NULL)
+        goto out;
+
+    run->isize = cost_isize(samples, n, v, run->input, run->srcsize, &known);
+    if (run->isize <= 0)
+        run->isize = 1;
+    rate = cost_rate(samples, n, v, run->flags_class);
+    compile = run->isize * rate / 1024;
+
+    /* with every core busy, a local compile waits its turn */
+    ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpus < 1)
+        ncpus = 1;
+    busy = lock_local_busy(&n_slots);
+    if (getloadavg(&load, 1) == 1 && (int) load > busy)
+        busy = (int) load;
+    local = compile;
+    if (busy >= ncpus)
+        local = compile * (busy + 1) / ncpus;
+
+    overhead = cost_overhead(samples, n, v, route, &n_used);
+    remote = overhead + compile;
+    /* only what was seen says how long a remote compile should take */
+    if (n_used > 0)
+        run->remote_usec = remote;
+
+    ret = getenv_bool("MRCC_COST_MODEL", 1) && local <= remote;
+    rs_trace("%s: .i %s %lldKB, flags class %d at %lldus/KB: "
+             "local %lldms with %d of %ld cores busy, "
+             "%s %lldms after %d round trips: compile %s",
+             input_fname, known ? "was" : "guessed", run->isize / 1024,
+             run->flags_class, rate, local / 1000, busy, ncpus,
+             cost_names[route], remote / 1000, n_used,
+             ret ? "locally" : "remotely");
+    if (ret)
+        run->where = COST_LOCAL;
+
+out:
+    free(samples);
+    free(buf);
+    free(v);
+    return ret;
+}
+
+/**
+ * @brief Note that the compile of @p run went out @p where.
+ * @param cpp_fname the preprocessed source, if it is in a file.
+ */
+void cost_set_remote(struct cost_run *run, enum cost_where where,
+                     const char *cpp_fname)
+{
+    struct stat st;
+
+    if (run->input == NULL)
+        return;
+    run->where = where;
+    if (cpp_fname && stat(cpp_fname, &st) == 0 && st.st_size > 0)
+        run->isize = st.st_size;
+}
+
+/*
+ * Cut the history open on @p fd back to its last COST_TAIL bytes.
+ * Lines others append meanwhile may be lost.
+ */
+static void cost_trim(int fd, const char *name)
+{
+    char *buf = NULL, *tmp = NULL;
+    size_t len;
+    int tfd;
+
+    if (cost_read_tail(fd, &buf, &len) != 0
+            || asprintf(&tmp, "%s.%ld", name, (long) getpid()) == -1) {
+        free(buf);
+        return;
+    }
+    tfd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC|O_BINARY, 0666);
+    if (tfd == -1 || writex(tfd, buf, len) != 0 || close(tfd) != 0
+            || rename(tmp, name) == -1) {
+        rs_log_warning("failed to trim %s", name);
+        unlink(tmp);
+    }
+    free(buf);
+    free(tmp);
+}
+
+/**
+ * @brief Add the compile of @p run, which took @p usec, to the history.
+ */
+void cost_record(struct cost_run *run, long usec)
+{
+    struct stat st;
+    char *name, *line = NULL;
+    int fd, len;
+
+    if (run->where == COST_NONE || run->input == NULL
+            || strchr(run->input, '\n'))
+        return;
+    if ((name = cost_history_name()) == NULL)
+        return;
+    len = asprintf(&line, "%s %ld %lld %lld %d %s\n", cost_names[run->where],
+                   usec, run->isize, run->srcsize, run->flags_class,
+                   run->input);
+    if (len == -1) {
+        free(name);
+        return;
+    }
+    fd = open(name, O_RDWR|O_APPEND|O_CREAT|O_BINARY, 0666);
+    if (fd != -1 && flock(fd, LOCK_EX) == 0) {
+        if (writex(fd, line, len) != 0)
+            rs_log_warning("failed to write %s", name);
+        else if (fstat(fd, &st) == 0 && st.st_size > COST_MAX_SIZE)
+            cost_trim(fd, name);
+    }
+    if (fd != -1)
+        close(fd);
+    free(line);
+    free(name);
+}
+
+void cost_free(struct cost_run *run)
+{
+    free(run->input);
+    run->input = NULL;
+}
@@ -0,0 +1,31 @@
+// mrcc - A C Compiler system on MapReduce
+// Zhiqiang Ma, https://www.ericzma.com
+#pragma once
+
+// where a compile ran, as far as the cost model is concerned
+enum cost_where {
+    COST_NONE = 0,              // not a compile it learns from
+    COST_LOCAL,
+    COST_MAPRED,
+    COST_MRCCD
+};
+
+/**
+ * What build_somewhere() tells build_somewhere_timed() about a compile,
+ * for cost_record().
+ **/
+struct cost_run {
+    enum cost_where where;
+    long long isize;            // bytes of preprocessed source
+    long long srcsize;          // bytes of the source
+    int flags_class;            // see cost_flags_class()
+    long long remote_usec;      // expected round trip, 0 if unknown
+    char *input;                // absolute name of the source
+};
+
+int cost_choose_local(char **argv, const char *input_fname, int mrccd,
+                      struct cost_run *run);
+void cost_set_remote(struct cost_run *run, enum cost_where where,
+                     const char *cpp_fname);
+void cost_record(struct cost_run *run, long usec);
+void cost_free(struct cost_run *run);
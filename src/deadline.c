@@ -0,0 +1,171 @@
+// mrcc - A C Compiler system on MapReduce
+// Zhiqiang Ma, https://www.ericzma.com
+
+#include <stdarg.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <string.h>
+#include <time.h>
+#include <ctype.h>
+#include <assert.h>
+#include <fcntl.h>
+
+#include <sys/fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "utils.h"
+#include "trace.h"
+#include "deadline.h"
+
+/**
+ * @file
+ * @brief How long each phase of a remote compile may take.
+ *
+ * A wedged MapReduce job, a hung hadoop client or a silent mrccd
+ * would otherwise keep mrcc, and the build, waiting forever.  Every
+ * phase has a limit, set in seconds by
+ *
+ *     MRCC_DEADLINE_CPP        running the preprocessor
+ *     MRCC_DEADLINE_UPLOAD     sending the .i
+ *     MRCC_DEADLINE_REMOTE     the remote compile itself
+ *     MRCC_DEADLINE_DOWNLOAD   fetching the object
+ *
+ * as SECONDS[,SECONDS_PER_MB], the second part growing the limit with
+ * the size of the .i; 0 means no limit.  When a phase overruns, what
+ * it waits for is killed and mrcc compiles locally instead.
+ *
+ * The limit of cpp is given to collect_child() directly.  The others
+ * run one at a time, so deadline_start() arms the one under way, and
+ * client_run(), the socket timeouts of mrccd and WebHDFS, and the
+ * wait() of the backends ask deadline_left_ms() what is left of it.
+ **/
+
+static const char *const deadline_envs[DEADLINE_N] = {
+    "MRCC_DEADLINE_CPP", "MRCC_DEADLINE_UPLOAD",
+    "MRCC_DEADLINE_REMOTE", "MRCC_DEADLINE_DOWNLOAD"
+};
+
+/* Limits until set, in seconds and seconds per MB of .i. */
+static const double deadline_defaults[DEADLINE_N][2] = {
+    { 300, 0 }, { 120, 30 }, { 1800, 60 }, { 120, 10 }
+};
+
+// size of the .i the limits are scaled by
+static long long deadline_isize = 0;
+
+// when the phase under way has to be done, or 0 if it need not be
+static struct timeval deadline_end = { 0, 0 };
+
+/**
+ * @brief Scale the limits for a .i of @p isize bytes.
+ */
+void deadline_set_size(long long isize)
+{
+    if (isize > 0)
+        deadline_isize = isize;
+}
+
+/**
+ * @brief Scale the limits for the .i in @p cpp_fname, if it is there
+ * already.
+ */
+void deadline_set_size_of(const char *cpp_fname)
+{
+    struct stat st;
+
+    if (cpp_fname && stat(cpp_fname, &st) == 0)
+        deadline_set_size(st.st_size);
+}
+
+/**
+ * @brief How long @p phase may take.
+ * @return milliseconds, or 0 for no limit.
+ */
+long deadline_limit_ms(enum deadline_phase phase)
+{
+    const char *e = getenv(deadline_envs[phase]);
+    double base = deadline_defaults[phase][0];
+    double per_mb = deadline_defaults[phase][1];
+    char *end;
+
+    if (e && e[0]) {
+        base = strtod(e, &end);
+        per_mb = 0;
+        if (*end == ',')
+            per_mb = strtod(end + 1, &end);
+        if (*end != '\0' || base < 0 || per_mb < 0) {
+            rs_log_warning("ignoring bad %s=\"%s\"", deadline_envs[phase], e);
+            base = deadline_defaults[phase][0];
+            per_mb = deadline_defaults[phase][1];
+        }
+    }
+    if (base == 0)
+        return 0;
+    return (long) (1000 * (base + per_mb * deadline_isize / (1024 * 1024)));
+}
+
+/**
+ * @brief Arm the deadline of @p phase, which starts now.
+ */
+void deadline_start(enum deadline_phase phase)
+{
+    long ms = deadline_limit_ms(phase);
+
+    if (ms == 0) {
+        deadline_stop();
+        return;
+    }
+    gettimeofday(&deadline_end, NULL);
+    deadline_end.tv_sec += ms / 1000;
+    deadline_end.tv_usec += (ms % 1000) * 1000;
+    if (deadline_end.tv_usec >= 1000000) {
+        deadline_end.tv_sec++;
+        deadline_end.tv_usec -= 1000000;
+    }
+    rs_trace("%s: %ldms", deadline_envs[phase], ms);
+}
+
+/**
+ * @brief Disarm the deadline.
+ */
+void deadline_stop(void)
+{
+    deadline_end.tv_sec = 0;
+    deadline_end.tv_usec = 0;
+}
+
+/**
+ * @brief What is left of the time for the phase under way.
+ * @return milliseconds, 0 if it is up, or -1 if there is no deadline.
+ */
+long deadline_left_ms(void)
+{
+    struct timeval now;
+    long ms;
+
+    if (deadline_end.tv_sec == 0)
+        return -1;
+    gettimeofday(&now, NULL);
+    ms = (deadline_end.tv_sec - now.tv_sec) * 1000
+         + (deadline_end.tv_usec - now.tv_usec) / 1000;
+    return ms > 0 ? ms : 0;
+}
+
+/**
+ * @brief A timeout in seconds for network IO: @p dflt, or less if the
+ * deadline is closer.  Never 0, which would mean none.
+ */
+int deadline_io_timeout(int dflt)
+{
+    long ms = deadline_left_ms();
+
+    if (ms < 0 || ms / 1000 >= dflt)
+        return dflt;
+    return ms < 1000 ? 1 : (int) (ms / 1000);
+}
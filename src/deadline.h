@@ -0,0 +1,22 @@
+// mrcc - A C Compiler system on MapReduce
+// Zhiqiang Ma, https://www.ericzma.com
+#pragma once
+
+// the phases of a remote compile that have a deadline
+enum deadline_phase {
+    DEADLINE_CPP = 0,
+    DEADLINE_UPLOAD,
+    DEADLINE_REMOTE,
+    DEADLINE_DOWNLOAD,
+    DEADLINE_N
+};
+
+void deadline_set_size(long long isize);
+void deadline_set_size_of(const char *cpp_fname);
+
+long deadline_limit_ms(enum deadline_phase phase);
+
+void deadline_start(enum deadline_phase phase);
+void deadline_stop(void);
+long deadline_left_ms(void);
+int deadline_io_timeout(int dflt);
@@ -0,0 +1,202 @@
+// mrcc - A C Compiler system on MapReduce
+// Zhiqiang Ma, https://www.ericzma.com
+
+#include <stdarg.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <string.h>
+#include <time.h>
+#include <ctype.h>
+#include <assert.h>
+#include <fcntl.h>
+
+#include <sys/fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "utils.h"
+#include "trace.h"
+#include "events.h"
+#include "spans.h"
+
+/**
+ * @file
+ * @brief A log of how long each phase of every compile took.
+ *
+ * With MRCC_EVENTS set to a file, every mrcc of the build appends one
+ * line to it for each phase it goes through:
+ *
+ *     START_US DURATION_US PHASE RESULT BYTES ID INPUT
+ *
+ * START_US is CLOCK_MONOTONIC, so the lines of the compiles running
+ * at the same time on this machine line up with each other.  RESULT
+ * is 0 or the error return code of the phase, BYTES what it moved, ID
+ * the pid of the mrcc the line is about (a hedged racer writes under
+ * its parent's) and INPUT the source file, to the end of the line.
+ *
+ * Phases can overlap: the upload of a streamed .i runs along with cpp.
+ * A phase begun with event_begin() is written by event_end(); one
+ * that is never ended, because the compile took another way, is not
+ * written at all.  Each line is a single write() on an O_APPEND file,
+ * so the compiles of a parallel build do not tear each other's lines.
+ * mrcc-stats reads the file back.
+ *
+ * With MRCC_TRACE=1 the same events also go into the span ring of
+ * spans.c, for a timeline of the whole build.
+ **/
+
+const char *const event_names[EVENT_N] = {
+    "scan_args", "cpp", "upload", "submit", "remote", "download",
+    "cleanup", "fallback"
+};
+
+// 1 if the log or the ring is wanted
+static int events_on = 0;
+
+static int events_fd = -1;
+
+// who the lines are about
+static long events_id = 0;
+static char events_input[256] = "-";
+
+// when the phases under way began, or 0
+static long long events_start[EVENT_N];
+
+/**
+ * @brief Open the event log if MRCC_EVENTS asks for it, and the span
+ * ring if MRCC_TRACE does.
+ *
+ * Only mrcc does; the programs it runs, such as mrcc-map under a
+ * local hadoop, leave them alone even though they see the variables.
+ */
+void events_init(void)
+{
+    const char *fname = getenv("MRCC_EVENTS");
+
+    if (events_on)
+        return;
+
+    if (fname != NULL && fname[0] != '\0') {
+        events_fd = open(fname, O_WRONLY|O_CREAT|O_APPEND|O_CLOEXEC, 0666);
+        if (events_fd == -1)
+            rs_log_warning("failed to open event log %s: %s", fname,
+                           strerror(errno));
+    }
+    if (getenv_bool("MRCC_TRACE", 0) && span_ring_open(NULL) == 0)
+        events_on = 1;
+    if (events_fd != -1)
+        events_on = 1;
+    events_id = (long) getpid();
+}
+
+/**
+ * @brief Is the event log wanted?
+ */
+int events_enabled(void)
+{
+    return events_on;
+}
+
+/**
+ * @brief The lines from now on are about @p input_fname.
+ */
+void event_set_input(const char *input_fname)
+{
+    size_t i;
+
+    if (!events_enabled() || input_fname == NULL)
+        return;
+    /* it is the last field, so only a new line would break it */
+    for (i = 0; input_fname[i] && i < sizeof(events_input) - 1; i++)
+        events_input[i] = input_fname[i] == '\n' ? '?' : input_fname[i];
+    events_input[i] = '\0';
+}
+
+/**
+ * @brief Now, in microseconds of CLOCK_MONOTONIC.
+ */
+long long event_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * @brief @p phase begins now.
+ */
+void event_begin(enum event_phase phase)
+{
+    if (events_enabled())
+        events_start[phase] = event_now();
+}
+
+/**
+ * @brief @p phase began at @p start_us, see event_now().
+ */
+void event_begin_at(enum event_phase phase, long long start_us)
+{
+    if (events_enabled())
+        events_start[phase] = start_us;
+}
+
+/**
+ * @brief @p phase, begun by event_begin(), is over now.
+ *
+ * @param bytes what it moved, or 0.
+ * @param result 0 or its error return code.
+ */
+void event_end(enum event_phase phase, long long bytes, int result)
+{
+    if (events_enabled() && events_start[phase] != 0)
+        event_end_at(phase, event_now(), bytes, result);
+}
+
+/**
+ * @brief @p phase, begun by event_begin(), was over at @p end_us.
+ */
+void event_end_at(enum event_phase phase, long long end_us, long long bytes,
+                  int result)
+{
+    if (!events_enabled() || events_start[phase] == 0)
+        return;
+    event_record(phase, events_start[phase], end_us, bytes, result);
+    events_start[phase] = 0;
+}
+
+/**
+ * @brief Append the line of @p phase, which ran from @p start_us to
+ * @p end_us, to the event log, and its span to the ring.
+ */
+void event_record(enum event_phase phase, long long start_us,
+                  long long end_us, long long bytes, int result)
+{
+    char line[512];
+    int n;
+
+    if (!events_enabled())
+        return;
+    if (end_us < start_us)
+        end_us = start_us;
+    span_ring_add(start_us, end_us - start_us, bytes, (int) events_id,
+                  phase, result, events_input);
+    if (events_fd == -1)
+        return;
+    n = snprintf(line, sizeof(line), "%lld %lld %s %d %lld %ld %s\n",
+                 start_us, end_us - start_us, event_names[phase], result,
+                 bytes, events_id, events_input);
+    if (n < 0)
+        return;
+    if (n >= (int) sizeof(line)) {
+        n = sizeof(line) - 1;
+        line[n - 1] = '\n';
+    }
+    if (write(events_fd, line, n) != n)
+        rs_trace("failed to write event log: %s", strerror(errno));
+}
@@ -0,0 +1,31 @@
+// mrcc - A C Compiler system on MapReduce
+// Zhiqiang Ma, https://www.ericzma.com
+#pragma once
+
+// the phases of a compile recorded in the event log, see events.c
+enum event_phase {
+    EVENT_SCAN_ARGS = 0,
+    EVENT_CPP,
+    EVENT_UPLOAD,
+    EVENT_SUBMIT,
+    EVENT_REMOTE,
+    EVENT_DOWNLOAD,
+    EVENT_CLEANUP,
+    EVENT_FALLBACK,
+    EVENT_N
+};
+
+extern const char *const event_names[EVENT_N];
+
+void events_init(void);
+int events_enabled(void);
+void event_set_input(const char *input_fname);
+
+long long event_now(void);
+void event_begin(enum event_phase phase);
+void event_begin_at(enum event_phase phase, long long start_us);
+void event_end(enum event_phase phase, long long bytes, int result);
+void event_end_at(enum event_phase phase, long long end_us, long long bytes,
+                  int result);
+void event_record(enum event_phase phase, long long start_us,
+                  long long end_us, long long bytes, int result);
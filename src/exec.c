@@ -20,15 +20,20 @@
 #include <unistd.h>
 
 #include <signal.h>
+#include <spawn.h>
 
 #include <sys/resource.h>
 #include <sys/wait.h>
 #include <sys/poll.h>
+#include <sys/syscall.h>
 
 #include "trace.h"
 #include "utils.h"
 #include "safeguard.h"
 #include "args.h"
+#include "exec.h"
+#include "io.h"
+#include "events.h"
 
 /**
  * Redirect a file descriptor into (or out of) a file.
@@ -214,6 +219,322 @@ int spawn_child(char **argv, pid_t *pidptr, const char *stdin_file, const char *
 }
 
 
+/**
+ * Run @p argv in a child asynchronously, with its stdout going into a
+ * pipe.
+ *
+ * This lets the parent consume the output, e.g. of cpp, while the child
+ * is still producing it.  Otherwise like spawn_child().
+ *
+ * @param stdout_fd receives the read end of the pipe.
+ **/
+int spawn_child_pipe(char **argv, pid_t *pidptr, const char *stdin_file,
+                     int *stdout_fd, const char *stderr_file)
+{
+    int fds[2];
+    pid_t pid;
+
+    if (pipe(fds) == -1) {
+        rs_log_error("failed to create pipe: %s", strerror(errno));
+        return EXIT_IO_ERROR;
+    }
+    /* later children have no business with our end */
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+
+    trace_argv("forking to execute", argv);
+
+    pid = fork();
+    if (pid == -1) {
+        rs_log_error("failed to fork: %s", strerror(errno));
+        close(fds[0]);
+        close(fds[1]);
+        return EXIT_OUT_OF_MEMORY; /* probably */
+    } else if (pid == 0) {
+        if (new_pgrp() != 0)
+            rs_trace("Unable to start a new group\n");
+        close(fds[0]);
+        if (dup2(fds[1], STDOUT_FILENO) == -1) {
+            rs_log_crit("failed to redirect stdout: %s", strerror(errno));
+            mrcc_exit(EXIT_IO_ERROR);
+        }
+        if (fds[1] != STDOUT_FILENO)
+            close(fds[1]);
+        inside_child(argv, stdin_file, NULL, stderr_file);
+        /* !! NEVER RETURN FROM HERE !! */
+    }
+
+    close(fds[1]);
+    *stdout_fd = fds[0];
+    *pidptr = pid;
+    rs_trace("child started as pid%d, output on fd%d", (int) pid, fds[0]);
+    return 0;
+}
+
+
+extern char **environ;
+
+/**
+ * Run @p argv in a child asynchronously, with no shell in between.
+ *
+ * This is for the tools mrcc drives, like the hadoop client, rather
+ * than for compilers: unlike spawn_child(), the child gets no
+ * safeguard and stays in our process group.  posix_spawnp() starts it,
+ * which spares copying our address space where the C library uses
+ * vfork() for it.
+ *
+ * @param in_fd, out_fd, err_fd what the child gets as stdin, stdout
+ * and stderr, or -1 to leave that alone.
+ **/
+int spawn_command(char **argv, pid_t *pidptr, int in_fd, int out_fd,
+                  int err_fd)
+{
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t none, dflt;
+    int fds[3];
+    int i, err;
+
+    trace_argv("spawning", argv);
+
+    fds[0] = in_fd;
+    fds[1] = out_fd;
+    fds[2] = err_fd;
+    posix_spawn_file_actions_init(&actions);
+    for (i = 0; i < 3; i++) {
+        if (fds[i] != -1 && fds[i] != i)
+            posix_spawn_file_actions_adddup2(&actions, fds[i], i);
+    }
+    /* we ignore SIGPIPE, which would carry over */
+    sigemptyset(&none);
+    sigemptyset(&dflt);
+    sigaddset(&dflt, SIGPIPE);
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setsigmask(&attr, &none);
+    posix_spawnattr_setsigdefault(&attr, &dflt);
+    posix_spawnattr_setflags(&attr,
+                             POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+
+    err = posix_spawnp(pidptr, argv[0], &actions, &attr, argv, environ);
+
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+    if (err != 0) {
+        rs_log_error("failed to run %s: %s", argv[0], strerror(err));
+        return EXIT_MRCC_FAILED;
+    }
+    rs_trace("child started as pid%d", (int) *pidptr);
+    return 0;
+}
+
+static int run_watch(const char *what, pid_t pid, int rfd, int err_fd,
+                     const char *mark, long long *mark_us, int until_mark,
+                     long timeout_ms, int *status);
+static void collect_kill(pid_t pid);
+
+/**
+ * Start @p argv, see spawn_command(); command_wait() sees it to its
+ * end, or command_kill() cuts it short.  Until then @p cmd is its.
+ *
+ * @param what what it is, for the log.
+ * @param in_fd what it reads, or -1 for our stdin.
+ * @param stdout_file where its output goes, or NULL to leave it alone.
+ * @param stderr_file where its errors go, appended, or NULL.
+ * @param mark if not NULL, its errors pass through a pipe on their way,
+ * and the first time they say @p mark, command_wait() notes the time.
+ * @return 0 if it started, otherwise error return code.
+ **/
+int command_start(struct command *cmd, const char *what, char **argv,
+                  int in_fd, const char *stdout_file,
+                  const char *stderr_file, const char *mark)
+{
+    int out_fd = -1;
+    int pipe_fds[2];
+    int ret;
+
+    cmd->what = what;
+    cmd->pid = 0;
+    cmd->rfd = -1;
+    cmd->err_fd = -1;
+    cmd->mark = mark;
+
+    if (stdout_file) {
+        out_fd = open(stdout_file, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0666);
+        if (out_fd == -1) {
+            rs_log_error("failed to open %s: %s", stdout_file,
+                         strerror(errno));
+            return EXIT_IO_ERROR;
+        }
+    }
+    if (stderr_file) {
+        cmd->err_fd = open(stderr_file,
+                           O_WRONLY|O_CREAT|O_APPEND|O_CLOEXEC, 0666);
+        if (cmd->err_fd == -1) {
+            rs_log_error("failed to open %s: %s", stderr_file,
+                         strerror(errno));
+            ret = EXIT_IO_ERROR;
+            goto out;
+        }
+    }
+
+    if (mark) {
+        if (pipe(pipe_fds) == -1) {
+            rs_log_error("failed to create pipe: %s", strerror(errno));
+            ret = EXIT_IO_ERROR;
+            goto out;
+        }
+        fcntl(pipe_fds[0], F_SETFD, FD_CLOEXEC);
+        fcntl(pipe_fds[1], F_SETFD, FD_CLOEXEC);
+        ret = spawn_command(argv, &cmd->pid, in_fd, out_fd, pipe_fds[1]);
+        close(pipe_fds[1]);
+        if (ret == 0)
+            cmd->rfd = pipe_fds[0];
+        else
+            close(pipe_fds[0]);
+        goto out;
+    }
+
+    ret = spawn_command(argv, &cmd->pid, in_fd, out_fd, cmd->err_fd);
+
+out:
+    if (out_fd != -1)
+        close(out_fd);
+    /* only the watcher of the pipe still needs it */
+    if ((ret != 0 || cmd->rfd == -1) && cmd->err_fd != -1) {
+        close(cmd->err_fd);
+        cmd->err_fd = -1;
+    }
+    if (ret != 0)
+        cmd->pid = 0;
+    return ret;
+}
+
+/**
+ * Wait for the command started by command_start() to end.
+ *
+ * @param mark_us receives event_now() when its errors first said the
+ * mark, and is left alone if they never did.
+ * @param timeout_ms as for collect_child().
+ * @param status receives its wait status.
+ * @return 0 if it ran, whatever its status; otherwise error return
+ * code, EXIT_TIMEOUT if it took too long.
+ **/
+int command_wait(struct command *cmd, long long *mark_us, long timeout_ms,
+                 int *status)
+{
+    int ret;
+
+    if (cmd->pid == 0)
+        return EXIT_MRCC_FAILED;
+    if (cmd->rfd != -1)
+        ret = run_watch(cmd->what, cmd->pid, cmd->rfd,
+                        cmd->err_fd != -1 ? cmd->err_fd : STDERR_FILENO,
+                        cmd->mark, mark_us, 0, timeout_ms, status);
+    else
+        ret = collect_child(cmd->what, cmd->pid, status, timeout_null_fd,
+                            timeout_ms);
+    cmd->rfd = -1;
+    cmd->pid = 0;
+    if (cmd->err_fd != -1) {
+        close(cmd->err_fd);
+        cmd->err_fd = -1;
+    }
+    return ret;
+}
+
+/**
+ * Wait for the errors of the command started by command_start() with
+ * a mark to say it, or for the command to end.  If they say it first,
+ * the command is left running for command_wait() or command_kill().
+ *
+ * @param mark_us receives event_now() when they said it.
+ * @return as command_wait(); cmd->pid is 0 if the command ended.
+ **/
+int command_wait_mark(struct command *cmd, long long *mark_us,
+                      long timeout_ms, int *status)
+{
+    int ret;
+
+    if (cmd->pid == 0 || cmd->rfd == -1)
+        return command_wait(cmd, mark_us, timeout_ms, status);
+    ret = run_watch(cmd->what, cmd->pid, cmd->rfd,
+                    cmd->err_fd != -1 ? cmd->err_fd : STDERR_FILENO,
+                    cmd->mark, mark_us, 1, timeout_ms, status);
+    if (ret == 1)
+        return 0;
+    cmd->rfd = -1;
+    cmd->pid = 0;
+    if (cmd->err_fd != -1) {
+        close(cmd->err_fd);
+        cmd->err_fd = -1;
+    }
+    return ret;
+}
+
+/**
+ * Has the command started by command_start() ended?  It is not
+ * reaped; command_wait() still has to be called.
+ * @return 1 if it has, 0 if it still runs.
+ **/
+int command_done(struct command *cmd)
+{
+    siginfo_t info;
+
+    if (cmd->pid == 0)
+        return 1;
+    memset(&info, 0, sizeof(info));
+    if (waitid(P_PID, cmd->pid, &info, WEXITED | WNOHANG | WNOWAIT) == -1)
+        return errno != EINTR;
+    return info.si_pid != 0;
+}
+
+/**
+ * Kill the command started by command_start(), and reap it.
+ **/
+void command_kill(struct command *cmd)
+{
+    if (cmd->pid != 0) {
+        rs_trace("killing %s pid%d", cmd->what, (int) cmd->pid);
+        collect_kill(cmd->pid);
+        cmd->pid = 0;
+    }
+    if (cmd->rfd != -1) {
+        close(cmd->rfd);
+        cmd->rfd = -1;
+    }
+    if (cmd->err_fd != -1) {
+        close(cmd->err_fd);
+        cmd->err_fd = -1;
+    }
+}
+
+/**
+ * Run @p argv to its end, see command_start() and command_wait().
+ *
+ * @param what what it is, for the log.
+ * @param stdout_file where its output goes, or NULL to leave it alone.
+ * @param stderr_file where its errors go, appended, or NULL.
+ * @param mark if not NULL, its errors pass through a pipe on their way,
+ * and the first time they say @p mark, event_now() goes to @p mark_us.
+ * @param timeout_ms as for collect_child().
+ * @param status receives its wait status.
+ * @return 0 if it ran, whatever its status; otherwise error return
+ * code, EXIT_TIMEOUT if it took too long.
+ **/
+int run_command(const char *what, char **argv, const char *stdout_file,
+                const char *stderr_file, const char *mark,
+                long long *mark_us, long timeout_ms, int *status)
+{
+    struct command cmd;
+    int ret;
+
+    ret = command_start(&cmd, what, argv, -1, stdout_file, stderr_file,
+                        mark);
+    if (ret == 0)
+        ret = command_wait(&cmd, mark_us, timeout_ms, status);
+    return ret;
+}
+
+
 void note_execution(struct hostdef *host, char **argv)
 {
     char *astr;
@@ -253,6 +574,222 @@ static int sys_wait4(pid_t pid, int *status, int options, struct rusage *rusage)
 /*******************************************/
 const int timeout_null_fd = -1;
 
+/* Note how a child ended. */
+static void collect_note(const char *what, pid_t pid, int wait_status,
+                         struct rusage *ru)
+{
+    /* This is not the main user-visible message; that comes from
+     * critique_status(). */
+    rs_trace("%s child %ld terminated with status %#x",
+             what, (long) pid, wait_status);
+    rs_log_info("%s times: user %ld.%06lds, system %ld.%06lds, "
+                "%ld minflt, %ld majflt",
+                what,
+                ru->ru_utime.tv_sec, (long) ru->ru_utime.tv_usec,
+                ru->ru_stime.tv_sec, (long) ru->ru_stime.tv_usec,
+                ru->ru_minflt, ru->ru_majflt);
+}
+
+/* Kill a child, and its group if it has one of its own. */
+static void collect_kill(pid_t pid)
+{
+    int status;
+
+    if (killpg(pid, SIGTERM) != 0)
+        kill(pid, SIGTERM);
+    while (waitpid(pid, &status, 0) == -1 && errno == EINTR)
+        ;
+}
+
+/* Milliseconds until @p end, at least 0. */
+static long collect_ms_until(const struct timeval *end)
+{
+    struct timeval now;
+    long ms;
+
+    gettimeofday(&now, NULL);
+    ms = (end->tv_sec - now.tv_sec) * 1000
+         + (end->tv_usec - now.tv_usec) / 1000;
+    return ms > 0 ? ms : 0;
+}
+
+/* @p end is @p ms from now. */
+static void collect_ms_from_now(struct timeval *end, long ms)
+{
+    gettimeofday(end, NULL);
+    end->tv_sec += ms / 1000;
+    end->tv_usec += (ms % 1000) * 1000;
+    if (end->tv_usec >= 1000000) {
+        end->tv_sec++;
+        end->tv_usec -= 1000000;
+    }
+}
+
+/*
+ * A pidfd for child @p pid: readable once it has exited, so that an
+ * exit wakes poll() along with whatever else is polled.  Linux has
+ * them since 5.3; without, -1, and the child is looked at now and
+ * then instead.
+ */
+static int child_pidfd(pid_t pid)
+{
+#ifdef SYS_pidfd_open
+    static int unsupported = 0;
+    int fd;
+
+    if (unsupported)
+        return -1;
+    /* close-on-exec already */
+    fd = (int) syscall(SYS_pidfd_open, pid, 0);
+    if (fd != -1)
+        return fd;
+    if (errno == ENOSYS || errno == EPERM) {
+        rs_trace("no pidfds here; looking at children every few ms");
+        unsupported = 1;
+    } else {
+        rs_log_warning("pidfd_open(%ld) failed: %s", (long) pid,
+                       strerror(errno));
+    }
+#else
+    MRCC_UNUSED(pid);
+#endif
+    return -1;
+}
+
+/**
+ * @brief Start an empty set of children.
+ */
+void child_set_init(struct child_set *set)
+{
+    set->n = 0;
+}
+
+/**
+ * @brief Add child @p pid, described by @p what, to @p set.
+ * @return 0, or EXIT_MRCC_FAILED if the set is full.
+ */
+int child_set_add(struct child_set *set, const char *what, pid_t pid)
+{
+    if (set->n == CHILD_SET_MAX) {
+        rs_log_error("too many children to wait for");
+        return EXIT_MRCC_FAILED;
+    }
+    set->what[set->n] = what;
+    set->pid[set->n] = pid;
+    set->pidfd[set->n] = child_pidfd(pid);
+    set->n++;
+    return 0;
+}
+
+/* Drop entry @p i of @p set. */
+static void child_set_drop(struct child_set *set, int i)
+{
+    if (set->pidfd[i] != -1)
+        close(set->pidfd[i]);
+    set->n--;
+    set->what[i] = set->what[set->n];
+    set->pid[i] = set->pid[set->n];
+    set->pidfd[i] = set->pidfd[set->n];
+}
+
+/**
+ * @brief Forget the children in @p set, without waiting for them.
+ */
+void child_set_free(struct child_set *set)
+{
+    while (set->n > 0)
+        child_set_drop(set, set->n - 1);
+}
+
+/**
+ * @brief Wait until one of the children in @p set exits, @p in_fd
+ * becomes readable, or @p timeout_ms is up.
+ *
+ * The child that exited is collected and dropped from the set.
+ *
+ * @param in_fd a file descriptor to watch too, or timeout_null_fd.
+ * @param timeout_ms how long to wait, or -1 for as long as it takes.
+ * @param pid_ret receives the child that exited, or 0 if @p in_fd is
+ * readable.
+ * @param wait_status receives its wait status.
+ * @return 0, EXIT_TIMEOUT if the time is up, or EXIT_MRCC_FAILED.
+ */
+int child_set_wait(struct child_set *set, int in_fd, long timeout_ms,
+                   pid_t *pid_ret, int *wait_status)
+{
+    struct pollfd pfds[CHILD_SET_MAX + 1];
+    struct rusage ru;
+    struct timeval end;
+    pid_t pid;
+    long left = -1;
+    int nap_ms = 1;
+    int i, n, looking;
+
+    *pid_ret = 0;
+    if (timeout_ms >= 0)
+        collect_ms_from_now(&end, timeout_ms);
+
+    for (;;) {
+        looking = 0;
+        for (i = 0; i < set->n; i++) {
+            pid = sys_wait4(set->pid[i], wait_status,
+                            set->n == 1 && set->pidfd[0] == -1
+                            && in_fd == timeout_null_fd && timeout_ms < 0
+                            ? 0 : WNOHANG, &ru);
+            if (pid == -1 && errno == EINTR) {
+                looking = 1;
+                continue;
+            }
+            if (pid == -1) {
+                rs_log_error("sys_wait4(pid=%d) borked: %s",
+                             (int) set->pid[i], strerror(errno));
+                return EXIT_MRCC_FAILED;
+            }
+            if (pid == set->pid[i]) {
+                collect_note(set->what[i], pid, *wait_status, &ru);
+                child_set_drop(set, i);
+                *pid_ret = pid;
+                return 0;
+            }
+            looking |= set->pidfd[i] == -1;
+        }
+
+        n = 0;
+        for (i = 0; i < set->n; i++) {
+            if (set->pidfd[i] == -1)
+                continue;
+            pfds[n].fd = set->pidfd[i];
+            pfds[n].events = POLLIN;
+            pfds[n].revents = 0;
+            n++;
+        }
+        if (in_fd != timeout_null_fd) {
+            pfds[n].fd = in_fd;
+            pfds[n].events = POLLIN;
+            pfds[n].revents = 0;
+            n++;
+        }
+        if (timeout_ms >= 0) {
+            left = collect_ms_until(&end);
+            if (left == 0)
+                return EXIT_TIMEOUT;
+        }
+        /* Most compiles are short, so without pidfds look often at
+         * first, and never leave an exit unnoticed for long. */
+        if (looking && (left < 0 || left > nap_ms)) {
+            left = nap_ms;
+            if (nap_ms < 50)
+                nap_ms *= 2;
+        }
+        if (poll(pfds, n, (int) left) == -1 && errno != EINTR) {
+            rs_log_error("poll failed: %s", strerror(errno));
+            return EXIT_MRCC_FAILED;
+        }
+        if (in_fd != timeout_null_fd && pfds[n - 1].revents)
+            return 0;
+    }
+}
+
 /**
  * Blocking wait for a child to exit.  This is used when waiting for
  * cpp, gcc, etc.
@@ -261,97 +798,165 @@ const int timeout_null_fd = -1;
  * implementation in reap_kids().  They could be unified, but the
  * parent only waits when it thinks a child has exited; the child
  * waits all the time.
+ *
+ * @param in_fd if not timeout_null_fd, a client connection; if that is
+ * closed, the child is killed.
+ * @param timeout_ms if not 0, how long the child may run; then it is
+ * killed, and EXIT_TIMEOUT returned.
  **/
-int collect_child(const char *what, pid_t pid, int *wait_status, int in_fd)
+int collect_child(const char *what, pid_t pid, int *wait_status, int in_fd,
+                  long timeout_ms)
 {
-    static int job_lifetime = 0;
-    struct rusage ru;
-    pid_t ret_pid;
-
+    struct child_set set;
+    struct timeval end;
+    pid_t done;
+    char buf;
+    int nread;
     int ret;
-    int wait_timeout_sec;
-    fd_set fds,readfds;
 
-    wait_timeout_sec = job_lifetime;
+    child_set_init(&set);
+    if ((ret = child_set_add(&set, what, pid)) != 0)
+        return ret;
+    if (timeout_ms > 0)
+        collect_ms_from_now(&end, timeout_ms);
+
+    for (;;) {
+        ret = child_set_wait(&set, in_fd,
+                             timeout_ms > 0 ? collect_ms_until(&end) : -1,
+                             &done, wait_status);
+        if (ret == EXIT_TIMEOUT) {
+            collect_kill(pid);
+            rs_log_error("%s took longer than %ldms, killed it", what,
+                         timeout_ms);
+            break;
+        }
+        if (ret != 0 || done != 0)
+            break;
 
-    FD_ZERO(&readfds);
-    if (in_fd != timeout_null_fd) {
-        FD_SET(in_fd,&readfds);
+        /* If client disconnects, the socket will become readable,
+         * and a read should return -1 and set errno to EPIPE.
+         */
+        nread = read(in_fd, &buf, 1);
+        if (nread == -1 && (EWOULDBLOCK == errno || EINTR == errno)) {
+            /* spurious wakeup, ignore */
+            ;
+        } else if (nread == 0) {
+            rs_log_error("Client fd disconnected, killing job");
+            /* If killpg fails, it might means the child process is not
+             * in a new group, so, just kill the child process */
+            if (killpg(pid,SIGTERM) != 0)
+                kill(pid, SIGTERM);
+            ret = EXIT_IO_ERROR;
+            break;
+        } else if (nread == 1) {
+            rs_log_error("Bug! Read from fd succeeded when checking whether client disconnected!");
+        } else {
+            rs_log_error("Bug! nread %d, errno %d checking whether client disconnected!", nread, errno);
+        }
     }
+    child_set_free(&set);
+    return ret;
+}
 
 
-    while (!job_lifetime || wait_timeout_sec-- >= 0) {
+/* Does @p buf of @p len bytes hold @p mark of @p mlen bytes? */
+static int run_has_mark(const char *buf, size_t len, const char *mark,
+                        size_t mlen)
+{
+    size_t i;
 
-        /* If we're called with a socket, break out of the loop if the socket disconnects.
-         * To do that, we need to block in select, not in sys_wait4.
-         * (Only waitpid uses WNOHANG to mean don't block ever, so I've modified
-         *  sys_wait4 above to preferentially call waitpid.)
-         */
-        int flags = (in_fd == timeout_null_fd) ? 0 : WNOHANG;
-        ret_pid = sys_wait4(pid, wait_status, flags, &ru);
-
-        if (ret_pid == -1) {
-            if (EINTR == errno) {
-                rs_trace("wait4 was interrupted; retrying");
-            } else {
-                rs_log_error("sys_wait4(pid=%d) borked: %s", (int) pid, strerror(errno));
-                return EXIT_MRCC_FAILED;
-            }
-        } else if (ret_pid != 0) {
-            /* This is not the main user-visible message; that comes from
-             * critique_status(). */
-            rs_trace("%s child %ld terminated with status %#x",
-                     what, (long) ret_pid, *wait_status);
-            rs_log_info("%s times: user %ld.%06lds, system %ld.%06lds, "
-                        "%ld minflt, %ld majflt",
-                        what,
-                        ru.ru_utime.tv_sec, (long) ru.ru_utime.tv_usec,
-                        ru.ru_stime.tv_sec, (long) ru.ru_stime.tv_usec,
-                        ru.ru_minflt, ru.ru_majflt);
+    for (i = 0; i + mlen <= len; i++) {
+        if (memcmp(buf + i, mark, mlen) == 0)
+            return 1;
+    }
+    return 0;
+}
 
-            return 0;
-        }
+/**
+ * Copy what @p pid writes into @p rfd on to @p err_fd until it exits,
+ * see run_command().  @p rfd is closed.  With @p until_mark, it stops
+ * as soon as @p mark goes by instead, and returns 1 with @p pid still
+ * running and @p rfd open.
+ */
+static int run_watch(const char *what, pid_t pid, int rfd, int err_fd,
+                     const char *mark, long long *mark_us, int until_mark,
+                     long timeout_ms, int *status)
+{
+    struct child_set set;
+    struct timeval end;
+    struct pollfd pfd;
+    char buf[4096 + 64];
+    size_t mlen = strlen(mark);
+    size_t keep = 0;
+    pid_t done = 0;
+    ssize_t n;
+    int ret;
 
-        /* check timeout */
-        if (in_fd != timeout_null_fd) {
-            struct timeval timeout;
-
-            /* If client disconnects, the socket will become readable,
-             * and a read should return -1 and set errno to EPIPE.
-             */
-            fds = readfds;
-            timeout.tv_sec = 1;
-            timeout.tv_usec = 0;
-            ret = select(in_fd+1, &fds, NULL, NULL, &timeout);
-            if (ret == 1) {
-                char buf;
-                int nread = read(in_fd, &buf, 1);
-                if (nread == -1 && EWOULDBLOCK == errno) {
-                    /* spurious wakeup, ignore */
-                    ;
-                } else if (nread == 0) {
-                    rs_log_error("Client fd disconnected, killing job");
-                    /* If killpg fails, it might means the child process is not
-                     * in a new group, so, just kill the child process */
-                    if (killpg(pid,SIGTERM) != 0)
-                        kill(pid, SIGTERM);
-                    return EXIT_IO_ERROR;
-                } else if (nread == 1) {
-                    rs_log_error("Bug! Read from fd succeeded when checking whether client disconnected!");
-                } else {
-                    rs_log_error("Bug! nread %d, errno %d checking whether client disconnected!", nread, errno);
-                }
+    /* the end of one read and the start of the next may share it */
+    if (mlen == 0 || mlen >= 64) {
+        close(rfd);
+        return collect_child(what, pid, status, timeout_null_fd, timeout_ms);
+    }
+    child_set_init(&set);
+    if ((ret = child_set_add(&set, what, pid)) != 0) {
+        close(rfd);
+        return ret;
+    }
+    if (timeout_ms > 0)
+        collect_ms_from_now(&end, timeout_ms);
+
+    while (done == 0 || rfd != -1) {
+        if (done == 0) {
+            ret = child_set_wait(&set, rfd == -1 ? timeout_null_fd : rfd,
+                                 timeout_ms > 0 ? collect_ms_until(&end) : -1,
+                                 &done, status);
+            if (ret == EXIT_TIMEOUT) {
+                collect_kill(pid);
+                rs_log_error("%s took longer than %ldms, killed it", what,
+                             timeout_ms);
+                break;
             }
+            if (ret != 0)
+                break;
+            if (done != 0)
+                continue;
         } else {
-            poll(NULL, 0, 1000);
+            /* It is gone; take what it left in the pipe, but do not
+             * wait for whoever it left holding the other end. */
+            pfd.fd = rfd;
+            pfd.events = POLLIN;
+            pfd.revents = 0;
+            if (poll(&pfd, 1, 0) <= 0)
+                break;
         }
-    }
-    /* If timeout, also kill the child process */
-    if (killpg(pid,SIGTERM) != 0)
-        kill(pid, SIGTERM);
-    rs_log_error("Compilation takes too long, timeout.");
 
-    return EXIT_TIMEOUT;
+        n = read(rfd, buf + keep, sizeof(buf) - 64);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            close(rfd);
+            rfd = -1;
+            continue;
+        }
+        writex(err_fd, buf + keep, n);
+        if ((until_mark || (mark_us && *mark_us == 0))
+                && run_has_mark(buf, keep + n, mark, mlen)) {
+            if (mark_us && *mark_us == 0)
+                *mark_us = event_now();
+            if (until_mark && done == 0) {
+                child_set_free(&set);
+                return 1;
+            }
+        }
+        keep += n;
+        n = keep < mlen - 1 ? keep : mlen - 1;
+        memmove(buf, buf + keep - n, n);
+        keep = n;
+    }
+    if (rfd != -1)
+        close(rfd);
+    child_set_free(&set);
+    return ret;
 }
 
 /**
@@ -10,10 +10,53 @@ extern const int timeout_null_fd;
 int redirect_fd(int fd, const char *fname, int mode);
 int redirect_fds(const char *stdin_file, const char *stdout_file, const char *stderr_file);
 int spawn_child(char **argv, pid_t *pidptr, const char *stdin_file, const char *stdout_file, const char *stderr_file);
+int spawn_child_pipe(char **argv, pid_t *pidptr, const char *stdin_file,
+                     int *stdout_fd, const char *stderr_file);
+int spawn_command(char **argv, pid_t *pidptr, int in_fd, int out_fd,
+                  int err_fd);
+// a command started by command_start()
+struct command {
+    const char *what;
+    pid_t pid;          // or 0 once waited for
+    int rfd;            // the pipe its errors come through, or -1
+    int err_fd;         // where they go on to, or -1 for our stderr
+    const char *mark;
+};
+
+int command_start(struct command *cmd, const char *what, char **argv,
+                  int in_fd, const char *stdout_file,
+                  const char *stderr_file, const char *mark);
+int command_wait(struct command *cmd, long long *mark_us, long timeout_ms,
+                 int *status);
+int command_wait_mark(struct command *cmd, long long *mark_us,
+                      long timeout_ms, int *status);
+int command_done(struct command *cmd);
+void command_kill(struct command *cmd);
+int run_command(const char *what, char **argv, const char *stdout_file,
+                const char *stderr_file, const char *mark,
+                long long *mark_us, long timeout_ms, int *status);
 
 void note_execution(struct hostdef *host, char **argv);
 
-int collect_child(const char *what, pid_t pid, int *wait_status, int in_fd);
+// most children waited for together
+#define CHILD_SET_MAX 8
+
+// children waited for together, see child_set_wait()
+struct child_set {
+    int n;
+    const char *what[CHILD_SET_MAX];
+    pid_t pid[CHILD_SET_MAX];
+    int pidfd[CHILD_SET_MAX];   // or -1 where there are no pidfds
+};
+
+void child_set_init(struct child_set *set);
+int child_set_add(struct child_set *set, const char *what, pid_t pid);
+void child_set_free(struct child_set *set);
+int child_set_wait(struct child_set *set, int in_fd, long timeout_ms,
+                   pid_t *pid_ret, int *wait_status);
+
+int collect_child(const char *what, pid_t pid, int *wait_status, int in_fd,
+                  long timeout_ms);
 int critique_status(int status,
                         const char *command,
                         const char *input_fname,
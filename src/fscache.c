@@ -0,0 +1,341 @@
+// mrcc - A C Compiler system on MapReduce
+// Zhiqiang Ma, https://www.ericzma.com
+
+#include <stdarg.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <string.h>
+#include <time.h>
+#include <ctype.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <limits.h>
+
+#include <sys/fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <signal.h>
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <sys/poll.h>
+
+#include "utils.h"
+#include "trace.h"
+#include "stringutils.h"
+#include "netfsutils.h"
+#include "fscache.h"
+
+/**
+ * @file
+ * @brief Object cache shared through the net fs.
+ *
+ * The local result cache (cache.c) only helps the machine that did the
+ * compile.  With $MRCC_SHARED_CACHE=1, mrcc-map also publishes every
+ * object it compiles under its cache key in the net fs, and mrcc looks
+ * there before submitting a job, so one developer's or CI agent's
+ * compile serves everybody else's.
+ *
+ * Objects are $MRCC_SHARED_CACHE_DIR/xx/KEY.o, where xx are the first two
+ * digits of the key.  The default directory is objcache under
+ * fs_top_dir, which is relative to the user's home on the net fs; give
+ * an absolute path to share the cache between users.
+ *
+ * An object is put under a temporary name and renamed into place, so
+ * readers never see part of one.  "mrcc --shared-cache-sweep" keeps the
+ * cache below $MRCC_SHARED_CACHE_SIZE bytes by evicting the objects
+ * used least recently.
+ **/
+
+// fraction of the size limit the sweep evicts down to, in percent
+static const int fscache_low_water = 90;
+
+// temporary files older than this are left over from crashed mappers
+static const int fscache_tmp_max_age = 86400;
+
+/**
+ * @brief Whether the shared object cache should be used.
+ * @return 1 if $MRCC_SHARED_CACHE is set to 1, otherwise 0.
+ */
+int fscache_enabled(void)
+{
+    return getenv_bool("MRCC_SHARED_CACHE", 0);
+}
+
+/**
+ * @brief Return the name of the cache directory on net fs.
+ * Caller is responsible for free()ing the returned string.
+ * @return the directory, or NULL on failure.
+ */
+char* fscache_dir(void)
+{
+    const char* env = getenv("MRCC_SHARED_CACHE_DIR");
+    char* dir = NULL;
+
+    if (env && env[0]) {
+        return strdup(env);
+    }
+    if (asprintf(&dir, "%s/objcache", fs_top_dir) == -1) {
+        return NULL;
+    }
+    return dir;
+}
+
+/**
+ * @brief Return the net fs name of the object for a cache key.
+ * Caller is responsible for free()ing the returned string.
+ * @param key cache key from cache_key().
+ * @return the filename, or NULL on failure.
+ */
+char* fscache_name(const char* key)
+{
+    char* dir;
+    char* fsname = NULL;
+
+    if ((dir = fscache_dir()) == NULL) {
+        return NULL;
+    }
+    if (asprintf(&fsname, "%s/%.2s/%s.o", dir, key, key) == -1) {
+        fsname = NULL;
+    }
+    free(dir);
+    return fsname;
+}
+
+/**
+ * @brief Get the object for a cache key from the shared cache.
+ * @param key cache key from cache_key().
+ * @param output_fname where the object file should go.
+ * @return 0 on a hit, or error return code.
+ */
+int fscache_fetch(const char* key, char* output_fname)
+{
+    char* fsname;
+    int ret;
+
+    if ((fsname = fscache_name(key)) == NULL) {
+        return EXIT_OUT_OF_MEMORY;
+    }
+    ret = get_file_fs(fsname, output_fname);
+    if (ret == 0) {
+        rs_log_info("shared cache hit for %s", output_fname);
+    } else {
+        rs_trace("shared cache miss for %s", key);
+    }
+    free(fsname);
+    return ret;
+}
+
+/**
+ * @brief Publish an object in the shared cache.
+ * If another mapper published the same object first, that is fine too.
+ * @param local_fname local object file.
+ * @param fsname name from fscache_name().
+ * @return 0 on success, or error return code.
+ */
+int fscache_publish(char* local_fname, char* fsname)
+{
+    char host[256];
+    char* tmp = NULL;
+    int ret;
+
+    if (gethostname(host, sizeof host) == -1) {
+        strcpy(host, "localhost");
+    }
+    host[sizeof host - 1] = '\0';
+    if (asprintf(&tmp, "%s.tmp-%s-%ld", fsname, host, (long) getpid()) == -1) {
+        return EXIT_OUT_OF_MEMORY;
+    }
+
+    ret = put_file_fs(local_fname, tmp);
+    if (ret == 0 && rename_file_fs(tmp, fsname) != 0) {
+        rs_trace("\"%s\" is already in the shared cache", fsname);
+        del_file_fs(tmp);
+    }
+    if (ret == 0) {
+        rs_trace("published \"%s\" as \"%s\"", local_fname, fsname);
+    }
+    free(tmp);
+    return ret;
+}
+
+/**
+ * @brief Parse a size like "512M", as $MRCC_SHARED_CACHE_SIZE has it.
+ * @param s a positive number of bytes, maybe followed by K, M, G or T.
+ * @return the size in bytes, or -1 if it makes no sense.
+ */
+long long fscache_parse_size(const char* s)
+{
+    char* end;
+    long long v;
+    int shift = 0;
+
+    errno = 0;
+    v = strtoll(s, &end, 10);
+    if (errno == ERANGE) {
+        return -1;
+    }
+
+    switch (toupper((unsigned char) *end)) {
+    case 'K': shift = 10; end++; break;
+    case 'M': shift = 20; end++; break;
+    case 'G': shift = 30; end++; break;
+    case 'T': shift = 40; end++; break;
+    }
+    if (end == s || *end != '\0' || v <= 0 || v > LLONG_MAX >> shift) {
+        return -1;
+    }
+    return v << shift;
+}
+
+/* One object in the cache, while sweeping. */
+struct fscache_obj {
+    char* fsname;
+    long long size;
+    long long used;             /* last access, or modification */
+};
+
+static int fscache_cmp_used(const void* a, const void* b)
+{
+    const struct fscache_obj* x = a;
+    const struct fscache_obj* y = b;
+
+    return x->used < y->used ? -1 : x->used > y->used;
+}
+
+/* Add the objects in subdirectory @p sub of the cache to @p objs. */
+static int fscache_collect(const char* dir, const char* sub,
+                           struct fscache_obj** objs, int* n, int* size,
+                           long long* total)
+{
+    struct fs_entry* entries;
+    struct fscache_obj* grown;
+    char* subdir = NULL;
+    char* fsname = NULL;
+    int n_entries, i;
+    int ret;
+
+    if (asprintf(&subdir, "%s/%s", dir, sub) == -1) {
+        return EXIT_OUT_OF_MEMORY;
+    }
+    if ((ret = list_dir_fs(subdir, &entries, &n_entries)) != 0) {
+        free(subdir);
+        return ret;
+    }
+
+    for (i = 0; i < n_entries && ret == 0; i++) {
+        if (entries[i].is_dir) {
+            continue;
+        }
+        if (asprintf(&fsname, "%s/%s", subdir, entries[i].name) == -1) {
+            ret = EXIT_OUT_OF_MEMORY;
+            break;
+        }
+        if (!str_endswith(".o", entries[i].name)) {
+            if (entries[i].mtime < time(NULL) - fscache_tmp_max_age) {
+                rs_trace("removing stale \"%s\"", fsname);
+                del_file_fs(fsname);
+            }
+            free(fsname);
+            continue;
+        }
+        if (*n == *size) {
+            *size = *size ? *size * 2 : 1024;
+            grown = realloc(*objs, *size * sizeof **objs);
+            if (grown == NULL) {
+                free(fsname);
+                ret = EXIT_OUT_OF_MEMORY;
+                break;
+            }
+            *objs = grown;
+        }
+        (*objs)[*n].fsname = fsname;
+        (*objs)[*n].size = entries[i].size;
+        (*objs)[*n].used = entries[i].atime > entries[i].mtime
+                           ? entries[i].atime : entries[i].mtime;
+        *total += entries[i].size;
+        (*n)++;
+    }
+
+    free_fs_entries(entries, n_entries);
+    free(subdir);
+    return ret;
+}
+
+/**
+ * @brief Trim the shared cache to its size limit.
+ * When the cache is larger than $MRCC_SHARED_CACHE_SIZE (default 10G),
+ * the least recently used objects are deleted until it is back under
+ * 90% of the limit.
+ * @param stats receives what was kept and what was evicted.
+ * @return 0 on success, or error return code.
+ */
+int fscache_sweep(struct fscache_stats* stats)
+{
+    struct fs_entry* entries = NULL;
+    struct fscache_obj* objs = NULL;
+    const char* env;
+    char* dir;
+    long long limit = FSCACHE_DEFAULT_SIZE;
+    long long total = 0, low, evicted = 0;
+    int n_entries = 0, n = 0, size = 0, n_evicted = 0;
+    int i, ret;
+
+    memset(stats, 0, sizeof *stats);
+    env = getenv("MRCC_SHARED_CACHE_SIZE");
+    if (env && env[0] && (limit = fscache_parse_size(env)) < 0) {
+        rs_log_error("bad MRCC_SHARED_CACHE_SIZE \"%s\"", env);
+        return EXIT_BAD_ARGUMENTS;
+    }
+    if ((dir = fscache_dir()) == NULL) {
+        return EXIT_OUT_OF_MEMORY;
+    }
+
+    ret = list_dir_fs(dir, &entries, &n_entries);
+    if (ret == EXIT_NO_SUCH_FILE) {
+        rs_log_info("shared cache \"%s\" is empty", dir);
+        free(dir);
+        return 0;
+    }
+    for (i = 0; ret == 0 && i < n_entries; i++) {
+        if (entries[i].is_dir) {
+            ret = fscache_collect(dir, entries[i].name, &objs, &n, &size, &total);
+        }
+    }
+    free_fs_entries(entries, n_entries);
+    if (ret) {
+        goto out;
+    }
+
+    if (total > limit) {
+        low = limit / 100 * fscache_low_water;
+        qsort(objs, n, sizeof *objs, fscache_cmp_used);
+        for (i = 0; i < n && total > low; i++) {
+            if (del_file_fs(objs[i].fsname) != 0) {
+                rs_log_warning("failed to evict \"%s\"", objs[i].fsname);
+                continue;
+            }
+            total -= objs[i].size;
+            evicted += objs[i].size;
+            n_evicted++;
+        }
+    }
+    stats->kept = n - n_evicted;
+    stats->kept_bytes = total;
+    stats->evicted = n_evicted;
+    stats->evicted_bytes = evicted;
+
+out:
+    for (i = 0; i < n; i++) {
+        free(objs[i].fsname);
+    }
+    free(objs);
+    free(dir);
+    return ret;
+}
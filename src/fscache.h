@@ -0,0 +1,27 @@
+// mrcc - A C Compiler system on MapReduce
+// Zhiqiang Ma, https://www.ericzma.com
+#pragma once
+
+// default size limit of the shared object cache, in bytes
+#define FSCACHE_DEFAULT_SIZE (10LL << 30)
+
+/**
+ * What a sweep of the shared object cache found and did.
+ **/
+struct fscache_stats {
+    int kept;
+    long long kept_bytes;
+    int evicted;
+    long long evicted_bytes;
+};
+
+int fscache_enabled(void);
+
+char* fscache_dir(void);
+char* fscache_name(const char* key);
+
+int fscache_fetch(const char* key, char* output_fname);
+int fscache_publish(char* local_fname, char* fsname);
+int fscache_sweep(struct fscache_stats* stats);
+
+long long fscache_parse_size(const char* s);
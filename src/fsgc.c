@@ -0,0 +1,225 @@
+// mrcc - A C Compiler system on MapReduce
+// Zhiqiang Ma, https://www.ericzma.com
+
+#include <stdarg.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <string.h>
+#include <time.h>
+#include <ctype.h>
+#include <assert.h>
+#include <fcntl.h>
+
+#include <sys/fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <signal.h>
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <sys/poll.h>
+
+#include "utils.h"
+#include "trace.h"
+#include "stringutils.h"
+#include "netfsutils.h"
+#include "fscache.h"
+#include "fsgc.h"
+
+/**
+ * @file
+ * @brief Garbage collection of temp files left on the net fs.
+ *
+ * mrcc and mrcc-map delete their temp files on the net fs when they
+ * exit, but not when they are killed, or when the node they run on is
+ * lost.  Such files pile up forever, and every one of them costs
+ * namenode memory.
+ *
+ * Every session keeps its temp files under fs_top_dir/tHOUR/SESSION
+ * (see fs_work_dir()), so "mrcc --gc" can remove all sessions that
+ * started in an hour with one delete, once that hour is older than
+ * $MRCC_GC_TTL.  Run it from cron, and per-file cleanup can be turned
+ * off with $MRCC_FS_CLEANUP=0.
+ *
+ * Directories of older mrcc versions, which kept temp files right
+ * under fs_top_dir, are collected one level deep by modification time.
+ * The shared object cache is left alone.
+ **/
+
+/**
+ * @brief Parse a time like "12h", as $MRCC_GC_TTL has it.
+ * @param s a number of seconds, maybe followed by s, m, h or d.
+ * @return the time in seconds, or -1 if it makes no sense.
+ */
+long long fsgc_parse_ttl(const char* s)
+{
+    char* end;
+    long long v = strtoll(s, &end, 10);
+
+    if (end == s) {
+        return -1;
+    }
+    switch (*end) {
+    case 's': end++; break;
+    case 'm': v *= 60; end++; break;
+    case 'h': v *= 3600; end++; break;
+    case 'd': v *= 86400; end++; break;
+    }
+    if (*end != '\0' || v < 0) {
+        return -1;
+    }
+    return v;
+}
+
+/**
+ * @brief The hour of a directory made by fs_work_dir().
+ * @param name the name of the directory, without its parent.
+ * @return the hour, or -1 if it is not an hour directory.
+ */
+long long fsgc_hour(const char* name)
+{
+    char* end;
+    long long hour;
+
+    if (!str_startswith(fs_hour_dir_prefix, name)) {
+        return -1;
+    }
+    name += strlen(fs_hour_dir_prefix);
+    if (!isdigit((unsigned char) *name)) {
+        return -1;
+    }
+    hour = strtoll(name, &end, 10);
+    return *end == '\0' ? hour : -1;
+}
+
+/* Add a malloc'd @p fsname to the list of victims. */
+static int fsgc_add(char*** victims, int* n, int* size, char* fsname)
+{
+    char** grown;
+
+    if (fsname == NULL) {
+        return EXIT_OUT_OF_MEMORY;
+    }
+    if (*n == *size) {
+        *size = *size ? *size * 2 : 64;
+        if ((grown = realloc(*victims, *size * sizeof **victims)) == NULL) {
+            free(fsname);
+            return EXIT_OUT_OF_MEMORY;
+        }
+        *victims = grown;
+    }
+    (*victims)[(*n)++] = fsname;
+    return 0;
+}
+
+/* Add what is older than @p cutoff in legacy directory @p dir. */
+static int fsgc_collect_legacy(const char* dir, long long cutoff,
+                               char*** victims, int* n, int* size)
+{
+    struct fs_entry* entries;
+    char* fsname;
+    int n_entries, i;
+    int ret;
+
+    if ((ret = list_dir_fs((char*) dir, &entries, &n_entries)) != 0) {
+        return ret;
+    }
+    for (i = 0; i < n_entries && ret == 0; i++) {
+        if (entries[i].mtime >= cutoff) {
+            continue;
+        }
+        if (asprintf(&fsname, "%s/%s", dir, entries[i].name) == -1) {
+            fsname = NULL;
+        }
+        ret = fsgc_add(victims, n, size, fsname);
+    }
+    free_fs_entries(entries, n_entries);
+    return ret;
+}
+
+/**
+ * @brief Remove temp files of sessions older than $MRCC_GC_TTL.
+ * The default time to live is FSGC_DEFAULT_TTL seconds; a suffix of
+ * s, m, h or d gives other units.
+ * @param n_removed receives the number of entries removed.
+ * @return 0 on success, or error return code.
+ */
+int fs_gc(int* n_removed)
+{
+    struct fs_entry* entries = NULL;
+    char** victims = NULL;
+    const char* env;
+    char* cache_dir;
+    char* fsname;
+    long long ttl = FSGC_DEFAULT_TTL;
+    long long cutoff, hour;
+    int n_entries = 0, n = 0, size = 0;
+    int i, ret;
+
+    *n_removed = 0;
+    env = getenv("MRCC_GC_TTL");
+    if (env && env[0] && (ttl = fsgc_parse_ttl(env)) < 0) {
+        rs_log_error("bad MRCC_GC_TTL \"%s\"", env);
+        return EXIT_BAD_ARGUMENTS;
+    }
+    cutoff = (long long) time(NULL) - ttl;
+
+    if ((cache_dir = fscache_dir()) == NULL) {
+        return EXIT_OUT_OF_MEMORY;
+    }
+    ret = list_dir_fs((char*) fs_top_dir, &entries, &n_entries);
+    if (ret == EXIT_NO_SUCH_FILE) {
+        rs_log_info("\"%s\" does not exist, nothing to collect", fs_top_dir);
+        free(cache_dir);
+        return 0;
+    }
+
+    for (i = 0; ret == 0 && i < n_entries; i++) {
+        if (!entries[i].is_dir) {
+            continue;
+        }
+        if (asprintf(&fsname, "%s/%s", fs_top_dir, entries[i].name) == -1) {
+            ret = EXIT_OUT_OF_MEMORY;
+            break;
+        }
+        if (str_equal(fsname, cache_dir)) {
+            free(fsname);
+            continue;
+        }
+
+        hour = fsgc_hour(entries[i].name);
+        if (hour < 0) {
+            ret = fsgc_collect_legacy(fsname, cutoff, &victims, &n, &size);
+            free(fsname);
+        } else if (hour + 3600 <= cutoff) {
+            /* every session in there started before the cutoff */
+            ret = fsgc_add(&victims, &n, &size, fsname);
+        } else {
+            free(fsname);
+        }
+    }
+    free_fs_entries(entries, n_entries);
+    free(cache_dir);
+
+    if (ret == 0 && n > 0) {
+        for (i = 0; i < n; i++) {
+            rs_trace("collecting \"%s\"", victims[i]);
+        }
+        ret = del_files_fs(victims, n);
+        if (ret == 0) {
+            *n_removed = n;
+        }
+    }
+
+    for (i = 0; i < n; i++) {
+        free(victims[i]);
+    }
+    free(victims);
+    return ret;
+}
@@ -0,0 +1,11 @@
+// mrcc - A C Compiler system on MapReduce
+// Zhiqiang Ma, https://www.ericzma.com
+#pragma once
+
+// default time temp files on net fs live, in seconds
+#define FSGC_DEFAULT_TTL (2 * 86400LL)
+
+int fs_gc(int* n_removed);
+
+long long fsgc_parse_ttl(const char* s);
+long long fsgc_hour(const char* name);
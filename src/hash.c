@@ -0,0 +1,201 @@
+// mrcc - A C Compiler system on MapReduce
+// Zhiqiang Ma, https://www.ericzma.com
+
+#include <stdarg.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <string.h>
+#include <time.h>
+#include <ctype.h>
+#include <assert.h>
+#include <fcntl.h>
+
+#include <sys/fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "utils.h"
+#include "trace.h"
+#include "io.h"
+#include "hash.h"
+
+/**
+ * @file
+ * @brief SHA-256, used to name compile results by their content.
+ *
+ * A straightforward implementation of FIPS 180-4, so that mrcc does not
+ * need a crypto library.
+ **/
+
+static const uint32_t hash_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void hash_block(struct hash_ctx *ctx, const unsigned char *p)
+{
+    uint32_t w[64];
+    uint32_t a, b, c, d, e, f, g, h, t1, t2;
+    int i;
+
+    for (i = 0; i < 16; i++)
+        w[i] = (uint32_t) p[i * 4] << 24 | (uint32_t) p[i * 4 + 1] << 16
+            | (uint32_t) p[i * 4 + 2] << 8 | p[i * 4 + 3];
+    for (; i < 64; i++)
+        w[i] = (ROR(w[i - 2], 17) ^ ROR(w[i - 2], 19) ^ (w[i - 2] >> 10))
+            + w[i - 7]
+            + (ROR(w[i - 15], 7) ^ ROR(w[i - 15], 18) ^ (w[i - 15] >> 3))
+            + w[i - 16];
+
+    a = ctx->state[0]; b = ctx->state[1]; c = ctx->state[2]; d = ctx->state[3];
+    e = ctx->state[4]; f = ctx->state[5]; g = ctx->state[6]; h = ctx->state[7];
+
+    for (i = 0; i < 64; i++) {
+        t1 = h + (ROR(e, 6) ^ ROR(e, 11) ^ ROR(e, 25)) + ((e & f) ^ (~e & g))
+            + hash_k[i] + w[i];
+        t2 = (ROR(a, 2) ^ ROR(a, 13) ^ ROR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+
+    ctx->state[0] += a; ctx->state[1] += b; ctx->state[2] += c; ctx->state[3] += d;
+    ctx->state[4] += e; ctx->state[5] += f; ctx->state[6] += g; ctx->state[7] += h;
+}
+
+/**
+ * @brief Start a new digest.
+ */
+void hash_init(struct hash_ctx *ctx)
+{
+    static const uint32_t init[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+
+    memcpy(ctx->state, init, sizeof init);
+    ctx->count = 0;
+}
+
+/**
+ * @brief Add @p len bytes at @p data to the digest.
+ */
+void hash_update(struct hash_ctx *ctx, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    size_t used = ctx->count % 64;
+    size_t n;
+
+    ctx->count += len;
+    if (used) {
+        n = 64 - used < len ? 64 - used : len;
+        memcpy(ctx->buf + used, p, n);
+        p += n;
+        len -= n;
+        if (used + n < 64)
+            return;
+        hash_block(ctx, ctx->buf);
+    }
+    for (; len >= 64; p += 64, len -= 64)
+        hash_block(ctx, p);
+    memcpy(ctx->buf, p, len);
+}
+
+/**
+ * @brief Add a string to the digest, including its terminating NUL,
+ * so that "ab","c" and "a","bc" give different digests.
+ */
+void hash_string(struct hash_ctx *ctx, const char *s)
+{
+    hash_update(ctx, s, strlen(s) + 1);
+}
+
+/**
+ * @brief Add the contents of a file to the digest.
+ * @param ctx digest.
+ * @param fname file to read.
+ * @return 0 on success, or error return code.
+ */
+int hash_file(struct hash_ctx *ctx, const char *fname)
+{
+    char buf[65536];
+    ssize_t r;
+    int fd;
+
+    fd = open(fname, O_RDONLY|O_BINARY);
+    if (fd == -1) {
+        rs_log_error("failed to open %s: %s", fname, strerror(errno));
+        return errno == ENOENT ? EXIT_NO_SUCH_FILE : EXIT_IO_ERROR;
+    }
+    while ((r = read(fd, buf, sizeof buf)) != 0) {
+        if (r == -1 && errno == EINTR)
+            continue;
+        if (r == -1) {
+            rs_log_error("failed to read %s: %s", fname, strerror(errno));
+            close(fd);
+            return EXIT_IO_ERROR;
+        }
+        hash_update(ctx, buf, (size_t) r);
+    }
+    close(fd);
+    return 0;
+}
+
+/**
+ * @brief Finish the digest.
+ * @param ctx digest; it must be initialized again before reuse.
+ * @param digest receives the result.
+ */
+void hash_final(struct hash_ctx *ctx, unsigned char digest[HASH_LEN])
+{
+    unsigned char tail[72];
+    uint64_t bits = ctx->count * 8;
+    size_t pad;
+    int i;
+
+    pad = 64 - (ctx->count + 8) % 64;
+    memset(tail, 0, sizeof tail);
+    tail[0] = 0x80;
+    for (i = 0; i < 8; i++)
+        tail[pad + i] = (unsigned char) (bits >> (56 - i * 8));
+    hash_update(ctx, tail, pad + 8);
+
+    for (i = 0; i < 8; i++) {
+        digest[i * 4] = (unsigned char) (ctx->state[i] >> 24);
+        digest[i * 4 + 1] = (unsigned char) (ctx->state[i] >> 16);
+        digest[i * 4 + 2] = (unsigned char) (ctx->state[i] >> 8);
+        digest[i * 4 + 3] = (unsigned char) ctx->state[i];
+    }
+}
+
+/**
+ * @brief Finish the digest and write it as a lower case hex string.
+ */
+void hash_final_hex(struct hash_ctx *ctx, char hex[HASH_HEX_LEN + 1])
+{
+    static const char digits[] = "0123456789abcdef";
+    unsigned char digest[HASH_LEN];
+    int i;
+
+    hash_final(ctx, digest);
+    for (i = 0; i < HASH_LEN; i++) {
+        hex[i * 2] = digits[digest[i] >> 4];
+        hex[i * 2 + 1] = digits[digest[i] & 15];
+    }
+    hex[HASH_HEX_LEN] = '\0';
+}
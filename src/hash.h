@@ -0,0 +1,28 @@
+// mrcc - A C Compiler system on MapReduce
+// Zhiqiang Ma, https://www.ericzma.com
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+// length of a digest, in bytes
+#define HASH_LEN 32
+
+// length of a digest in hex, without the terminating NUL
+#define HASH_HEX_LEN (HASH_LEN * 2)
+
+/**
+ * State of a running SHA-256 computation.
+ **/
+struct hash_ctx {
+    uint32_t state[8];
+    uint64_t count;             /**< bytes hashed so far */
+    unsigned char buf[64];      /**< partial block */
+};
+
+void hash_init(struct hash_ctx *ctx);
+void hash_update(struct hash_ctx *ctx, const void *data, size_t len);
+void hash_string(struct hash_ctx *ctx, const char *s);
+int hash_file(struct hash_ctx *ctx, const char *fname);
+void hash_final(struct hash_ctx *ctx, unsigned char digest[HASH_LEN]);
+void hash_final_hex(struct hash_ctx *ctx, char hex[HASH_HEX_LEN + 1]);
@@ -0,0 +1,526 @@
+// mrcc - A C Compiler system on MapReduce
+// Zhiqiang Ma, https://www.ericzma.com
+
+#include <stdarg.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <string.h>
+#include <time.h>
+#include <ctype.h>
+#include <assert.h>
+#include <fcntl.h>
+
+#include <sys/fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <signal.h>
+
+#include <sys/wait.h>
+
+#include "utils.h"
+#include "trace.h"
+#include "args.h"
+#include "exec.h"
+#include "io.h"
+#include "lock.h"
+#include "hosts.h"
+#include "batch.h"
+#include "cleanup.h"
+#include "tempfile.h"
+#include "stringutils.h"
+#include "remote.h"
+#include "mrutils.h"
+#include "netfsutils.h"
+#include "hedge.h"
+
+/**
+ * @file
+ * @brief Race a slow remote compile with other tries of it.
+ *
+ * On a busy cluster a MapReduce job may wait long for a map slot, or
+ * land on an overloaded tasktracker, and the link waits for that one
+ * object.  So a remote compile that takes too long gets company:
+ *
+ *  - with $MRCC_HEDGE_DELAY set to some milliseconds, the same compile
+ *    of the preprocessed source is started locally after that long, if
+ *    a local compile slot is free;
+ *
+ *  - with $MRCC_SPECULATE set to a factor, a second remote compile is
+ *    started once the first has taken that many times as long as
+ *    remote compiles took lately (see cost.c): another MapReduce job,
+ *    or another mrccd host if one has a free slot.
+ *
+ * Whichever finishes first successfully wins, and the others are
+ * killed.  If all fail, so does the race, and mrcc falls back to
+ * compiling locally as usual.
+ *
+ * For that each remote compile runs in a child, in a process group of
+ * its own, and every racer writes its object beside the real one; the
+ * winner's is renamed into place and the rest deleted.  Killing a
+ * remote compile kills the child's group, which drops the connection
+ * to mrccd, or the hadoop client; the MapReduce job itself is killed
+ * with "hadoop job -kill", after the job id the client logged.
+ *
+ * Compiles in a shared MapReduce job ($MRCC_BATCH) are not raced, as
+ * killing that would kill the others too.
+ **/
+
+/* The racers. */
+enum hedge_who {
+    HEDGE_REMOTE,               // the compile as it would be sent anyway
+    HEDGE_LOCAL,                // the same here
+    HEDGE_SPECULATIVE,          // sent again, elsewhere
+    HEDGE_N
+};
+
+static const char *const hedge_names[HEDGE_N] = {
+    "remotely", "locally", "remotely again"
+};
+
+struct hedge_racer {
+    pid_t pid;                  // 0 until started
+    int done;
+    int delay_ms;               // when it starts, or -1 for not (again)
+    char *out;                  // where it writes the object
+    char *cpp_fname;            // the .i it sends, if any
+    char *err_fname;            // where compiler errors go
+    char *job_log;              // log of its hadoop client, or NULL
+    struct hostdef *host;       // NULL for MapReduce
+    int lock_fd;                // slot it holds, or -1
+};
+
+/* Everything the racers need to know about the compile. */
+struct hedge_job {
+    char **argv;
+    char *input_fname;
+    char *cpp_fname;
+    char **files;
+    char *output_fname;
+    char *cache_key;
+    struct hostdef *hostlist;
+};
+
+/* the racers under way */
+static struct child_set hedge_children;
+
+/* Read a number from the environment, or @p dflt if it is not set. */
+static double hedge_getenv(const char *name, double dflt, double max)
+{
+    const char *e = getenv(name);
+    char *end;
+    double v;
+
+    if (e == NULL || e[0] == '\0')
+        return dflt;
+    v = strtod(e, &end);
+    if (*end != '\0' || v < 0 || v > max) {
+        rs_log_warning("ignoring bad %s=\"%s\"", name, e);
+        return dflt;
+    }
+    return v;
+}
+
+/**
+ * @brief How long to give a compile on @p host (NULL for MapReduce)
+ * before racing it locally.
+ * @return milliseconds, or -1 to leave it alone.
+ */
+int hedge_delay(struct hostdef *host)
+{
+    if (host == NULL && batch_enabled())
+        return -1;
+    return (int) hedge_getenv("MRCC_HEDGE_DELAY", -1, 86400000);
+}
+
+/**
+ * @brief How long to give a compile on @p host (NULL for MapReduce),
+ * expected to take @p expect_usec, before sending it again.
+ * @param expect_usec 0 if there is no telling.
+ * @return milliseconds, or -1 to leave it alone.
+ */
+int speculate_delay(struct hostdef *host, long long expect_usec)
+{
+    double factor = hedge_getenv("MRCC_SPECULATE", 0, 1000);
+
+    if ((host == NULL && batch_enabled()) || expect_usec <= 0 || factor < 1)
+        return -1;
+    return (int) (factor * expect_usec / 1000);
+}
+
+/*
+ * Copy @p argv with the output going to @p out instead, and the input
+ * read from @p in if not NULL.
+ */
+static int hedge_argv(char **argv, char *input_fname, char *in,
+                      char *output_fname, char *out, char ***argv_ret)
+{
+    char **new_argv;
+    char *a;
+    int i;
+
+    if (copy_argv(argv, &new_argv, 0) != 0)
+        return EXIT_OUT_OF_MEMORY;
+    for (i = 0; new_argv[i]; i++) {
+        a = NULL;
+        if (str_equal(new_argv[i], output_fname)) {
+            a = strdup(out);
+        } else if (str_startswith("-o", new_argv[i])
+                   && str_equal(new_argv[i] + 2, output_fname)) {
+            if (asprintf(&a, "-o%s", out) == -1)
+                a = NULL;
+        } else if (in && str_equal(new_argv[i], input_fname)) {
+            a = strdup(in);
+        } else {
+            continue;
+        }
+        if (a == NULL) {
+            free_argv(new_argv);
+            return EXIT_OUT_OF_MEMORY;
+        }
+        free(new_argv[i]);
+        new_argv[i] = a;
+    }
+    *argv_ret = new_argv;
+    return 0;
+}
+
+/*
+ * Name a file beside @p output_fname for racer @p who to write, so
+ * that renaming it into place is atomic.
+ */
+static int hedge_name(char *output_fname, int who, char **name_ret)
+{
+    if (asprintf(name_ret, "%s.mrcc-%c%ld", output_fname, "rls"[who],
+                 (long) getpid()) == -1) {
+        *name_ret = NULL;
+        return EXIT_OUT_OF_MEMORY;
+    }
+    return add_cleanup(*name_ret);
+}
+
+/*
+ * Give a second remote compile its own .i, as the name of the .i is
+ * also that of its files on net fs.
+ */
+static int hedge_copy_cpp(char *cpp_fname, char **copy_ret)
+{
+    const char *dot = strrchr(cpp_fname, '.');
+    int ret;
+
+    if ((ret = make_tmpnam("mrcc_spec", dot ? dot : ".i", copy_ret)))
+        return ret;
+    unlink(*copy_ret);
+    if (link(cpp_fname, *copy_ret) == -1) {
+        rs_log_warning("failed to link %s to %s: %s", cpp_fname, *copy_ret,
+                       strerror(errno));
+        return EXIT_IO_ERROR;
+    }
+    return 0;
+}
+
+/*
+ * Copy @p from over @p to.  Not a rename, as either may be in memory
+ * (see make_tmpmem()).
+ */
+static int hedge_copy_file(const char *from, const char *to)
+{
+    int fd, ret;
+
+    if ((fd = open(to, O_WRONLY|O_CREAT|O_TRUNC|O_BINARY, 0666)) == -1) {
+        rs_log_error("failed to create %s: %s", to, strerror(errno));
+        return EXIT_IO_ERROR;
+    }
+    ret = copy_file_to_fd(from, fd);
+    if (mrcc_close(fd) && ret == 0)
+        ret = EXIT_IO_ERROR;
+    return ret;
+}
+
+/*
+ * A remote racer, in the child.  It cleans up its own files, even when
+ * killed; those of the parent are not its business.
+ */
+static int hedge_remote(struct hedge_job *job, struct hedge_racer *r,
+                        char **argv)
+{
+    int status = 0;
+    int ret;
+
+    child_set_free(&hedge_children);
+    if (new_pgrp() != 0)
+        rs_trace("Unable to start a new group");
+    forget_cleanups();
+    if (r->job_log)
+        mr_set_job_log(r->job_log);
+
+    ret = compile_remote(argv, job->input_fname, r->cpp_fname, job->files,
+                         r->out, NULL, r->err_fname, job->cache_key,
+                         0, -1, -1, r->host, &status);
+    return ret == 0 && status == 0 ? 0 : EXIT_MRCC_FAILED;
+}
+
+/* Start racer @p who, if it can be. */
+static void hedge_start(struct hedge_job *job, struct hedge_racer *racers,
+                        int who)
+{
+    struct hedge_racer *r = &racers[who];
+    char **argv = NULL;
+
+    r->delay_ms = -1;
+    if (who == HEDGE_LOCAL) {
+        if (trylock_local(&r->lock_fd) != 0) {
+            rs_trace("no local slot is free to race %s with",
+                     job->input_fname);
+            r->lock_fd = -1;
+            return;
+        }
+        /* the same .i, unless the host preprocesses */
+        if (hedge_argv(job->argv, job->input_fname,
+                       job->files ? NULL : job->cpp_fname,
+                       job->output_fname, r->out, &argv) == 0
+                && spawn_child(argv, &r->pid, "/dev/null", "/dev/null",
+                               r->err_fname) != 0)
+            r->pid = 0;
+        goto out;
+    }
+
+    if (who == HEDGE_SPECULATIVE) {
+        if (racers[HEDGE_REMOTE].host
+                && pick_spare_host(job->hostlist, racers[HEDGE_REMOTE].host,
+                                   &r->host, &r->lock_fd) != 0) {
+            rs_trace("no host is free to send %s to again", job->input_fname);
+            r->lock_fd = -1;
+            return;
+        }
+        if (job->cpp_fname && hedge_copy_cpp(job->cpp_fname, &r->cpp_fname))
+            return;
+    }
+    if (r->host == NULL
+            && make_tmpmem("mrcc_hedge_job", ".log", &r->job_log) != 0)
+        return;
+    if (hedge_argv(job->argv, job->input_fname, NULL, job->output_fname,
+                   r->out, &argv) != 0)
+        return;
+
+    fflush(NULL);
+    r->pid = fork();
+    if (r->pid == -1) {
+        rs_log_error("failed to fork: %s", strerror(errno));
+        r->pid = 0;
+        goto out;
+    }
+    if (r->pid == 0)
+        exit(hedge_remote(job, r, argv));
+    /* so that it can be killed as a group right away */
+    setpgid(r->pid, r->pid);
+
+out:
+    if (r->pid)
+        rs_trace("%s: compiling %s", job->input_fname, hedge_names[who]);
+    if (argv)
+        free_argv(argv);
+}
+
+/*
+ * Stop racer @p r.  For MapReduce, the mapper that would have deleted
+ * the .i on net fs never runs, nor may the backend get to note the
+ * output directory, so both are ours to delete.  A remote racer
+ * deletes its other files before it goes, and need not be waited for.
+ */
+static void hedge_kill(struct hedge_racer *r, int local)
+{
+    char *outdir, *fsname;
+    int status;
+
+    if (killpg(r->pid, SIGTERM) != 0)
+        kill(r->pid, SIGTERM);
+    if (local) {
+        while (waitpid(r->pid, &status, 0) == -1 && errno == EINTR)
+            ;
+        return;
+    }
+    if (r->job_log == NULL)
+        return;
+    if (mr_kill_job(r->job_log) != 0)
+        rs_log_warning("failed to kill the MapReduce job in %s", r->job_log);
+    if ((fsname = name_local_to_fs(r->cpp_fname)) != NULL) {
+        add_cleanup_fs(fsname);
+        free(fsname);
+    }
+    if ((outdir = name_local_cpp_to_local_outdir(r->cpp_fname)) != NULL
+            && (fsname = name_local_to_fs(outdir)) != NULL) {
+        add_cleanup_fs(fsname);
+        free(fsname);
+    }
+    free(outdir);
+}
+
+/*
+ * Run the race: start the racers when it is their time, until one
+ * succeeds or all that started have failed.
+ * @return the winner, or -1.
+ */
+static int hedge_run(struct hedge_job *job, struct hedge_racer *racers)
+{
+    struct timeval start, now;
+    pid_t pid;
+    long elapsed;
+    int wstatus, timeout, who;
+
+    gettimeofday(&start, NULL);
+
+    for (;;) {
+        gettimeofday(&now, NULL);
+        elapsed = (now.tv_sec - start.tv_sec) * 1000
+                  + (now.tv_usec - start.tv_usec) / 1000;
+        timeout = -1;
+        for (who = 0; who < HEDGE_N; who++) {
+            if (racers[who].delay_ms < 0)
+                continue;
+            if (racers[who].delay_ms <= elapsed) {
+                hedge_start(job, racers, who);
+                if (racers[who].pid
+                        && child_set_add(&hedge_children, hedge_names[who],
+                                         racers[who].pid) != 0)
+                    return -1;
+            } else if (timeout < 0
+                       || racers[who].delay_ms - elapsed < timeout) {
+                timeout = racers[who].delay_ms - elapsed;
+            }
+        }
+
+        /* with nobody left, those to come would not do better */
+        if (hedge_children.n == 0)
+            return -1;
+
+        switch (child_set_wait(&hedge_children, timeout_null_fd, timeout,
+                               &pid, &wstatus)) {
+        case 0:
+            break;
+        case EXIT_TIMEOUT:
+            continue;
+        default:
+            return -1;
+        }
+        for (who = 0; who < HEDGE_N; who++) {
+            if (racers[who].pid != pid)
+                continue;
+            racers[who].done = 1;
+            if (WIFEXITED(wstatus) && WEXITSTATUS(wstatus) == 0)
+                return who;
+        }
+    }
+}
+
+/**
+ * @brief Compile remotely, and if that takes too long, locally or
+ * remotely again as well.
+ *
+ * cpp must be done already.  The arguments are those of
+ * compile_remote().
+ *
+ * @param hostlist where @p host came from.
+ * @param hedge_ms when to start compiling locally, or -1.
+ * @param speculate_ms when to send it again, or -1.
+ * @param local_won set if the local compile won the race.
+ * @return 0 if one of them succeeded and @p output_fname is in place,
+ * otherwise error return code.
+ */
+int compile_hedged(char **argv, char *input_fname, char *cpp_fname,
+                   char **files, char *output_fname,
+                   char *server_stderr_fname, char *cache_key,
+                   struct hostdef *host, struct hostdef *hostlist,
+                   int hedge_ms, int speculate_ms,
+                   int *status, int *local_won)
+{
+    struct hedge_job job = { argv, input_fname, cpp_fname, files,
+                             output_fname, cache_key, hostlist };
+    struct hedge_racer racers[HEDGE_N];
+    struct hedge_racer *r;
+    int who, winner;
+    int ret;
+
+    *local_won = 0;
+    memset(racers, 0, sizeof racers);
+    for (who = 0; who < HEDGE_N; who++) {
+        r = &racers[who];
+        r->lock_fd = -1;
+        if ((ret = hedge_name(output_fname, who, &r->out)))
+            goto out;
+    }
+    racers[HEDGE_REMOTE].delay_ms = 0;
+    racers[HEDGE_REMOTE].host = host;
+    racers[HEDGE_LOCAL].delay_ms = hedge_ms;
+    racers[HEDGE_SPECULATIVE].delay_ms = speculate_ms;
+    if ((cpp_fname
+         && (racers[HEDGE_REMOTE].cpp_fname = strdup(cpp_fname)) == NULL)
+            || (racers[HEDGE_REMOTE].err_fname
+                = strdup(server_stderr_fname)) == NULL) {
+        ret = EXIT_OUT_OF_MEMORY;
+        goto out;
+    }
+    if ((ret = make_tmpmem("mrcc_hedge", ".txt",
+                           &racers[HEDGE_LOCAL].err_fname))
+            || (ret = make_tmpmem("mrcc_server_stderr", ".txt",
+                                  &racers[HEDGE_SPECULATIVE].err_fname)))
+        goto out;
+
+    /* the children have to put their files where we would look */
+    if (fs_work_dir() == NULL) {
+        ret = EXIT_OUT_OF_MEMORY;
+        goto out;
+    }
+    child_set_init(&hedge_children);
+    winner = hedge_run(&job, racers);
+    child_set_free(&hedge_children);
+
+    for (who = 0; who < HEDGE_N; who++) {
+        if (who != winner && racers[who].pid && !racers[who].done)
+            hedge_kill(&racers[who], who == HEDGE_LOCAL);
+    }
+    if (winner < 0) {
+        ret = EXIT_MRCC_FAILED;
+        goto out;
+    }
+    rs_trace("%s compiled %s first", input_fname, hedge_names[winner]);
+
+    /* what the winning compiler had to say */
+    r = &racers[winner];
+    if (r->job_log)
+        copy_file_to_fd(r->job_log, STDERR_FILENO);
+    if (winner == HEDGE_LOCAL) {
+        *local_won = 1;
+        copy_file_to_fd(r->err_fname, STDERR_FILENO);
+    } else if (winner == HEDGE_SPECULATIVE
+               && hedge_copy_file(r->err_fname, server_stderr_fname) != 0) {
+        rs_log_warning("failed to copy %s to %s", r->err_fname,
+                       server_stderr_fname);
+    }
+
+    if (rename(r->out, output_fname) == -1) {
+        rs_log_error("failed to rename %s to %s: %s", r->out, output_fname,
+                     strerror(errno));
+        ret = EXIT_IO_ERROR;
+        goto out;
+    }
+    *status = 0;
+    ret = 0;
+
+out:
+    for (who = 0; who < HEDGE_N; who++) {
+        r = &racers[who];
+        if (r->lock_fd != -1)
+            mrcc_unlock(r->lock_fd);
+        free(r->out);
+        free(r->cpp_fname);
+        free(r->err_fname);
+        free(r->job_log);
+    }
+    return ret;
+}
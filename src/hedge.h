@@ -0,0 +1,15 @@
+// mrcc - A C Compiler system on MapReduce
+// Zhiqiang Ma, https://www.ericzma.com
+#pragma once
+
+struct hostdef;
+
+int hedge_delay(struct hostdef *host);
+int speculate_delay(struct hostdef *host, long long expect_usec);
+
+int compile_hedged(char **argv, char *input_fname, char *cpp_fname,
+                   char **files, char *output_fname,
+                   char *server_stderr_fname, char *cache_key,
+                   struct hostdef *host, struct hostdef *hostlist,
+                   int hedge_ms, int speculate_ms,
+                   int *status, int *local_won);
@@ -0,0 +1,301 @@
+// mrcc - A C Compiler system on MapReduce
+// Zhiqiang Ma, https://www.ericzma.com
+
+#include <stdarg.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <string.h>
+#include <time.h>
+#include <ctype.h>
+#include <assert.h>
+#include <fcntl.h>
+
+#include <sys/fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "utils.h"
+#include "trace.h"
+#include "stringutils.h"
+#include "sockets.h"
+#include "tempfile.h"
+#include "lock.h"
+#include "hosts.h"
+
+/**
+ * @file
+ * @brief The list of mrccd hosts compiles can be sent to.
+ *
+ * The list comes from $MRCC_HOSTS, or else from the file
+ * $MRCC_DIR/hosts.  It is a list of "HOST[:PORT][/SLOTS][,cpp]"
+ * separated by white space; in the file, '#' starts a comment.  SLOTS
+ * is how many compiles go to the host at once, and ",cpp" has the host
+ * run the preprocessor too (see approximate_includes()).  With no list,
+ * compiles go to MapReduce as before.
+ *
+ * Several mrccd on one machine make a test cluster:
+ *
+ *     MRCC_HOSTS="127.0.0.1:3701/2 127.0.0.1:3702/2"
+ **/
+
+/* Parse one "HOST[:PORT][/SLOTS][,cpp]". */
+static int parse_one_host(const char *word, struct hostdef **ret_host)
+{
+    struct hostdef *h;
+    char *spec, *slash, *comma, *opt, *end;
+    long n_slots = HOSTS_DEFAULT_SLOTS;
+    enum cpp_where cpp_where = MRCC_CPP_ON_CLIENT;
+    int ret;
+
+    if ((spec = strdup(word)) == NULL)
+        return EXIT_OUT_OF_MEMORY;
+    comma = strchr(spec, ',');
+    if (comma)
+        *comma++ = '\0';
+    for (; comma; comma = opt) {
+        opt = strchr(comma, ',');
+        if (opt)
+            *opt++ = '\0';
+        if (str_equal(comma, "cpp")) {
+            cpp_where = MRCC_CPP_ON_SERVER;
+        } else {
+            rs_log_error("unknown option \"%s\" in \"%s\"", comma, word);
+            free(spec);
+            return EXIT_BAD_HOSTSPEC;
+        }
+    }
+    slash = strchr(spec, '/');
+    if (slash) {
+        *slash++ = '\0';
+        n_slots = strtol(slash, &end, 10);
+        if (*end != '\0' || n_slots <= 0 || n_slots > 1024) {
+            rs_log_error("bad number of slots in \"%s\"", word);
+            free(spec);
+            return EXIT_BAD_HOSTSPEC;
+        }
+    }
+
+    if ((h = calloc(1, sizeof *h)) == NULL) {
+        free(spec);
+        return EXIT_OUT_OF_MEMORY;
+    }
+    ret = parse_host_port(spec, MRCCD_DEFAULT_PORT, &h->hostname, &h->port);
+    free(spec);
+    if (ret) {
+        free(h);
+        return ret;
+    }
+    if ((h->hostdef_string = strdup(word)) == NULL) {
+        free(h->hostname);
+        free(h);
+        return EXIT_OUT_OF_MEMORY;
+    }
+    h->mode = MRCC_MODE_TCP;
+    h->is_up = 1;
+    h->n_slots = (int) n_slots;
+    h->cpp_where = cpp_where;
+    *ret_host = h;
+    return 0;
+}
+
+/**
+ * @brief Parse a host list.
+ * @param spec host definitions separated by white space; '#' comments
+ * out the rest of a line.
+ * @param ret_list receives the list, NULL if @p spec lists no host.
+ * @return 0 on success, or error return code.
+ */
+int parse_hostlist(const char *spec, struct hostdef **ret_list)
+{
+    struct hostdef *list = NULL, **tail = &list;
+    const char *p = spec, *start;
+    char *word;
+    int ret;
+
+    while (*p) {
+        if (isspace((unsigned char) *p)) {
+            p++;
+            continue;
+        }
+        if (*p == '#') {
+            while (*p && *p != '\n')
+                p++;
+            continue;
+        }
+        for (start = p; *p && !isspace((unsigned char) *p) && *p != '#'; p++)
+            ;
+        if ((word = strndup(start, p - start)) == NULL) {
+            free_hostlist(list);
+            return EXIT_OUT_OF_MEMORY;
+        }
+        ret = parse_one_host(word, tail);
+        free(word);
+        if (ret) {
+            free_hostlist(list);
+            return ret;
+        }
+        tail = &(*tail)->next;
+    }
+    *ret_list = list;
+    return 0;
+}
+
+/**
+ * @brief Get the hosts from $MRCC_HOSTS or $MRCC_DIR/hosts.
+ * @param ret_list receives the list, NULL if there are no hosts.
+ * @return 0 on success, or error return code.
+ */
+int get_hostlist(struct hostdef **ret_list)
+{
+    const char *env;
+    char *top, *fname = NULL, *spec = NULL;
+    size_t size = 0;
+    FILE *f;
+    int ret;
+
+    *ret_list = NULL;
+    if ((env = getenv("MRCC_HOSTS")) != NULL)
+        return parse_hostlist(env, ret_list);
+
+    if ((ret = get_top_dir(&top)))
+        return ret;
+    if (asprintf(&fname, "%s/hosts", top) == -1)
+        return EXIT_OUT_OF_MEMORY;
+    f = fopen(fname, "r");
+    if (f == NULL) {
+        free(fname);
+        return 0;
+    }
+    /* the whole file, newlines and all */
+    if (getdelim(&spec, &size, '\0', f) == -1) {
+        free(spec);
+        spec = NULL;
+    }
+    fclose(f);
+    rs_trace("read hosts from %s", fname);
+    free(fname);
+
+    ret = spec ? parse_hostlist(spec, ret_list) : 0;
+    free(spec);
+    return ret;
+}
+
+/**
+ * @brief Free a list made by parse_hostlist().
+ */
+void free_hostlist(struct hostdef *list)
+{
+    struct hostdef *next;
+
+    for (; list; list = next) {
+        next = list->next;
+        free(list->hostname);
+        free(list->hostdef_string);
+        free(list);
+    }
+}
+
+/* Name of the lock budget of a host, e.g. "host_127.0.0.1_3701". */
+static char *host_lock_name(const struct hostdef *h)
+{
+    char *name, *p;
+
+    if (asprintf(&name, "host_%s_%d", h->hostname, h->port) == -1)
+        return NULL;
+    for (p = name; *p; p++) {
+        if (!isalnum((unsigned char) *p) && *p != '.' && *p != '-')
+            *p = '_';
+    }
+    return name;
+}
+
+/*
+ * Take a slot of one of the hosts in @p list other than @p skip,
+ * starting from a random one.  With @p wait, if all are full, wait for
+ * a slot of the one at the start.
+ */
+static int host_pick(struct hostdef *list, struct hostdef *skip, int wait,
+                     struct hostdef **host, int *lock_fd)
+{
+    struct hostdef *h;
+    struct timeval tv;
+    char *name;
+    int n_hosts = 0, start, i, k;
+    int ret;
+
+    for (h = list; h; h = h->next)
+        n_hosts++;
+    if (n_hosts == 0)
+        return EXIT_NO_HOSTS;
+
+    gettimeofday(&tv, NULL);
+    start = (int) ((tv.tv_usec ^ getpid()) % n_hosts);
+
+    /* first pass looks for a free slot, second one waits at start */
+    for (i = 0; i < n_hosts + (wait != 0); i++) {
+        for (h = list, k = (start + i) % n_hosts; k > 0; k--)
+            h = h->next;
+        if (h == skip)
+            continue;
+        if ((name = host_lock_name(h)) == NULL)
+            return EXIT_OUT_OF_MEMORY;
+        if (i < n_hosts)
+            ret = mrcc_trylock_slot(name, h->n_slots, lock_fd);
+        else
+            ret = mrcc_lock_slot(name, h->n_slots, lock_fd);
+        free(name);
+        if (ret == 0) {
+            rs_trace("picked host %s", h->hostdef_string);
+            *host = h;
+            return 0;
+        }
+        if (ret != EXIT_BUSY)
+            return ret;
+    }
+    return EXIT_BUSY;
+}
+
+/**
+ * @brief Choose a host to send a compile to, and take one of its slots.
+ * Hosts with a free slot are preferred, starting from a random one so
+ * that the load spreads.  If all are full, this waits for a slot of a
+ * random host.
+ * @param list hosts to choose from.
+ * @param host receives the chosen host, which stays part of @p list.
+ * @param lock_fd receives the slot, to be given to mrcc_unlock().
+ * @return 0 on success, EXIT_NO_HOSTS if @p list is empty, or error
+ * return code.
+ */
+int pick_host(struct hostdef *list, struct hostdef **host, int *lock_fd)
+{
+    return host_pick(list, NULL, 1, host, lock_fd);
+}
+
+/**
+ * @brief Choose another host than @p busy for a second try of a
+ * compile, if one has a free slot; if none has, another slot of @p busy.
+ * @return 0 on success, EXIT_BUSY if no slot is free, or error return
+ * code.
+ */
+int pick_spare_host(struct hostdef *list, struct hostdef *busy,
+                    struct hostdef **host, int *lock_fd)
+{
+    char *name;
+    int ret;
+
+    ret = host_pick(list, busy, 0, host, lock_fd);
+    if (ret != EXIT_BUSY && ret != EXIT_NO_HOSTS)
+        return ret;
+    if ((name = host_lock_name(busy)) == NULL)
+        return EXIT_OUT_OF_MEMORY;
+    ret = mrcc_trylock_slot(name, busy->n_slots, lock_fd);
+    free(name);
+    if (ret == 0)
+        *host = busy;
+    return ret;
+}
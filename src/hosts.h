@@ -0,0 +1,19 @@
+// mrcc - A C Compiler system on MapReduce
+// Zhiqiang Ma, https://www.ericzma.com
+#pragma once
+
+#include "utils.h"
+
+// port mrccd listens on unless told otherwise
+#define MRCCD_DEFAULT_PORT 3633
+
+// compiles sent to one mrccd at the same time, unless the host says
+#define HOSTS_DEFAULT_SLOTS 4
+
+int parse_hostlist(const char *spec, struct hostdef **ret_list);
+int get_hostlist(struct hostdef **ret_list);
+void free_hostlist(struct hostdef *list);
+
+int pick_host(struct hostdef *list, struct hostdef **host, int *lock_fd);
+int pick_spare_host(struct hostdef *list, struct hostdef *busy,
+                    struct hostdef **host, int *lock_fd);
@@ -0,0 +1,478 @@
+// mrcc - A C Compiler system on MapReduce
+// Zhiqiang Ma, https://www.ericzma.com
+
+#include <stdarg.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <string.h>
+#include <time.h>
+#include <ctype.h>
+#include <assert.h>
+#include <fcntl.h>
+
+#include <sys/fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <signal.h>
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <sys/poll.h>
+
+#include "utils.h"
+#include "trace.h"
+#include "io.h"
+#include "sockets.h"
+#include "stringutils.h"
+#include "http.h"
+
+/**
+ * @file
+ * @brief Minimal HTTP/1.1 transport.
+ *
+ * Just enough of the protocol for the WebHDFS client and the stand-in
+ * file system server: one request per connection, bodies framed by
+ * Content-Length, chunked encoding or connection close.
+ **/
+
+
+/**
+ * @brief Set up @p c to talk over @p fd.
+ */
+void http_init(struct http_conn *c, int fd)
+{
+    memset(c, 0, sizeof *c);
+    c->fd = fd;
+    c->content_length = -1;
+}
+
+/**
+ * @brief Close the connection and free everything hanging off @p c.
+ */
+void http_close(struct http_conn *c)
+{
+    if (c->fd != -1)
+        close(c->fd);
+    c->fd = -1;
+    free(c->location);
+    free(c->method);
+    free(c->target);
+    free(c->host);
+    c->location = c->method = c->target = c->host = NULL;
+}
+
+/* Read more input into the buffer.  Returns 0, or EXIT_TRUNCATED at eof. */
+static int http_fill(struct http_conn *c)
+{
+    ssize_t r;
+
+    if (c->pos > 0) {
+        memmove(c->buf, c->buf + c->pos, c->len - c->pos);
+        c->len -= c->pos;
+        c->pos = 0;
+    }
+    if (c->len == sizeof c->buf) {
+        rs_log_error("http header line too long");
+        return EXIT_PROTOCOL_ERROR;
+    }
+
+    do {
+        r = read(c->fd, c->buf + c->len, sizeof c->buf - c->len);
+    } while (r == -1 && errno == EINTR);
+
+    if (r == -1) {
+        rs_log_error("failed to read from fd%d: %s", c->fd, strerror(errno));
+        return EXIT_IO_ERROR;
+    }
+    if (r == 0)
+        return EXIT_TRUNCATED;
+    c->len += r;
+    return 0;
+}
+
+/**
+ * @brief Read one CRLF-terminated line, without the terminator.
+ * Overlong lines are truncated to fit @p size.
+ * @return 0, EXIT_TRUNCATED at end of file, or EXIT_IO_ERROR.
+ */
+int http_getline(struct http_conn *c, char *line, size_t size)
+{
+    char *nl;
+    size_t n;
+    int ret;
+
+    while ((nl = memchr(c->buf + c->pos, '\n', c->len - c->pos)) == NULL) {
+        if ((ret = http_fill(c)))
+            return ret;
+    }
+
+    n = nl - (c->buf + c->pos);
+    if (n > 0 && nl[-1] == '\r')
+        n--;
+    if (n >= size)
+        n = size - 1;
+    memcpy(line, c->buf + c->pos, n);
+    line[n] = '\0';
+    c->pos = nl - c->buf + 1;
+    return 0;
+}
+
+/**
+ * @brief Connect to @p host and send a request head.
+ * The body, if any, must be written by the caller: @p body_len bytes,
+ * or chunks if @p body_len is HTTP_CHUNKED.  HTTP_NO_BODY sends no
+ * framing at all.
+ * @param timeout IO timeout in seconds for the connection.
+ * @return 0 on success, or error return code.
+ */
+int http_send_request(struct http_conn *c, const char *host, int port,
+                      const char *method, const char *target,
+                      off_t body_len, int timeout)
+{
+    char *head = NULL;
+    char framing[64];
+    int fd;
+    int ret;
+
+    http_init(c, -1);
+
+    ret = sock_connect(host, port, &fd);
+    if (ret)
+        return ret;
+    c->fd = fd;
+    sock_set_timeout(fd, timeout);
+    sock_nodelay(fd);
+
+    if (body_len == HTTP_NO_BODY)
+        framing[0] = '\0';
+    else if (body_len == HTTP_CHUNKED)
+        strcpy(framing, "Transfer-Encoding: chunked\r\n");
+    else
+        snprintf(framing, sizeof framing, "Content-Length: %lld\r\n",
+                 (long long) body_len);
+
+    if (asprintf(&head, "%s %s HTTP/1.1\r\n"
+                 "Host: %s:%d\r\n"
+                 "Connection: close\r\n"
+                 "%s"
+                 "\r\n",
+                 method, target, host, port, framing) == -1) {
+        http_close(c);
+        return EXIT_OUT_OF_MEMORY;
+    }
+
+    rs_trace("http %s http://%s:%d%s", method, host, port, target);
+    ret = writex(fd, head, strlen(head));
+    free(head);
+    if (ret)
+        http_close(c);
+    return ret;
+}
+
+/* Read header lines up to the blank line, keeping the ones we care about. */
+static int http_read_headers(struct http_conn *c)
+{
+    char line[4096];
+    char *value;
+    int ret;
+
+    c->content_length = -1;
+    c->chunked = 0;
+
+    while (1) {
+        if ((ret = http_getline(c, line, sizeof line)))
+            return ret;
+        if (line[0] == '\0')
+            return 0;
+        value = strchr(line, ':');
+        if (value == NULL)
+            continue;
+        *value++ = '\0';
+        while (*value == ' ' || *value == '\t')
+            value++;
+
+        if (!strcasecmp(line, "Content-Length")) {
+            c->content_length = strtoll(value, NULL, 10);
+        } else if (!strcasecmp(line, "Transfer-Encoding")) {
+            c->chunked = !strncasecmp(value, "chunked", strlen("chunked"));
+        } else if (!strcasecmp(line, "Location")) {
+            free(c->location);
+            c->location = strdup(value);
+        } else if (!strcasecmp(line, "Host")) {
+            free(c->host);
+            c->host = strdup(value);
+        }
+    }
+}
+
+/**
+ * @brief Read the status line and headers of a response.
+ * @return 0 on success, or error return code.
+ */
+int http_read_response(struct http_conn *c)
+{
+    char line[4096];
+    int ret;
+
+    if ((ret = http_getline(c, line, sizeof line)))
+        return ret;
+    if (sscanf(line, "HTTP/%*d.%*d %d", &c->status) != 1) {
+        rs_log_error("bad http status line: \"%s\"", line);
+        return EXIT_PROTOCOL_ERROR;
+    }
+    rs_trace("http status %d", c->status);
+    return http_read_headers(c);
+}
+
+/**
+ * @brief Read the request line and headers of a request.
+ * @return 0 on success, or error return code.
+ */
+int http_read_request(struct http_conn *c)
+{
+    char line[4096];
+    char *sp1, *sp2;
+    int ret;
+
+    if ((ret = http_getline(c, line, sizeof line)))
+        return ret;
+    sp1 = strchr(line, ' ');
+    sp2 = sp1 ? strchr(sp1 + 1, ' ') : NULL;
+    if (sp2 == NULL || !str_startswith(" HTTP/", sp2)) {
+        rs_log_error("bad http request line: \"%s\"", line);
+        return EXIT_PROTOCOL_ERROR;
+    }
+    c->method = strndup(line, sp1 - line);
+    c->target = strndup(sp1 + 1, sp2 - sp1 - 1);
+    if (c->method == NULL || c->target == NULL)
+        return EXIT_OUT_OF_MEMORY;
+    rs_trace("http request %s %s", c->method, c->target);
+    return http_read_headers(c);
+}
+
+/**
+ * @brief Send a complete response with a Content-Length framed body.
+ * @param extra_headers more header lines, each ending in CRLF, or NULL.
+ * @param body body to send, or NULL to send only the head; in that case
+ * @p body_len is still announced, and the caller sends the body.
+ * @return 0 on success, or error return code.
+ */
+int http_send_response(int fd, int status, const char *extra_headers,
+                       const char *body, off_t body_len)
+{
+    const char *reason;
+    char *head = NULL;
+    int ret;
+
+    switch (status) {
+    case 200: reason = "OK"; break;
+    case 201: reason = "Created"; break;
+    case 307: reason = "Temporary Redirect"; break;
+    case 400: reason = "Bad Request"; break;
+    case 403: reason = "Forbidden"; break;
+    case 404: reason = "Not Found"; break;
+    case 503: reason = "Service Unavailable"; break;
+    default:  reason = "Internal Server Error"; break;
+    }
+
+    if (asprintf(&head, "HTTP/1.1 %d %s\r\n"
+                 "Connection: close\r\n"
+                 "Content-Length: %lld\r\n"
+                 "%s"
+                 "\r\n",
+                 status, reason, (long long) body_len,
+                 extra_headers ? extra_headers : "") == -1)
+        return EXIT_OUT_OF_MEMORY;
+
+    ret = writex(fd, head, strlen(head));
+    free(head);
+    if (ret == 0 && body && body_len > 0)
+        ret = writex(fd, body, (size_t) body_len);
+    return ret;
+}
+
+/**
+ * @brief Send @p len bytes from @p fd as a Content-Length framed body.
+ * @return 0 on success, or error return code.
+ */
+int http_send_body(struct http_conn *c, int fd, off_t len)
+{
+    char buf[65536];
+    ssize_t r;
+    int ret;
+
+    while (len > 0) {
+        r = read(fd, buf, len > (off_t) sizeof buf ? sizeof buf : (size_t) len);
+        if (r == -1 && errno == EINTR)
+            continue;
+        if (r == -1) {
+            rs_log_error("failed to read: %s", strerror(errno));
+            return EXIT_IO_ERROR;
+        }
+        if (r == 0) {
+            rs_log_error("file shrank while sending it");
+            return EXIT_TRUNCATED;
+        }
+        if ((ret = writex(c->fd, buf, r)))
+            return ret;
+        len -= r;
+    }
+    return 0;
+}
+
+/**
+ * @brief Send one chunk of a chunked body.
+ * A chunk of @p n == 0 bytes ends the body.
+ * @return 0 on success, or error return code.
+ */
+int http_send_chunk(struct http_conn *c, const void *buf, size_t n)
+{
+    char size[32];
+    int ret;
+
+    snprintf(size, sizeof size, "%lx\r\n", (unsigned long) n);
+    if ((ret = writex(c->fd, size, strlen(size))))
+        return ret;
+    if (n > 0 && (ret = writex(c->fd, buf, n)))
+        return ret;
+    return writex(c->fd, "\r\n", 2);
+}
+
+/* Hand @p n body bytes to the sink. */
+static int http_sink(const char *p, size_t n, int out_fd,
+                     char **mem, size_t *mem_len)
+{
+    char *grown;
+
+    if (out_fd != -1)
+        return writex(out_fd, p, n);
+    if (mem) {
+        grown = realloc(*mem, *mem_len + n + 1);
+        if (grown == NULL)
+            return EXIT_OUT_OF_MEMORY;
+        memcpy(grown + *mem_len, p, n);
+        *mem_len += n;
+        grown[*mem_len] = '\0';
+        *mem = grown;
+    }
+    return 0;
+}
+
+/* Copy @p want body bytes (or until eof if @p want < 0) to the sink. */
+static int http_copy_body(struct http_conn *c, off_t want, int out_fd,
+                          char **mem, size_t *mem_len)
+{
+    size_t n;
+    int ret;
+
+    while (want != 0) {
+        if (c->pos == c->len) {
+            c->pos = c->len = 0;
+            ret = http_fill(c);
+            if (ret == EXIT_TRUNCATED && want < 0)
+                return 0;
+            if (ret)
+                return ret;
+        }
+        n = c->len - c->pos;
+        if (want > 0 && (off_t) n > want)
+            n = (size_t) want;
+        if ((ret = http_sink(c->buf + c->pos, n, out_fd, mem, mem_len)))
+            return ret;
+        c->pos += n;
+        if (want > 0)
+            want -= n;
+    }
+    return 0;
+}
+
+/**
+ * @brief Read the body of the message whose head was just read.
+ * The body goes to @p out_fd if it is not -1, otherwise into a malloc'd,
+ * NUL-terminated buffer returned in @p mem (if not NULL); otherwise it
+ * is discarded.
+ *
+ * A request without any framing has no body, while such a response
+ * runs until the connection is closed.
+ * @return 0 on success, or error return code.
+ */
+int http_read_body(struct http_conn *c, int out_fd, char **mem, size_t *mem_len)
+{
+    char line[128];
+    size_t dummy_len = 0;
+    off_t chunk;
+    int ret;
+
+    if (mem_len == NULL)
+        mem_len = &dummy_len;
+    if (mem) {
+        *mem = NULL;
+        *mem_len = 0;
+    }
+
+    if (!c->chunked) {
+        if (c->content_length < 0 && c->method)
+            return 0;
+        return http_copy_body(c, c->content_length, out_fd, mem, mem_len);
+    }
+
+    while (1) {
+        if ((ret = http_getline(c, line, sizeof line)))
+            return ret;
+        chunk = strtoll(line, NULL, 16);
+        if (chunk <= 0)
+            break;
+        if ((ret = http_copy_body(c, chunk, out_fd, mem, mem_len)))
+            return ret;
+        if ((ret = http_getline(c, line, sizeof line)))
+            return ret;
+    }
+    /* trailers */
+    do {
+        if ((ret = http_getline(c, line, sizeof line)))
+            return ret;
+    } while (line[0] != '\0');
+    return 0;
+}
+
+/**
+ * @brief Split "http://HOST[:PORT]/TARGET" into its parts.
+ * Caller is responsible for free()ing the returned strings.
+ * @return 0 on success, or error return code.
+ */
+int http_parse_url(const char *url, char **host, int *port, char **target)
+{
+    const char *p, *slash;
+    char *hostport;
+    int ret;
+
+    if (!str_startswith("http://", url)) {
+        rs_log_error("unsupported url \"%s\"", url);
+        return EXIT_PROTOCOL_ERROR;
+    }
+    p = url + strlen("http://");
+    slash = strchr(p, '/');
+    if (slash == NULL)
+        slash = p + strlen(p);
+
+    hostport = strndup(p, slash - p);
+    if (hostport == NULL)
+        return EXIT_OUT_OF_MEMORY;
+    ret = parse_host_port(hostport, 80, host, port);
+    free(hostport);
+    if (ret)
+        return ret;
+
+    *target = strdup(*slash ? slash : "/");
+    if (*target == NULL) {
+        free(*host);
+        return EXIT_OUT_OF_MEMORY;
+    }
+    return 0;
+}
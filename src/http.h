@@ -0,0 +1,53 @@
+// mrcc - A C Compiler system on MapReduce
+// Zhiqiang Ma, https://www.ericzma.com
+#pragma once
+
+// include for off_t
+#include <sys/types.h>
+
+/* Request body framing for http_send_request(), besides a byte count. */
+#define HTTP_CHUNKED    (-1)
+#define HTTP_NO_BODY    (-2)
+
+/**
+ * An HTTP connection, its buffered input and the head of the last
+ * message read from it.  All strings are mallocd.
+ **/
+struct http_conn {
+    int fd;
+    char buf[8192];
+    size_t pos;
+    size_t len;
+
+    /* response head */
+    int status;
+    char *location;
+
+    /* request head */
+    char *method;
+    char *target;
+    char *host;
+
+    /* both */
+    off_t content_length;       /* -1 if not known */
+    int chunked;
+};
+
+void http_init(struct http_conn *c, int fd);
+void http_close(struct http_conn *c);
+int http_getline(struct http_conn *c, char *line, size_t size);
+
+int http_send_request(struct http_conn *c, const char *host, int port,
+                      const char *method, const char *target,
+                      off_t body_len, int timeout);
+int http_read_response(struct http_conn *c);
+
+int http_read_request(struct http_conn *c);
+int http_send_response(int fd, int status, const char *extra_headers,
+                       const char *body, off_t body_len);
+
+int http_send_body(struct http_conn *c, int fd, off_t len);
+int http_send_chunk(struct http_conn *c, const void *buf, size_t n);
+int http_read_body(struct http_conn *c, int out_fd, char **mem, size_t *mem_len);
+
+int http_parse_url(const char *url, char **host, int *port, char **target);
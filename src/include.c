@@ -0,0 +1,998 @@
+// mrcc - A C Compiler system on MapReduce
+// Zhiqiang Ma, https://www.ericzma.com
+
+#include <stdarg.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <string.h>
+#include <time.h>
+#include <ctype.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <dirent.h>
+
+#include <sys/fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <sys/file.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "utils.h"
+#include "trace.h"
+#include "stringutils.h"
+#include "io.h"
+#include "tempfile.h"
+#include "include.h"
+
+/**
+ * @file
+ * @brief Find the files a compile reads, without running cpp.
+ *
+ * For preprocessing on the server ("pump mode") the client has to send
+ * every file that cpp is going to open.  This scans the source for
+ * #include directives and follows them through the same directories
+ * cpp would search, given by -iquote, -I, -isystem and -idirafter.
+ *
+ * The answer may be too big, but must never be too small:
+ *  - every directive counts, whatever #if it is in;
+ *  - #include_next and __has_include() take every file they could
+ *    mean;
+ *  - a file that is in none of the directories is taken to be a system
+ *    header, which the server has too.
+ * If that cannot be made to hold, e.g. for "#include MACRO", the
+ * compile is not pumped.
+ *
+ * It has to be cheap, as it runs for every compile:
+ *  - whether a file is in a directory is looked up in a listing of the
+ *    directory, read once, rather than with a stat() per candidate;
+ *  - what a file includes only changes with the file, so the cache
+ *    file $MRCC_DIR/state/includes keeps it, and it is used again
+ *    while the file's mtime and size stay the same.  Only the names
+ *    as written are kept: where they lead depends on the -I options of
+ *    each compile.
+ * With a warm cache, a scan reads no headers at all and only stat()s
+ * each one once.
+ **/
+
+/* Read no more of the cache than this. */
+#define INCLUDE_CACHE_MAX (64 * 1024 * 1024)
+
+/* A hash set of strings, open addressing; it does not own them. */
+struct include_set {
+    char **slots;
+    int size, n;
+};
+
+/* What the cache file says about one file. */
+struct include_cached {
+    const char *path;
+    long long mtime, size;
+    char *directives;           /* as noted by include_note() */
+};
+
+/* The directories cpp searches, and what has been found so far. */
+struct include_scan {
+    char **quote;               /* -iquote */
+    char **angle;               /* -I, then -isystem, then -idirafter */
+    int n_quote, n_angle;
+
+    char **files;               /* found, in order; NULL-terminated */
+    int n_files, size_files;
+    struct include_set found;   /* the same files */
+
+    struct include_set listed;  /* directories read */
+    struct include_set entries; /* the regular files in them */
+
+    char *cache_buf;            /* the cache file as read, cut up */
+    struct include_cached *cached;
+    int n_cached, n_lines;
+    int cache_too_big;          /* nonzero if over INCLUDE_CACHE_MAX */
+    int *cache_index;           /* hash of cached by path, -1 if free */
+    int size_index;
+
+    char *rec;                  /* directives of the file being scanned */
+    size_t len_rec, size_rec;
+    int rec_ok;                 /* nonzero if rec can be cached */
+
+    char *added;                /* cache lines for the files scanned */
+    size_t len_added, size_added;
+
+    time_t now;
+};
+
+static unsigned include_hash(const char *s)
+{
+    unsigned h = 2166136261u;
+
+    for (; *s; s++)
+        h = (h ^ (unsigned char) *s) * 16777619u;
+    return h;
+}
+
+/* Find the slot of @p key in the set, empty if it is not there. */
+static char **include_set_slot(struct include_set *set, const char *key)
+{
+    unsigned i = include_hash(key) & (set->size - 1);
+
+    while (set->slots[i] && !str_equal(set->slots[i], key))
+        i = (i + 1) & (set->size - 1);
+    return &set->slots[i];
+}
+
+static int include_set_has(struct include_set *set, const char *key)
+{
+    return set->size && *include_set_slot(set, key) != NULL;
+}
+
+/* Double the size of the set. */
+static int include_set_grow(struct include_set *set)
+{
+    char **old = set->slots;
+    int old_size = set->size, i;
+
+    set->size = old_size ? old_size * 2 : 256;
+    if ((set->slots = calloc(set->size, sizeof *set->slots)) == NULL) {
+        set->slots = old;
+        set->size = old_size;
+        return EXIT_OUT_OF_MEMORY;
+    }
+    for (i = 0; i < old_size; i++) {
+        if (old[i])
+            *include_set_slot(set, old[i]) = old[i];
+    }
+    free(old);
+    return 0;
+}
+
+/* Put @p key, which is not in the set yet, into it. */
+static int include_set_put(struct include_set *set, char *key)
+{
+    int ret;
+
+    if (2 * (set->n + 1) > set->size && (ret = include_set_grow(set)))
+        return ret;
+    *include_set_slot(set, key) = key;
+    set->n++;
+    return 0;
+}
+
+/* Free the set, and its strings too if @p keys. */
+static void include_set_free(struct include_set *set, int keys)
+{
+    int i;
+
+    for (i = 0; keys && i < set->size; i++)
+        free(set->slots[i]);
+    free(set->slots);
+}
+
+/* Append @p n bytes to a growing buffer, keeping it NUL-terminated. */
+static int include_append(char **buf, size_t *len, size_t *size,
+                          const char *s, size_t n)
+{
+    char *grown;
+
+    if (*len + n + 1 > *size) {
+        *size = (*len + n + 1) * 2;
+        if ((grown = realloc(*buf, *size)) == NULL)
+            return EXIT_OUT_OF_MEMORY;
+        *buf = grown;
+    }
+    memcpy(*buf + *len, s, n);
+    *len += n;
+    (*buf)[*len] = '\0';
+    return 0;
+}
+
+/*
+ * Make dir/name absolute and drop "." and ".." parts and doubled
+ * slashes, in a static buffer that the next call overwrites.
+ */
+static char *include_path(const char *dir, const char *name)
+{
+    static char buf[4096];
+    char joined[4096], cwd[4096];
+    char *seg, *next, *o;
+    size_t len_dir, len_name;
+
+    if (name[0] != '/' && dir == NULL) {
+        if (getcwd(cwd, sizeof cwd) == NULL) {
+            rs_log_error("getcwd failed: %s", strerror(errno));
+            return NULL;
+        }
+        dir = cwd;
+    }
+    /* by hand, as this is done for every candidate of every name */
+    len_dir = name[0] != '/' ? strlen(dir) : 0;
+    len_name = strlen(name);
+    if (len_dir + len_name + 2 > sizeof joined) {
+        rs_log_error("path too long: %s/%s", dir, name);
+        return NULL;
+    }
+    if (len_dir)
+        memcpy(joined, dir, len_dir);
+    joined[len_dir] = '/';
+    memcpy(joined + len_dir + 1, name, len_name + 1);
+
+    /* part by part, so that a ".." never takes away a "." */
+    o = buf;
+    for (seg = joined; seg; seg = next) {
+        if ((next = strchr(seg, '/')) != NULL)
+            *next++ = '\0';
+        if (seg[0] == '\0' || str_equal(seg, "."))
+            continue;
+        if (str_equal(seg, "..")) {
+            while (o > buf && *--o != '/')
+                ;
+            continue;
+        }
+        *o++ = '/';
+        len_name = strlen(seg);
+        memcpy(o, seg, len_name);
+        o += len_name;
+    }
+    if (o == buf)
+        *o++ = '/';
+    *o = '\0';
+    return buf;
+}
+
+/* Add a directory to a search list, made absolute. */
+static int include_add_dir(char ***dirs, int *n, const char *dir)
+{
+    char **grown;
+    char *copy, *p;
+    size_t len;
+
+    if ((p = include_path(NULL, dir)) == NULL || (copy = strdup(p)) == NULL)
+        return EXIT_OUT_OF_MEMORY;
+    len = strlen(copy);
+    if (len > 1 && copy[len - 1] == '/')
+        copy[len - 1] = '\0';
+    if ((grown = realloc(*dirs, (*n + 2) * sizeof **dirs)) == NULL) {
+        free(copy);
+        return EXIT_OUT_OF_MEMORY;
+    }
+    *dirs = grown;
+    (*dirs)[(*n)++] = copy;
+    (*dirs)[*n] = NULL;
+    return 0;
+}
+
+static void include_free_dirs(char **dirs, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++)
+        free(dirs[i]);
+    free(dirs);
+}
+
+/* Record @p path, an absolute and normalized name, unless it is known. */
+static int include_add_file(struct include_scan *s, const char *path)
+{
+    char **grown;
+    char *copy;
+    int ret;
+
+    if (include_set_has(&s->found, path))
+        return 0;
+
+    if (s->n_files + 1 >= s->size_files) {
+        s->size_files = s->size_files ? s->size_files * 2 : 64;
+        grown = realloc(s->files, s->size_files * sizeof *s->files);
+        if (grown == NULL)
+            return EXIT_OUT_OF_MEMORY;
+        s->files = grown;
+    }
+    if ((copy = strdup(path)) == NULL)
+        return EXIT_OUT_OF_MEMORY;
+    if ((ret = include_set_put(&s->found, copy))) {
+        free(copy);
+        return ret;
+    }
+    s->files[s->n_files++] = copy;
+    s->files[s->n_files] = NULL;
+    return 0;
+}
+
+/* Read the regular files in @p dir into s->entries, once per directory. */
+static int include_list_dir(struct include_scan *s, const char *dir)
+{
+    struct dirent *de;
+    struct stat st;
+    char *path, *copy;
+    size_t len_dir, len_name;
+    DIR *d;
+    int ret = 0;
+
+    if (include_set_has(&s->listed, dir))
+        return 0;
+    if ((copy = strdup(dir)) == NULL)
+        return EXIT_OUT_OF_MEMORY;
+    if ((ret = include_set_put(&s->listed, copy))) {
+        free(copy);
+        return ret;
+    }
+    if ((d = opendir(dir)) == NULL)
+        return 0;               /* then nothing is in it */
+
+    len_dir = strlen(dir);
+    while ((de = readdir(d)) != NULL) {
+        if (de->d_type != DT_REG && de->d_type != DT_LNK
+                && de->d_type != DT_UNKNOWN)
+            continue;
+        len_name = strlen(de->d_name);
+        if ((path = malloc(len_dir + len_name + 2)) == NULL) {
+            ret = EXIT_OUT_OF_MEMORY;
+            break;
+        }
+        memcpy(path, dir, len_dir);
+        path[len_dir] = '/';
+        memcpy(path + len_dir + (dir[len_dir - 1] != '/'), de->d_name,
+               len_name + 1);
+        if (de->d_type != DT_REG
+                && (stat(path, &st) == -1 || !S_ISREG(st.st_mode))) {
+            free(path);
+            continue;
+        }
+        if ((ret = include_set_put(&s->entries, path))) {
+            free(path);
+            break;
+        }
+    }
+    closedir(d);
+    return ret;
+}
+
+/*
+ * Whether @p path, absolute and normalized, is a file that can be read.
+ * *exists is set to the answer.
+ */
+static int include_exists(struct include_scan *s, char *path, int *exists)
+{
+    char *slash = strrchr(path, '/');
+    char save;
+    int ret;
+
+    /* the directory is path up to the last slash, or "/" */
+    save = slash[slash == path];
+    slash[slash == path] = '\0';
+    ret = include_list_dir(s, path);
+    slash[slash == path] = save;
+    *exists = ret == 0 && include_set_has(&s->entries, path);
+    return ret;
+}
+
+/*
+ * Look for the file named in a directive of a file in @p from_dir.
+ * quoted is 1 for "name", 0 for <name>; all is 1 to take every file
+ * it could mean, as for #include_next.
+ */
+static int include_resolve(struct include_scan *s, const char *name,
+                           int quoted, int all, const char *from_dir)
+{
+    const char *dir;
+    char *path;
+    int found = 0, exists;
+    int i, ret;
+
+    if (name[0] == '/') {
+        if ((path = include_path(NULL, name)) == NULL)
+            return EXIT_OUT_OF_MEMORY;
+        if ((ret = include_exists(s, path, &exists)) || !exists)
+            return ret;
+        return include_add_file(s, path);
+    }
+
+    /* "name" looks next to the includer, then in -iquote, then like <> */
+    for (i = quoted ? -1 : s->n_quote; i < s->n_quote + s->n_angle; i++) {
+        if (i < 0)
+            dir = from_dir;
+        else if (i < s->n_quote)
+            dir = s->quote[i];
+        else
+            dir = s->angle[i - s->n_quote];
+        if ((path = include_path(dir, name)) == NULL)
+            return EXIT_OUT_OF_MEMORY;
+        if ((ret = include_exists(s, path, &exists)))
+            return ret;
+        if (!exists)
+            continue;
+        if ((ret = include_add_file(s, path)))
+            return ret;
+        found = 1;
+        if (!all)
+            break;
+    }
+    if (!found)
+        rs_trace("taking %c%s%c for a system header",
+                 quoted ? '"' : '<', name, quoted ? '"' : '>');
+    return 0;
+}
+
+/*
+ * Note a directive of the file being scanned for the cache, as a tab,
+ * its kind and the name: 'q' for "name", 'a' for <name>, upper case if
+ * it takes every file it could mean, 'c' for a computed #include.
+ */
+static int include_note(struct include_scan *s, int kind, const char *name,
+                        size_t len)
+{
+    char head[2];
+
+    if (memchr(name, '\t', len) || memchr(name, '\n', len)) {
+        s->rec_ok = 0;
+        return 0;
+    }
+    head[0] = '\t';
+    head[1] = (char) kind;
+    if (include_append(&s->rec, &s->len_rec, &s->size_rec, head, 2)
+            || include_append(&s->rec, &s->len_rec, &s->size_rec, name, len))
+        return EXIT_OUT_OF_MEMORY;
+    return 0;
+}
+
+/* Skip blanks, but not the end of the line. */
+static const char *include_skip_blanks(const char *p, const char *end)
+{
+    while (p < end && (*p == ' ' || *p == '\t'))
+        p++;
+    return p;
+}
+
+/* Whether the directive at @p p is @p word, and not a longer one. */
+static int include_is_word(const char *p, const char *end, const char *word)
+{
+    size_t n = strlen(word);
+
+    return (size_t) (end - p) >= n && !memcmp(p, word, n)
+        && (p + n == end || !(isalnum((unsigned char) p[n]) || p[n] == '_'));
+}
+
+/*
+ * Resolve the "name" or <name> at p.  *p_ret is set past it.
+ * Returns EXIT_MRCC_FAILED if it is neither, as for "#include MACRO".
+ */
+static int include_name(struct include_scan *s, const char *p,
+                        const char *end, int all, const char *from_dir,
+                        const char **p_ret)
+{
+    const char *close;
+    char *name;
+    int quoted, ret;
+
+    if (p < end && *p == '"')
+        quoted = 1;
+    else if (p < end && *p == '<')
+        quoted = 0;
+    else
+        return EXIT_MRCC_FAILED;
+
+    close = memchr(p + 1, quoted ? '"' : '>', end - p - 1);
+    if (close == NULL)
+        return EXIT_MRCC_FAILED;
+    if ((ret = include_note(s, quoted ? (all ? 'Q' : 'q') : (all ? 'A' : 'a'),
+                            p + 1, close - p - 1)))
+        return ret;
+    if ((name = strndup(p + 1, close - p - 1)) == NULL)
+        return EXIT_OUT_OF_MEMORY;
+    ret = include_resolve(s, name, quoted, all, from_dir);
+    free(name);
+    *p_ret = close + 1;
+    return ret;
+}
+
+/* Look at one preprocessor directive; p is just past the '#'. */
+static int include_directive(struct include_scan *s, const char *p,
+                             const char *end, const char *from_dir,
+                             const char *fname)
+{
+    const char *hit;
+    int all, ret;
+
+    p = include_skip_blanks(p, end);
+
+    if (include_is_word(p, end, "include_next")) {
+        p += strlen("include_next");
+        all = 1;
+    } else if (include_is_word(p, end, "include")) {
+        p += strlen("include");
+        all = 0;
+    } else if (include_is_word(p, end, "import")) {
+        p += strlen("import");
+        all = 0;
+    } else if (include_is_word(p, end, "if") || include_is_word(p, end, "elif")) {
+        /* __has_include("x") would be false on the server without x */
+        while ((hit = memchr(p, '_', end - p)) != NULL) {
+            p = hit + 1;
+            if ((size_t) (end - hit) < strlen("__has_include")
+                    || memcmp(hit, "__has_include", strlen("__has_include")))
+                continue;
+            p = hit + strlen("__has_include");
+            all = include_is_word(p, end, "_next");
+            if (all)
+                p += strlen("_next");
+            p = include_skip_blanks(p, end);
+            if (p < end && *p == '(')
+                p = include_skip_blanks(p + 1, end);
+            ret = include_name(s, p, end, 1, from_dir, &p);
+            if (ret == EXIT_MRCC_FAILED)
+                continue;       /* e.g. __has_include(MACRO) */
+            if (ret)
+                return ret;
+        }
+        return 0;
+    } else {
+        return 0;
+    }
+
+    p = include_skip_blanks(p, end);
+    ret = include_name(s, p, end, all, from_dir, &p);
+    if (ret == EXIT_MRCC_FAILED) {
+        rs_trace("computed #include in %s; cannot tell what it reads", fname);
+        if (include_note(s, 'c', "", 0))
+            return EXIT_OUT_OF_MEMORY;
+    }
+    return ret;
+}
+
+/*
+ * The next '#' at or after p, 16 bytes at a time where SSE2 is there.
+ * Most lines of most files have none, so the lines are not looked at
+ * one by one.
+ */
+static const char *include_find_hash(const char *p, const char *end)
+{
+#ifdef __SSE2__
+    const __m128i hash = _mm_set1_epi8('#');
+    unsigned mask;
+
+    for (; end - p >= 16; p += 16) {
+        mask = _mm_movemask_epi8(_mm_cmpeq_epi8(
+                   _mm_loadu_si128((const __m128i *) p), hash));
+        if (mask)
+            return p + __builtin_ctz(mask);
+    }
+#endif
+    return memchr(p, '#', end - p);
+}
+
+/* The name of the cache file, to be freed. */
+static char *include_cache_name(void)
+{
+    char *state, *name = NULL;
+
+    if (get_state_dir(&state) || asprintf(&name, "%s/includes", state) == -1)
+        return NULL;
+    return name;
+}
+
+/* The slot of @p path in the index of the cache. */
+static int *include_cache_slot(struct include_scan *s, const char *path)
+{
+    unsigned i = include_hash(path) & (s->size_index - 1);
+
+    while (s->cache_index[i] != -1
+           && !str_equal(s->cached[s->cache_index[i]].path, path))
+        i = (i + 1) & (s->size_index - 1);
+    return &s->cache_index[i];
+}
+
+/*
+ * Read the cache file.  Each line is "MTIME SIZE PATH" and the
+ * directives of PATH; a later line for the same file wins.  A cache
+ * that cannot be read is an empty one.
+ */
+static int include_cache_load(struct include_scan *s)
+{
+    struct include_cached c;
+    char *name, *p, *q, *eol, *end, *tab;
+    off_t fsize;
+    int fd, n, i;
+    int *slot;
+
+    if ((name = include_cache_name()) == NULL)
+        return 0;
+    if (open_read(name, &fd, &fsize) != 0 || fd == -1) {
+        free(name);
+        return 0;
+    }
+    free(name);
+    if (fsize > INCLUDE_CACHE_MAX) {
+        /* include_cache_save() starts it over */
+        rs_trace("the include cache is too big, not reading it");
+        s->cache_too_big = 1;
+        close(fd);
+        return 0;
+    }
+    if ((s->cache_buf = malloc(fsize + 1)) == NULL
+            || readx(fd, s->cache_buf, fsize) != 0) {
+        close(fd);
+        free(s->cache_buf);
+        s->cache_buf = NULL;
+        return 0;
+    }
+    close(fd);
+    end = s->cache_buf + fsize;
+    *end = '\0';
+
+    for (n = 0, p = s->cache_buf; (p = memchr(p, '\n', end - p)); p++)
+        n++;
+    s->cached = malloc((n + 1) * sizeof *s->cached);
+    for (s->size_index = 256; s->size_index < 2 * n; s->size_index *= 2)
+        ;
+    s->cache_index = malloc(s->size_index * sizeof *s->cache_index);
+    if (s->cached == NULL || s->cache_index == NULL)
+        return EXIT_OUT_OF_MEMORY;
+    for (i = 0; i < s->size_index; i++)
+        s->cache_index[i] = -1;
+
+    for (p = s->cache_buf; p < end && (eol = memchr(p, '\n', end - p));
+         p = eol + 1) {
+        s->n_lines++;
+        *eol = '\0';
+        c.mtime = strtoll(p, &q, 10);
+        if (*q != ' ')
+            continue;
+        c.size = strtoll(q + 1, &q, 10);
+        if (*q != ' ' || q[1] != '/')
+            continue;
+        c.path = q + 1;
+        if ((tab = strchr(q + 1, '\t')) != NULL) {
+            *tab = '\0';
+            c.directives = tab + 1;
+        } else {
+            c.directives = eol;
+        }
+        slot = include_cache_slot(s, c.path);
+        if (*slot == -1)
+            *slot = s->n_cached++;
+        s->cached[*slot] = c;
+    }
+    rs_trace("%d of %d lines of the include cache are current",
+             s->n_cached, s->n_lines);
+    return 0;
+}
+
+/*
+ * Follow the directives the cache has for @p fname, if it has them for
+ * the file as it is now.  *hit is set to 1 if it did.
+ */
+static int include_cache_lookup(struct include_scan *s, const char *fname,
+                                const struct stat *st, const char *dir,
+                                int *hit)
+{
+    struct include_cached *c;
+    char *p, *tab;
+    int slot, ret = 0;
+
+    *hit = 0;
+    if (s->size_index == 0 || (slot = *include_cache_slot(s, fname)) == -1)
+        return 0;
+    c = &s->cached[slot];
+    if (c->mtime != (long long) st->st_mtime
+            || c->size != (long long) st->st_size)
+        return 0;
+
+    *hit = 1;
+    for (p = c->directives; *p && ret == 0; p = tab + 1) {
+        if ((tab = strchr(p, '\t')) != NULL)
+            *tab = '\0';
+        if (*p == 'c') {
+            rs_trace("computed #include in %s; cannot tell what it reads",
+                     fname);
+            ret = EXIT_MRCC_FAILED;
+        } else {
+            ret = include_resolve(s, p + 1, *p == 'q' || *p == 'Q',
+                                  *p == 'Q' || *p == 'A', dir);
+        }
+        if (tab == NULL)
+            break;
+        *tab = '\t';
+    }
+    return ret;
+}
+
+/*
+ * Keep what was found in @p fname for the next scan.  Files changed in
+ * the last second are left out: they may change again without a new
+ * mtime.
+ */
+static int include_cache_note(struct include_scan *s, const char *fname,
+                              const struct stat *st)
+{
+    char *line = NULL;
+    int len, ret;
+
+    if (!s->rec_ok || st->st_mtime >= s->now - 1
+            || strchr(fname, '\t') || strchr(fname, '\n'))
+        return 0;
+    len = asprintf(&line, "%lld %lld %s%s\n", (long long) st->st_mtime,
+                   (long long) st->st_size, fname, s->rec ? s->rec : "");
+    if (len == -1)
+        return EXIT_OUT_OF_MEMORY;
+    ret = include_append(&s->added, &s->len_added, &s->size_added, line, len);
+    free(line);
+    return ret;
+}
+
+/*
+ * Add the files scanned to the cache file.  Lines are appended under
+ * an flock(), so that parallel compiles do not mix them up.  Once the
+ * file is mostly out of date lines, or too big to be read at all, it
+ * is written anew; what others append meanwhile is lost, which only
+ * costs them a scan.
+ */
+static void include_cache_save(struct include_scan *s)
+{
+    char *name, *tmp = NULL, *buf = NULL;
+    size_t len = 0, size = 0;
+    struct include_cached *c;
+    char line[64];
+    int fd, i, n;
+
+    if (s->len_added == 0 || (name = include_cache_name()) == NULL)
+        return;
+
+    if (s->cache_too_big
+            || (s->n_lines > 1024 && s->n_lines > 2 * s->n_cached)) {
+        for (i = 0; i < s->n_cached; i++) {
+            c = &s->cached[i];
+            n = snprintf(line, sizeof line, "%lld %lld ", c->mtime, c->size);
+            if (include_append(&buf, &len, &size, line, n)
+                    || include_append(&buf, &len, &size, c->path,
+                                      strlen(c->path))
+                    || (*c->directives
+                        && (include_append(&buf, &len, &size, "\t", 1)
+                            || include_append(&buf, &len, &size,
+                                              c->directives,
+                                              strlen(c->directives))))
+                    || include_append(&buf, &len, &size, "\n", 1))
+                goto out;
+        }
+        if (include_append(&buf, &len, &size, s->added, s->len_added)
+                || asprintf(&tmp, "%s.%ld", name, (long) getpid()) == -1) {
+            tmp = NULL;
+            goto out;
+        }
+        fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC|O_BINARY, 0666);
+        if (fd != -1 && writex(fd, buf, len) == 0 && close(fd) == 0
+                && rename(tmp, name) == 0) {
+            rs_trace("rewrote the include cache with %d files",
+                     s->n_cached);
+        } else {
+            rs_log_warning("failed to rewrite %s", name);
+            unlink(tmp);
+        }
+        goto out;
+    }
+
+    if ((fd = open(name, O_WRONLY|O_APPEND|O_CREAT|O_BINARY, 0666)) == -1) {
+        rs_log_warning("failed to open %s: %s", name, strerror(errno));
+        goto out;
+    }
+    if (flock(fd, LOCK_EX) == 0)
+        writex(fd, s->added, s->len_added);
+    close(fd);
+
+out:
+    free(name);
+    free(tmp);
+    free(buf);
+}
+
+/* Scan one file for the files it includes. */
+static int include_scan_file(struct include_scan *s, const char *fname)
+{
+    struct stat st;
+    char *buf = NULL, *dir = NULL, *slash;
+    const char *p, *q, *end, *eol;
+    int fd = -1, hit;
+    int ret;
+
+    if (stat(fname, &st) == -1) {
+        rs_log_error("failed to stat %s: %s", fname, strerror(errno));
+        return EXIT_IO_ERROR;
+    }
+    if ((dir = strdup(fname)) == NULL)
+        return EXIT_OUT_OF_MEMORY;
+    slash = strrchr(dir, '/');
+    if (slash)
+        *(slash == dir ? slash + 1 : slash) = '\0';
+
+    ret = include_cache_lookup(s, fname, &st, dir, &hit);
+    if (hit)
+        goto out;
+
+    if ((fd = open(fname, O_RDONLY|O_BINARY)) == -1) {
+        rs_log_error("failed to open %s: %s", fname, strerror(errno));
+        ret = EXIT_IO_ERROR;
+        goto out;
+    }
+    if ((buf = malloc(st.st_size + 1)) == NULL) {
+        ret = EXIT_OUT_OF_MEMORY;
+        goto out;
+    }
+    if ((ret = readx(fd, buf, st.st_size)))
+        goto out;
+
+    s->len_rec = 0;
+    if (s->rec)
+        s->rec[0] = '\0';
+    s->rec_ok = 1;
+    end = buf + st.st_size;
+    for (p = buf; (q = include_find_hash(p, end)) != NULL; p = eol + 1) {
+        eol = memchr(q, '\n', end - q);
+        if (eol == NULL)
+            eol = end;
+        /* a directive if only blanks come before it on its line */
+        for (p = q; p > buf && (p[-1] == ' ' || p[-1] == '\t'); p--)
+            ;
+        if ((p == buf || p[-1] == '\n')
+                && (ret = include_directive(s, q + 1, eol, dir, fname)))
+            break;
+        if (eol == end)
+            break;
+    }
+    if ((ret == 0 || ret == EXIT_MRCC_FAILED)
+            && include_cache_note(s, fname, &st))
+        ret = EXIT_OUT_OF_MEMORY;
+
+out:
+    if (fd != -1)
+        close(fd);
+    free(buf);
+    free(dir);
+    return ret;
+}
+
+/* Collect the include directories from the compiler options. */
+static int include_parse_argv(struct include_scan *s, char **argv,
+                              char ***roots, int *n_roots)
+{
+    char **dirs[4] = { NULL, NULL, NULL, NULL };   /* -iquote -I -isystem -idirafter */
+    int n[4] = { 0, 0, 0, 0 };
+    static const char *const opts[] = {
+        "-iquote", "-I", "-isystem", "-idirafter"
+    };
+    const char *a, *arg;
+    char **grown;
+    int i, k, ret = 0;
+
+    for (i = 1; argv[i] && ret == 0; i++) {
+        a = argv[i];
+        if (a[0] != '-')
+            continue;
+        if (a[1] == 'M' || str_startswith("-iprefix", a)
+                || str_startswith("-iwithprefix", a)) {
+            rs_trace("%s is not supported on the server", a);
+            ret = EXIT_MRCC_FAILED;
+            break;
+        }
+        if (str_equal(a, "-include") || str_equal(a, "-imacros")) {
+            if (argv[i + 1] == NULL)
+                break;
+            /* a name to look up, not a directory */
+            grown = realloc(*roots, (*n_roots + 2) * sizeof **roots);
+            if (grown == NULL) {
+                ret = EXIT_OUT_OF_MEMORY;
+                break;
+            }
+            *roots = grown;
+            if (((*roots)[*n_roots] = strdup(argv[++i])) == NULL) {
+                ret = EXIT_OUT_OF_MEMORY;
+                break;
+            }
+            (*roots)[++*n_roots] = NULL;
+            continue;
+        }
+        for (k = 0; k < 4; k++) {
+            if (str_startswith(opts[k], a))
+                break;
+        }
+        if (k == 4)
+            continue;
+        arg = a + strlen(opts[k]);
+        if (*arg == '\0') {
+            if ((arg = argv[i + 1]) == NULL)
+                break;
+            i++;
+        }
+        if (k == 1 && str_equal(arg, "-")) {
+            rs_trace("-I- is not supported on the server");
+            ret = EXIT_MRCC_FAILED;
+            break;
+        }
+        ret = include_add_dir(&dirs[k], &n[k], arg);
+    }
+
+    s->quote = dirs[0];
+    s->n_quote = n[0];
+    for (k = 1; k < 4 && ret == 0; k++) {
+        for (i = 0; i < n[k] && ret == 0; i++)
+            ret = include_add_dir(&s->angle, &s->n_angle, dirs[k][i]);
+    }
+    for (k = 1; k < 4; k++)
+        include_free_dirs(dirs[k], n[k]);
+    return ret;
+}
+
+/**
+ * @brief Find every file a compile may read, except system headers.
+ * @param argv the compiler command.
+ * @param input_fname the source file in @p argv.
+ * @param files receives a NULL-terminated list of absolute filenames,
+ * the source first, to be given to free_argv() by the caller.
+ * @return 0 on success, EXIT_MRCC_FAILED if the files cannot be known
+ * for sure, or error return code.
+ */
+int approximate_includes(char **argv, const char *input_fname, char ***files)
+{
+    struct include_scan s;
+    struct timeval before, after;
+    char **roots = NULL;
+    char *path;
+    int n_roots = 0, i;
+    int ret;
+
+    gettimeofday(&before, NULL);
+    memset(&s, 0, sizeof s);
+    s.now = before.tv_sec;
+    if ((ret = include_parse_argv(&s, argv, &roots, &n_roots))
+            || (ret = include_cache_load(&s)))
+        goto out;
+
+    if ((path = include_path(NULL, input_fname)) == NULL) {
+        ret = EXIT_OUT_OF_MEMORY;
+        goto out;
+    }
+    if ((ret = include_add_file(&s, path)))
+        goto out;
+    /* -include looks in the current directory first, then like "" */
+    for (i = 0; i < n_roots && ret == 0; i++)
+        ret = include_resolve(&s, roots[i], 1, 0, ".");
+
+    /* the list grows as we go */
+    for (i = 0; ret == 0 && i < s.n_files; i++)
+        ret = include_scan_file(&s, s.files[i]);
+    include_cache_save(&s);
+    if (ret)
+        goto out;
+
+    gettimeofday(&after, NULL);
+    rs_trace("%s reads %d files besides system headers, found in %ldus",
+             input_fname, s.n_files - 1,
+             (long) ((after.tv_sec - before.tv_sec) * 1000000
+                     + after.tv_usec - before.tv_usec));
+    *files = s.files;
+    s.files = NULL;
+
+out:
+    include_free_dirs(s.quote, s.n_quote);
+    include_free_dirs(s.angle, s.n_angle);
+    include_free_dirs(roots, n_roots);
+    if (s.files) {
+        for (i = 0; i < s.n_files; i++)
+            free(s.files[i]);
+        free(s.files);
+    }
+    include_set_free(&s.found, 0);
+    include_set_free(&s.listed, 1);
+    include_set_free(&s.entries, 1);
+    free(s.cache_buf);
+    free(s.cached);
+    free(s.cache_index);
+    free(s.rec);
+    free(s.added);
+    return ret;
+}
@@ -0,0 +1,5 @@
+// mrcc - A C Compiler system on MapReduce
+// Zhiqiang Ma, https://www.ericzma.com
+#pragma once
+
+int approximate_includes(char **argv, const char *input_fname, char ***files);
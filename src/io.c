@@ -24,6 +24,13 @@
 #include <sys/resource.h>
 #include <sys/wait.h>
 #include <sys/poll.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#ifdef __linux__
+#  include <sys/sendfile.h>
+#  include <sys/syscall.h>
+#  include <linux/fs.h>
+#endif
 
 #include "utils.h"
 #include "io.h"
@@ -130,6 +137,44 @@ int writex(int fd, const void *buf, size_t len)
 }
 
 
+/**
+ * @brief Read exactly @p len bytes from an fd.
+ * Keep reading until we have them all, or hit end of file or an error.
+ * @param fd file descriptor.
+ * @param buf buffer to fill.
+ * @param len number of bytes to read.
+ * @return 0, EXIT_TRUNCATED on premature end of file, or EXIT_IO_ERROR.
+ */
+int readx(int fd, void *buf, size_t len)
+{
+    ssize_t r;
+
+    while (len > 0) {
+        r = read(fd, buf, len);
+
+        if (r == -1 && EINTR == errno) {
+            continue;
+        }
+        if (r == -1 && (EAGAIN == errno || EWOULDBLOCK == errno)) {
+            rs_log_error("IO timeout reading fd%d", fd);
+            return EXIT_IO_ERROR;
+        }
+        if (r == -1) {
+            rs_log_error("failed to read: %s", strerror(errno));
+            return EXIT_IO_ERROR;
+        }
+        if (r == 0) {
+            rs_log_error("unexpected eof on fd%d", fd);
+            return EXIT_TRUNCATED;
+        }
+        buf = &((char *) buf)[r];
+        len -= r;
+    }
+
+    return 0;
+}
+
+
 int mrcc_close(int fd)
 {
     if (close(fd) != 0) {
@@ -186,10 +231,318 @@ int open_read(const char *fname, int *ifd, off_t *fsize)
     return 0;
 }
 
+/**
+ * @brief Copy @p n bytes from @p ifd to @p ofd through a buffer.
+ * @param ofd file descriptor to write to.
+ * @param ifd file descriptor to read from.
+ * @param n number of bytes to copy.
+ * @return 0 on success, or error return code.
+ */
+int pump_readwrite(int ofd, int ifd, size_t n)
+{
+    static char buf[262144];
+    ssize_t r_in;
+    size_t wanted;
+    int ret;
+
+    while (n > 0) {
+        wanted = (n > sizeof buf) ? (sizeof buf) : n;
+        r_in = read(ifd, buf, wanted);
+
+        if (r_in == -1 && EINTR == errno) {
+            continue;
+        }
+        if (r_in == -1) {
+            rs_log_error("failed to read from fd%d: %s", ifd, strerror(errno));
+            return EXIT_IO_ERROR;
+        }
+        if (r_in == 0) {
+            rs_log_error("unexpected eof on fd%d", ifd);
+            return EXIT_TRUNCATED;
+        }
+        if ((ret = writex(ofd, buf, (size_t) r_in)))
+            return ret;
+        n -= r_in;
+    }
+
+    return 0;
+}
+
+/*
+ * The ways of moving data without it passing through our buffers.
+ * Each moves what it can of *n bytes, counting them off, and returns
+ * 0, an error return code, or PUMP_NOT_HERE if it cannot be used for
+ * these descriptors at all; the next way then goes on from there.
+ */
+#define PUMP_NOT_HERE (-1)
+
+/* errors that mean a way does not work for these descriptors */
+static int pump_not_here(int err)
+{
+    return err == EINVAL || err == ENOSYS || err == EXDEV || err == EBADF
+        || err == EOPNOTSUPP || err == ENOTSUP || err == EPERM;
+}
+
+/* errno after a failed move from @p ifd to @p ofd, as a return code */
+static int pump_error(const char *how, int ofd, int ifd)
+{
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        rs_log_error("IO timeout moving fd%d to fd%d", ifd, ofd);
+    } else {
+        rs_log_error("%s from fd%d to fd%d failed: %s", how, ifd, ofd,
+                     strerror(errno));
+    }
+    return EXIT_IO_ERROR;
+}
+
+#ifdef __linux__
+/* file to file, within the kernel; the fs may share the blocks */
+static int pump_copy_range(int ofd, int ifd, size_t *n)
+{
+#ifdef SYS_copy_file_range
+    ssize_t r;
+
+    while (*n > 0) {
+        r = syscall(SYS_copy_file_range, ifd, NULL, ofd, NULL, *n, 0);
+        if (r == -1 && errno == EINTR)
+            continue;
+        if (r == -1 && pump_not_here(errno))
+            return PUMP_NOT_HERE;
+        if (r == -1)
+            return pump_error("copy_file_range", ofd, ifd);
+        if (r == 0) {
+            rs_log_error("unexpected eof on fd%d", ifd);
+            return EXIT_TRUNCATED;
+        }
+        *n -= r;
+    }
+    return 0;
+#else
+    MRCC_UNUSED(ofd);
+    MRCC_UNUSED(ifd);
+    MRCC_UNUSED(n);
+    return PUMP_NOT_HERE;
+#endif
+}
+
+/* from a file to anything */
+static int pump_sendfile(int ofd, int ifd, size_t *n)
+{
+    ssize_t r;
+
+    while (*n > 0) {
+        r = sendfile(ofd, ifd, NULL, *n > 0x7ffff000 ? 0x7ffff000 : *n);
+        if (r == -1 && EINTR == errno)
+            continue;
+        if (r == -1 && pump_not_here(errno))
+            return PUMP_NOT_HERE;
+        if (r == -1)
+            return pump_error("sendfile", ofd, ifd);
+        if (r == 0) {
+            rs_log_error("unexpected eof on fd%d", ifd);
+            return EXIT_TRUNCATED;
+        }
+        *n -= r;
+    }
+    return 0;
+}
+
+/* one splice(), at least one end being a pipe */
+static ssize_t pump_splice1(int ifd, int ofd, size_t n)
+{
+    ssize_t r;
+
+    do {
+        r = syscall(SYS_splice, ifd, NULL, ofd, NULL, n, 0);
+    } while (r == -1 && errno == EINTR);
+    return r;
+}
+
+/*
+ * Anything to anything through a pipe: straight, if one end is one,
+ * otherwise through one of ours.
+ */
+static int pump_splice(int ofd, int ifd, size_t *n, int through_pipe)
+{
+    static int pipe_fds[2] = { -1, -1 };
+    const size_t chunk = 65536;
+    char buf[4096];
+    ssize_t r, w;
+    int ret;
+
+    if (!through_pipe) {
+        while (*n > 0) {
+            r = pump_splice1(ifd, ofd, *n > chunk ? chunk : *n);
+            if (r == -1 && pump_not_here(errno))
+                return PUMP_NOT_HERE;
+            if (r == -1)
+                return pump_error("splice", ofd, ifd);
+            if (r == 0) {
+                rs_log_error("unexpected eof on fd%d", ifd);
+                return EXIT_TRUNCATED;
+            }
+            *n -= r;
+        }
+        return 0;
+    }
+
+    if (pipe_fds[0] == -1) {
+        if (pipe(pipe_fds) == -1)
+            return PUMP_NOT_HERE;
+        fcntl(pipe_fds[0], F_SETFD, FD_CLOEXEC);
+        fcntl(pipe_fds[1], F_SETFD, FD_CLOEXEC);
+    }
+    while (*n > 0) {
+        r = pump_splice1(ifd, pipe_fds[1], *n > chunk ? chunk : *n);
+        if (r == -1 && pump_not_here(errno))
+            return PUMP_NOT_HERE;
+        if (r == -1)
+            return pump_error("splice", pipe_fds[1], ifd);
+        if (r == 0) {
+            rs_log_error("unexpected eof on fd%d", ifd);
+            return EXIT_TRUNCATED;
+        }
+        *n -= r;
+        while (r > 0) {
+            w = pump_splice1(pipe_fds[0], ofd, (size_t) r);
+            if (w == -1 && pump_not_here(errno)) {
+                /* the pipe has to be emptied some way */
+                w = read(pipe_fds[0], buf, (size_t) r > sizeof buf
+                                           ? sizeof buf : (size_t) r);
+                if (w > 0 && writex(ofd, buf, (size_t) w) != 0)
+                    w = -1;
+            }
+            if (w <= 0) {
+                ret = pump_error("splice", ofd, pipe_fds[0]);
+                /* what is left in the pipe would end up elsewhere */
+                close(pipe_fds[0]);
+                close(pipe_fds[1]);
+                pipe_fds[0] = pipe_fds[1] = -1;
+                return ret;
+            }
+            r -= w;
+        }
+    }
+    return 0;
+}
+#endif
+
+/*
+ * from a file to anything, mapped rather than read; only as much as
+ * the file has, as touching a page past its end raises SIGBUS
+ */
+static int pump_mmap(int ofd, int ifd, size_t *n)
+{
+    const size_t window = 16 * 1024 * 1024;
+    struct stat st;
+    off_t pos;
+    size_t skip, len;
+    char *p;
+    int ret;
+
+    if ((pos = lseek(ifd, 0, SEEK_CUR)) == (off_t) -1)
+        return PUMP_NOT_HERE;
+    while (*n > 0) {
+        if (fstat(ifd, &st) == -1)
+            return PUMP_NOT_HERE;
+        if (st.st_size <= pos) {
+            rs_log_error("unexpected eof on fd%d", ifd);
+            return EXIT_TRUNCATED;
+        }
+        /* the mapping has to start on a page */
+        skip = (size_t) (pos % sysconf(_SC_PAGESIZE));
+        len = *n > window ? window : *n;
+        if ((off_t) len > st.st_size - pos)
+            len = (size_t) (st.st_size - pos);
+        p = mmap(NULL, skip + len, PROT_READ, MAP_PRIVATE, ifd, pos - skip);
+        if (p == MAP_FAILED)
+            return PUMP_NOT_HERE;
+        ret = writex(ofd, p + skip, len);
+        munmap(p, skip + len);
+        if (ret)
+            return ret;
+        pos += len;
+        *n -= len;
+        if (lseek(ifd, pos, SEEK_SET) == (off_t) -1)
+            return EXIT_IO_ERROR;
+    }
+    return 0;
+}
+
+/**
+ * @brief Copy @p n bytes from @p ifd to @p ofd the cheapest way the
+ * two allow.
+ *
+ * Between files that is copy_file_range(), which the fs may turn into
+ * shared blocks; from a file to anything else sendfile(); with a pipe
+ * or socket on either end splice(); from a file elsewhere a mapping of
+ * it; and pump_readwrite() when nothing else works.  Both descriptors
+ * move on by @p n, as with read() and write().
+ * @return 0 on success, or error return code.
+ */
+int pump_copy(int ofd, int ifd, size_t n)
+{
+    struct stat ist, ost;
+    int in_file, out_file;
+    int ret = PUMP_NOT_HERE;
+
+    if (n == 0)
+        return 0;
+    if (fstat(ifd, &ist) == -1 || fstat(ofd, &ost) == -1)
+        return pump_readwrite(ofd, ifd, n);
+    in_file = S_ISREG(ist.st_mode);
+    out_file = S_ISREG(ost.st_mode);
+
+#ifdef __linux__
+    if (in_file && out_file)
+        ret = pump_copy_range(ofd, ifd, &n);
+    if (ret == PUMP_NOT_HERE && in_file)
+        ret = pump_sendfile(ofd, ifd, &n);
+    if (ret == PUMP_NOT_HERE
+            && (S_ISFIFO(ist.st_mode) || S_ISFIFO(ost.st_mode)))
+        ret = pump_splice(ofd, ifd, &n, 0);
+    if (ret == PUMP_NOT_HERE && S_ISSOCK(ist.st_mode))
+        ret = pump_splice(ofd, ifd, &n, 1);
+#endif
+    if (ret == PUMP_NOT_HERE && in_file)
+        ret = pump_mmap(ofd, ifd, &n);
+    if (ret == PUMP_NOT_HERE)
+        ret = pump_readwrite(ofd, ifd, n);
+    return ret;
+}
+
+/*
+ * Make @p ofd, an empty file, share the blocks of @p ifd, where the fs
+ * can (btrfs, XFS); the offset of @p ofd then moves to the end.
+ * @return 0 if it does.
+ */
+static int clone_file(int ofd, int ifd, off_t len)
+{
+#ifdef FICLONE
+    struct stat st;
+
+    if (fstat(ofd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size != 0
+            || lseek(ifd, 0, SEEK_CUR) != 0
+            || ioctl(ofd, FICLONE, ifd) == -1)
+        return -1;
+    if (lseek(ofd, len, SEEK_SET) == (off_t) -1)
+        return -1;
+    lseek(ifd, len, SEEK_SET);
+    return 0;
+#else
+    MRCC_UNUSED(ofd);
+    MRCC_UNUSED(ifd);
+    MRCC_UNUSED(len);
+    return -1;
+#endif
+}
+
 /**
  * @brief Copy a file's contents to a file descriptor.
+ * A file that does not exist counts as empty.  Into an empty file, the
+ * copy shares the blocks of the original where the fs allows.
  * @param in_fname filename to open.
- * @param out_fd unused.
+ * @param out_fd file descriptor to write to.
  * @return 0 on success, or EXIT_IO_ERROR.
  */
 int
@@ -202,19 +555,16 @@ copy_file_to_fd(const char *in_fname, int out_fd)
     ret = open_read(in_fname, &ifd, &len);
     if (ret)
         return ret;
+    if (ifd == -1)
+        return 0;
 
-#ifdef HAVE_SENDFILE
-    ret = pump_sendfile(out_fd, ifd, (size_t) len);
-#else
-    // deleted here
-    // ret = pump_readwrite(out_fd, ifd, (size_t) len);
-#endif
+    if (clone_file(out_fd, ifd, len) == 0)
+        ret = 0;
+    else
+        ret = pump_copy(out_fd, ifd, (size_t) len);
 
-    if (ret) {
-        close(ifd);
-        return ret;
-    }
-    return 0;
+    close(ifd);
+    return ret;
 }
 
 
@@ -10,8 +10,12 @@
 
 int select_for_write(int fd, int timeout);
 int writex(int fd, const void *buf, size_t len);
+int readx(int fd, void *buf, size_t len);
 int mrcc_close(int fd);
 
 int open_read(const char *fname, int *ifd, off_t *fsize);
 
+int pump_readwrite(int ofd, int ifd, size_t n);
+int pump_copy(int ofd, int ifd, size_t n);
+
 int copy_file_to_fd(const char *in_fname, int out_fd);
@@ -0,0 +1,324 @@
+// mrcc - A C Compiler system on MapReduce
+// Zhiqiang Ma, https://www.ericzma.com
+
+#include <stdarg.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <string.h>
+#include <time.h>
+#include <ctype.h>
+#include <assert.h>
+#include <fcntl.h>
+
+#include <sys/fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <sys/file.h>
+
+#include "utils.h"
+#include "trace.h"
+#include "stringutils.h"
+#include "tempfile.h"
+#include "compile.h"
+#include "lock.h"
+#include "exec.h"
+#include "deadline.h"
+
+/**
+ * @file
+ * @brief Counting semaphores for local work, made of lock files.
+ *
+ * With "make -j300" there are 300 mrcc processes, and without a limit
+ * they would run 300 preprocessors and start 300 hadoop JVMs at once.
+ * Each kind of work has a budget of slots instead: slot N of budget
+ * "cpp" is the lock file $MRCC_DIR/lock/cpp_N, and a process owns the
+ * slot while it holds an flock() on it.  The kernel drops the lock when
+ * the process dies, so a crash never leaks a slot.
+ *
+ * There are three budgets:
+ *  - "cpp" for local preprocessors, $MRCC_CPP_SLOTS;
+ *  - "cc" for compiles and links run locally, $MRCC_LOCAL_SLOTS;
+ *  - "client" for hadoop JVMs started to move files or submit jobs,
+ *    $MRCC_CLIENT_SLOTS.
+ * and one per mrccd host, as many as the host definition says (see
+ * pick_host()).
+ *
+ * The first two default to the number of CPUs.  A process holds at
+ * most one slot per budget, and takes them only in the order host,
+ * cpp, client; "cc" is never held together with another one.  That
+ * rules out deadlocks.
+ **/
+
+/* Nonzero if lock_client() always succeeds without taking a slot. */
+static int lock_client_disabled = 0;
+
+/* Number of slots of a budget: $env if set, else @p dflt. */
+static int lock_slots(const char *env, int dflt)
+{
+    const char *e = getenv(env);
+    int n;
+
+    if (e && e[0]) {
+        n = atoi(e);
+        if (n > 0)
+            return n;
+        rs_log_warning("bad %s \"%s\", using %d", env, e, dflt);
+    }
+    return dflt;
+}
+
+/* The number of online CPUs, but no more than @p max. */
+static int lock_ncpus(int max)
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (n < 1)
+        n = 1;
+    return n > max ? max : (int) n;
+}
+
+/* Open the lock file of one slot. */
+static int lock_open_slot(const char *what, int slot, int *fd_ret)
+{
+    char *dir, *fname = NULL;
+    int ret;
+
+    if ((ret = get_lock_dir(&dir)))
+        return ret;
+    if (asprintf(&fname, "%s/%s_%d", dir, what, slot) == -1)
+        return EXIT_OUT_OF_MEMORY;
+
+    *fd_ret = open(fname, O_WRONLY | O_CREAT, 0666);
+    if (*fd_ret == -1) {
+        rs_log_error("failed to open lock %s: %s", fname, strerror(errno));
+        free(fname);
+        return EXIT_IO_ERROR;
+    }
+    /* a child holding a copy would keep the slot after we let go */
+    fcntl(*fd_ret, F_SETFD, FD_CLOEXEC);
+    free(fname);
+    return 0;
+}
+
+/* A random slot of @p n_slots, so that waiters spread over them. */
+static int lock_random_slot(int n_slots)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (int) ((tv.tv_usec ^ getpid()) % n_slots);
+}
+
+/* Try each slot once without waiting, starting at @p start. */
+static int lock_try_slots(const char *what, int n_slots, int start,
+                          int *lock_fd)
+{
+    int i, slot, fd;
+    int ret;
+
+    for (i = 0; i < n_slots; i++) {
+        slot = (start + i) % n_slots;
+        if ((ret = lock_open_slot(what, slot, &fd)))
+            return ret;
+        if (flock(fd, LOCK_EX | LOCK_NB) == 0) {
+            rs_trace("got %s slot %d", what, slot);
+            *lock_fd = fd;
+            return 0;
+        }
+        if (errno != EWOULDBLOCK && errno != EINTR) {
+            rs_log_error("failed to lock %s slot %d: %s",
+                         what, slot, strerror(errno));
+            close(fd);
+            return EXIT_IO_ERROR;
+        }
+        close(fd);
+    }
+    return EXIT_BUSY;
+}
+
+/**
+ * @brief Take one of @p n_slots slots of the budget called @p what if
+ * one is free right now.
+ * @param lock_fd receives the lock, to be given to mrcc_unlock().
+ * @return 0 on success, EXIT_BUSY if all slots are taken, or error
+ * return code.
+ */
+int mrcc_trylock_slot(const char *what, int n_slots, int *lock_fd)
+{
+    return lock_try_slots(what, n_slots, lock_random_slot(n_slots), lock_fd);
+}
+
+/**
+ * @brief Take one of @p n_slots slots of the budget called @p what.
+ * First each slot is tried without waiting, from a random start.  If
+ * all are busy, this waits for a random one.
+ * @param lock_fd receives the lock, to be given to mrcc_unlock().
+ * @return 0 on success, or error return code.
+ */
+int mrcc_lock_slot(const char *what, int n_slots, int *lock_fd)
+{
+    int start, fd;
+    int ret;
+
+    start = lock_random_slot(n_slots);
+    ret = lock_try_slots(what, n_slots, start, lock_fd);
+    if (ret != EXIT_BUSY)
+        return ret;
+
+    rs_trace("all %d %s slots are busy, waiting for slot %d",
+             n_slots, what, start);
+    if ((ret = lock_open_slot(what, start, &fd)))
+        return ret;
+    while (flock(fd, LOCK_EX) == -1) {
+        if (errno != EINTR) {
+            rs_log_error("failed to lock %s slot %d: %s",
+                         what, start, strerror(errno));
+            close(fd);
+            return EXIT_IO_ERROR;
+        }
+    }
+    rs_trace("got %s slot %d", what, start);
+    *lock_fd = fd;
+    return 0;
+}
+
+/**
+ * @brief Give back a slot taken with mrcc_lock_slot().
+ */
+void mrcc_unlock(int lock_fd)
+{
+    /* closing drops the flock */
+    if (close(lock_fd) == -1)
+        rs_log_warning("failed to close lock fd%d: %s", lock_fd, strerror(errno));
+}
+
+/**
+ * @brief Take a slot for running the preprocessor locally.
+ */
+int lock_local_cpp(int *lock_fd)
+{
+    return mrcc_lock_slot("cpp", lock_slots("MRCC_CPP_SLOTS",
+                                            lock_ncpus(MAX_LOCAL_CPP_TASKS)),
+                          lock_fd);
+}
+
+/**
+ * @brief Take a slot for compiling or linking locally.
+ */
+int lock_local(int *lock_fd)
+{
+    return mrcc_lock_slot("cc", lock_slots("MRCC_LOCAL_SLOTS",
+                                           lock_ncpus(MAX_LOCAL_TASKS)),
+                          lock_fd);
+}
+
+/**
+ * @brief Take a slot for compiling locally if one is free right now.
+ * @return 0 on success, EXIT_BUSY if all are taken, or error return code.
+ */
+int trylock_local(int *lock_fd)
+{
+    return mrcc_trylock_slot("cc", lock_slots("MRCC_LOCAL_SLOTS",
+                                              lock_ncpus(MAX_LOCAL_TASKS)),
+                             lock_fd);
+}
+
+/**
+ * @brief Count the local compile slots that are taken right now.
+ * @param n_slots receives the number of slots there are.
+ * @return the number of slots taken.
+ */
+int lock_local_busy(int *n_slots)
+{
+    int slot, fd, busy = 0;
+
+    *n_slots = lock_slots("MRCC_LOCAL_SLOTS", lock_ncpus(MAX_LOCAL_TASKS));
+    for (slot = 0; slot < *n_slots; slot++) {
+        if (lock_open_slot("cc", slot, &fd))
+            break;
+        if (flock(fd, LOCK_EX | LOCK_NB) == -1)
+            busy++;
+        close(fd);
+    }
+    return busy;
+}
+
+/**
+ * @brief Take a slot for a hadoop client process.
+ * The client of a MapReduce job gives it up once the job is
+ * submitted, see mr_finish_job().
+ */
+int lock_client(int *lock_fd)
+{
+    if (lock_client_disabled) {
+        *lock_fd = -1;
+        return 0;
+    }
+    return mrcc_lock_slot("client", lock_slots("MRCC_CLIENT_SLOTS",
+                                               MAX_CLIENT_TASKS),
+                          lock_fd);
+}
+
+/**
+ * @brief Stop taking client slots in this process.
+ * For processes that run on behalf of one already holding a slot.
+ */
+void lock_client_disable(void)
+{
+    lock_client_disabled = 1;
+}
+
+/**
+ * @brief Run a hadoop command within the budget of client processes.
+ * If no slot can be had at all, the command runs anyway.
+ *
+ * The command is run directly, see run_command(); it gives up on it
+ * when the deadline of the phase under way passes (see deadline.c),
+ * and kills it.
+ * @param argv the command.
+ * @param stdout_file where its output goes, or NULL for ours.
+ * @param stderr_file where its errors are appended, or NULL for ours.
+ * @return its wait status, or -1 with errno set if it could not be
+ * run, or to ETIMEDOUT if it took too long.
+ */
+int client_run(char **argv, const char *stdout_file, const char *stderr_file)
+{
+    return client_run_mark(argv, stdout_file, stderr_file, NULL, NULL);
+}
+
+/**
+ * @brief client_run(), noting when the errors of the command first
+ * say @p mark, see run_command().
+ * @param mark_us receives event_now() at that time, and is left alone
+ * if they never do.
+ */
+int client_run_mark(char **argv, const char *stdout_file,
+                    const char *stderr_file, const char *mark,
+                    long long *mark_us)
+{
+    long left;
+    int lock_fd = -1;
+    int status = -1;
+    int ret;
+
+    if (lock_client(&lock_fd) != 0)
+        lock_fd = -1;
+
+    left = deadline_left_ms();
+    ret = run_command("hadoop", argv, stdout_file, stderr_file, mark, mark_us,
+                      left < 0 ? 0 : left + 1, &status);
+
+    if (lock_fd != -1)
+        mrcc_unlock(lock_fd);
+    if (ret != 0) {
+        errno = ret == EXIT_TIMEOUT ? ETIMEDOUT : EIO;
+        return -1;
+    }
+    return status;
+}
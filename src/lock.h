@@ -0,0 +1,23 @@
+// mrcc - A C Compiler system on MapReduce
+// Zhiqiang Ma, https://www.ericzma.com
+#pragma once
+
+// default number of hadoop client processes run at the same time
+#define MAX_CLIENT_TASKS 8
+
+int mrcc_trylock_slot(const char *what, int n_slots, int *lock_fd);
+int mrcc_lock_slot(const char *what, int n_slots, int *lock_fd);
+void mrcc_unlock(int lock_fd);
+
+int lock_local_cpp(int *lock_fd);
+int lock_local(int *lock_fd);
+int trylock_local(int *lock_fd);
+int lock_local_busy(int *n_slots);
+int lock_client(int *lock_fd);
+void lock_client_disable(void);
+
+int client_run(char **argv, const char *stdout_file,
+               const char *stderr_file);
+int client_run_mark(char **argv, const char *stdout_file,
+                    const char *stderr_file, const char *mark,
+                    long long *mark_us);
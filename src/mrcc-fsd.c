@@ -0,0 +1,552 @@
+//mrcc-fsd - part of mrcc
+//Zhiqiang Ma https://www.ericzma.com
+
+#include <stdarg.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <string.h>
+#include <time.h>
+#include <ctype.h>
+#include <assert.h>
+#include <fcntl.h>
+
+#include <sys/fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <signal.h>
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <sys/poll.h>
+
+#include <dirent.h>
+#include <sys/socket.h>
+
+#include "mrcc-fsd.h"
+#include "traceenv.h"
+#include "trace.h"
+#include "utils.h"
+#include "io.h"
+#include "http.h"
+#include "sockets.h"
+#include "stringutils.h"
+#include "tempfile.h"
+#include "webhdfs.h"
+
+/**
+ * @file
+ * @brief A stand-in WebHDFS server that keeps its files in a local
+ * directory.
+ *
+ * It speaks enough of the namenode and datanode protocol for mrcc's
+ * WebHDFS client, including the redirect of CREATE and OPEN to a
+ * "datanode", which is simply the same server again.  That makes it
+ * possible to test and benchmark the in-process file system client on
+ * a single machine with no cluster.
+ **/
+
+const char* mrcc_fsd_version = "0.1.0";
+
+const char* rs_program_name = "mrcc-fsd";
+
+// directory that holds the file system
+static const char* fsd_root = ".";
+
+static void fsd_show_version()
+{
+    printf(
+"mrcc-fsd %s built at %s, %s\n"
+"Copyright (C) 2009 by Zhiqiang Ma.\n"
+"mrcc-fsd comes with ABSOLUTELY NO WARRANTY. mrcc-fsd is free software,\n"
+"and you may use, modify and redistribute it under the terms of the GNU\n"
+"General Public License version 2.\n"
+"Please report bugs to eric.zq.ma [at] gmail.com.\n"
+"\n"
+        ,
+        mrcc_fsd_version, __TIME__, __DATE__);
+}
+
+static void fsd_show_usage()
+{
+    printf(
+"Usage:\n"
+"   mrcc-fsd [--root DIR] [--listen ADDR] [--port PORT]\n"
+"\n"
+"Options:\n"
+"   --root DIR                 keep the file system in DIR (default \".\")\n"
+"   --listen ADDR              address to listen on (default 127.0.0.1)\n"
+"   --port PORT                port to listen on (default %d)\n"
+"   --help                     explain usage and exit\n"
+"   --version                  show version and exit\n"
+"\n"
+"mrcc-fsd is part of mrcc.  It is a stand-in for the WebHDFS server of\n"
+"a Hadoop cluster, for testing and benchmarking mrcc without a cluster.\n"
+"Point mrcc at it with MRCC_WEBHDFS=ADDR:PORT.\n"
+        , WEBHDFS_DEFAULT_PORT);
+}
+
+static void fsd_show_help()
+{
+    fsd_show_version();
+    fsd_show_usage();
+}
+
+/* Decode %XX escapes in place. */
+static void fsd_unescape(char *s)
+{
+    char *o = s;
+    unsigned int c;
+
+    for (; *s; s++) {
+        if (*s == '%' && isxdigit((unsigned char) s[1])
+                && isxdigit((unsigned char) s[2])
+                && sscanf(s + 1, "%2x", &c) == 1) {
+            *o++ = (char) c;
+            s += 2;
+        } else {
+            *o++ = *s;
+        }
+    }
+    *o = '\0';
+}
+
+/**
+ * Look up query parameter @p name in @p query.
+ * Returns a malloc'd, decoded copy, or NULL if it is not there.
+ */
+static char *fsd_param(const char *query, const char *name)
+{
+    size_t n = strlen(name);
+    const char *p = query;
+    char *value;
+
+    while (p && *p) {
+        if (!strncmp(p, name, n) && p[n] == '=') {
+            p += n + 1;
+            value = strndup(p, strcspn(p, "&"));
+            if (value)
+                fsd_unescape(value);
+            return value;
+        }
+        p = strchr(p, '&');
+        if (p)
+            p++;
+    }
+    return NULL;
+}
+
+/**
+ * Map a WebHDFS path to a local filename under fsd_root.
+ * Returns NULL for paths that try to escape the root.
+ */
+static char *fsd_local_path(const char *path)
+{
+    char *local = NULL;
+
+    if (path[0] != '/' || strstr(path, "/../") || str_endswith("/..", path))
+        return NULL;
+    if (asprintf(&local, "%s%s", fsd_root, path) == -1)
+        return NULL;
+    return local;
+}
+
+/* Create every missing parent directory of @p fname. */
+static int fsd_mkparents(const char *fname)
+{
+    char *dir, *slash;
+    int ret = 0;
+
+    dir = strdup(fname);
+    if (dir == NULL)
+        return EXIT_OUT_OF_MEMORY;
+    slash = strrchr(dir, '/');
+    if (slash && slash != dir) {
+        *slash = '\0';
+        ret = mrcc_mkdir_p(dir);
+    }
+    free(dir);
+    return ret;
+}
+
+static int fsd_send_json(int fd, int status, const char *json)
+{
+    return http_send_response(fd, status,
+                              "Content-Type: application/json\r\n",
+                              json, strlen(json));
+}
+
+static int fsd_send_boolean(int fd, int value)
+{
+    return fsd_send_json(fd, 200, value ? "{\"boolean\":true}"
+                                        : "{\"boolean\":false}");
+}
+
+static int fsd_send_error(int fd, int status, const char *exception,
+                          const char *msg)
+{
+    char *json = NULL;
+    int ret;
+
+    if (asprintf(&json, "{\"RemoteException\":{\"exception\":\"%s\","
+                 "\"message\":\"%s\"}}", exception, msg) == -1)
+        return EXIT_OUT_OF_MEMORY;
+    ret = fsd_send_json(fd, status, json);
+    free(json);
+    return ret;
+}
+
+/* Redirect to ourselves as the "datanode". */
+static int fsd_redirect(struct http_conn *c, const char *host_hdr)
+{
+    char *loc = NULL;
+    int ret;
+
+    if (asprintf(&loc, "Location: http://%s%s&datanode=true\r\n",
+                 host_hdr, c->target) == -1)
+        return EXIT_OUT_OF_MEMORY;
+    ret = http_send_response(c->fd, 307, loc, NULL, 0);
+    free(loc);
+    return ret;
+}
+
+/* CREATE on the datanode side: store the body. */
+static int fsd_create(struct http_conn *c, const char *local)
+{
+    char *tmp = NULL;
+    int fd;
+    int ret;
+
+    if ((ret = fsd_mkparents(local)))
+        return fsd_send_error(c->fd, 500, "IOException", "mkdirs failed");
+    if (asprintf(&tmp, "%s.fsd_XXXXXX", local) == -1)
+        return EXIT_OUT_OF_MEMORY;
+    fd = mkstemp(tmp);
+    if (fd == -1) {
+        free(tmp);
+        return fsd_send_error(c->fd, 500, "IOException", strerror(errno));
+    }
+    fchmod(fd, 0644);
+
+    ret = http_read_body(c, fd, NULL, NULL);
+    if (mrcc_close(fd) && ret == 0)
+        ret = EXIT_IO_ERROR;
+    if (ret == 0 && rename(tmp, local) == -1)
+        ret = EXIT_IO_ERROR;
+    if (ret) {
+        unlink(tmp);
+        free(tmp);
+        return fsd_send_error(c->fd, 500, "IOException", "write failed");
+    }
+    free(tmp);
+    return http_send_response(c->fd, 201, NULL, NULL, 0);
+}
+
+/* OPEN on the datanode side: send the file. */
+static int fsd_open(struct http_conn *c, const char *local)
+{
+    char buf[65536];
+    off_t len;
+    ssize_t r;
+    int fd;
+    int ret;
+
+    if (open_read(local, &fd, &len) || fd == -1)
+        return fsd_send_error(c->fd, 404, "FileNotFoundException",
+                              "File does not exist");
+
+    ret = http_send_response(c->fd, 200,
+                             "Content-Type: application/octet-stream\r\n",
+                             NULL, len);
+    while (ret == 0 && len > 0) {
+        r = read(fd, buf, sizeof buf);
+        if (r <= 0) {
+            ret = EXIT_IO_ERROR;
+            break;
+        }
+        ret = writex(c->fd, buf, r);
+        len -= r;
+    }
+    close(fd);
+    return ret;
+}
+
+static int fsd_delete(struct http_conn *c, const char *local)
+{
+    struct stat st;
+
+    if (lstat(local, &st) == -1)
+        return fsd_send_boolean(c->fd, 0);
+    if (mrcc_remove_tree(local) == -1)
+        return fsd_send_error(c->fd, 500, "IOException", strerror(errno));
+    return fsd_send_boolean(c->fd, 1);
+}
+
+/*
+ * Move @p from to @p to unless @p to is there, as RENAME does on HDFS.
+ * Files are moved with link(), as rename() would replace @p to; the
+ * check for a directory is racy, but it is only a stand-in.
+ */
+static int fsd_move(const char *from, const char *to)
+{
+    struct stat st;
+
+    if (lstat(from, &st) == -1)
+        return -1;
+    if (!S_ISDIR(st.st_mode)) {
+        if (link(from, to) == -1)
+            return -1;
+        return unlink(from);
+    }
+    if (lstat(to, &st) == 0) {
+        errno = EEXIST;
+        return -1;
+    }
+    return rename(from, to);
+}
+
+static int fsd_rename(struct http_conn *c, const char *local, const char *query)
+{
+    char *dest, *local_dest;
+    int ok;
+
+    dest = fsd_param(query, "destination");
+    local_dest = dest ? fsd_local_path(dest) : NULL;
+    free(dest);
+    if (local_dest == NULL)
+        return fsd_send_error(c->fd, 400, "IllegalArgumentException",
+                              "bad destination");
+    ok = (fsd_mkparents(local_dest) == 0 && fsd_move(local, local_dest) == 0);
+    free(local_dest);
+    return fsd_send_boolean(c->fd, ok);
+}
+
+/* Append one FileStatus JSON object for @p st to @p json. */
+static int fsd_append_status(char **json, const char *suffix,
+                             const struct stat *st, int first)
+{
+    char *grown = NULL;
+    int ret;
+
+    ret = asprintf(&grown, "%s%s{\"accessTime\":%lld,\"blockSize\":0,"
+                   "\"group\":\"\",\"length\":%lld,"
+                   "\"modificationTime\":%lld,\"owner\":\"\","
+                   "\"pathSuffix\":\"%s\",\"permission\":\"%o\","
+                   "\"replication\":1,\"type\":\"%s\"}",
+                   *json ? *json : "", first ? "" : ",",
+                   (long long) st->st_atime * 1000,
+                   S_ISDIR(st->st_mode) ? 0LL : (long long) st->st_size,
+                   (long long) st->st_mtime * 1000,
+                   suffix, (unsigned) (st->st_mode & 0777),
+                   S_ISDIR(st->st_mode) ? "DIRECTORY" : "FILE");
+    if (ret == -1)
+        return EXIT_OUT_OF_MEMORY;
+    free(*json);
+    *json = grown;
+    return 0;
+}
+
+static int fsd_liststatus(struct http_conn *c, const char *local)
+{
+    char *json = NULL, *reply = NULL, *child = NULL;
+    struct dirent *de;
+    struct stat st;
+    DIR *dir;
+    int first = 1;
+    int ret = 0;
+
+    if (stat(local, &st) == -1)
+        return fsd_send_error(c->fd, 404, "FileNotFoundException",
+                              "File does not exist");
+    if (!S_ISDIR(st.st_mode)) {
+        ret = fsd_append_status(&json, "", &st, 1);
+    } else if ((dir = opendir(local)) != NULL) {
+        while (ret == 0 && (de = readdir(dir)) != NULL) {
+            if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+                continue;
+            if (asprintf(&child, "%s/%s", local, de->d_name) == -1) {
+                ret = EXIT_OUT_OF_MEMORY;
+                break;
+            }
+            if (lstat(child, &st) == 0) {
+                ret = fsd_append_status(&json, de->d_name, &st, first);
+                first = 0;
+            }
+            free(child);
+        }
+        closedir(dir);
+    }
+    if (ret)
+        return ret;
+
+    if (asprintf(&reply, "{\"FileStatuses\":{\"FileStatus\":[%s]}}",
+                 json ? json : "") == -1)
+        ret = EXIT_OUT_OF_MEMORY;
+    else
+        ret = fsd_send_json(c->fd, 200, reply);
+    free(json);
+    free(reply);
+    return ret;
+}
+
+static int fsd_getfilestatus(struct http_conn *c, const char *local)
+{
+    char *json = NULL, *reply = NULL;
+    struct stat st;
+    int ret;
+
+    if (stat(local, &st) == -1)
+        return fsd_send_error(c->fd, 404, "FileNotFoundException",
+                              "File does not exist");
+    if ((ret = fsd_append_status(&json, "", &st, 1)))
+        return ret;
+    if (asprintf(&reply, "{\"FileStatus\":%s}", json) == -1)
+        ret = EXIT_OUT_OF_MEMORY;
+    else
+        ret = fsd_send_json(c->fd, 200, reply);
+    free(json);
+    free(reply);
+    return ret;
+}
+
+/**
+ * Serve a single request on @p fd, which is closed on return.
+ */
+static int fsd_serve(int fd, const char *self)
+{
+    struct http_conn c;
+    char *path, *query, *op = NULL, *local = NULL, *datanode;
+    int ret;
+
+    http_init(&c, fd);
+    sock_set_timeout(fd, 300);
+
+    if ((ret = http_read_request(&c)))
+        goto out;
+
+    if (!str_startswith("/webhdfs/v1/", c.target)) {
+        ret = fsd_send_error(fd, 404, "IllegalArgumentException",
+                             "not a webhdfs path");
+        goto out;
+    }
+    path = strdup(c.target + strlen("/webhdfs/v1"));
+    if (path == NULL) {
+        ret = EXIT_OUT_OF_MEMORY;
+        goto out;
+    }
+    query = strchr(path, '?');
+    if (query)
+        *query++ = '\0';
+    fsd_unescape(path);
+
+    op = fsd_param(query, "op");
+    datanode = fsd_param(query, "datanode");
+    local = fsd_local_path(path);
+    rs_trace("%s %s on \"%s\"", c.method, op ? op : "(none)",
+             local ? local : path);
+
+    if (op == NULL || local == NULL) {
+        http_read_body(&c, -1, NULL, NULL);
+        ret = fsd_send_error(fd, 400, "IllegalArgumentException",
+                             "bad request");
+    } else if (!strcmp(op, "CREATE") && !strcmp(c.method, "PUT")) {
+        if (datanode == NULL) {
+            http_read_body(&c, -1, NULL, NULL);
+            ret = fsd_redirect(&c, c.host ? c.host : self);
+        } else {
+            ret = fsd_create(&c, local);
+        }
+    } else if (!strcmp(op, "OPEN") && !strcmp(c.method, "GET")) {
+        if (datanode == NULL)
+            ret = fsd_redirect(&c, c.host ? c.host : self);
+        else
+            ret = fsd_open(&c, local);
+    } else if (!strcmp(op, "DELETE") && !strcmp(c.method, "DELETE")) {
+        ret = fsd_delete(&c, local);
+    } else if (!strcmp(op, "RENAME") && !strcmp(c.method, "PUT")) {
+        ret = fsd_rename(&c, local, query);
+    } else if (!strcmp(op, "MKDIRS") && !strcmp(c.method, "PUT")) {
+        ret = fsd_send_boolean(fd, mrcc_mkdir_p(local) == 0);
+    } else if (!strcmp(op, "LISTSTATUS") && !strcmp(c.method, "GET")) {
+        ret = fsd_liststatus(&c, local);
+    } else if (!strcmp(op, "GETFILESTATUS") && !strcmp(c.method, "GET")) {
+        ret = fsd_getfilestatus(&c, local);
+    } else {
+        http_read_body(&c, -1, NULL, NULL);
+        ret = fsd_send_error(fd, 400, "UnsupportedOperationException", op);
+    }
+
+    free(path);
+    free(datanode);
+out:
+    free(op);
+    free(local);
+    http_close(&c);
+    return ret;
+}
+
+int main(int argc, char* argv[])
+{
+    const char *listen_addr = "127.0.0.1";
+    int port = WEBHDFS_DEFAULT_PORT;
+    char *self = NULL;
+    int listen_fd, fd;
+    pid_t pid;
+    int i;
+
+    for (i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--help")) {
+            fsd_show_help();
+            return 0;
+        } else if (!strcmp(argv[i], "--version")) {
+            fsd_show_version();
+            return 0;
+        } else if (!strcmp(argv[i], "--root") && i + 1 < argc) {
+            fsd_root = argv[++i];
+        } else if (!strcmp(argv[i], "--listen") && i + 1 < argc) {
+            listen_addr = argv[++i];
+        } else if (!strcmp(argv[i], "--port") && i + 1 < argc) {
+            port = atoi(argv[++i]);
+        } else {
+            fsd_show_usage();
+            return EXIT_BAD_ARGUMENTS;
+        }
+    }
+
+    set_trace_from_env();
+    trace_version();
+    ignore_sigpipe(1);
+    /* children are reaped automatically */
+    signal(SIGCHLD, SIG_IGN);
+
+    if (mrcc_mkdir_p(fsd_root) != 0)
+        return EXIT_IO_ERROR;
+    if (sock_listen(listen_addr, port, &listen_fd) != 0)
+        return EXIT_BIND_FAILED;
+    if (asprintf(&self, "%s:%d", listen_addr, port) == -1)
+        return EXIT_OUT_OF_MEMORY;
+
+    rs_log_notice("serving \"%s\" on %s", fsd_root, self);
+
+    while (1) {
+        fd = accept(listen_fd, NULL, NULL);
+        if (fd == -1) {
+            if (errno != EINTR)
+                rs_log_error("accept failed: %s", strerror(errno));
+            continue;
+        }
+        pid = fork();
+        if (pid == 0) {
+            close(listen_fd);
+            _exit(fsd_serve(fd, self) ? EXIT_IO_ERROR : 0);
+        }
+        if (pid == -1)
+            rs_log_error("failed to fork: %s", strerror(errno));
+        close(fd);
+    }
+}
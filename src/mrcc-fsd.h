@@ -0,0 +1,5 @@
+#pragma once
+
+extern const char* rs_program_name;
+
+int main(int argc, char* argv[]);
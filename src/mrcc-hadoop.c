@@ -0,0 +1,1240 @@
+//mrcc-hadoop - part of mrcc
+//Zhiqiang Ma https://www.ericzma.com
+
+#include <stdarg.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <string.h>
+#include <time.h>
+#include <ctype.h>
+#include <assert.h>
+#include <fcntl.h>
+
+#include <sys/fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <signal.h>
+
+#include <sys/wait.h>
+
+#include <dirent.h>
+
+#include "mrcc-hadoop.h"
+#include "traceenv.h"
+#include "trace.h"
+#include "utils.h"
+#include "io.h"
+#include "exec.h"
+#include "files.h"
+#include "lock.h"
+#include "stringutils.h"
+#include "tempfile.h"
+
+/**
+ * @file
+ * @brief A Hadoop cluster emulated on this machine, behind the command
+ * line of the hadoop client.
+ *
+ * With MRCC_HADOOP=mrcc-hadoop and MRCC_MAPPER=mrcc-map, mrcc runs it
+ * wherever it would run hadoop, so that the whole client path can be
+ * tried out and loaded on one machine with no cluster.  It does what
+ * mrcc asks of hadoop, and no more:
+ *  - "dfs -put/-get/-cat/-rmr/-mv/-mkdir/-ls" on a directory standing
+ *    in for HDFS, $MRCC_EMU_DIR/dfs, with relative names under
+ *    /user/$MRCC_WEBHDFS_USER as on HDFS;
+ *  - "jar STREAMING_JAR ... -mapper CMD -input IN -output OUT", a
+ *    streaming job with no reducers, whose map tasks run here;
+ *  - "job -kill JOBID".
+ *
+ * As on HDFS, a file appears whole or not at all, and is not put or
+ * moved over one that is there.  A job says "Running job: JOBID" once
+ * it is submitted, and fails if its output directory exists.  Its map
+ * tasks get "OFFSET\tLINE" for each line of their split with
+ * NLineInputFormat, or the lines alone otherwise; "-input null", if
+ * there is no such file, is one empty line.  They run on the "emu_map"
+ * slots of lock.c, $MRCC_EMU_SLOTS of them, write their output to
+ * OUT/part-NNNNN and their errors to $MRCC_EMU_DIR/logs/JOBID.  A task
+ * is run with MRCC_DIR=$MRCC_EMU_DIR/tasktracker, as on a machine of
+ * its own, so that its mrcc-map does not wait for the client slots the
+ * mrcc that submitted the job holds.
+ *
+ * Three knobs make it behave more like a cluster:
+ *  - MRCC_EMU_LATENCY=MS[,JOB_MS]: every command and every task attempt
+ *    starts MS late, as a JVM would, and a job waits JOB_MS more
+ *    (default MS) before its tasks are scheduled;
+ *  - MRCC_EMU_BANDWIDTH=MB: put, get and cat move at most MB megabytes
+ *    a second;
+ *  - MRCC_EMU_FAIL=PERCENT: that many dfs commands fail, and that many
+ *    task attempts are lost before their mapper starts.  A task is
+ *    tried EMU_MAX_ATTEMPTS times, like mapred.map.max.attempts.
+ **/
+
+const char* mrcc_hadoop_version = "0.1.0";
+
+const char* rs_program_name = "mrcc-hadoop";
+
+// times a map task is tried before its job fails
+#define EMU_MAX_ATTEMPTS 4
+
+// lock.c budget of the map slots
+static const char* emu_slot_name = "emu_map";
+
+// what the emulated cluster keeps, absolute, and its dfs
+static char* emu_dir = NULL;
+static char* emu_dfs = NULL;
+
+// owner of the files, and home of relative names
+static const char* emu_user = "mrcc";
+
+static long emu_latency_ms = 0;
+static long emu_job_latency_ms = 0;
+
+// bytes per second, or 0 for no limit
+static double emu_bandwidth = 0;
+
+// percent of commands and task attempts that fail
+static double emu_fail = 0;
+
+static int emu_slots = 1;
+
+// the task runners of the job under way, for emu_job_killed()
+static pid_t* emu_tasks = NULL;
+static int emu_n_tasks = 0;
+static char* emu_job_file = NULL;
+
+static void emu_show_version()
+{
+    printf(
+"mrcc-hadoop %s built at %s, %s\n"
+"Copyright (C) 2009 by Zhiqiang Ma.\n"
+"mrcc-hadoop comes with ABSOLUTELY NO WARRANTY. mrcc-hadoop is free\n"
+"software, and you may use, modify and redistribute it under the terms\n"
+"of the GNU General Public License version 2.\n"
+"Please report bugs to eric.zq.ma [at] gmail.com.\n"
+"\n"
+        ,
+        mrcc_hadoop_version, __TIME__, __DATE__);
+}
+
+static void emu_show_usage()
+{
+    printf(
+"Usage:\n"
+"   mrcc-hadoop dfs -put LOCAL|- NAME\n"
+"   mrcc-hadoop dfs -get NAME LOCAL\n"
+"   mrcc-hadoop dfs -cat NAME ...\n"
+"   mrcc-hadoop dfs -rmr NAME ...\n"
+"   mrcc-hadoop dfs -mv NAME NEWNAME\n"
+"   mrcc-hadoop dfs -mkdir NAME\n"
+"   mrcc-hadoop dfs -ls NAME\n"
+"   mrcc-hadoop jar JAR [-D KEY=VALUE] [-inputformat CLASS] -mapper CMD\n"
+"               [-numReduceTasks 0] -input NAME -output NAME\n"
+"   mrcc-hadoop job -kill JOBID\n"
+"\n"
+"Options:\n"
+"   --help                     explain usage and exit\n"
+"   --version                  show version and exit\n"
+"\n"
+"Environment variables:\n"
+"   MRCC_EMU_DIR               where the emulated cluster keeps its files\n"
+"                              and logs (default $MRCC_DIR/emu)\n"
+"   MRCC_EMU_SLOTS             map tasks run at once (default: number\n"
+"                              of CPUs)\n"
+"   MRCC_EMU_LATENCY=MS[,JOB_MS]\n"
+"                              start every command and task attempt MS\n"
+"                              milliseconds late, and the tasks of a job\n"
+"                              JOB_MS more (default MS)\n"
+"   MRCC_EMU_BANDWIDTH=MB      move files at most MB megabytes a second\n"
+"   MRCC_EMU_FAIL=PERCENT      fail that many dfs commands and map task\n"
+"                              attempts\n"
+"   MRCC_WEBHDFS_USER          home of relative names (default $USER)\n"
+"\n"
+"mrcc-hadoop is part of mrcc.  It is a stand-in for the hadoop client\n"
+"and the cluster behind it, for testing and loading mrcc on a single\n"
+"machine.  Point mrcc at it with MRCC_HADOOP=mrcc-hadoop and\n"
+"MRCC_MAPPER=mrcc-map.\n"
+        );
+}
+
+static void emu_show_help()
+{
+    emu_show_version();
+    emu_show_usage();
+}
+
+/* $name as a number, or @p dflt if it is not set. */
+static double emu_getenv_number(const char* name, double dflt, char** rest)
+{
+    const char* e = getenv(name);
+    char* end;
+    double v;
+
+    if (rest)
+        *rest = NULL;
+    if (e == NULL || e[0] == '\0')
+        return dflt;
+    v = strtod(e, &end);
+    if (end == e || v < 0 || (*end && (rest == NULL || *end != ','))) {
+        rs_log_warning("bad %s \"%s\", using %g", name, e, dflt);
+        return dflt;
+    }
+    if (rest && *end == ',')
+        *rest = end + 1;
+    return v;
+}
+
+/* Read the configuration and find the emulated cluster. */
+static int emu_init(void)
+{
+    const char* e;
+    char* dir = NULL;
+    char* top;
+    char* rest;
+    long ncpus;
+    int ret;
+
+    if ((e = getenv("MRCC_EMU_DIR")) && e[0]) {
+        dir = strdup(e);
+    } else {
+        if ((ret = get_top_dir(&top)))
+            return ret;
+        if (asprintf(&dir, "%s/emu", top) == -1)
+            dir = NULL;
+    }
+    if (dir == NULL)
+        return EXIT_OUT_OF_MEMORY;
+    if ((ret = mrcc_mkdir_p(dir))) {
+        free(dir);
+        return ret;
+    }
+    /* the tasks run with another MRCC_DIR, and maybe elsewhere */
+    emu_dir = realpath(dir, NULL);
+    free(dir);
+    if (emu_dir == NULL) {
+        rs_log_error("failed to find emulator directory: %s", strerror(errno));
+        return EXIT_IO_ERROR;
+    }
+    if (asprintf(&emu_dfs, "%s/dfs", emu_dir) == -1)
+        return EXIT_OUT_OF_MEMORY;
+
+    if ((e = getenv("MRCC_WEBHDFS_USER")) && e[0])
+        emu_user = e;
+    else if ((e = getenv("USER")) && e[0])
+        emu_user = e;
+    else if ((e = getenv("LOGNAME")) && e[0])
+        emu_user = e;
+
+    emu_latency_ms = (long) emu_getenv_number("MRCC_EMU_LATENCY", 0, &rest);
+    emu_job_latency_ms = rest ? atol(rest) : emu_latency_ms;
+    emu_bandwidth = emu_getenv_number("MRCC_EMU_BANDWIDTH", 0, NULL)
+        * 1024 * 1024;
+    emu_fail = emu_getenv_number("MRCC_EMU_FAIL", 0, NULL);
+    if (emu_fail > 100)
+        emu_fail = 100;
+    ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    emu_slots = (int) emu_getenv_number("MRCC_EMU_SLOTS",
+                                        ncpus < 1 ? 1 : ncpus, NULL);
+    if (emu_slots < 1)
+        emu_slots = 1;
+
+    srand((unsigned) (time(NULL) ^ (getpid() << 16)));
+    return 0;
+}
+
+static void emu_sleep_ms(long ms)
+{
+    struct timespec ts;
+
+    if (ms <= 0)
+        return;
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = (ms % 1000) * 1000000;
+    while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+        ;
+}
+
+/* Does the next thing fail, MRCC_EMU_FAIL percent of the time? */
+static int emu_fails(void)
+{
+    return emu_fail > 0
+        && rand() < emu_fail / 100 * ((double) RAND_MAX + 1);
+}
+
+/**
+ * The absolute dfs name of @p name, or NULL for names that try to
+ * escape the dfs.
+ */
+static char* emu_dfs_name(const char* name)
+{
+    char* abs = NULL;
+
+    if (!strcmp(name, "..") || str_startswith("../", name)
+            || strstr(name, "/../") || str_endswith("/..", name))
+        return NULL;
+    if (name[0] == '/')
+        return strdup(name);
+    if (asprintf(&abs, "/user/%s/%s", emu_user, name) == -1)
+        return NULL;
+    return abs;
+}
+
+/* The local filename of dfs name @p name, see emu_dfs_name(). */
+static char* emu_path(const char* name)
+{
+    char* abs;
+    char* local = NULL;
+
+    if ((abs = emu_dfs_name(name)) == NULL) {
+        rs_log_error("bad dfs name \"%s\"", name);
+        return NULL;
+    }
+    if (asprintf(&local, "%s%s", emu_dfs, abs) == -1)
+        local = NULL;
+    free(abs);
+    return local;
+}
+
+/* Create every missing parent directory of @p fname. */
+static int emu_mkparents(const char* fname)
+{
+    char* dir;
+    char* slash;
+    int ret = 0;
+
+    if ((dir = strdup(fname)) == NULL)
+        return EXIT_OUT_OF_MEMORY;
+    slash = strrchr(dir, '/');
+    if (slash && slash != dir) {
+        *slash = '\0';
+        ret = mrcc_mkdir_p(dir);
+    }
+    free(dir);
+    return ret;
+}
+
+/* @p dir/basename of @p name if @p dir is a directory, else @p dir. */
+static char* emu_into_dir(const char* dir, const char* name)
+{
+    struct stat st;
+    char* into = NULL;
+
+    if (stat(dir, &st) == 0 && S_ISDIR(st.st_mode)) {
+        if (asprintf(&into, "%s/%s", dir, find_basename(name)) == -1)
+            return NULL;
+        return into;
+    }
+    return strdup(dir);
+}
+
+/* Copy @p in_fd to @p out_fd, no faster than MRCC_EMU_BANDWIDTH. */
+static int emu_copy(int in_fd, int out_fd)
+{
+    char buf[65536];
+    struct timeval start, now;
+    long long bytes = 0;
+    double late_ms;
+    ssize_t n;
+    int ret;
+
+    gettimeofday(&start, NULL);
+    while ((n = read(in_fd, buf, sizeof buf)) != 0) {
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            rs_log_error("failed to read: %s", strerror(errno));
+            return EXIT_IO_ERROR;
+        }
+        if ((ret = writex(out_fd, buf, n)))
+            return ret;
+        bytes += n;
+        if (emu_bandwidth > 0) {
+            gettimeofday(&now, NULL);
+            late_ms = bytes / emu_bandwidth * 1000
+                - ((now.tv_sec - start.tv_sec) * 1000.0
+                   + (now.tv_usec - start.tv_usec) / 1000.0);
+            emu_sleep_ms((long) late_ms);
+        }
+    }
+    return 0;
+}
+
+/* Copy @p in_fd to the new file @p fname, which appears once complete. */
+static int emu_copy_to(int in_fd, const char* fname, int replace)
+{
+    char* tmp = NULL;
+    int out_fd;
+    int ret;
+
+    if (asprintf(&tmp, "%s._COPYING_%ld", fname, (long) getpid()) == -1)
+        return EXIT_OUT_OF_MEMORY;
+    out_fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (out_fd == -1) {
+        rs_log_error("failed to create %s: %s", tmp, strerror(errno));
+        free(tmp);
+        return EXIT_IO_ERROR;
+    }
+    ret = emu_copy(in_fd, out_fd);
+    if (close(out_fd) == -1 && ret == 0) {
+        rs_log_error("failed to write %s: %s", tmp, strerror(errno));
+        ret = EXIT_IO_ERROR;
+    }
+    if (ret == 0 && replace && rename(tmp, fname) == -1) {
+        rs_log_error("failed to rename %s: %s", tmp, strerror(errno));
+        ret = EXIT_IO_ERROR;
+    }
+    /* link() rather than rename(), which would replace the file */
+    if (ret == 0 && !replace && link(tmp, fname) == -1) {
+        if (errno == EEXIST)
+            rs_log_error("Target %s already exists", fname + strlen(emu_dfs));
+        else
+            rs_log_error("failed to create %s: %s", fname, strerror(errno));
+        ret = EXIT_IO_ERROR;
+    }
+    if (ret != 0 || !replace)
+        unlink(tmp);
+    free(tmp);
+    return ret;
+}
+
+/* dfs -put @p src, or stdin for "-", to @p dst */
+static int emu_put(const char* src, const char* dst)
+{
+    char* local;
+    char* fname = NULL;
+    int in_fd = STDIN_FILENO;
+    int ret;
+
+    if ((local = emu_path(dst)) == NULL)
+        return EXIT_BAD_ARGUMENTS;
+    fname = strcmp(src, "-") ? emu_into_dir(local, src) : strdup(local);
+    free(local);
+    if (fname == NULL)
+        return EXIT_OUT_OF_MEMORY;
+
+    if (strcmp(src, "-") && (in_fd = open(src, O_RDONLY | O_CLOEXEC)) == -1) {
+        rs_log_error("failed to open %s: %s", src, strerror(errno));
+        ret = EXIT_NO_SUCH_FILE;
+        goto out;
+    }
+    if ((ret = emu_mkparents(fname)))
+        goto out;
+    ret = emu_copy_to(in_fd, fname, 0);
+
+out:
+    if (in_fd != STDIN_FILENO && in_fd != -1)
+        close(in_fd);
+    free(fname);
+    return ret;
+}
+
+/* dfs -get @p src to the local file @p dst */
+static int emu_get(const char* src, const char* dst)
+{
+    char* local;
+    char* fname = NULL;
+    int in_fd;
+    int ret;
+
+    if ((local = emu_path(src)) == NULL)
+        return EXIT_BAD_ARGUMENTS;
+    if ((in_fd = open(local, O_RDONLY | O_CLOEXEC)) == -1) {
+        rs_log_error("File %s does not exist", src);
+        free(local);
+        return EXIT_NO_SUCH_FILE;
+    }
+    if ((fname = emu_into_dir(dst, src)) == NULL)
+        ret = EXIT_OUT_OF_MEMORY;
+    else
+        ret = emu_copy_to(in_fd, fname, 1);
+    close(in_fd);
+    free(fname);
+    free(local);
+    return ret;
+}
+
+/* dfs -cat @p name to stdout */
+static int emu_cat(const char* name)
+{
+    char* local;
+    int in_fd;
+    int ret;
+
+    if ((local = emu_path(name)) == NULL)
+        return EXIT_BAD_ARGUMENTS;
+    if ((in_fd = open(local, O_RDONLY | O_CLOEXEC)) == -1) {
+        rs_log_error("File %s does not exist", name);
+        free(local);
+        return EXIT_NO_SUCH_FILE;
+    }
+    ret = emu_copy(in_fd, STDOUT_FILENO);
+    close(in_fd);
+    free(local);
+    return ret;
+}
+
+/* dfs -rmr @p name; what is not there is gone already */
+static int emu_rmr(const char* name)
+{
+    struct stat st;
+    char* local;
+    int ret = 0;
+
+    if ((local = emu_path(name)) == NULL)
+        return EXIT_BAD_ARGUMENTS;
+    if (lstat(local, &st) == 0 && mrcc_remove_tree(local) == -1
+            && errno != ENOENT) {
+        rs_log_error("failed to remove %s: %s", name, strerror(errno));
+        ret = EXIT_IO_ERROR;
+    }
+    free(local);
+    return ret;
+}
+
+/* dfs -mv @p src to @p dst, or into it if it is a directory */
+static int emu_mv(const char* src, const char* dst)
+{
+    struct stat st;
+    char* from;
+    char* local;
+    char* to = NULL;
+    int ret = 0;
+
+    from = emu_path(src);
+    local = emu_path(dst);
+    if (from == NULL || local == NULL) {
+        ret = EXIT_BAD_ARGUMENTS;
+        goto out;
+    }
+    if (lstat(from, &st) == -1) {
+        rs_log_error("File %s does not exist", src);
+        ret = EXIT_NO_SUCH_FILE;
+        goto out;
+    }
+    if ((to = emu_into_dir(local, src)) == NULL) {
+        ret = EXIT_OUT_OF_MEMORY;
+        goto out;
+    }
+    if (lstat(to, &st) == 0) {
+        rs_log_error("Failed to rename %s to %s: it exists", src, dst);
+        ret = EXIT_IO_ERROR;
+        goto out;
+    }
+    if ((ret = emu_mkparents(to)))
+        goto out;
+    if (rename(from, to) == -1) {
+        rs_log_error("Failed to rename %s to %s: %s", src, dst,
+                     strerror(errno));
+        ret = EXIT_IO_ERROR;
+    }
+
+out:
+    free(to);
+    free(local);
+    free(from);
+    return ret;
+}
+
+/* dfs -mkdir @p name */
+static int emu_mkdir(const char* name)
+{
+    char* local;
+    int ret;
+
+    if ((local = emu_path(name)) == NULL)
+        return EXIT_BAD_ARGUMENTS;
+    ret = mrcc_mkdir_p(local);
+    free(local);
+    return ret;
+}
+
+/* Print the -ls line of the local file @p local, dfs name @p name. */
+static void emu_ls_line(const char* local, const char* name)
+{
+    struct stat st;
+    struct tm* tm;
+    char when[32];
+    int is_dir;
+
+    if (stat(local, &st) == -1)
+        return;
+    is_dir = S_ISDIR(st.st_mode);
+    tm = localtime(&st.st_mtime);
+    if (tm == NULL || strftime(when, sizeof when, "%Y-%m-%d %H:%M", tm) == 0)
+        strcpy(when, "1970-01-01 00:00");
+    printf("%s   %s %s supergroup %10lld %s %s\n",
+           is_dir ? "drwxr-xr-x" : "-rw-r--r--", is_dir ? "-" : "3",
+           emu_user, is_dir ? 0LL : (long long) st.st_size, when, name);
+}
+
+static int emu_cmp_names(const void* a, const void* b)
+{
+    return strcmp(*(char* const*) a, *(char* const*) b);
+}
+
+/* dfs -ls @p name, in the format of hadoop 0.20 */
+static int emu_ls(const char* name)
+{
+    struct dirent* de;
+    struct stat st;
+    char** names = NULL;
+    char** grown;
+    char* abs;
+    char* local;
+    char* child_local;
+    char* child;
+    DIR* dir;
+    int n = 0, size = 0;
+    int i;
+    int ret = 0;
+
+    abs = emu_dfs_name(name);
+    local = emu_path(name);
+    if (abs == NULL || local == NULL) {
+        ret = EXIT_BAD_ARGUMENTS;
+        goto out;
+    }
+    if (stat(local, &st) == -1) {
+        rs_log_error("Cannot access %s: No such file or directory.", name);
+        ret = EXIT_NO_SUCH_FILE;
+        goto out;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        printf("Found 1 items\n");
+        emu_ls_line(local, abs);
+        goto out;
+    }
+
+    if ((dir = opendir(local)) == NULL) {
+        rs_log_error("failed to list %s: %s", local, strerror(errno));
+        ret = EXIT_IO_ERROR;
+        goto out;
+    }
+    while ((de = readdir(dir)) != NULL) {
+        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+            continue;
+        if (n == size) {
+            size = size ? size * 2 : 64;
+            if ((grown = realloc(names, size * sizeof *names)) == NULL) {
+                ret = EXIT_OUT_OF_MEMORY;
+                break;
+            }
+            names = grown;
+        }
+        if ((names[n] = strdup(de->d_name)) == NULL) {
+            ret = EXIT_OUT_OF_MEMORY;
+            break;
+        }
+        n++;
+    }
+    closedir(dir);
+    if (ret != 0)
+        goto out;
+
+    qsort(names, n, sizeof *names, emu_cmp_names);
+    printf("Found %d items\n", n);
+    for (i = 0; i < n; i++) {
+        child = child_local = NULL;
+        if (asprintf(&child, "%s%s%s", abs, str_endswith("/", abs) ? "" : "/",
+                     names[i]) == -1
+                || asprintf(&child_local, "%s%s", emu_dfs, child) == -1) {
+            free(child);
+            ret = EXIT_OUT_OF_MEMORY;
+            goto out;
+        }
+        emu_ls_line(child_local, child);
+        free(child_local);
+        free(child);
+    }
+
+out:
+    for (i = 0; i < n; i++)
+        free(names[i]);
+    free(names);
+    free(local);
+    free(abs);
+    return ret;
+}
+
+/* hadoop dfs OP ARGS... */
+static int emu_dfs_command(int argc, char* argv[])
+{
+    const char* op = argc > 0 ? argv[0] : "";
+    int i;
+    int ret = 0;
+
+    emu_sleep_ms(emu_latency_ms);
+    if (emu_fails()) {
+        rs_log_error("%s: emulated failure", op);
+        return EXIT_IO_ERROR;
+    }
+
+    if (!strcmp(op, "-put") && argc == 3)
+        return emu_put(argv[1], argv[2]);
+    if ((!strcmp(op, "-get") || !strcmp(op, "-copyToLocal")) && argc == 3)
+        return emu_get(argv[1], argv[2]);
+    if (!strcmp(op, "-mv") && argc == 3)
+        return emu_mv(argv[1], argv[2]);
+    if (!strcmp(op, "-mkdir") && argc == 2)
+        return emu_mkdir(argv[1]);
+    if (!strcmp(op, "-ls") && argc == 2)
+        return emu_ls(argv[1]);
+    if ((!strcmp(op, "-cat") || !strcmp(op, "-rmr")) && argc > 1) {
+        for (i = 1; i < argc; i++) {
+            int r = op[1] == 'c' ? emu_cat(argv[i]) : emu_rmr(argv[i]);
+            if (r != 0)
+                ret = r;
+        }
+        return ret;
+    }
+    rs_log_error("unsupported dfs command \"%s\" with %d arguments",
+                 op, argc - 1);
+    return EXIT_BAD_ARGUMENTS;
+}
+
+/* Say @p msg the way the streaming client logs. */
+static void emu_job_log(const char* level, const char* msg, const char* arg)
+{
+    char when[32];
+    time_t now = time(NULL);
+    struct tm* tm = localtime(&now);
+
+    if (tm == NULL || strftime(when, sizeof when, "%y/%m/%d %H:%M:%S", tm) == 0)
+        when[0] = '\0';
+    fprintf(stderr, "%s %s streaming.StreamJob: %s%s\n", when, level, msg,
+            arg ? arg : "");
+    fflush(stderr);
+}
+
+/* Split the mapper command line into its words, as streaming does. */
+static char** emu_split_words(char* cmd)
+{
+    char** words;
+    char* p;
+    int n = 0;
+
+    if ((words = malloc((strlen(cmd) / 2 + 2) * sizeof *words)) == NULL)
+        return NULL;
+    for (p = strtok(cmd, " \t\n"); p; p = strtok(NULL, " \t\n"))
+        words[n++] = p;
+    words[n] = NULL;
+    return words;
+}
+
+/* The input of one map task. */
+struct emu_split {
+    char* data;
+    size_t len;
+};
+
+/**
+ * Cut @p data, @p len bytes, into the splits of the map tasks: one
+ * each @p lines lines, with the byte offset of each line before it,
+ * or, if @p lines is 0, a single one of the lines as they are.
+ */
+static int emu_make_splits(const char* data, size_t len, int lines,
+                           struct emu_split** splits_ret, int* n_ret)
+{
+    struct emu_split* splits;
+    size_t off, end, size;
+    int n = 0, in_split = 0;
+
+    /* at most one split a line */
+    if ((splits = calloc(len + 1, sizeof *splits)) == NULL)
+        return EXIT_OUT_OF_MEMORY;
+    if (lines <= 0) {
+        if (len > 0) {
+            splits[0].data = malloc(len);
+            if (splits[0].data == NULL) {
+                free(splits);
+                return EXIT_OUT_OF_MEMORY;
+            }
+            memcpy(splits[0].data, data, len);
+            splits[0].len = len;
+            n = 1;
+        }
+        *splits_ret = splits;
+        *n_ret = n;
+        return 0;
+    }
+
+    for (off = 0; off < len; off = end) {
+        struct emu_split* s;
+        char* grown;
+
+        for (end = off; end < len && data[end] != '\n'; end++)
+            ;
+        if (end < len)
+            end++;
+        if (in_split == 0)
+            n++;
+        s = &splits[n - 1];
+        size = s->len + 24 + (end - off) + 1;
+        if ((grown = realloc(s->data, size)) == NULL)
+            goto oom;
+        s->data = grown;
+        s->len += sprintf(s->data + s->len, "%lu\t", (unsigned long) off);
+        memcpy(s->data + s->len, data + off, end - off);
+        s->len += end - off;
+        if (s->data[s->len - 1] != '\n')
+            s->data[s->len++] = '\n';
+        in_split = (in_split + 1) % lines;
+    }
+    *splits_ret = splits;
+    *n_ret = n;
+    return 0;
+
+oom:
+    while (n-- > 0)
+        free(splits[n].data);
+    free(splits);
+    return EXIT_OUT_OF_MEMORY;
+}
+
+/* A streaming job. */
+struct emu_job {
+    char id[64];
+    const char* mapper;
+    char* output;           // local name of its output directory
+    char* log_dir;
+    char* tasktracker;      // MRCC_DIR of its tasks
+};
+
+/**
+ * Run attempt @p attempt of map task @p task of @p job on @p split.
+ * The output is moved into place only if the mapper succeeds.
+ */
+static int emu_attempt(struct emu_job* job, int task, int attempt,
+                       struct emu_split* split)
+{
+    char* cmd = NULL;
+    char** words = NULL;
+    char* tmp_out = NULL;
+    char* out = NULL;
+    char* log = NULL;
+    int fds[2] = {-1, -1};
+    int out_fd = -1, log_fd = -1;
+    int status;
+    pid_t pid;
+    int ret;
+
+    if ((cmd = strdup(job->mapper)) == NULL
+            || (words = emu_split_words(cmd)) == NULL || words[0] == NULL
+            || asprintf(&tmp_out, "%s/_temporary/part-%05d_%d", job->output,
+                        task, attempt) == -1
+            || asprintf(&out, "%s/part-%05d", job->output, task) == -1
+            || asprintf(&log, "%s/attempt_%s_m_%06d_%d", job->log_dir,
+                        job->id + 4, task, attempt) == -1) {
+        ret = EXIT_OUT_OF_MEMORY;
+        goto out;
+    }
+    out_fd = open(tmp_out, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    log_fd = open(log, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (out_fd == -1 || log_fd == -1 || pipe(fds) == -1) {
+        rs_log_error("failed to set up task %d: %s", task, strerror(errno));
+        ret = EXIT_IO_ERROR;
+        goto out;
+    }
+    /* the mapper must see the end of its input */
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+
+    if ((ret = spawn_command(words, &pid, fds[0], out_fd, log_fd)))
+        goto out;
+    close(fds[0]);
+    fds[0] = -1;
+    /* a mapper that does not read its input is fine */
+    if (split->len > 0)
+        writex(fds[1], split->data, split->len);
+    close(fds[1]);
+    fds[1] = -1;
+
+    while (waitpid(pid, &status, 0) == -1) {
+        if (errno != EINTR) {
+            rs_log_error("failed to wait for the mapper: %s", strerror(errno));
+            ret = EXIT_IO_ERROR;
+            goto out;
+        }
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        rs_log_warning("attempt %d of task %d of %s failed, see %s",
+                       attempt, task, job->id, log);
+        ret = EXIT_MAPPER_FAILED;
+    } else if (rename(tmp_out, out) == -1) {
+        rs_log_error("failed to commit %s: %s", out, strerror(errno));
+        ret = EXIT_IO_ERROR;
+    }
+
+out:
+    if (fds[0] != -1)
+        close(fds[0]);
+    if (fds[1] != -1)
+        close(fds[1]);
+    if (out_fd != -1)
+        close(out_fd);
+    if (log_fd != -1)
+        close(log_fd);
+    if (tmp_out)
+        unlink(tmp_out);
+    free(log);
+    free(out);
+    free(tmp_out);
+    free(words);
+    free(cmd);
+    return ret;
+}
+
+/* Run map task @p task of @p job until an attempt succeeds. */
+static int emu_task(struct emu_job* job, int task, struct emu_split* split)
+{
+    int attempt;
+    int lock_fd;
+    int ret = EXIT_MAPPER_FAILED;
+
+    for (attempt = 0; attempt < EMU_MAX_ATTEMPTS; attempt++) {
+        if (mrcc_lock_slot(emu_slot_name, emu_slots, &lock_fd) != 0)
+            lock_fd = -1;
+        emu_sleep_ms(emu_latency_ms);
+        if (emu_fails()) {
+            rs_log_warning("attempt %d of task %d of %s lost: emulated failure",
+                           attempt, task, job->id);
+            ret = EXIT_MAPPER_FAILED;
+        } else {
+            ret = emu_attempt(job, task, attempt, split);
+        }
+        if (lock_fd != -1)
+            mrcc_unlock(lock_fd);
+        if (ret == 0)
+            return 0;
+    }
+    rs_log_error("task %d of %s failed %d times", task, job->id,
+                 EMU_MAX_ATTEMPTS);
+    return ret;
+}
+
+/* "job -kill" ends the job: its tasks with it. */
+static void emu_job_killed(int sig)
+{
+    int i;
+
+    (void) sig;
+    for (i = 0; i < emu_n_tasks; i++) {
+        if (emu_tasks[i] > 0)
+            kill(-emu_tasks[i], SIGKILL);
+    }
+    if (emu_job_file)
+        unlink(emu_job_file);
+    _exit(EXIT_MAPPER_FAILED);
+}
+
+/* Read all of @p fname. */
+static int emu_read_all(const char* fname, char** data_ret, size_t* len_ret)
+{
+    struct stat st;
+    char* data;
+    int fd;
+    int ret = 0;
+
+    if ((fd = open(fname, O_RDONLY | O_CLOEXEC)) == -1)
+        return EXIT_NO_SUCH_FILE;
+    if (fstat(fd, &st) == -1 || S_ISDIR(st.st_mode)) {
+        close(fd);
+        return EXIT_NO_SUCH_FILE;
+    }
+    if ((data = malloc(st.st_size + 1)) == NULL) {
+        close(fd);
+        return EXIT_OUT_OF_MEMORY;
+    }
+    if (st.st_size > 0 && (ret = readx(fd, data, st.st_size))) {
+        free(data);
+        close(fd);
+        return ret;
+    }
+    close(fd);
+    *data_ret = data;
+    *len_ret = st.st_size;
+    return 0;
+}
+
+/* Start the job's map tasks on @p splits and wait for them. */
+static int emu_run_tasks(struct emu_job* job, struct emu_split* splits,
+                         int n_splits)
+{
+    int running = 0;
+    int status;
+    pid_t pid;
+    int i;
+    int ret = 0;
+
+    if (n_splits > 0
+            && (emu_tasks = calloc(n_splits, sizeof *emu_tasks)) == NULL)
+        return EXIT_OUT_OF_MEMORY;
+    emu_n_tasks = n_splits;
+
+    for (i = 0; i < n_splits; i++) {
+        pid = fork();
+        if (pid == 0) {
+            /* "job -kill" gets the mapper too */
+            setpgid(0, 0);
+            _exit(emu_task(job, i, &splits[i]) ? EXIT_MAPPER_FAILED : 0);
+        }
+        if (pid == -1) {
+            rs_log_error("failed to fork: %s", strerror(errno));
+            ret = EXIT_MRCC_FAILED;
+            break;
+        }
+        setpgid(pid, pid);
+        emu_tasks[i] = pid;
+        running++;
+    }
+
+    while (running > 0) {
+        pid = wait(&status);
+        if (pid == -1) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        for (i = 0; i < n_splits && emu_tasks[i] != pid; i++)
+            ;
+        if (i == n_splits)
+            continue;
+        emu_tasks[i] = 0;
+        running--;
+        if ((!WIFEXITED(status) || WEXITSTATUS(status) != 0) && ret == 0) {
+            /* one task failing for good fails the job */
+            ret = EXIT_MAPPER_FAILED;
+            for (i = 0; i < n_splits; i++) {
+                if (emu_tasks[i] > 0)
+                    kill(-emu_tasks[i], SIGKILL);
+            }
+        }
+    }
+    return ret;
+}
+
+/* hadoop jar STREAMING_JAR OPTIONS... */
+static int emu_jar_command(int argc, char* argv[])
+{
+    struct emu_job job;
+    struct emu_split* splits = NULL;
+    struct sigaction sa;
+    const char* input = NULL;
+    const char* output = NULL;
+    char* in_local = NULL;
+    char* data = NULL;
+    char* jobs_dir = NULL;
+    char* tmp_dir = NULL;
+    size_t len = 0;
+    struct stat st;
+    FILE* f;
+    int lines = 1, nline = 0;
+    int n_splits = 0;
+    int i;
+    int ret;
+
+    memset(&job, 0, sizeof job);
+    /* argv[0] is the streaming jar, which is not needed here */
+    for (i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-D") && i + 1 < argc) {
+            if (str_startswith("mapred.line.input.format.linespermap=",
+                               argv[++i]))
+                lines = atoi(strchr(argv[i], '=') + 1);
+        } else if (!strcmp(argv[i], "-inputformat") && i + 1 < argc) {
+            nline = strstr(argv[++i], "NLineInputFormat") != NULL;
+        } else if (!strcmp(argv[i], "-mapper") && i + 1 < argc) {
+            job.mapper = argv[++i];
+        } else if (!strcmp(argv[i], "-input") && i + 1 < argc) {
+            input = argv[++i];
+        } else if (!strcmp(argv[i], "-output") && i + 1 < argc) {
+            output = argv[++i];
+        } else if (!strcmp(argv[i], "-numReduceTasks") && i + 1 < argc) {
+            if (atoi(argv[++i]) != 0)
+                rs_log_warning("no reducers here, ignoring %s reduce tasks",
+                               argv[i]);
+        } else if (argv[i][0] == '-' && i + 1 < argc) {
+            rs_trace("ignoring %s %s", argv[i], argv[i + 1]);
+            i++;
+        } else {
+            rs_log_error("bad streaming option \"%s\"", argv[i]);
+            return EXIT_BAD_ARGUMENTS;
+        }
+    }
+    if (job.mapper == NULL || input == NULL || output == NULL) {
+        rs_log_error("a streaming job needs -mapper, -input and -output");
+        return EXIT_BAD_ARGUMENTS;
+    }
+    if (lines < 1)
+        lines = 1;
+
+    emu_sleep_ms(emu_latency_ms);
+    if ((in_local = emu_path(input)) == NULL
+            || (job.output = emu_path(output)) == NULL) {
+        ret = EXIT_BAD_ARGUMENTS;
+        goto out;
+    }
+    if (lstat(job.output, &st) == 0) {
+        emu_job_log("ERROR", "Error launching job , Output path already "
+                    "exists : Output directory ", output);
+        ret = EXIT_MAPPER_FAILED;
+        goto out;
+    }
+    ret = emu_read_all(in_local, &data, &len);
+    if (ret == EXIT_NO_SUCH_FILE && !strcmp(input, "null")) {
+        data = strdup("\n");
+        len = 1;
+        ret = data ? 0 : EXIT_OUT_OF_MEMORY;
+    }
+    if (ret == EXIT_NO_SUCH_FILE) {
+        emu_job_log("ERROR", "Error Launching job : Input path does not "
+                    "exist: ", input);
+        goto out;
+    }
+    if (ret != 0)
+        goto out;
+    if ((ret = emu_make_splits(data, len, nline ? lines : 0, &splits,
+                               &n_splits)))
+        goto out;
+
+    /* submit it */
+    snprintf(job.id, sizeof job.id, "job_%ld_%05ld", (long) time(NULL),
+             (long) getpid());
+    if (asprintf(&job.log_dir, "%s/logs/%s", emu_dir, job.id) == -1
+            || asprintf(&job.tasktracker, "%s/tasktracker", emu_dir) == -1
+            || asprintf(&jobs_dir, "%s/jobs", emu_dir) == -1
+            || asprintf(&emu_job_file, "%s/%s", jobs_dir, job.id) == -1) {
+        ret = EXIT_OUT_OF_MEMORY;
+        goto out;
+    }
+    if ((ret = mrcc_mkdir_p(job.log_dir)) || (ret = mrcc_mkdir_p(jobs_dir))
+            || (ret = mrcc_mkdir_p(job.tasktracker))
+            || (ret = emu_mkparents(job.output)))
+        goto out;
+    if (mkdir(job.output, 0755) == -1) {
+        rs_log_error("failed to create %s: %s", output, strerror(errno));
+        ret = EXIT_IO_ERROR;
+        goto out;
+    }
+    if (asprintf(&tmp_dir, "%s/_temporary", job.output) == -1) {
+        tmp_dir = NULL;
+        ret = EXIT_OUT_OF_MEMORY;
+        goto out;
+    }
+    if ((ret = mrcc_mkdir(tmp_dir)))
+        goto out;
+    /* from now on, "job -kill" finds it */
+    memset(&sa, 0, sizeof sa);
+    sa.sa_handler = emu_job_killed;
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+    if ((f = fopen(emu_job_file, "w")) != NULL) {
+        fprintf(f, "%ld\n", (long) getpid());
+        fclose(f);
+    }
+    emu_job_log("INFO", "Running job: ", job.id);
+    /* what the tasks run on a machine of their own */
+    setenv("MRCC_EMU_DIR", emu_dir, 1);
+    setenv("MRCC_DIR", job.tasktracker, 1);
+
+    emu_sleep_ms(emu_job_latency_ms);
+    ret = emu_run_tasks(&job, splits, n_splits);
+
+    mrcc_remove_tree(tmp_dir);
+    unlink(emu_job_file);
+    if (ret == 0) {
+        emu_job_log("INFO", " map 100%  reduce 100%", NULL);
+        emu_job_log("INFO", "Job complete: ", job.id);
+        emu_job_log("INFO", "Output: ", output);
+    } else {
+        emu_job_log("ERROR", "Job not Successful!", NULL);
+        emu_job_log("INFO", "killJob...", NULL);
+    }
+
+out:
+    for (i = 0; i < n_splits; i++)
+        free(splits[i].data);
+    free(splits);
+    free(tmp_dir);
+    free(jobs_dir);
+    free(job.tasktracker);
+    free(job.log_dir);
+    free(job.output);
+    free(in_local);
+    free(data);
+    return ret;
+}
+
+/* hadoop job -kill JOBID */
+static int emu_job_command(int argc, char* argv[])
+{
+    char* fname = NULL;
+    const char* p;
+    FILE* f;
+    long pid = 0;
+    int ret = 0;
+
+    if (argc != 2 || strcmp(argv[0], "-kill")) {
+        rs_log_error("only \"job -kill JOBID\" is supported");
+        return EXIT_BAD_ARGUMENTS;
+    }
+    for (p = argv[1]; *p; p++) {
+        if (!isalnum((unsigned char) *p) && *p != '_') {
+            rs_log_error("bad job id \"%s\"", argv[1]);
+            return EXIT_BAD_ARGUMENTS;
+        }
+    }
+    emu_sleep_ms(emu_latency_ms);
+    if (asprintf(&fname, "%s/jobs/%s", emu_dir, argv[1]) == -1)
+        return EXIT_OUT_OF_MEMORY;
+    if ((f = fopen(fname, "r")) != NULL) {
+        if (fscanf(f, "%ld", &pid) != 1)
+            pid = 0;
+        fclose(f);
+    }
+    if (pid <= 0 || kill((pid_t) pid, SIGTERM) == -1) {
+        printf("Could not find job %s\n", argv[1]);
+        ret = EXIT_NO_SUCH_FILE;
+    } else {
+        printf("Killed job %s\n", argv[1]);
+    }
+    free(fname);
+    return ret;
+}
+
+int main(int argc, char* argv[])
+{
+    int ret;
+
+    if (argc < 2) {
+        emu_show_usage();
+        return EXIT_BAD_ARGUMENTS;
+    }
+    if (!strcmp(argv[1], "--help")) {
+        emu_show_help();
+        return 0;
+    }
+    if (!strcmp(argv[1], "--version") || !strcmp(argv[1], "version")) {
+        emu_show_version();
+        return 0;
+    }
+
+    set_trace_from_env();
+    ignore_sigpipe(1);
+    if ((ret = emu_init()))
+        return ret;
+
+    if (!strcmp(argv[1], "dfs") || !strcmp(argv[1], "fs"))
+        return emu_dfs_command(argc - 2, argv + 2);
+    if (!strcmp(argv[1], "jar") && argc > 2)
+        return emu_jar_command(argc - 2, argv + 2);
+    if (!strcmp(argv[1], "job"))
+        return emu_job_command(argc - 2, argv + 2);
+
+    emu_show_usage();
+    return EXIT_BAD_ARGUMENTS;
+}
@@ -0,0 +1,7 @@
+// mrcc - A C Compiler system on MapReduce
+// Zhiqiang Ma, https://www.ericzma.com
+#pragma once
+
+extern const char* rs_program_name;
+
+int main(int argc, char* argv[]);
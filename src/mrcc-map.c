@@ -4,16 +4,25 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
 
 #include "mrcc-map.h"
 #include "args.h"
 #include "traceenv.h"
 #include "trace.h"
+#include "lock.h"
 #include "files.h"
 #include "netfsutils.h"
 #include "cleanup.h"
 #include "utils.h"
-#include "args.h"
+#include "batch.h"
+#include "fscache.h"
+#include "compress.h"
+#include "stringutils.h"
+#include "exec.h"
 
 
 const char* mrcc_map_version = "0.1.0";
@@ -43,6 +52,15 @@ static void map_show_usage()
 "Jobs that cannot be distributed, such as linking or preprocessing\n"
 "are run locally on master. mrcc should be used with make's -jN option\n"
 "to execute in parallel on MapReduce.\n"
+"\n"
+"   mrcc-map [OPTIONS] CPP_FNAME OUT_FNAME COMPILER [ARGS...]\n"
+"   mrcc-map --batch           run the compiles listed on stdin\n"
+"\n"
+"   --fs-dir=DIR               directory of the files on net fs\n"
+"   --protover=N               protocol version mrcc speaks; 2 means the\n"
+"                              preprocessed source may be compressed\n"
+"   --cache-to=FSNAME          also publish the object in the shared\n"
+"                              object cache as FSNAME\n"
         );
 }
 
@@ -67,55 +85,51 @@ static void log_int(char* msg, int ret)
 }
 */
 
-int main(int argc, char* argv[])
+/*
+ * replace the compressed file cpp_fname by its decompressed content
+ */
+static int map_decompress(char* cpp_fname)
 {
-    int ret = 0;
-    const char* compiler_name;
-    char* cpp_fname;
-    char** map_argv;
-    char* map_argv_str;
-    char* fs_cpp_fname;
-    char* out_fname;
-    char* fs_out_fname;
-
-    // for debug only
-    // int i;
-    // FILE* log_file;
-    // log_file = fopen("/tmp/mrcc-map.log", "w");
-    // for (i = 0; i < argc; i++) {
-    //     fprintf(log_file, "%s ", argv[i]);
-    // }
-    // fclose(log_file);
-    // end debug
+    char* packed_fname = NULL;
+    int ret;
 
-    if (argc <= 1 || !strcmp(argv[1], "--help")) {
-        map_show_help();
-        ret = 0;
-        goto out;
+    if (asprintf(&packed_fname, "%s.z", cpp_fname) == -1) {
+        return EXIT_OUT_OF_MEMORY;
     }
-    else if (!strcmp(argv[1], "--version")) {
-        map_show_version();
-        ret = 0;
-        goto out;
+    if (rename(cpp_fname, packed_fname) == -1) {
+        rs_log_error("rename \"%s\" failed: %s", cpp_fname, strerror(errno));
+        free(packed_fname);
+        return EXIT_IO_ERROR;
     }
+    ret = decompress_file(packed_fname, cpp_fname);
+    unlink(packed_fname);
+    free(packed_fname);
+    rs_trace("decompressed \"%s\": %d", cpp_fname, ret);
+    return ret;
+}
 
+/*
+ * get the preprocessed file from net fs, compile it, and put the
+ * object file back to net fs
+ * if cache_to is not NULL, also publish the object there in the
+ * shared object cache
+ */
+static int map_compile(char* cpp_fname, char* out_fname, char** map_argv,
+        char* cache_to)
+{
+    int ret = 0;
+    const char* compiler_name;
+    pid_t pid;
+    int status;
+    char* fs_cpp_fname;
+    char* fs_out_fname;
 
-    atexit(cleanup_tempfiles);
-
-    set_trace_from_env();
-    note_called_time();
-    trace_version();
-
-    cpp_fname = argv[1];
     rs_trace("cpp_fname is \"%s\"", cpp_fname);
-
-    out_fname = argv[2];
     rs_trace("out_fname is \"%s\"", out_fname);
-    map_argv = argv + 3;
 
     compiler_name = (char *) find_basename(map_argv[0]);
     rs_trace("compiler name is \"%s\"", compiler_name);
-    
+
     // get cpp_fname from net fs
     rs_trace("get cpp from net fs: \"%s\"", cpp_fname);
     // error here on hadoop 0.20.2
@@ -124,32 +138,33 @@ int main(int argc, char* argv[])
     }
     if (get_file_fs(fs_cpp_fname, cpp_fname) != 0) {
         rs_log_error("get cpp from net fs: \"%s\" failed", cpp_fname);
-        ret =  EXIT_GET_CPP_FS_FAILED;
-        goto out;
-    } 
-    else {
-        ret = add_cleanup_fs(fs_cpp_fname);
+        free(fs_cpp_fname);
+        return EXIT_GET_CPP_FS_FAILED;
     }
- 
+    ret = add_cleanup_fs(fs_cpp_fname);
     free(fs_cpp_fname);
     fs_cpp_fname = NULL;
 
     // add clean up files - cpp_fname
     if ((ret = add_cleanup(cpp_fname)) != 0) {
-        goto out;
+        return ret;
     }
     rs_trace("add clean up file: \"%s\"", cpp_fname);
 
+    // mrcc may have compressed it on the way
+    if (is_compressed_file(cpp_fname) && (ret = map_decompress(cpp_fname)) != 0) {
+        return EXIT_GET_CPP_FS_FAILED;
+    }
+
     // compile it now
-    if ((map_argv_str = argv_tostr(map_argv)) == NULL) {
-        return EXIT_OUT_OF_MEMORY;
+    if ((ret = spawn_child(map_argv, &pid, NULL, NULL, NULL)) != 0
+            || (ret = collect_child("cc", pid, &status, timeout_null_fd,
+                                    0)) != 0) {
+        return ret;
     }
-    rs_trace("compile on map: \"%s\"", map_argv_str);
-    ret = system(map_argv_str);
-    rs_trace("compile on map return %d ", ret);
-    free(map_argv_str);
-    if (ret != 0) {
-        goto out;
+    rs_trace("compile on map return %d ", status);
+    if (status != 0) {
+        return status;
     }
 
     // put output file to net fs
@@ -158,19 +173,162 @@ int main(int argc, char* argv[])
     }
     rs_trace("put output file to net fs: \"%s\"", out_fname);
     if (put_file_fs(out_fname, fs_out_fname) != 0) {
-        ret =  EXIT_GET_CPP_FS_FAILED;
         rs_log_error("put output file to  net fs: \"%s\" failed", out_fname);
-        goto out;
+        free(fs_out_fname);
+        return EXIT_GET_CPP_FS_FAILED;
     }
     free(fs_out_fname);
-    fs_cpp_fname = NULL;
-   
+
+    // a failed publish costs others a compile, not us
+    if (cache_to && fscache_publish(out_fname, cache_to) != 0) {
+        rs_log_warning("publish \"%s\" to shared cache failed", out_fname);
+    }
+
     // add clean up files - output_fname
     rs_trace("add clean up file out_fname: \"%s\"", out_fname);
-    if ((ret = add_cleanup(out_fname)) != 0) {
+    return add_cleanup(out_fname);
+}
+
+/*
+ * skip over the mrcc-map options at the start of argv
+ * the object name given by --cache-to= goes to cache_to, or NULL
+ * --fs-dir= sets where the files are on net fs; mrcc versions that do
+ * not send it keep them right under fs_top_dir
+ * returns 0, or EXIT_PROTOCOL_ERROR if mrcc speaks a protocol
+ * version we do not know
+ */
+static int map_options(char*** argv, char** cache_to)
+{
+    long protover;
+    int ret;
+
+    *cache_to = NULL;
+    if ((ret = set_fs_work_dir(fs_top_dir)) != 0) {
+        return ret;
+    }
+    for (; **argv && str_startswith("--", **argv); (*argv)++) {
+        if (str_startswith("--cache-to=", **argv)) {
+            *cache_to = **argv + strlen("--cache-to=");
+        } else if (str_startswith("--fs-dir=", **argv)) {
+            ret = set_fs_work_dir(**argv + strlen("--fs-dir="));
+            if (ret != 0) {
+                return ret;
+            }
+        } else if (str_startswith("--protover=", **argv)) {
+            protover = strtol(**argv + strlen("--protover="), NULL, 10);
+            if (protover < MRCC_VER_1 || protover > MRCC_VER_2) {
+                rs_log_error("unsupported protocol version %ld", protover);
+                return EXIT_PROTOCOL_ERROR;
+            }
+        } else {
+            rs_log_warning("ignoring unknown option \"%s\"", **argv);
+        }
+    }
+    return 0;
+}
+
+/*
+ * run the compiles of a batch job, one per line on stdin
+ * Each line is "cpp_fname out_fname compiler args...", as written by
+ * batch_argv_toline(), maybe preceded by the line's key and a tab.
+ * A failed compile only loses its own object file; mrcc notices that
+ * and compiles the file locally, so the task itself still succeeds.
+ */
+static int map_batch(void)
+{
+    char* line = NULL;
+    size_t size = 0;
+    ssize_t len;
+    char** words;
+    char** args;
+    char* cache_to;
+    char* p;
+    int ret;
+
+    while ((len = getline(&line, &size, stdin)) != -1) {
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+            line[--len] = '\0';
+        // NLineInputFormat hands us the byte offset as key
+        for (p = line; isdigit((unsigned char) *p); p++)
+            ;
+        p = (p != line && *p == '\t') ? p + 1 : line;
+        if (*p == '\0')
+            continue;
+
+        if ((ret = batch_line_toargv(p, &words)) != 0) {
+            free(line);
+            return ret;
+        }
+        args = words;
+        ret = map_options(&args, &cache_to);
+        if (ret == 0 && argv_len(args) < 3) {
+            rs_log_error("short batch line \"%s\"", p);
+            ret = EXIT_PROTOCOL_ERROR;
+        } else if (ret == 0) {
+            ret = map_compile(args[0], args[1], args + 2, cache_to);
+        }
+        printf("%s\t%d\n", args[0] ? args[0] : "", ret);
+        fflush(stdout);
+        free(words);
+    }
+    free(line);
+    return 0;
+}
+
+int main(int argc, char* argv[])
+{
+    int ret = 0;
+    char** args;
+    char* cache_to;
+
+    // for debug only
+    // int i;
+    // FILE* log_file;
+    // log_file = fopen("/tmp/mrcc-map.log", "w");
+    // for (i = 0; i < argc; i++) {
+    //     fprintf(log_file, "%s ", argv[i]);
+    // }
+    // fclose(log_file);
+    // end debug
+
+    if (argc <= 1 || !strcmp(argv[1], "--help")) {
+        map_show_help();
+        ret = 0;
+        goto out;
+    }
+    else if (!strcmp(argv[1], "--version")) {
+        map_show_version();
+        ret = 0;
         goto out;
     }
 
+
+    atexit(cleanup_tempfiles);
+
+    set_trace_from_env();
+    note_called_time();
+    trace_version();
+
+    /* The tasktracker already limits how many of us run.  Our job's
+     * "hadoop jar" holds a client slot on the master until we finish,
+     * so waiting for one here could wait forever. */
+    lock_client_disable();
+
+    if (!strcmp(argv[1], "--batch")) {
+        ret = map_batch();
+    }
+    else {
+        args = argv + 1;
+        ret = map_options(&args, &cache_to);
+        if (ret == 0 && argv_len(args) < 3) {
+            rs_log_error("usage: mrcc-map [OPTIONS] CPP_FNAME OUT_FNAME COMPILER [ARGS...]");
+            ret = EXIT_BAD_ARGUMENTS;
+        }
+        else if (ret == 0) {
+            ret = map_compile(args[0], args[1], args + 2, cache_to);
+        }
+    }
+
 out:
     if (ret != 0)
         return EXIT_MAPPER_FAILED;
@@ -178,4 +336,3 @@ out:
     // fclose(stdout);
     // exit(0);
 }
-
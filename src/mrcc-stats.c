@@ -0,0 +1,538 @@
+//mrcc-stats - part of mrcc
+//Zhiqiang Ma https://www.ericzma.com
+
+#include <stdarg.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <string.h>
+#include <time.h>
+#include <ctype.h>
+#include <assert.h>
+#include <fcntl.h>
+
+#include <sys/fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "mrcc-stats.h"
+#include "traceenv.h"
+#include "trace.h"
+#include "utils.h"
+#include "events.h"
+#include "spans.h"
+
+/**
+ * @file
+ * @brief Sum up the event log of a build, see events.c.
+ *
+ * For every phase it tells how often it ran, how often it failed, how
+ * long it took in total and at the 50th, 90th and 99th percentile, and
+ * how many bytes it moved.  For the compiles it tells where their time
+ * went along the critical path: at any moment of a compile the phase
+ * it waits for is the one under way that ends last, so a streamed .i
+ * whose upload outlasts cpp is charged to the upload.  Time when no
+ * phase is under way, taking locks or waiting for a slot, is "other".
+ *
+ * It reads the span ring of spans.c as well, and with --chrome writes
+ * the events as a Chrome trace instead, for chrome://tracing or
+ * ui.perfetto.dev: every compile is a process there, its local phases
+ * on one thread and those on the network or the cluster on another,
+ * so that serialized compiles, idle stretches and slow job starts of
+ * a whole build show at a glance.
+ **/
+
+const char* mrcc_stats_version = "0.1.0";
+
+const char* rs_program_name = "mrcc-stats";
+
+// one line of the event log
+struct stats_event {
+    long long start;
+    long long dur;
+    long long bytes;
+    int phase;
+    int result;
+    long id;
+    char* input;
+};
+
+// one compile: the run of events with the same id from a scan_args on
+struct stats_compile {
+    long long start;
+    long long end;
+    long long path[EVENT_N + 1];    // critical path, "other" last
+    const char* input;
+};
+
+static struct stats_event* events = NULL;
+static int n_events = 0;
+static int events_size = 0;
+
+static void stats_show_version()
+{
+    printf(
+"mrcc-stats %s built at %s, %s\n"
+"Copyright (C) 2009 by Zhiqiang Ma.\n"
+"mrcc-stats comes with ABSOLUTELY NO WARRANTY. mrcc-stats is free software,\n"
+"and you may use, modify and redistribute it under the terms of the GNU\n"
+"General Public License version 2.\n"
+"Please report bugs to eric.zq.ma [at] gmail.com.\n"
+"\n"
+        ,
+        mrcc_stats_version, __TIME__, __DATE__);
+}
+
+static void stats_show_usage()
+{
+    printf(
+"Usage:\n"
+"   mrcc-stats [--top N] [--chrome] [FILE...]\n"
+"\n"
+"Options:\n"
+"   --top N                    show the N slowest compiles (default 10)\n"
+"   --chrome                   write a Chrome trace in JSON rather than\n"
+"                              the report\n"
+"   --help                     explain usage and exit\n"
+"   --version                  show version and exit\n"
+"\n"
+"mrcc-stats is part of mrcc.  It reads the event logs that mrcc writes\n"
+"with MRCC_EVENTS=FILE, \"-\" being stdin, or the span ring it fills\n"
+"with MRCC_TRACE=1, and reports how long each phase of the compiles\n"
+"took.  Without FILE it reads $MRCC_EVENTS, or if that is not set,\n"
+"the ring, $MRCC_DIR/state/trace.\n"
+        );
+}
+
+static int stats_phase(const char* name)
+{
+    int i;
+
+    for (i = 0; i < EVENT_N; i++) {
+        if (!strcmp(event_names[i], name))
+            return i;
+    }
+    return -1;
+}
+
+/* The next free entry of events[], or NULL. */
+static struct stats_event* stats_new_event(void)
+{
+    struct stats_event* e;
+
+    if (n_events == events_size) {
+        events_size = events_size ? events_size * 2 : 1024;
+        e = realloc(events, events_size * sizeof(*events));
+        if (e == NULL) {
+            rs_log_error("out of memory");
+            return NULL;
+        }
+        events = e;
+    }
+    return &events[n_events];
+}
+
+/* Add the lines of @p f; those that do not parse are skipped. */
+static int stats_read(FILE* f, const char* fname)
+{
+    struct stats_event* e;
+    char line[1024];
+    char phase[32];
+    int input_at, bad = 0;
+    size_t len;
+
+    while (fgets(line, sizeof line, f)) {
+        len = strlen(line);
+        if (len > 0 && line[len - 1] == '\n')
+            line[--len] = '\0';
+        if ((e = stats_new_event()) == NULL)
+            return EXIT_OUT_OF_MEMORY;
+        input_at = 0;
+        if (sscanf(line, "%lld %lld %31s %d %lld %ld %n", &e->start, &e->dur,
+                   phase, &e->result, &e->bytes, &e->id, &input_at) < 6
+                || input_at == 0 || (e->phase = stats_phase(phase)) < 0) {
+            bad++;
+            continue;
+        }
+        if ((e->input = strdup(line + input_at)) == NULL)
+            return EXIT_OUT_OF_MEMORY;
+        n_events++;
+    }
+    if (bad)
+        rs_log_warning("skipped %d bad lines of %s", bad, fname);
+    return 0;
+}
+
+/* Add span @p s of the ring, see span_ring_read(). */
+static int stats_add_span(void* arg, const struct span* s)
+{
+    struct stats_event* e;
+
+    (void) arg;
+    if (s->phase < 0 || s->phase >= EVENT_N)
+        return 0;
+    if ((e = stats_new_event()) == NULL
+            || (e->input = strdup(s->input)) == NULL)
+        return EXIT_OUT_OF_MEMORY;
+    e->start = s->start_us;
+    e->dur = s->dur_us;
+    e->bytes = s->bytes;
+    e->phase = s->phase;
+    e->result = s->result;
+    e->id = s->id;
+    n_events++;
+    return 0;
+}
+
+/* Read @p fname, an event log or a span ring. */
+static int stats_read_file(const char* fname)
+{
+    char magic[sizeof(SPAN_RING_MAGIC) - 1];
+    FILE* f;
+    int ret;
+
+    if (!strcmp(fname, "-"))
+        return stats_read(stdin, "stdin");
+    if ((f = fopen(fname, "r")) == NULL) {
+        rs_log_error("failed to open %s: %s", fname, strerror(errno));
+        return EXIT_NO_SUCH_FILE;
+    }
+    if (fread(magic, 1, sizeof(magic), f) == sizeof(magic)
+            && memcmp(magic, SPAN_RING_MAGIC, sizeof(magic)) == 0) {
+        fclose(f);
+        return span_ring_read(fname, stats_add_span, NULL);
+    }
+    rewind(f);
+    ret = stats_read(f, fname);
+    fclose(f);
+    return ret;
+}
+
+static int stats_by_id(const void* a, const void* b)
+{
+    const struct stats_event* x = a;
+    const struct stats_event* y = b;
+
+    if (x->id != y->id)
+        return x->id < y->id ? -1 : 1;
+    if (x->start != y->start)
+        return x->start < y->start ? -1 : 1;
+    /* scan_args comes first of those that start together */
+    return x->phase - y->phase;
+}
+
+static int stats_by_value(const void* a, const void* b)
+{
+    const long long* x = a;
+    const long long* y = b;
+
+    return *x < *y ? -1 : *x > *y;
+}
+
+static int stats_by_span(const void* a, const void* b)
+{
+    const struct stats_compile* x = a;
+    const struct stats_compile* y = b;
+    long long dx = x->end - x->start, dy = y->end - y->start;
+
+    return dx > dy ? -1 : dx < dy;
+}
+
+/* The @p p th percentile of the @p n sorted @p v, by nearest rank. */
+static long long stats_percentile(const long long* v, int n, int p)
+{
+    int rank = (int) (((long long) n * p + 99) / 100);
+
+    return v[rank > 0 ? rank - 1 : 0];
+}
+
+/* Charge the time of @p c, whose events are @p e[0 .. n-1], to the
+ * phases along its critical path. */
+static void stats_critical_path(struct stats_compile* c,
+                                const struct stats_event* e, int n)
+{
+    long long t, next, end;
+    int i, on;
+
+    memset(c->path, 0, sizeof(c->path));
+    for (t = c->start; t < c->end; t = next) {
+        /* the phase under way that ends last, and when the next
+         * phase starts or ends */
+        on = EVENT_N;
+        end = t;
+        next = c->end;
+        for (i = 0; i < n; i++) {
+            if (e[i].start > t && e[i].start < next)
+                next = e[i].start;
+            if (e[i].start <= t && e[i].start + e[i].dur > t) {
+                if (e[i].start + e[i].dur < next)
+                    next = e[i].start + e[i].dur;
+                if (e[i].start + e[i].dur > end) {
+                    end = e[i].start + e[i].dur;
+                    on = e[i].phase;
+                }
+            }
+        }
+        c->path[on] += next - t;
+    }
+}
+
+static void stats_ms(char* buf, size_t size, long long us)
+{
+    snprintf(buf, size, "%.1f", us / 1000.0);
+}
+
+static void stats_report_phases(void)
+{
+    long long* v;
+    long long total, bytes;
+    char p50[32], p90[32], p99[32], max[32], sum[32];
+    int phase, i, n, failed;
+
+    v = malloc((n_events ? n_events : 1) * sizeof(*v));
+    if (v == NULL)
+        return;
+    printf("%-10s %7s %6s %12s %10s %10s %10s %10s %14s\n",
+           "phase", "count", "failed", "total ms", "p50 ms", "p90 ms",
+           "p99 ms", "max ms", "bytes");
+    for (phase = 0; phase < EVENT_N; phase++) {
+        n = failed = 0;
+        total = bytes = 0;
+        for (i = 0; i < n_events; i++) {
+            if (events[i].phase != phase)
+                continue;
+            v[n++] = events[i].dur;
+            total += events[i].dur;
+            bytes += events[i].bytes;
+            failed += events[i].result != 0;
+        }
+        if (n == 0)
+            continue;
+        qsort(v, n, sizeof(*v), stats_by_value);
+        stats_ms(sum, sizeof sum, total);
+        stats_ms(p50, sizeof p50, stats_percentile(v, n, 50));
+        stats_ms(p90, sizeof p90, stats_percentile(v, n, 90));
+        stats_ms(p99, sizeof p99, stats_percentile(v, n, 99));
+        stats_ms(max, sizeof max, v[n - 1]);
+        printf("%-10s %7d %6d %12s %10s %10s %10s %10s %14lld\n",
+               event_names[phase], n, failed, sum, p50, p90, p99, max,
+               bytes);
+    }
+    free(v);
+}
+
+static void stats_report_path(const struct stats_compile* c, int n_compiles,
+                              int top)
+{
+    long long path[EVENT_N + 1];
+    long long total = 0;
+    char ms[32];
+    int i, j;
+
+    memset(path, 0, sizeof(path));
+    for (i = 0; i < n_compiles; i++) {
+        for (j = 0; j <= EVENT_N; j++) {
+            path[j] += c[i].path[j];
+            total += c[i].path[j];
+        }
+    }
+    printf("\ncritical path of %d compiles:\n", n_compiles);
+    for (j = 0; j <= EVENT_N; j++) {
+        if (path[j] == 0)
+            continue;
+        stats_ms(ms, sizeof ms, path[j]);
+        printf("  %-10s %12s ms %5.1f%%\n",
+               j < EVENT_N ? event_names[j] : "other", ms,
+               total ? 100.0 * path[j] / total : 0.0);
+    }
+
+    if (top > n_compiles)
+        top = n_compiles;
+    if (top <= 0)
+        return;
+    printf("\nslowest %d compiles:\n", top);
+    for (i = 0; i < top; i++) {
+        stats_ms(ms, sizeof ms, c[i].end - c[i].start);
+        printf("  %10s ms  %s\n   ", ms, c[i].input);
+        for (j = 0; j <= EVENT_N; j++) {
+            if (c[i].path[j] == 0)
+                continue;
+            stats_ms(ms, sizeof ms, c[i].path[j]);
+            printf(" %s %s", j < EVENT_N ? event_names[j] : "other", ms);
+        }
+        printf("\n");
+    }
+}
+
+static int stats_report(int top)
+{
+    struct stats_compile* c;
+    long long first, last, end;
+    char ms[32];
+    int i, from, n_compiles = 0;
+
+    if (n_events == 0) {
+        printf("no events\n");
+        return 0;
+    }
+    qsort(events, n_events, sizeof(*events), stats_by_id);
+
+    c = malloc(n_events * sizeof(*c));
+    if (c == NULL)
+        return EXIT_OUT_OF_MEMORY;
+    first = events[0].start;
+    last = first;
+    /* pids come around again in a long build, but every compile
+     * begins with scan_args */
+    for (from = 0; from < n_events; from = i) {
+        c[n_compiles].start = events[from].start;
+        c[n_compiles].end = events[from].start;
+        c[n_compiles].input = events[from].input;
+        for (i = from; i < n_events && events[i].id == events[from].id
+                 && (i == from || events[i].phase != EVENT_SCAN_ARGS); i++) {
+            end = events[i].start + events[i].dur;
+            if (end > c[n_compiles].end)
+                c[n_compiles].end = end;
+            if (events[i].phase == EVENT_SCAN_ARGS
+                    || strcmp(events[i].input, "-") != 0)
+                c[n_compiles].input = events[i].input;
+        }
+        stats_critical_path(&c[n_compiles], events + from, i - from);
+        if (c[n_compiles].start < first)
+            first = c[n_compiles].start;
+        if (c[n_compiles].end > last)
+            last = c[n_compiles].end;
+        n_compiles++;
+    }
+
+    stats_ms(ms, sizeof ms, last - first);
+    printf("%d events of %d compiles over %s ms\n\n", n_events, n_compiles,
+           ms);
+    stats_report_phases();
+    qsort(c, n_compiles, sizeof(*c), stats_by_span);
+    stats_report_path(c, n_compiles, top);
+    free(c);
+    return 0;
+}
+
+/* Write @p str as a JSON string. */
+static void stats_json_string(const char* str)
+{
+    putchar('"');
+    for (; *str; str++) {
+        if (*str == '"' || *str == '\\')
+            printf("\\%c", *str);
+        else if ((unsigned char) *str < 0x20)
+            printf("\\u%04x", (unsigned char) *str);
+        else
+            putchar(*str);
+    }
+    putchar('"');
+}
+
+/* The thread of a compile that @p phase runs on in the Chrome trace:
+ * 1 for what is done here, 2 for the network and the cluster. */
+static int stats_chrome_tid(int phase)
+{
+    switch (phase) {
+    case EVENT_UPLOAD:
+    case EVENT_SUBMIT:
+    case EVENT_REMOTE:
+    case EVENT_DOWNLOAD:
+        return 2;
+    default:
+        return 1;
+    }
+}
+
+/*
+ * Write the events in the Trace Event Format of Chrome, as complete
+ * ("X") events with microsecond times from the first event on.
+ */
+static int stats_chrome(void)
+{
+    long long first;
+    int i, sep = 0;
+
+    qsort(events, n_events, sizeof(*events), stats_by_id);
+    first = 0;
+    for (i = 0; i < n_events; i++) {
+        if (i == 0 || events[i].start < first)
+            first = events[i].start;
+    }
+
+    printf("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    for (i = 0; i < n_events; i++) {
+        if (i == 0 || events[i].id != events[i - 1].id) {
+            printf("%s{\"ph\":\"M\",\"name\":\"process_name\",\"pid\":%ld,"
+                   "\"args\":{\"name\":", sep ? ",\n" : "", events[i].id);
+            stats_json_string(events[i].input);
+            printf("}},\n{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":%ld,"
+                   "\"tid\":1,\"args\":{\"name\":\"local\"}},\n"
+                   "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":%ld,"
+                   "\"tid\":2,\"args\":{\"name\":\"remote\"}}",
+                   events[i].id, events[i].id);
+            sep = 1;
+        }
+        printf(",\n{\"ph\":\"X\",\"cat\":\"mrcc\",\"name\":\"%s\","
+               "\"pid\":%ld,\"tid\":%d,\"ts\":%lld,\"dur\":%lld,"
+               "\"args\":{\"bytes\":%lld,\"result\":%d,\"input\":",
+               event_names[events[i].phase], events[i].id,
+               stats_chrome_tid(events[i].phase), events[i].start - first,
+               events[i].dur, events[i].bytes, events[i].result);
+        stats_json_string(events[i].input);
+        printf("}}");
+    }
+    printf("\n]}\n");
+    return ferror(stdout) ? EXIT_IO_ERROR : 0;
+}
+
+int main(int argc, char* argv[])
+{
+    const char* fname;
+    char* ring = NULL;
+    int top = 10;
+    int chrome = 0;
+    int n_files = 0;
+    int i, ret;
+
+    set_trace_from_env();
+
+    for (i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--help")) {
+            stats_show_version();
+            stats_show_usage();
+            return 0;
+        } else if (!strcmp(argv[i], "--version")) {
+            stats_show_version();
+            return 0;
+        } else if (!strcmp(argv[i], "--top") && i + 1 < argc) {
+            top = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--chrome")) {
+            chrome = 1;
+        } else if (argv[i][0] == '-' && argv[i][1] != '\0') {
+            stats_show_usage();
+            return EXIT_BAD_ARGUMENTS;
+        } else {
+            break;
+        }
+    }
+
+    for (; i < argc || n_files == 0; i++, n_files++) {
+        fname = i < argc ? argv[i] : getenv("MRCC_EVENTS");
+        if (fname == NULL || fname[0] == '\0') {
+            if ((ret = span_ring_name(&ring)) != 0)
+                return ret;
+            fname = ring;
+        }
+        if ((ret = stats_read_file(fname)) != 0)
+            return ret;
+    }
+    free(ring);
+
+    return chrome ? stats_chrome() : stats_report(top);
+}
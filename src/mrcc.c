@@ -16,6 +16,9 @@
 #include "trace.h"
 #include "traceenv.h"
 #include "compile.h"
+#include "fscache.h"
+#include "fsgc.h"
+#include "events.h"
 
 
 const char* mrcc_version = MRCC_VERSION;
@@ -48,15 +51,101 @@ static void show_usage()
 "   COMPILER                   defaults to \"cc\"\n"
 "   --help                     explain usage and exit\n"
 "   --version                  show version and exit\n"
+"   --shared-cache-sweep       trim the shared object cache to its size\n"
+"                              limit and exit\n"
+"   --gc                       remove temp files of old sessions from the\n"
+"                              net fs and exit\n"
 "\n"
-/*
 "Environment variables:\n"
-"   See the manual page for a complete list.\n"
-"   MRCC_VERBOSE=1           give debug messages\n"
-"   MRCC_LOG                 send messages to file, not stderr\n"
-"   MRCC_DIR                 directory for host list and locks\n"
+"   MRCC_VERBOSE=1             give debug messages\n"
+"   MRCC_LOG                   send messages to file, not stderr\n"
+"   MRCC_DIR                   directory for host list and locks\n"
+"   MRCC_WEBHDFS=HOST[:PORT]   talk WebHDFS to this namenode instead of\n"
+"                              running \"hadoop dfs\" for net fs files\n"
+"   MRCC_WEBHDFS_USER          user name for WebHDFS (default $USER)\n"
+"   MRCC_HADOOP                hadoop client to run, such as mrcc-hadoop\n"
+"                              for a cluster emulated on this machine\n"
+"                              (default /lhome/mr/hadoop-0.20.2/bin/hadoop)\n"
+"   MRCC_MAPPER                mapper the map tasks run\n"
+"                              (default /usr/bin/mrcc-map)\n"
+"   MRCC_BACKEND               where remote compiles run: hadoop, local\n"
+"                              (mrcc-map on this machine) or cmd\n"
+"                              (default hadoop); hosts of MRCC_HOSTS\n"
+"                              are always sent to mrccd\n"
+"   MRCC_BACKEND_CMD           for cmd, the shell command that runs\n"
+"                              mrcc-map, with %%c for its command line\n"
+"                              and %%j for a job name, such as\n"
+"                              \"srun -J %%j %%c\"\n"
+"   MRCC_BACKEND_CANCEL        for cmd, the shell command that takes a\n"
+"                              job back, such as \"scancel -n %%j\"\n"
+"   MRCC_BATCH=1               share one MapReduce job among compiles\n"
+"                              started at about the same time\n"
+"   MRCC_BATCH_WINDOW          milliseconds to wait for more compiles\n"
+"                              before submitting a batch (default 500)\n"
+"   MRCC_BATCH_MAX             most compiles in one batch (default 64)\n"
+"   MRCC_CACHE=1               keep the results of remote compiles and\n"
+"                              reuse them for identical compiles\n"
+"   MRCC_CACHE_DIR             where to keep them (default $MRCC_DIR/cache)\n"
+"   MRCC_SHARED_CACHE=1        look for objects in the net fs before\n"
+"                              compiling, and publish new ones there\n"
+"   MRCC_SHARED_CACHE_DIR      net fs directory of the shared cache\n"
+"                              (default mrcc/objcache)\n"
+"   MRCC_SHARED_CACHE_SIZE     size limit of the shared cache, e.g. 20G\n"
+"                              (default 10G)\n"
+"   MRCC_COMPRESS              compress preprocessed sources sent to the\n"
+"                              mappers: none or lz4 (default none)\n"
+"   MRCC_STREAM_CPP            set to 0 to write preprocessed sources to a\n"
+"                              temp file before uploading them, rather\n"
+"                              than uploading them as cpp runs\n"
+"   MRCC_MEMFD                 set to 1 to keep compressed sources,\n"
+"                              server messages and job logs in memory\n"
+"                              rather than in temp files\n"
+"   MRCC_ASYNC_CLEANUP         set to 0 to delete temporary files on the\n"
+"                              net fs before exiting, rather than in the\n"
+"                              background\n"
+"   MRCC_FS_CLEANUP            set to 0 to leave temporary files on the\n"
+"                              net fs to \"mrcc --gc\"\n"
+"   MRCC_GC_TTL                age at which --gc removes temporary files,\n"
+"                              e.g. 12h (default 2d)\n"
+"   MRCC_SESSION               keep the temporary files of this build\n"
+"                              together on the net fs under this name\n"
+"   MRCC_CPP_SLOTS             preprocessors run at once on this machine\n"
+"                              (default: number of CPUs)\n"
+"   MRCC_LOCAL_SLOTS           compiles and links run at once on this\n"
+"                              machine (default: number of CPUs)\n"
+"   MRCC_CLIENT_SLOTS          hadoop client processes run at once on\n"
+"                              this machine (default 8); the client of\n"
+"                              a job gives its slot up once the job is\n"
+"                              submitted, so more jobs may be in flight\n"
+"   MRCC_HOSTS                 mrccd workers to compile on instead of\n"
+"                              MapReduce, as HOST[:PORT][/SLOTS][,cpp] ...;\n"
+"                              ,cpp has the host preprocess, given the\n"
+"                              headers (default: $MRCC_DIR/hosts, if it\n"
+"                              exists)\n"
+"   MRCC_HEDGE_DELAY           milliseconds after which a remote compile\n"
+"                              is raced by the same compile here, if a\n"
+"                              local slot is free (default: never)\n"
+"   MRCC_SPECULATE=FACTOR      send a remote compile again, to another\n"
+"                              host or as another job, once it takes\n"
+"                              FACTOR times as long as they did lately\n"
+"   MRCC_COST_MODEL            set to 0 to send every compile out, rather\n"
+"                              than compiling here what looks quicker to\n"
+"                              (timings are kept in $MRCC_DIR/state)\n"
+"   MRCC_DEADLINE_CPP=SEC[,SEC_PER_MB]\n"
+"   MRCC_DEADLINE_UPLOAD=...\n"
+"   MRCC_DEADLINE_REMOTE=...\n"
+"   MRCC_DEADLINE_DOWNLOAD=...\n"
+"                              how long running cpp, sending the .i, the\n"
+"                              remote compile and fetching the object may\n"
+"                              take, plus SEC_PER_MB for each MB of .i;\n"
+"                              after that the compile is done here (0 for\n"
+"                              no limit)\n"
+"   MRCC_EVENTS=FILE           append how long each phase of every compile\n"
+"                              took to FILE, for mrcc-stats to sum up\n"
+"   MRCC_TRACE=1               put the same into the shared ring\n"
+"                              $MRCC_DIR/state/trace, for a timeline of\n"
+"                              the build (\"mrcc-stats --chrome\")\n"
 "\n"
-*/
 "mrcc is a C Compiler system on MapReduce.\n"
 "mrcc distributes compilation jobs across slave machines on MapReduce.\n"
 "Jobs that cannot be distributed, such as linking or preprocessing\n"
@@ -84,6 +173,7 @@ int main(int argc, char* argv[])
     //atexit(remove_state_file);
 
     set_trace_from_env();
+    events_init();
     note_called_time();
     trace_version();
     
@@ -109,6 +199,24 @@ int main(int argc, char* argv[])
             ret = 0;
             goto out;
         }
+        if (!strcmp(argv[1], "--shared-cache-sweep")) {
+            struct fscache_stats stats;
+            ret = fscache_sweep(&stats);
+            if (ret == 0) {
+                printf("kept %d objects (%lld bytes), evicted %d objects (%lld bytes)\n",
+                       stats.kept, stats.kept_bytes,
+                       stats.evicted, stats.evicted_bytes);
+            }
+            goto out;
+        }
+        if (!strcmp(argv[1], "--gc")) {
+            int n_removed;
+            ret = fs_gc(&n_removed);
+            if (ret == 0) {
+                printf("removed %d temporary directories and files\n", n_removed);
+            }
+            goto out;
+        }
         if ((ret = find_compiler(argv, &compiler_args)) != 0) {
             goto out;
         }
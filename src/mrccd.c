@@ -0,0 +1,686 @@
+//mrccd - part of mrcc
+//Zhiqiang Ma https://www.ericzma.com
+
+#include <stdarg.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <string.h>
+#include <time.h>
+#include <ctype.h>
+#include <assert.h>
+#include <fcntl.h>
+
+#include <sys/fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <signal.h>
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <sys/poll.h>
+
+#include <sys/socket.h>
+
+#include "mrccd.h"
+#include "traceenv.h"
+#include "trace.h"
+#include "utils.h"
+#include "args.h"
+#include "exec.h"
+#include "files.h"
+#include "io.h"
+#include "rpc.h"
+#include "hosts.h"
+#include "sockets.h"
+#include "stringutils.h"
+#include "tempfile.h"
+#include "cleanup.h"
+#include "compress.h"
+#include "hash.h"
+
+/**
+ * @file
+ * @brief A worker daemon that compiles for mrcc over TCP.
+ *
+ * Starting a MapReduce job takes tens of seconds, which is more than
+ * most compiles.  mrccd takes compiles straight from mrcc instead, one
+ * per connection, in the framed protocol of rpc.c:
+ *
+ *     mrcc:  MRCC version
+ *            ARGC n, then n times ARGV argument
+ *            INPT name of the input in the arguments
+ *            OUTC n, then n times OUTP name of an output in the arguments
+ *            DOTI chunks of the preprocessed source, maybe compressed,
+ *            ended by an empty one
+ *     mrccd: DONE version
+ *            STAT wait status of the compiler
+ *            SERR its stderr, SOUT its stdout
+ *            FILE for each output, in order, or NOFL if it was not made
+ *
+ * In version 3, "pump mode", mrccd runs cpp itself.  The source goes
+ * in the arguments as it is, and is sent along with its headers:
+ *
+ *     mrcc:  MRCC 3, ARGC/ARGV, CDIR directory the compile runs in,
+ *            INPT, OUTC/OUTP as above
+ *            NFIL n, then n times NAME absolute path and HASH of it
+ *     mrccd: NEED n, then n times FIDX index of a file it lacks
+ *     mrcc:  for each of those, HDRC chunks of it, compressed, ended
+ *            by an empty one
+ *
+ * and the reply is the same.  Files are kept in $MRCC_DIR/headers by
+ * hash, so a header common to many sources crosses the network once.
+ * For each compile they are linked into a fresh directory at the same
+ * paths as on the client, and the compiler runs there with the
+ * absolute paths in its arguments moved below it.  System headers are
+ * not sent; the host has to have the same ones.
+ *
+ * mrccd puts the input and outputs in temp files of its own and runs
+ * the compiler on them, found in its PATH.  It runs whatever compiler
+ * options it is sent, so it should only listen where trusted clients
+ * can reach it.
+ **/
+
+const char* mrccd_version = "0.1.0";
+
+const char* rs_program_name = "mrccd";
+
+// most compiles run at the same time
+static int mrccd_jobs;
+
+// compiles running now
+static int mrccd_n_children;
+
+static void mrccd_show_version()
+{
+    printf(
+"mrccd %s built at %s, %s\n"
+"Copyright (C) 2009 by Zhiqiang Ma.\n"
+"mrccd comes with ABSOLUTELY NO WARRANTY. mrccd is free software,\n"
+"and you may use, modify and redistribute it under the terms of the GNU\n"
+"General Public License version 2.\n"
+"Please report bugs to eric.zq.ma [at] gmail.com.\n"
+"\n"
+        ,
+        mrccd_version, __TIME__, __DATE__);
+}
+
+static void mrccd_show_usage()
+{
+    printf(
+"Usage:\n"
+"   mrccd [--listen ADDR] [--port PORT] [--jobs N]\n"
+"\n"
+"Options:\n"
+"   --listen ADDR              address to listen on (default 127.0.0.1)\n"
+"   --port PORT                port to listen on (default %d)\n"
+"   --jobs N                   most compiles run at once (default: number\n"
+"                              of CPUs)\n"
+"   --help                     explain usage and exit\n"
+"   --version                  show version and exit\n"
+"\n"
+"mrccd is part of mrcc.  It compiles for mrcc clients that list it in\n"
+"MRCC_HOSTS, without the cost of starting a MapReduce job.  It runs\n"
+"whatever it is sent, so only let trusted machines reach it.\n"
+        , MRCCD_DEFAULT_PORT);
+}
+
+static void mrccd_show_help()
+{
+    mrccd_show_version();
+    mrccd_show_usage();
+}
+
+/* A temp file named like @p like, so the compiler sees the same kind. */
+static int mrccd_tmpnam(const char *prefix, const char *like, char **name_ret)
+{
+    const char *ext = find_extension_const(like);
+
+    return make_tmpnam(prefix, ext ? ext : "", name_ret);
+}
+
+/*
+ * Replace the input and the outputs in argv by temp files of ours.
+ * The outputs get one temp file each, in local_outputs.
+ */
+static int mrccd_rewrite_argv(char **argv, const char *input_fname,
+                              const char *local_input, char **outputs,
+                              char ***local_outputs)
+{
+    char **locals;
+    char *s;
+    int n_outputs, n_inputs = 0, i, j;
+    int ret;
+
+    n_outputs = argv_len(outputs);
+    if ((locals = calloc(n_outputs + 1, sizeof *locals)) == NULL)
+        return EXIT_OUT_OF_MEMORY;
+    *local_outputs = locals;
+    for (j = 0; j < n_outputs; j++) {
+        if ((ret = mrccd_tmpnam("mrccd_out", outputs[j], &locals[j])))
+            return ret;
+    }
+
+    for (i = 1; argv[i]; i++) {
+        s = NULL;
+        if (str_equal(argv[i], input_fname)) {
+            s = strdup(local_input);
+            n_inputs++;
+        } else {
+            for (j = 0; j < n_outputs; j++) {
+                if (str_equal(argv[i], outputs[j])) {
+                    s = strdup(locals[j]);
+                    break;
+                }
+            }
+            if (j == n_outputs)
+                continue;
+        }
+        if (s == NULL)
+            return EXIT_OUT_OF_MEMORY;
+        free(argv[i]);
+        argv[i] = s;
+    }
+    if (n_inputs != 1) {
+        rs_log_error("input \"%s\" is given %d times", input_fname, n_inputs);
+        return EXIT_PROTOCOL_ERROR;
+    }
+    return 0;
+}
+
+/* Run it from PATH, whatever directory the client had it in. */
+static int mrccd_set_compiler(char **argv)
+{
+    char *base;
+
+    if (argv[0] == NULL || argv[0][0] == '\0') {
+        rs_log_error("no compiler given");
+        return EXIT_PROTOCOL_ERROR;
+    }
+    if (strchr(argv[0], '/') == NULL)
+        return 0;
+    if ((base = strdup(find_basename(argv[0]))) == NULL)
+        return EXIT_OUT_OF_MEMORY;
+    free(argv[0]);
+    argv[0] = base;
+    return 0;
+}
+
+/* Read the preprocessed source into local_input. */
+static int mrccd_read_input(int fd, const char *local_input)
+{
+    char *packed_fname = NULL;
+    int ret;
+
+    if ((ret = make_tmpnam("mrccd_in", ".z", &packed_fname)))
+        return ret;
+    ret = rpc_read_chunks(fd, "DOTI", packed_fname);
+    if (ret == 0 && is_compressed_file(packed_fname)) {
+        ret = decompress_file(packed_fname, local_input);
+    } else if (ret == 0 && rename(packed_fname, local_input) == -1) {
+        rs_log_error("failed to rename %s: %s", packed_fname, strerror(errno));
+        ret = EXIT_IO_ERROR;
+    }
+    free(packed_fname);
+    return ret;
+}
+
+/* The name of the file of hash @p hex in the header store. */
+static int mrccd_header_path(const char *hex, char **path_ret)
+{
+    static char *store;
+    int i, ret;
+
+    for (i = 0; i < HASH_HEX_LEN; i++) {
+        if (!isxdigit((unsigned char) hex[i]))
+            break;
+    }
+    if (i != HASH_HEX_LEN || hex[i] != '\0') {
+        rs_log_error("bad hash \"%s\"", hex);
+        return EXIT_PROTOCOL_ERROR;
+    }
+    if (store == NULL && (ret = get_subdir("headers", &store)))
+        return ret;
+    if (asprintf(path_ret, "%s/%s", store, hex) == -1)
+        return EXIT_OUT_OF_MEMORY;
+    return 0;
+}
+
+/* Read a file sent as HDRC chunks into the store, if it has @p hex. */
+static int mrccd_read_header(int fd, const char *hex, const char *path)
+{
+    struct hash_ctx ctx;
+    char got[HASH_HEX_LEN + 1];
+    char *packed_fname = NULL, *fname = NULL;
+    int ret;
+
+    if ((ret = make_tmpmem("mrccd_hdr", ".z", &packed_fname))
+            || (ret = make_tmpnam("mrccd_hdr", ".h", &fname)))
+        goto out;
+    if ((ret = rpc_read_chunks(fd, "HDRC", packed_fname))
+            || (ret = decompress_file(packed_fname, fname)))
+        goto out;
+
+    hash_init(&ctx);
+    if ((ret = hash_file(&ctx, fname)))
+        goto out;
+    hash_final_hex(&ctx, got);
+    if (strcmp(got, hex)) {
+        rs_log_error("file sent as %s hashes to %s", hex, got);
+        ret = EXIT_PROTOCOL_ERROR;
+        goto out;
+    }
+    /* whoever stores it first wins; the contents are the same */
+    if (rename(fname, path) == -1) {
+        rs_log_error("failed to rename %s: %s", fname, strerror(errno));
+        ret = EXIT_IO_ERROR;
+    }
+
+out:
+    free(packed_fname);
+    free(fname);
+    return ret;
+}
+
+/* Put the stored file @p from at @p to, making its directory. */
+static int mrccd_place_file(const char *from, char *to)
+{
+    char *slash = strrchr(to, '/');
+    int fd, ret;
+
+    *slash = '\0';
+    ret = mrcc_mkdir_p(to);
+    *slash = '/';
+    if (ret)
+        return ret;
+    if (link(from, to) == 0)
+        return 0;
+    if (errno != EXDEV && errno != EPERM && errno != EMLINK) {
+        rs_log_error("failed to link %s to %s: %s", from, to, strerror(errno));
+        return EXIT_IO_ERROR;
+    }
+    if ((fd = open(to, O_WRONLY|O_CREAT|O_TRUNC|O_BINARY, 0644)) == -1) {
+        rs_log_error("failed to create %s: %s", to, strerror(errno));
+        return EXIT_IO_ERROR;
+    }
+    ret = copy_file_to_fd(from, fd);
+    close(fd);
+    return ret;
+}
+
+/*
+ * Get the source and headers of a pump mode compile, and lay them out
+ * below root as they are on the client.
+ */
+static int mrccd_read_files(int fd, const char *root)
+{
+    char **names = NULL, **stored = NULL;
+    unsigned *need = NULL;
+    char *hex = NULL, *to;
+    unsigned n_files, n_need = 0, i;
+    int ret;
+
+    if ((ret = rpc_read_token(fd, "NFIL", &n_files)))
+        return ret;
+    if (n_files > RPC_MAX_STRING / 16) {
+        rs_log_error("too many files: %u", n_files);
+        return EXIT_PROTOCOL_ERROR;
+    }
+    names = calloc(n_files + 1, sizeof *names);
+    stored = calloc(n_files + 1, sizeof *stored);
+    need = calloc(n_files + 1, sizeof *need);
+    if (names == NULL || stored == NULL || need == NULL) {
+        ret = EXIT_OUT_OF_MEMORY;
+        goto out;
+    }
+    for (i = 0; i < n_files; i++) {
+        if ((ret = rpc_read_string(fd, "NAME", &names[i]))
+                || (ret = rpc_read_string(fd, "HASH", &hex)))
+            goto out;
+        if (names[i][0] != '/' || strstr(names[i], "/../")) {
+            rs_log_error("bad file name \"%s\"", names[i]);
+            ret = EXIT_PROTOCOL_ERROR;
+            goto out;
+        }
+        ret = mrccd_header_path(hex, &stored[i]);
+        free(hex);
+        hex = NULL;
+        if (ret)
+            goto out;
+        if (access(stored[i], R_OK) == -1) {
+            need[n_need++] = i;
+        }
+    }
+
+    if ((ret = rpc_xmit_token(fd, "NEED", n_need)))
+        goto out;
+    for (i = 0; i < n_need; i++) {
+        if ((ret = rpc_xmit_token(fd, "FIDX", need[i])))
+            goto out;
+    }
+    rs_trace("need %u of %u files", n_need, n_files);
+    for (i = 0; i < n_need; i++) {
+        if ((ret = mrccd_read_header(fd, find_basename(stored[need[i]]),
+                                     stored[need[i]])))
+            goto out;
+    }
+
+    for (i = 0; i < n_files; i++) {
+        if (asprintf(&to, "%s%s", root, names[i]) == -1) {
+            ret = EXIT_OUT_OF_MEMORY;
+            goto out;
+        }
+        ret = mrccd_place_file(stored[i], to);
+        free(to);
+        if (ret)
+            goto out;
+    }
+
+out:
+    free(need);
+    if (names)
+        free_argv(names);
+    if (stored)
+        free_argv(stored);
+    return ret;
+}
+
+/* Options whose argument is a file or directory cpp reads. */
+static const char *const mrccd_path_options[] = {
+    "-I", "-iquote", "-isystem", "-idirafter", "-include", "-imacros", NULL
+};
+
+/* A copy of @p path, moved below root if it is absolute. */
+static char *mrccd_rooted(const char *root, const char *path)
+{
+    char *s = NULL;
+
+    if (path[0] != '/')
+        return strdup(path);
+    if (asprintf(&s, "%s%s", root, path) == -1)
+        return NULL;
+    return s;
+}
+
+/*
+ * Move the absolute paths cpp reads in argv below root, and have the
+ * compiler name files as the client would.  input_fname is moved along.
+ */
+static int mrccd_root_argv(char ***argv_p, const char *root,
+                           char **input_fname)
+{
+    char **argv = *argv_p, **grown;
+    const char *opt;
+    char *s;
+    int i, j, n;
+    int moved = 0;
+
+    for (i = 1; argv[i]; i++) {
+        s = NULL;
+        if (str_equal(argv[i], *input_fname)) {
+            if ((s = mrccd_rooted(root, argv[i])) == NULL)
+                return EXIT_OUT_OF_MEMORY;
+            if (!moved) {
+                free(*input_fname);
+                if ((*input_fname = strdup(s)) == NULL) {
+                    free(s);
+                    return EXIT_OUT_OF_MEMORY;
+                }
+                moved = 1;
+            }
+        } else {
+            for (j = 0; (opt = mrccd_path_options[j]) != NULL; j++) {
+                if (str_equal(argv[i], opt) && argv[i + 1]) {
+                    /* the argument is the next word */
+                    i++;
+                    if ((s = mrccd_rooted(root, argv[i])) == NULL)
+                        return EXIT_OUT_OF_MEMORY;
+                    break;
+                }
+                if (str_startswith(opt, argv[i])
+                        && argv[i][strlen(opt)] == '/') {
+                    if (asprintf(&s, "%s%s%s", opt, root,
+                                 argv[i] + strlen(opt)) == -1)
+                        return EXIT_OUT_OF_MEMORY;
+                    break;
+                }
+            }
+            if (s == NULL)
+                continue;
+        }
+        free(argv[i]);
+        argv[i] = s;
+    }
+
+    n = argv_len(argv);
+    if ((grown = realloc(argv, (n + 2) * sizeof *argv)) == NULL)
+        return EXIT_OUT_OF_MEMORY;
+    *argv_p = argv = grown;
+    argv[n + 1] = NULL;
+    if (asprintf(&argv[n], "-ffile-prefix-map=%s=", root) == -1) {
+        argv[n] = NULL;
+        return EXIT_OUT_OF_MEMORY;
+    }
+    return 0;
+}
+
+/*
+ * Get what a pump mode compile reads, lay it out below a new directory
+ * root and change to the client's directory in there.
+ */
+static int mrccd_pump(int fd, char ***argv, const char *cwd,
+                      char **input_fname, char **root_ret)
+{
+    char *root = NULL, *dir = NULL;
+    int ret;
+
+    if (cwd[0] != '/' || strstr(cwd, "/../")) {
+        rs_log_error("bad directory \"%s\"", cwd);
+        return EXIT_PROTOCOL_ERROR;
+    }
+    if ((ret = make_tmpnam("mrccd_root", "", &root)))
+        return ret;
+    unlink(root);
+    if ((ret = mrcc_mkdir(root))) {
+        free(root);
+        return ret;
+    }
+    *root_ret = root;
+
+    if ((ret = mrccd_read_files(fd, root))
+            || (ret = mrccd_root_argv(argv, root, input_fname)))
+        return ret;
+    if (asprintf(&dir, "%s%s", root, cwd) == -1)
+        return EXIT_OUT_OF_MEMORY;
+    ret = mrcc_mkdir_p(dir);
+    if (ret == 0 && chdir(dir) == -1) {
+        rs_log_error("failed to chdir to %s: %s", dir, strerror(errno));
+        ret = EXIT_IO_ERROR;
+    }
+    free(dir);
+    return ret;
+}
+
+/*
+ * Serve one compile on fd.
+ * Returns 0 if the result went back to the client, whether or not the
+ * compile itself succeeded.
+ */
+static int mrccd_serve(int fd)
+{
+    char **argv = NULL, **outputs = NULL, **local_outputs = NULL;
+    char *input_fname = NULL, *local_input = NULL;
+    char *cwd = NULL, *root = NULL;
+    char *stdout_fname = NULL, *stderr_fname = NULL;
+    unsigned protover;
+    pid_t pid;
+    int status = 0;
+    int i, ret;
+
+    sock_set_timeout(fd, 300);
+    sock_nodelay(fd);
+
+    if ((ret = rpc_read_token(fd, "MRCC", &protover)))
+        goto out;
+    if (protover < MRCC_VER_1 || protover > MRCC_VER_3) {
+        rs_log_error("unsupported protocol version %u", protover);
+        ret = EXIT_PROTOCOL_ERROR;
+        goto out;
+    }
+    if ((ret = rpc_read_argv(fd, "ARGC", "ARGV", &argv))
+            || (protover == MRCC_VER_3
+                && (ret = rpc_read_string(fd, "CDIR", &cwd)))
+            || (ret = rpc_read_string(fd, "INPT", &input_fname))
+            || (ret = rpc_read_argv(fd, "OUTC", "OUTP", &outputs))
+            || (ret = mrccd_set_compiler(argv)))
+        goto out;
+
+    if (protover == MRCC_VER_3) {
+        /* the source stays where the headers expect it */
+        if ((ret = mrccd_pump(fd, &argv, cwd, &input_fname, &root)))
+            goto out;
+        if ((local_input = strdup(input_fname)) == NULL) {
+            ret = EXIT_OUT_OF_MEMORY;
+            goto out;
+        }
+        ret = mrccd_rewrite_argv(argv, input_fname, local_input,
+                                 outputs, &local_outputs);
+    } else {
+        if ((ret = mrccd_tmpnam("mrccd", input_fname, &local_input))
+                || (ret = mrccd_rewrite_argv(argv, input_fname, local_input,
+                                             outputs, &local_outputs)))
+            goto out;
+        ret = mrccd_read_input(fd, local_input);
+    }
+    if (ret
+            || (ret = make_tmpmem("mrccd_stdout", ".txt", &stdout_fname))
+            || (ret = make_tmpmem("mrccd_stderr", ".txt", &stderr_fname)))
+        goto out;
+
+    ret = spawn_child(argv, &pid, "/dev/null", stdout_fname, stderr_fname);
+    if (ret == 0) {
+        /* gives up if the client goes away */
+        ret = collect_child("cc", pid, &status, fd, 0);
+    }
+    if (ret)
+        goto out;
+    rs_log_info("compiled \"%s\": status %#x", input_fname, status);
+
+    if ((ret = rpc_xmit_token(fd, "DONE", protover))
+            || (ret = rpc_xmit_token(fd, "STAT", (unsigned) status))
+            || (ret = rpc_xmit_file(fd, "SERR", stderr_fname))
+            || (ret = rpc_xmit_file(fd, "SOUT", stdout_fname)))
+        goto out;
+    for (i = 0; local_outputs[i]; i++) {
+        if (status == 0)
+            ret = rpc_xmit_file(fd, "FILE", local_outputs[i]);
+        else
+            ret = rpc_xmit_token(fd, "NOFL", 0);
+        if (ret)
+            goto out;
+    }
+
+out:
+    if (argv)
+        free_argv(argv);
+    if (outputs)
+        free_argv(outputs);
+    if (local_outputs) {
+        for (i = 0; local_outputs[i]; i++)
+            free(local_outputs[i]);
+        free(local_outputs);
+    }
+    free(input_fname);
+    free(local_input);
+    free(cwd);
+    if (root) {
+        if (mrcc_remove_tree(root) == -1)
+            rs_log_warning("failed to remove %s: %s", root, strerror(errno));
+        free(root);
+    }
+    free(stdout_fname);
+    free(stderr_fname);
+    cleanup_tempfiles();
+    return ret;
+}
+
+/* Reap finished compiles; wait for one if there are too many. */
+static void mrccd_reap(int block)
+{
+    int status;
+
+    while (mrccd_n_children > 0) {
+        if (waitpid(-1, &status,
+                    block && mrccd_n_children >= mrccd_jobs ? 0 : WNOHANG) <= 0)
+            break;
+        mrccd_n_children--;
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    const char *listen_addr = "127.0.0.1";
+    int port = MRCCD_DEFAULT_PORT;
+    long ncpus;
+    int listen_fd, fd;
+    pid_t pid;
+    int i;
+
+    ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    mrccd_jobs = ncpus > 0 ? (int) ncpus : 1;
+
+    for (i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--help")) {
+            mrccd_show_help();
+            return 0;
+        } else if (!strcmp(argv[i], "--version")) {
+            mrccd_show_version();
+            return 0;
+        } else if (!strcmp(argv[i], "--listen") && i + 1 < argc) {
+            listen_addr = argv[++i];
+        } else if (!strcmp(argv[i], "--port") && i + 1 < argc) {
+            port = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--jobs") && i + 1 < argc
+                   && atoi(argv[i + 1]) > 0) {
+            mrccd_jobs = atoi(argv[++i]);
+        } else {
+            mrccd_show_usage();
+            return EXIT_BAD_ARGUMENTS;
+        }
+    }
+
+    set_trace_from_env();
+    trace_version();
+    ignore_sigpipe(1);
+
+    if (sock_listen(listen_addr, port, &listen_fd) != 0)
+        return EXIT_BIND_FAILED;
+
+    rs_log_notice("compiling on %s port %d, %d at a time",
+                  listen_addr, port, mrccd_jobs);
+
+    while (1) {
+        mrccd_reap(1);
+        fd = accept(listen_fd, NULL, NULL);
+        if (fd == -1) {
+            if (errno != EINTR)
+                rs_log_error("accept failed: %s", strerror(errno));
+            continue;
+        }
+        pid = fork();
+        if (pid == 0) {
+            close(listen_fd);
+            _exit(mrccd_serve(fd) ? EXIT_IO_ERROR : 0);
+        }
+        if (pid == -1)
+            rs_log_error("failed to fork: %s", strerror(errno));
+        else
+            mrccd_n_children++;
+        close(fd);
+    }
+}
@@ -30,43 +30,356 @@
 #include "args.h"
 #include "netfsutils.h"
 #include "trace.h"
+#include "lock.h"
+#include "io.h"
+#include "tempfile.h"
+#include "deadline.h"
+#include "events.h"
+#include "exec.h"
+#include "batch.h"
+#include "backend.h"
 
 
-// MapReduce operation command
-const char* mr_exec_cmd_prefix = "/lhome/mr/hadoop-0.20.2/bin/hadoop jar /lhome/mr/hadoop-0.20.2/contrib/streaming/hadoop-0.20.2-streaming.jar -mapper ";
-const char* mr_exec_cmd_mapper = "/usr/bin/mrcc-map ";
-const char* mr_exec_cmd_parameter = "-numReduceTasks 0 -input null -output ";
+// MapReduce operation command, run by hadoop_client()
+const char* mr_exec_cmd_jar = "/lhome/mr/hadoop-0.20.2/contrib/streaming/hadoop-0.20.2-streaming.jar";
 
-int mr_exec(char* argv, char* cpp_fname, char* out_fname)
+// one map task for every line of the input of a batch job
+const char* mr_exec_cmd_batch_lines = "mapred.line.input.format.linespermap=1";
+const char* mr_exec_cmd_batch_format = "org.apache.hadoop.mapred.lib.NLineInputFormat";
+
+// where the client of a job that may have to be killed writes its log
+static const char* mr_job_log = NULL;
+
+/**
+ * @brief Have the hadoop client of the jobs submitted from now on
+ * log into @p log_fname rather than to stderr, so that mr_kill_job()
+ * can find the job there.  They are not shown then.
+ */
+void mr_set_job_log(const char* log_fname)
+{
+    mr_job_log = log_fname;
+}
+
+/**
+ * @brief Kill the MapReduce job whose client logged into @p log_fname.
+ * The client says "Running job: JOBID" once the job is submitted; if it
+ * has not said so yet, there is no job to kill.
+ * @return 0 on success, otherwise error return code.
+ */
+int mr_kill_job(const char* log_fname)
+{
+    FILE* f;
+    char line[1024];
+    char job[128];
+    char* argv[5];
+    char* p;
+    int ret;
+
+    if ((f = fopen(log_fname, "r")) == NULL) {
+        return EXIT_NO_SUCH_FILE;
+    }
+    job[0] = '\0';
+    while (fgets(line, sizeof line, f)) {
+        if ((p = strstr(line, "Running job: ")) != NULL
+                && sscanf(p + 13, "%127[A-Za-z0-9_]", job) == 1) {
+            break;
+        }
+    }
+    fclose(f);
+    if (job[0] == '\0') {
+        rs_trace("no job to kill in %s", log_fname);
+        return 0;
+    }
+
+    argv[0] = (char*) hadoop_client();
+    argv[1] = "job";
+    argv[2] = "-kill";
+    argv[3] = job;
+    argv[4] = NULL;
+    rs_log_info("mr_kill_job: %s", job);
+    /* however late it is, the kill gets the time it needs */
+    deadline_stop();
+    ret = client_run(argv, "/dev/null", NULL);
+    return ret ? EXIT_MRCC_FAILED : 0;
+}
+
+/*
+ * Start the hadoop client of a job with arguments @p argv, for @p job.
+ * If it runs out of time, the job is killed too, for which its log is
+ * needed; unless mr_set_job_log() asked for it, the log goes to a temp
+ * file then, and is shown afterwards.
+ */
+static int mr_start_job(const char* what, char** argv, struct backend_job* job)
+{
+    char* cmd;
+    int ret;
+
+    job->log_fname = (char*) mr_job_log;
+    job->own_log = 0;
+    if (job->log_fname == NULL && deadline_left_ms() >= 0
+            && make_tmpmem("mrcc_job", ".log", &job->log_fname) == 0) {
+        job->own_log = 1;
+    }
+    if ((cmd = argv_tostr(argv)) != NULL) {
+        rs_log_info("%s: %s", what, cmd);
+        free(cmd);
+    }
+    /* if no slot can be had at all, the client runs anyway */
+    if (lock_client(&job->lock_fd) != 0) {
+        job->lock_fd = -1;
+    }
+    /* the job is submitted once the client says which it is */
+    ret = command_start(&job->cmd, "hadoop", argv, -1, NULL, job->log_fname,
+                        "Running job: ");
+    if (ret != 0) {
+        if (job->lock_fd != -1) {
+            mrcc_unlock(job->lock_fd);
+            job->lock_fd = -1;
+        }
+        return ret;
+    }
+    job->state = BACKEND_RUNNING;
+    return 0;
+}
+
+/* Show the log of the client of @p job if nobody else wants it. */
+static void mr_show_log(struct backend_job* job)
+{
+    if (job->own_log && job->log_fname) {
+        copy_file_to_fd(job->log_fname, STDERR_FILENO);
+    }
+}
+
+/*
+ * Wait for the client started by mr_start_job() to end, within the
+ * deadline.  If it takes too long, the client is killed, but the job
+ * stays BACKEND_RUNNING for hadoop_cancel().
+ *
+ * The client slot is only held until the job is submitted; from then
+ * on the client merely waits for the cluster, and the number of jobs
+ * in flight is not limited by MRCC_CLIENT_SLOTS.
+ */
+static int mr_finish_job(struct backend_job* job)
+{
+    long long running_us = 0;
+    long left = deadline_left_ms();
+    int status = -1;
+    int ret;
+
+    ret = command_wait_mark(&job->cmd, &running_us, left < 0 ? 0 : left + 1,
+                            &status);
+    if (job->lock_fd != -1) {
+        mrcc_unlock(job->lock_fd);
+        job->lock_fd = -1;
+    }
+    if (ret == 0 && job->cmd.pid != 0) {
+        left = deadline_left_ms();
+        ret = command_wait(&job->cmd, NULL, left < 0 ? 0 : left + 1, &status);
+    }
+    if (running_us != 0) {
+        event_end_at(EVENT_SUBMIT, running_us, 0, 0);
+        event_begin_at(EVENT_REMOTE, running_us);
+    }
+    if (ret == EXIT_TIMEOUT) {
+        rs_log_error("MapReduce job took too long");
+        return ret;
+    }
+    job->state = BACKEND_DONE;
+    mr_show_log(job);
+    if (ret == 0 && status != 0) {
+        ret = EXIT_CALL_MAPPER_FAILED;
+    }
+    return ret;
+}
+
+/* Run the hadoop client of a job with arguments @p argv to its end. */
+static int mr_run_job(const char* what, char** argv)
+{
+    struct backend_job job;
+    int ret;
+
+    backend_job_init(&job);
+    ret = mr_start_job(what, argv, &job);
+    if (ret == 0) {
+        ret = mr_finish_job(&job);
+    }
+    if (job.state == BACKEND_RUNNING) {
+        backend_hadoop.cancel(&job);
+    }
+    backend_job_free(&job);
+    return ret;
+}
+
+/*
+ * Submit the MapReduce job for one compile: one map task that runs
+ * mrcc-map on what backend_map_job() worked out.  With MRCC_BATCH, the
+ * compile shares a job with others instead, which hadoop_wait() runs.
+ */
+static int hadoop_submit(struct backend_job* job)
 {
     int ret;
     char* out_dir = NULL;
     char* fs_out_dir = NULL;
-    char* mr_argv = NULL;
+    char* mapper = NULL;
+    char* str_argv = NULL;
+    char* str_options = NULL;
 
-    out_dir = name_local_cpp_to_local_outdir(cpp_fname);
+    if (batch_enabled()) {
+        job->state = BACKEND_RUNNING;
+        return 0;
+    }
+
+    out_dir = name_local_cpp_to_local_outdir(job->cpp_fname);
     if (out_dir == NULL) {
         return EXIT_OUT_OF_MEMORY;
     }
 
     fs_out_dir = name_local_to_fs(out_dir);
+    free(out_dir);
     if (fs_out_dir == NULL) {
         return EXIT_OUT_OF_MEMORY;
     }
-    free(out_dir);
 
-    if (asprintf(&mr_argv, "%s \"%s %s %s %s\" %s %s",
-                    mr_exec_cmd_prefix,
-                    mr_exec_cmd_mapper, cpp_fname, out_fname, argv,
-                    mr_exec_cmd_parameter,
-                    fs_out_dir) == -1) {
-        return EXIT_OUT_OF_MEMORY;
+    /* streaming splits the mapper into its words itself */
+    if ((str_argv = argv_tostr(job->map_argv)) == NULL
+            || (str_options = argv_tostr(job->map_options)) == NULL
+            || asprintf(&mapper, "%s %s %s %s %s", backend_mapper(),
+                        str_options, job->cpp_fname, job->map_output_fname,
+                        str_argv) == -1) {
+        mapper = NULL;
+        ret = EXIT_OUT_OF_MEMORY;
+        goto out;
+    }
+    if ((ret = add_cleanup_fs(fs_out_dir)) != 0) {
+        goto out;
     }
-    rs_log_info("mr_exec: %s", mr_argv);
-    ret = system(mr_argv);
-    ret = add_cleanup_fs(fs_out_dir) || ret;
+    {
+        char* mr_argv[] = {
+            (char*) hadoop_client(), "jar", (char*) mr_exec_cmd_jar,
+            "-mapper", mapper,
+            "-numReduceTasks", "0", "-input", "null", "-output", fs_out_dir,
+            NULL
+        };
+        ret = mr_start_job("mr_exec", mr_argv, job);
+    }
+
+out:
+    free(str_argv);
+    free(str_options);
     free(fs_out_dir);
-    free(mr_argv);
+    free(mapper);
+    return ret;
+}
+
+static int hadoop_wait(struct backend_job* job)
+{
+    int ret;
+
+    if (job->cmd.pid != 0) {
+        return mr_finish_job(job);
+    }
+    /* share one MapReduce job with the other compiles going on */
+    ret = batch_exec(job->map_argv, job->map_options, job->cpp_fname,
+                     job->map_output_fname);
+    job->state = BACKEND_DONE;
+    return ret;
+}
+
+/* Kill the client, and the job if it got as far as being submitted. */
+static int hadoop_cancel(struct backend_job* job)
+{
+    int ret = 0;
+
+    command_kill(&job->cmd);
+    if (job->lock_fd != -1) {
+        mrcc_unlock(job->lock_fd);
+        job->lock_fd = -1;
+    }
+    if (job->log_fname) {
+        ret = mr_kill_job(job->log_fname);
+        mr_show_log(job);
+    }
+    job->state = BACKEND_IDLE;
+    return ret;
+}
+
+static enum backend_state hadoop_status(struct backend_job* job)
+{
+    if (job->state == BACKEND_RUNNING && job->cmd.pid != 0
+            && command_done(&job->cmd)) {
+        return BACKEND_DONE;
+    }
+    return job->state;
+}
+
+// Hadoop streaming, see backend.c
+const struct backend backend_hadoop = {
+    "hadoop", BACKEND_CAP_NETFS | BACKEND_CAP_CANCEL | BACKEND_CAP_BATCH,
+    hadoop_submit, hadoop_wait, hadoop_cancel, hadoop_status
+};
 
+/**
+ * @brief Run one MapReduce job for a batch of compiles.
+ * The list is put to net fs as the job's input.  Every line of it is
+ * the command line of one mrcc-map run, as made by batch_argv_toline(),
+ * and is given to its own map task.
+ * @param list_fname local file listing the compiles.
+ * @return 0 if the job succeeded, otherwise error return code.
+ */
+int mr_exec_batch(char* list_fname)
+{
+    int ret, cleanup_ret;
+    char* fs_list_fname = NULL;
+    char* out_dir = NULL;
+    char* fs_out_dir = NULL;
+    char* mapper = NULL;
+
+    fs_list_fname = name_local_to_fs(list_fname);
+    out_dir = name_local_cpp_to_local_outdir(list_fname);
+    if (fs_list_fname == NULL || out_dir == NULL) {
+        ret = EXIT_OUT_OF_MEMORY;
+        goto out;
+    }
+    fs_out_dir = name_local_to_fs(out_dir);
+    if (fs_out_dir == NULL) {
+        ret = EXIT_OUT_OF_MEMORY;
+        goto out;
+    }
+
+    if (put_file_fs(list_fname, fs_list_fname) != 0) {
+        rs_log_error("put batch list \"%s\" to net fs failed", list_fname);
+        ret = EXIT_PUT_CPP_FS_FAILED;
+        goto out;
+    }
+    if ((ret = add_cleanup_fs(fs_list_fname)) != 0)
+        goto out;
+
+    if (asprintf(&mapper, "%s --batch", backend_mapper()) == -1) {
+        ret = EXIT_OUT_OF_MEMORY;
+        goto out;
+    }
+    {
+        char* mr_argv[] = {
+            (char*) hadoop_client(), "jar", (char*) mr_exec_cmd_jar,
+            "-D", (char*) mr_exec_cmd_batch_lines,
+            "-inputformat", (char*) mr_exec_cmd_batch_format,
+            "-mapper", mapper,
+            "-numReduceTasks", "0", "-input", fs_list_fname,
+            "-output", fs_out_dir,
+            NULL
+        };
+        ret = mr_run_job("mr_exec_batch", mr_argv);
+    }
+    /* a failed job keeps its own error code */
+    cleanup_ret = add_cleanup_fs(fs_out_dir);
+    if (ret == 0) {
+        ret = cleanup_ret;
+    }
+
+out:
+    free(mapper);
+    free(fs_out_dir);
+    free(out_dir);
+    free(fs_list_fname);
     return ret;
 }
@@ -2,4 +2,6 @@
 // Zhiqiang Ma, https://www.ericzma.com
 #pragma once
 
-int mr_exec(char* argv, char* cpp_fname, char* out_fname);
+int mr_exec_batch(char* list_fname);
+void mr_set_job_log(const char* log_fname);
+int mr_kill_job(const char* log_fname);
@@ -29,11 +29,23 @@
 #include "stringutils.h"
 #include "trace.h"
 #include "cleanup.h"
+#include "files.h"
+#include "netfsutils.h"
+#include "http.h"
+#include "webhdfs.h"
+#include "lock.h"
+#include "exec.h"
+#include "io.h"
 
-// net fs oporation command
-const char* put_file_fs_cmd = "/lhome/mr/hadoop-0.20.2/bin/hadoop dfs -put";
-const char* get_file_fs_cmd = "/lhome/mr/hadoop-0.20.2/bin/hadoop dfs -get";
-const char* del_file_fs_cmd = "/lhome/mr/hadoop-0.20.2/bin/hadoop dfs -rmr";
+// the hadoop client, see hadoop_client()
+const char* hadoop_cmd = "/lhome/mr/hadoop-0.20.2/bin/hadoop";
+
+// net fs oporation command, given to "hadoop dfs"
+const char* put_file_fs_cmd = "-put";
+const char* get_file_fs_cmd = "-get";
+const char* del_file_fs_cmd = "-rmr";
+const char* mv_file_fs_cmd = "-mv";
+const char* ls_dir_fs_cmd = "-ls";
 
 // top dir of temp files in net fs
 const char* fs_top_dir = "mrcc";
@@ -47,6 +59,82 @@ const char* fs_out_dir_suffix = ".odir";
 // the prefix for noting the file is on net fs when clean up
 const char* net_file_prefix_for_clean_up = "#";
 
+// prefix of the hour directories under fs_top_dir
+const char* fs_hour_dir_prefix = "t";
+
+// this process' directory of temp files in net fs, see fs_work_dir()
+static char* fs_session_dir = NULL;
+
+/**
+ * @brief Return the directory of this session's temp files on net fs.
+ * That is fs_top_dir/tHOUR/SESSION, where HOUR is the start of the hour
+ * the session started in, in seconds since the epoch, and SESSION is
+ * $MRCC_SESSION or else the host name and pid.  Setting $MRCC_SESSION
+ * for a whole build keeps its files together.  "mrcc --gc" removes whole
+ * hours once they are older than the time to live.
+ * @return the directory, or NULL if out of memory.
+ */
+const char* fs_work_dir(void)
+{
+    const char* session = getenv("MRCC_SESSION");
+    char host[256];
+    char* id = NULL;
+    char* p;
+    time_t now;
+    int ret;
+
+    if (fs_session_dir) {
+        return fs_session_dir;
+    }
+
+    if (session && session[0]) {
+        id = strdup(session);
+    } else {
+        if (gethostname(host, sizeof host) == -1) {
+            strcpy(host, "localhost");
+        }
+        host[sizeof host - 1] = '\0';
+        if (asprintf(&id, "%s-%ld", host, (long) getpid()) == -1) {
+            id = NULL;
+        }
+    }
+    if (id == NULL) {
+        return NULL;
+    }
+    for (p = id; *p; p++) {
+        if (*p == '/') {
+            *p = '_';
+        }
+    }
+
+    now = time(NULL);
+    ret = asprintf(&fs_session_dir, "%s/%s%lld/%s", fs_top_dir,
+                   fs_hour_dir_prefix, (long long) (now - now % 3600), id);
+    free(id);
+    if (ret == -1) {
+        fs_session_dir = NULL;
+    }
+    return fs_session_dir;
+}
+
+/**
+ * @brief Use @p dir for temp files on net fs instead of fs_work_dir().
+ * mrcc-map uses this to find the files of the session it works for.
+ * @param dir the directory, or NULL to go back to the default.
+ * @return 0 on success, or error return code.
+ */
+int set_fs_work_dir(const char* dir)
+{
+    char* copy = NULL;
+
+    if (dir && (copy = strdup(dir)) == NULL) {
+        return EXIT_OUT_OF_MEMORY;
+    }
+    free(fs_session_dir);
+    fs_session_dir = copy;
+    return 0;
+}
+
 
 /**
  * @brief Append out file suffix to cpp_fname.
@@ -83,7 +171,7 @@ name_local_cpp_to_local_outdir(char* cpp_fname)
 }
 
 /**
- * @brief Prepend the fs_top_dir string before a local filename.
+ * @brief Prepend the fs_work_dir() string before a local filename.
  * Caller is responsible for free()ing the returned string.
  * @param local filename of the local file.
  * @return filename with fs_out_file_suffix appended, or NULL on failure.
@@ -91,15 +179,20 @@ name_local_cpp_to_local_outdir(char* cpp_fname)
 char*
 name_local_to_fs(char* localname)
 {
+    const char* dir = fs_work_dir();
     char* fsname = NULL;
-    if (asprintf(&fsname, "%s%s", fs_top_dir, localname) == -1) {
+
+    if (dir == NULL) {
+        return NULL;
+    }
+    if (asprintf(&fsname, "%s%s", dir, localname) == -1) {
         return NULL;
     }
     return fsname;
 }
 
 /**
- * @brief Remove the fs_top_dir string from a file system filename.
+ * @brief Remove the fs_work_dir() string from a file system filename.
  * Caller is responsible for free()ing the returned string.
  * @param fsname filename in the file system.
  * @return filename with fs_out_file_suffix removed, or NULL on failure.
@@ -107,48 +200,222 @@ name_local_to_fs(char* localname)
 char*
 name_fs_to_local(char* fsname)
 {
-    if (!str_startswith(fs_top_dir, fsname)) {
+    const char* dir = fs_work_dir();
+
+    if (dir == NULL || !str_startswith(dir, fsname)) {
         return NULL;
     }
-    return strdup(fsname + strlen(fs_top_dir));
+    return strdup(fsname + strlen(dir));
+}
+
+/**
+ * @brief Return the hadoop client to run: $MRCC_HADOOP if it is set,
+ * such as mrcc-hadoop for a cluster emulated on this machine, otherwise
+ * hadoop_cmd.
+ */
+const char* hadoop_client(void)
+{
+    const char* cmd = getenv("MRCC_HADOOP");
+
+    return cmd && cmd[0] ? cmd : hadoop_cmd;
+}
+
+/*
+ * run "hadoop dfs OP A B", B being optional
+ * returns what client_run() does
+ */
+static int fs_run(const char* op, char* a, char* b)
+{
+    char* argv[6];
+
+    argv[0] = (char*) hadoop_client();
+    argv[1] = "dfs";
+    argv[2] = (char*) op;
+    argv[3] = a;
+    argv[4] = b;
+    argv[5] = NULL;
+    return client_run(argv, NULL, NULL);
+}
+
+/*
+ * start "hadoop dfs OP [DASH] NAME" with @p in_fd or @p out_fd, if not
+ * -1, as its stdin or stdout
+ */
+static int fs_spawn(const char* op, char* dash, char* name, int in_fd,
+                    int out_fd, pid_t* pid)
+{
+    char* argv[6];
+    int i = 0;
+
+    argv[i++] = (char*) hadoop_client();
+    argv[i++] = "dfs";
+    argv[i++] = (char*) op;
+    if (dash)
+        argv[i++] = dash;
+    argv[i++] = name;
+    argv[i] = NULL;
+    return spawn_command(argv, pid, in_fd, out_fd, -1);
 }
 
 /**
  * @brief Put file to net fs.
+ * Goes through the in-process WebHDFS client if it is configured,
+ * otherwise through the hadoop shell.
  * @param localsrc local source filename.
  * @param dst destination filename.
  * @return 0 on success, or error return code.
  */
 int put_file_fs(char* localsrc, char* dst)
 {
-    int ret;
-    char* args = NULL;
-    if (asprintf(&args, "%s %s %s",
-                put_file_fs_cmd, localsrc, dst) == -1) {
+    if (webhdfs_enabled()) {
+        return webhdfs_put(localsrc, dst);
+    }
+    return fs_run(put_file_fs_cmd, localsrc, dst);
+}
+
+/**
+ * A file being put to net fs while its data is still being produced.
+ **/
+struct fs_writer {
+    char* fsname;
+    int pipe_fd;                /* into "hadoop dfs -put -", or -1 */
+    pid_t pid;                  /* of that */
+    struct http_conn conn;      /* WebHDFS upload, if pipe_fd is -1 */
+    int lock_fd;                /* client slot held by the pipe, or -1 */
+    long long bytes;
+};
+
+/**
+ * @brief Start putting a file to net fs whose length is not known yet.
+ * Feed it with write_writer_fs() and finish with close_writer_fs().
+ * @param dst destination filename.
+ * @param w_ret receives the writer.
+ * @return 0 on success, or error return code.
+ */
+int open_writer_fs(char* dst, struct fs_writer** w_ret)
+{
+    struct fs_writer* w;
+    int fds[2];
+    int ret = 0;
+
+    if ((w = calloc(1, sizeof *w)) == NULL
+            || (w->fsname = strdup(dst)) == NULL) {
+        free(w);
         return EXIT_OUT_OF_MEMORY;
     }
-    ret = system(args);
-    free(args);
+    w->lock_fd = -1;
+    w->pipe_fd = -1;
+
+    if (webhdfs_enabled()) {
+        ret = webhdfs_create(dst, &w->conn);
+    } else if (pipe(fds) == -1) {
+        rs_log_error("failed to create pipe: %s", strerror(errno));
+        ret = EXIT_IO_ERROR;
+    } else {
+        /* later children have no business with either end */
+        fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+        fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+        if (lock_client(&w->lock_fd) != 0) {
+            w->lock_fd = -1;
+        }
+        ret = fs_spawn(put_file_fs_cmd, "-", dst, fds[0], -1, &w->pid);
+        close(fds[0]);
+        if (ret == 0) {
+            w->pipe_fd = fds[1];
+        } else {
+            close(fds[1]);
+        }
+    }
+
+    if (ret) {
+        if (w->lock_fd != -1) {
+            mrcc_unlock(w->lock_fd);
+        }
+        free(w->fsname);
+        free(w);
+        return ret;
+    }
+    *w_ret = w;
+    return 0;
+}
+
+/**
+ * @brief Send more data of a file opened with open_writer_fs().
+ * @return 0 on success, or error return code.
+ */
+int write_writer_fs(struct fs_writer* w, const void* buf, size_t n)
+{
+    int ret;
+
+    if (n == 0) {
+        return 0;
+    }
+    if (w->pipe_fd != -1) {
+        ret = writex(w->pipe_fd, buf, n);
+    } else {
+        ret = http_send_chunk(&w->conn, buf, n);
+    }
+    if (ret == 0) {
+        w->bytes += n;
+    }
     return ret;
 }
 
 /**
- * @brief Put file to net fs.
+ * @brief Complete or abandon a file opened with open_writer_fs().
+ * An abandoned file is removed from net fs.
+ * @param w the writer, which is freed.
+ * @param abandon nonzero to give up on the file.
+ * @return 0 if the file was stored, or error return code.
+ */
+int close_writer_fs(struct fs_writer* w, int abandon)
+{
+    int status;
+    int ret;
+
+    if (w->pipe_fd != -1) {
+        close(w->pipe_fd);
+        ret = collect_child("hadoop", w->pid, &status, timeout_null_fd, 0);
+        if (ret == 0 && status != 0) {
+            ret = EXIT_IO_ERROR;
+        }
+        if (w->lock_fd != -1) {
+            mrcc_unlock(w->lock_fd);
+        }
+    } else if (abandon) {
+        http_close(&w->conn);
+        ret = 0;
+    } else {
+        ret = webhdfs_create_finish(&w->conn, w->fsname);
+    }
+
+    if (abandon || ret != 0) {
+        del_file_fs(w->fsname);
+    } else {
+        rs_trace("streamed %lld bytes to %s", w->bytes, w->fsname);
+    }
+    if (abandon && ret == 0) {
+        ret = EXIT_IO_ERROR;
+    }
+    free(w->fsname);
+    free(w);
+    return ret;
+}
+
+/**
+ * @brief Get file from net fs.
+ * Goes through the in-process WebHDFS client if it is configured,
+ * otherwise through the hadoop shell.
  * @param src source filename.
  * @param localdst local destination filename.
  * @return 0 on success, or error return code.
  */
 int get_file_fs(char* src, char* localdst)
 {
-    int ret;
-    char* args = NULL;
-    if (asprintf(&args, "%s %s %s",
-                get_file_fs_cmd, src, localdst) == -1) {
-        return EXIT_OUT_OF_MEMORY;
+    if (webhdfs_enabled()) {
+        return webhdfs_get(src, localdst);
     }
-    ret = system(args);
-    free(args);
-    return ret;
+    return fs_run(get_file_fs_cmd, src, localdst);
 }
 
 /*
@@ -156,16 +423,193 @@ int get_file_fs(char* src, char* localdst)
  */
 int del_file_fs(char* fname)
 {
-    int ret;
-    char* args = NULL;
-    if (asprintf(&args, "%s %s", del_file_fs_cmd, fname) == -1) {
+    if (webhdfs_enabled()) {
+        return webhdfs_delete(fname);
+    }
+    return fs_run(del_file_fs_cmd, fname, NULL);
+}
+
+/**
+ * @brief Delete several files or directory trees from net fs at once.
+ * Without WebHDFS, this runs one hadoop command for as many of them as
+ * fit on a command line, instead of one command each.  Files that do
+ * not exist are not an error.
+ * @param fnames filenames on net fs.
+ * @param n number of filenames.
+ * @return 0 on success, or error return code of the last failure.
+ */
+int del_files_fs(char** fnames, int n)
+{
+    const size_t max_args = 32768;
+    char** argv;
+    size_t len;
+    int i, j, r;
+    int ret = 0;
+
+    if (webhdfs_enabled()) {
+        for (i = 0; i < n; i++) {
+            r = webhdfs_delete(fnames[i]);
+            if (r != 0 && r != EXIT_NO_SUCH_FILE) {
+                ret = r;
+            }
+        }
+        return ret;
+    }
+
+    if ((argv = malloc((n + 4) * sizeof *argv)) == NULL) {
         return EXIT_OUT_OF_MEMORY;
     }
-    ret = system(args);
-    free(args);
+    argv[0] = (char*) hadoop_client();
+    argv[1] = "dfs";
+    argv[2] = (char*) del_file_fs_cmd;
+    for (i = 0; i < n; ) {
+        /* as many names as fit on a command line, but at least one */
+        j = 3;
+        len = 0;
+        do {
+            len += strlen(fnames[i]) + 1;
+            argv[j++] = fnames[i++];
+        } while (i < n && len + strlen(fnames[i]) < max_args);
+        argv[j] = NULL;
+
+        if (client_run(argv, NULL, NULL) != 0) {
+            rs_log_warning("deleting %d files from net fs failed", j - 3);
+            ret = EXIT_IO_ERROR;
+        }
+    }
+    free(argv);
     return ret;
 }
 
+/**
+ * @brief Rename a file on net fs.
+ * @param src current filename.
+ * @param dst new filename; its parent directory must exist.
+ * @return 0 on success, or error return code.
+ */
+int rename_file_fs(char* src, char* dst)
+{
+    if (webhdfs_enabled()) {
+        return webhdfs_rename(src, dst);
+    }
+    return fs_run(mv_file_fs_cmd, src, dst);
+}
+
+/*
+ * parse one line of "hadoop dfs -ls" output, e.g.
+ * -rw-r--r--   3 mr supergroup   1234 2010-06-01 12:34 /user/mr/mrcc/x.o
+ */
+static int parse_ls_line(const char* line, struct fs_entry* e)
+{
+    char perms[16], date[16], hhmm[16], path[4096];
+    struct tm tm;
+
+    if (sscanf(line, "%15s %*s %*s %*s %lld %15s %15s %4095s",
+                perms, &e->size, date, hhmm, path) != 5) {
+        return -1;
+    }
+    memset(&tm, 0, sizeof tm);
+    if (sscanf(date, "%d-%d-%d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday) != 3
+            || sscanf(hhmm, "%d:%d", &tm.tm_hour, &tm.tm_min) != 2) {
+        return -1;
+    }
+    tm.tm_year -= 1900;
+    tm.tm_mon -= 1;
+    tm.tm_isdst = -1;
+    e->mtime = e->atime = (long long) mktime(&tm);
+    e->is_dir = (perms[0] == 'd');
+    e->name = strdup(find_basename(path));
+    return e->name ? 0 : -1;
+}
+
+/**
+ * @brief List a directory on net fs.
+ * @param dir directory name.
+ * @param entries_ret receives a malloc'd array, to be released with
+ * free_fs_entries().
+ * @param n_ret receives the number of entries.
+ * @return 0 on success, or error return code.
+ */
+int list_dir_fs(char* dir, struct fs_entry** entries_ret, int* n_ret)
+{
+    struct fs_entry* entries = NULL;
+    struct fs_entry* grown;
+    char line[8192];
+    FILE* ls;
+    pid_t pid;
+    int fds[2];
+    int n = 0, size = 0;
+    int lock_fd;
+    int status;
+    int ret;
+
+    if (webhdfs_enabled()) {
+        return webhdfs_list(dir, entries_ret, n_ret);
+    }
+    if (pipe(fds) == -1) {
+        rs_log_error("failed to create pipe: %s", strerror(errno));
+        return EXIT_IO_ERROR;
+    }
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    if (lock_client(&lock_fd) != 0) {
+        lock_fd = -1;
+    }
+    ret = fs_spawn(ls_dir_fs_cmd, NULL, dir, -1, fds[1], &pid);
+    close(fds[1]);
+    if (ret != 0 || (ls = fdopen(fds[0], "r")) == NULL) {
+        rs_log_error("failed to list \"%s\"", dir);
+        close(fds[0]);
+        if (ret == 0) {
+            /* it gets EPIPE, if it has anything to say */
+            collect_child("hadoop", pid, &status, timeout_null_fd, 0);
+        }
+        if (lock_fd != -1) {
+            mrcc_unlock(lock_fd);
+        }
+        return EXIT_IO_ERROR;
+    }
+    while (fgets(line, sizeof line, ls) != NULL) {
+        if (n == size) {
+            size = size ? size * 2 : 64;
+            grown = realloc(entries, size * sizeof *entries);
+            if (grown == NULL) {
+                break;
+            }
+            entries = grown;
+        }
+        memset(&entries[n], 0, sizeof entries[n]);
+        if (parse_ls_line(line, &entries[n]) == 0) {
+            n++;
+        }
+    }
+    fclose(ls);
+    ret = collect_child("hadoop", pid, &status, timeout_null_fd, 0);
+    if (lock_fd != -1) {
+        mrcc_unlock(lock_fd);
+    }
+    if (ret != 0 || status != 0) {
+        free_fs_entries(entries, n);
+        return EXIT_NO_SUCH_FILE;
+    }
+    *entries_ret = entries;
+    *n_ret = n;
+    return 0;
+}
+
+/**
+ * @brief Release what list_dir_fs() returned.
+ */
+void free_fs_entries(struct fs_entry* entries, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        free(entries[i].name);
+    }
+    free(entries);
+}
+
 /*
  * delete dir from net fs
  * we use del_file_fs instead, dir and file is no deference for net fs
@@ -173,14 +617,7 @@ int del_file_fs(char* fname)
 /*
 int del_dir_fs(char* fname)
 {
-    int ret;
-    char* args = NULL;
-    if (asprintf(&args, "%s %s", del_dir_fs_cmd, fname) == -1) {
-        return EXIT_OUT_OF_MEMORY;
-    }
-    ret = system(args);
-    free(args);
-    return ret;
+    return fs_run(del_dir_fs_cmd, fname, NULL);
 }
 */
 
@@ -200,6 +637,11 @@ int add_cleanup_fs(char* fname)
 {
     char* fs_fname = NULL;
     int ret;
+
+    /* with MRCC_FS_CLEANUP=0 "mrcc --gc" is left to do it */
+    if (!getenv_bool("MRCC_FS_CLEANUP", 1)) {
+        return 0;
+    }
     ret = asprintf(&fs_fname, "%s%s", net_file_prefix_for_clean_up, fname);
     if (ret == -1) {
         rs_log_error("out of memory when add_cleanup_fs");
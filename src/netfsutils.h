@@ -2,6 +2,13 @@
 // Zhiqiang Ma, https://www.ericzma.com
 #pragma once
 
+// include for size_t
+#include <stddef.h>
+
+// the hadoop client
+extern const char* hadoop_cmd;
+const char* hadoop_client(void);
+
 // top dir of temp files in net fs
 extern const char* fs_top_dir;
 // output file suffix
@@ -12,14 +19,40 @@ extern const char* fs_out_dir_suffix;
 // the prefix for noting the file is on net fs when clean up
 extern const char* net_file_prefix_for_clean_up;
 
+// prefix of the hour directories under fs_top_dir
+extern const char* fs_hour_dir_prefix;
+
+/**
+ * A file or directory in a net fs directory listing.
+ **/
+struct fs_entry {
+    char* name;                 /**< name within the directory */
+    long long size;             /**< length in bytes */
+    long long mtime;            /**< modification time, seconds since epoch */
+    long long atime;            /**< access time, if the fs keeps it */
+    int is_dir;
+};
+
+struct fs_writer;
+
 char* name_local_cpp_to_local_outfile(char* cpp_fname);
 char* name_local_cpp_to_local_outdir(char* cpp_fname);
 
 int get_file_fs(char* srt, char* localdst);
 int put_file_fs(char* localsrc, char* dst);
+int open_writer_fs(char* dst, struct fs_writer** w_ret);
+int write_writer_fs(struct fs_writer* w, const void* buf, size_t n);
+int close_writer_fs(struct fs_writer* w, int abandon);
 int del_file_fs(char* fname);
+int del_files_fs(char** fnames, int n);
+int rename_file_fs(char* src, char* dst);
+int list_dir_fs(char* dir, struct fs_entry** entries_ret, int* n_ret);
+void free_fs_entries(struct fs_entry* entries, int n);
 //int del_dir_fs(char* fname);
 
+const char* fs_work_dir(void);
+int set_fs_work_dir(const char* dir);
+
 char* name_local_to_fs(char* localname);
 char* name_fs_to_local(char* fsname);
 
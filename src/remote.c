@@ -11,6 +11,7 @@
 #include <ctype.h>
 #include <assert.h>
 #include <fcntl.h>
+#include <limits.h>
 
 #include <sys/fcntl.h>
 #include <errno.h>
@@ -31,20 +32,29 @@
 #include "exec.h"
 #include "remote.h"
 //#include "state.h"
-//#include "lock.h"
+#include "lock.h"
 #include "netfsutils.h"
 #include "stringutils.h"
-#include "mrutils.h"
+#include "fscache.h"
+#include "compress.h"
+#include "io.h"
+#include "rpc.h"
+#include "sockets.h"
+#include "tempfile.h"
+#include "hash.h"
 #include "compile.h"
+#include "deadline.h"
+#include "events.h"
+#include "backend.h"
 
 /**
  * @brief Wait for cpp to finish (if not already done), check the result, then send the .i file.
- * @param cpp_pid pid of the C preprocessor.
+ * @param cpp_pid pid of the C preprocessor, or 0 if it was already collected.
  * @param status pointer to an int to receive the status.
  * @param input_fname input filename (C source)
  * @return 0 on success, or error return code.
  */
-static int
+int
 wait_for_cpp(pid_t cpp_pid, int *status, const char *input_fname)
 {
     int ret;
@@ -54,23 +64,37 @@ wait_for_cpp(pid_t cpp_pid, int *status, const char *input_fname)
         /* Wait for cpp to finish (if not already done), check the
          * result, then send the .i file */
 
-        ret = collect_child("cpp", cpp_pid, status, timeout_null_fd);
-        if (ret)
+        ret = collect_child("cpp", cpp_pid, status, timeout_null_fd,
+                            deadline_limit_ms(DEADLINE_CPP));
+        if (ret) {
+            event_end(EVENT_CPP, 0, ret);
             return ret;
+        }
 
         /* Although cpp failed, there is no need to try running the command
          * locally, because we'd presumably get the same result.  Therefore
          * critique the command and log a message and return an indication
          * that compilation is complete. */
         ret = critique_status(*status, "cpp", input_fname, hostdef_local, 0);
+        event_end(EVENT_CPP, 0, ret);
         if (ret)
             return 0;
     }
     return 0;
 }
 
+/* Size of @p fname, or 0 if it is not there, for the event log. */
+static long long file_bytes(const char* fname)
+{
+    struct stat st;
+
+    return stat(fname, &st) == 0 ? (long long) st.st_size : 0;
+}
+
 /**
  * @brief Put a preprocessed file on the filesystem.
+ * With $MRCC_COMPRESS set, the file is compressed on the way, under the
+ * same name on net fs; mrcc-map recognizes and decompresses it.
  * @param cpp_fname
  * @return 0 on success,
  */
@@ -78,18 +102,141 @@ int put_cpp_fs(char* cpp_fname)
 {
     int ret;
     char *out = NULL;
+    char *packed_fname = NULL;
+    enum compress compr;
+    struct stat st_raw, st_packed;
+    int fd;
+
     out = name_local_to_fs(cpp_fname);
     if (out == NULL) {
         return EXIT_OUT_OF_MEMORY;
     }
-    ret = put_file_fs(cpp_fname, out);
+
+    compr = compress_from_env();
+    if (compr != MRCC_COMPRESS_NONE) {
+        if ((ret = make_tmpmem("mrcc_cpp", ".z", &packed_fname)) != 0) {
+            free(out);
+            return ret;
+        }
+        if ((ret = compress_file(compr, cpp_fname, packed_fname)) != 0) {
+            rs_log_warning("compressing \"%s\" failed, sending it as is", cpp_fname);
+            /* whatever it left is not needed; the cleanup list still
+             * has the name, and the descriptor if it is in memory */
+            if ((fd = tmpmem_fd(packed_fname)) != -1) {
+                if (ftruncate(fd, 0) == -1)
+                    rs_trace("failed to empty %s: %s", packed_fname,
+                             strerror(errno));
+            } else if (unlink(packed_fname) == -1 && errno != ENOENT) {
+                rs_log_warning("failed to remove %s: %s", packed_fname,
+                               strerror(errno));
+            }
+            free(packed_fname);
+            packed_fname = NULL;
+        } else if (stat(cpp_fname, &st_raw) == 0
+                   && stat(packed_fname, &st_packed) == 0) {
+            rs_log_info("%s: %ld bytes compressed to %ld with %s",
+                        cpp_fname, (long) st_raw.st_size,
+                        (long) st_packed.st_size, compress_name(compr));
+        }
+    }
+
+    event_begin(EVENT_UPLOAD);
+    ret = put_file_fs(packed_fname ? packed_fname : cpp_fname, out);
     if (ret != 0) {
         ret = EXIT_PUT_CPP_FS_FAILED;
     }
+    event_end(EVENT_UPLOAD,
+              file_bytes(packed_fname ? packed_fname : cpp_fname), ret);
+    free(packed_fname);
     free(out);
     return ret;
 }
 
+/* Where stream_sink() sends its data. */
+struct stream_out {
+    struct fs_writer* w;
+    long long bytes;
+};
+
+/* Hand streamed data to the net fs writer. */
+static int stream_sink(void* arg, const void* buf, size_t n)
+{
+    struct stream_out* o = arg;
+
+    o->bytes += n;
+    return write_writer_fs(o->w, buf, n);
+}
+
+/**
+ * @brief Put the output of a running preprocessor on the filesystem.
+ * The data goes out while cpp is still producing it, compressed if
+ * $MRCC_COMPRESS says so, and nothing is written locally.  The file is
+ * only left on net fs if cpp succeeds.
+ * @param cpp_fd read end of the pipe from cpp; it is closed.
+ * @param cpp_fname name reserved for the preprocessed file.
+ * @param cpp_pid pid of the preprocessor, which is waited for.
+ * @param status receives the wait status of cpp.
+ * @param input_fname input filename (C source)
+ * @return 0 on success, or error return code.
+ */
+int stream_cpp_fs(int cpp_fd, char* cpp_fname, pid_t cpp_pid, int* status,
+        const char* input_fname)
+{
+    struct fs_writer* w = NULL;
+    struct stream_out o;
+    enum compress compr = compress_from_env();
+    char buf[65536];
+    char* out;
+    ssize_t r;
+    int ret, wait_ret;
+
+    event_begin(EVENT_UPLOAD);
+    if ((out = name_local_to_fs(cpp_fname)) == NULL) {
+        ret = EXIT_OUT_OF_MEMORY;
+    } else {
+        ret = open_writer_fs(out, &w);
+        free(out);
+    }
+
+    o.w = w;
+    o.bytes = 0;
+    if (ret == 0 && compr != MRCC_COMPRESS_NONE) {
+        ret = compress_stream(compr, cpp_fd, stream_sink, &o);
+    } else if (ret == 0) {
+        while ((r = read(cpp_fd, buf, sizeof buf)) != 0) {
+            if (r == -1 && errno == EINTR) {
+                continue;
+            }
+            if (r == -1) {
+                rs_log_error("failed to read from cpp: %s", strerror(errno));
+                ret = EXIT_IO_ERROR;
+                break;
+            }
+            if ((ret = stream_sink(&o, buf, r)) != 0) {
+                break;
+            }
+        }
+    }
+
+    /* if we gave up early, this makes cpp give up too */
+    close(cpp_fd);
+    wait_ret = wait_for_cpp(cpp_pid, status, input_fname);
+
+    if (w != NULL) {
+        r = close_writer_fs(w, ret != 0 || wait_ret != 0 || *status != 0);
+        if (ret == 0 && wait_ret == 0 && *status == 0) {
+            ret = r;
+        }
+    }
+    if (ret != 0) {
+        rs_log_error("streaming \"%s\" to net fs failed", cpp_fname);
+        event_end(EVENT_UPLOAD, o.bytes, EXIT_PUT_CPP_FS_FAILED);
+        return EXIT_PUT_CPP_FS_FAILED;
+    }
+    event_end(EVENT_UPLOAD, o.bytes, wait_ret);
+    return wait_ret;
+}
+
 /*
  * generate config file and put it to net fs
  * return 0 if success
@@ -166,6 +313,9 @@ int clean_up_dir_fs(char* local_fname)
  * @param cpp_pid If nonzero, the pid of the preprocessor.  Must be
  * allowed to complete before we send the input file.
  *
+ * @param cpp_fd If not -1, cpp writes into this pipe rather than into
+ * @p cpp_fname, and its output is streamed to the fs as it comes.
+ *
  * @param local_cpu_lock_fd If != -1, file descriptor for the lock file.
  * Should be != -1 iff (host->cpp_where != CPP_ON_SERVER).
  * If != -1, the lock must be held on entry to this function,
@@ -178,27 +328,40 @@ static int put_cpp_config_fs(char** argv,
                        char* cpp_fname,
                        char* output_fname,
                        pid_t cpp_pid,
+                       int cpp_fd,
                        int local_cpu_lock_fd,
                        struct hostdef *host /* no use by now */,
                        int* status)
 {
     int ret = 0;
 
-    ret = wait_for_cpp(cpp_pid, status, input_fname);
-    if (ret)
-        goto out;
+    if (cpp_fd != -1) {
+        /* cpp and the upload go together here */
+        deadline_start(DEADLINE_UPLOAD);
+        ret = stream_cpp_fs(cpp_fd, cpp_fname, cpp_pid, status, input_fname);
+        if (ret)
+            goto out;
+    } else {
+        ret = wait_for_cpp(cpp_pid, status, input_fname);
+        if (ret)
+            goto out;
+    }
 
     /* We are done with local preprocessing.
      * Unlock to allow someone else to start preprocessing.
      */
     if (local_cpu_lock_fd != -1) {
-        //mrcc_unlock(local_cpu_lock_fd);
+        mrcc_unlock(local_cpu_lock_fd);
         local_cpu_lock_fd = -1;
     }
     if (*status != 0)
         goto out;
 
-    ret = put_cpp_fs(cpp_fname);
+    if (cpp_fd == -1) {
+        deadline_set_size_of(cpp_fname);
+        deadline_start(DEADLINE_UPLOAD);
+        ret = put_cpp_fs(cpp_fname);
+    }
     if (ret != 0) {
         rs_log_error("put cpp file \"%s\" to net fs failed", cpp_fname);
         goto out;
@@ -218,7 +381,7 @@ static int put_cpp_config_fs(char** argv,
 
 out:
     if (local_cpu_lock_fd != -1) {
-        // mrcc_unlock(local_cpu_lock_fd);
+        mrcc_unlock(local_cpu_lock_fd);
         local_cpu_lock_fd = -1; /* Not really needed; just for consistency. */
     }
     /* we cleanup them at atexit */
@@ -237,56 +400,6 @@ out:
     return ret;
 }
 
-/*
- * call the mapper with a string argv
- * argv[0] is the cpp_fname
- * argv[1] ... is the running argv
- * source and object is replaced for the remote compilation
- * MapReduce will control the running of the job
- */
-static int call_mapper(char** argv, char* input_fname, char* cpp_fname, char* output_fname)
-{
-    int ret = EXIT_CALL_MAPPER_FAILED;
-    char** new_argv = NULL;
-    char* new_output_fname = NULL;
-    char* str_argv = NULL;
-    int i = 0;
-    int argc = 0;
-
-    if (copy_argv(argv, &new_argv, 0) != 0) {
-        return EXIT_OUT_OF_MEMORY;
-    }
-    new_output_fname = name_local_cpp_to_local_outfile(cpp_fname);
-    if (new_output_fname == NULL) {
-        return EXIT_OUT_OF_MEMORY;
-    }
-
-    argc = argv_len(new_argv);
-    for (i = 0; i < argc; i++) {
-        if (str_equal(new_argv[i], input_fname)) {
-            free(new_argv[i]);
-            new_argv[i] = strdup(cpp_fname);
-        }
-        else if (str_equal(new_argv[i], output_fname)) {
-            free(new_argv[i]);
-            new_argv[i] = strdup(new_output_fname);
-        }
-    }
-
-    str_argv = argv_tostr(new_argv);
-    if (str_argv == NULL) {
-        return EXIT_OUT_OF_MEMORY;
-    }
-    free_argv(new_argv);
-
-    ret = mr_exec(str_argv, cpp_fname, new_output_fname);
-
-    free(str_argv);
-    free(new_output_fname);
-
-    return ret;
-}
-
 /*
  * get the result from net fs and do cleanup at the same time
  * get the output file from network and put it to the right place
@@ -332,7 +445,7 @@ static int get_result_fs(char* cpp_fname, char* output_fname)
     ret = clean_up_outdir_fs(cpp_fname) || ret;
 #endif
 
-    return 0;
+    return ret;
 }
 
 #if 0
@@ -350,6 +463,441 @@ int clean_up_outdir_fs(char* cpp_fname)
 }
 #endif
 
+/* Where tcp_sink() sends its chunks. */
+struct tcp_chunks {
+    int fd;
+    const char* token;
+    long long* sent;
+};
+
+/* Hand compressed data to mrccd as a chunk of a file. */
+static int tcp_sink(void* arg, const void* buf, size_t n)
+{
+    struct tcp_chunks* c = arg;
+
+    *c->sent += n;
+    return rpc_xmit_chunk(c->fd, c->token, buf, n);
+}
+
+/*
+ * send everything read from ifd to mrccd as chunks of token,
+ * compressed with compr, adding what went out to *sent
+ * the empty chunk that ends the file is left to the caller
+ */
+static int tcp_send_input(int fd, const char* token, int ifd,
+        enum compress compr, long long* sent)
+{
+    struct tcp_chunks c;
+    char buf[65536];
+    ssize_t r;
+
+    c.fd = fd;
+    c.token = token;
+    c.sent = sent;
+    if (compr != MRCC_COMPRESS_NONE) {
+        return compress_stream(compr, ifd, tcp_sink, &c);
+    }
+    while ((r = read(ifd, buf, sizeof buf)) != 0) {
+        if (r == -1 && errno == EINTR) {
+            continue;
+        }
+        if (r == -1) {
+            rs_log_error("failed to read input: %s", strerror(errno));
+            return EXIT_IO_ERROR;
+        }
+        if (tcp_sink(&c, buf, r) != 0) {
+            return EXIT_IO_ERROR;
+        }
+    }
+    return 0;
+}
+
+/*
+ * send the request to mrccd on fd: the compiler command, which files
+ * it reads and writes, and the preprocessed source, which goes out as
+ * cpp writes it if cpp_fd is not -1
+ * *status receives the wait status of cpp; the request is only
+ * completed if cpp succeeded
+ */
+static int tcp_send_request(int fd, char** argv, char* input_fname,
+        char* cpp_fname, char* output_fname, pid_t cpp_pid, int cpp_fd,
+        int* status, long long* sent)
+{
+    char* outputs[2];
+    enum compress compr = compress_from_env();
+    enum protover protover = MRCC_VER_1;
+    int ifd;
+    int ret, wait_ret;
+
+    if (compr != MRCC_COMPRESS_NONE
+            && get_protover_from_features(compr,
+                                          MRCC_CPP_ON_CLIENT, &protover) <= 0) {
+        compr = MRCC_COMPRESS_NONE;
+        protover = MRCC_VER_1;
+    }
+    outputs[0] = output_fname;
+    outputs[1] = NULL;
+
+    if ((ret = rpc_xmit_token(fd, "MRCC", protover)) != 0
+            || (ret = rpc_xmit_argv(fd, "ARGC", "ARGV", argv)) != 0
+            || (ret = rpc_xmit_string(fd, "INPT", cpp_fname)) != 0
+            || (ret = rpc_xmit_argv(fd, "OUTC", "OUTP", outputs)) != 0) {
+        if (cpp_fd != -1) {
+            close(cpp_fd);
+        }
+        wait_for_cpp(cpp_pid, status, input_fname);
+        return ret;
+    }
+
+    if (cpp_fd != -1) {
+        ret = tcp_send_input(fd, "DOTI", cpp_fd, compr, sent);
+        /* if we gave up early, this makes cpp give up too */
+        close(cpp_fd);
+        wait_ret = wait_for_cpp(cpp_pid, status, input_fname);
+    } else {
+        wait_ret = wait_for_cpp(cpp_pid, status, input_fname);
+        if (wait_ret == 0 && *status == 0) {
+            if ((ifd = open(cpp_fname, O_RDONLY|O_BINARY)) == -1) {
+                rs_log_error("failed to open %s: %s", cpp_fname,
+                             strerror(errno));
+                ret = EXIT_IO_ERROR;
+            } else {
+                ret = tcp_send_input(fd, "DOTI", ifd, compr, sent);
+                close(ifd);
+            }
+        }
+    }
+    if (ret == 0) {
+        ret = wait_ret;
+    }
+    if (ret == 0 && *status == 0) {
+        ret = rpc_xmit_chunk(fd, "DOTI", NULL, 0);
+    }
+    return ret;
+}
+
+/*
+ * offer mrccd the files cpp reads on it, by name and hash, and send
+ * those it does not have yet, compressed with compr
+ */
+static int tcp_send_files(int fd, char** files, enum compress compr,
+        long long* sent)
+{
+    struct hash_ctx ctx;
+    char hex[HASH_HEX_LEN + 1];
+    unsigned n_files, n_need, i, idx;
+    int ifd;
+    int ret;
+
+    n_files = argv_len(files);
+    if ((ret = rpc_xmit_token(fd, "NFIL", n_files)) != 0) {
+        return ret;
+    }
+    for (i = 0; i < n_files; i++) {
+        hash_init(&ctx);
+        if ((ret = hash_file(&ctx, files[i])) != 0) {
+            return ret;
+        }
+        hash_final_hex(&ctx, hex);
+        if ((ret = rpc_xmit_string(fd, "NAME", files[i])) != 0
+                || (ret = rpc_xmit_string(fd, "HASH", hex)) != 0) {
+            return ret;
+        }
+    }
+
+    if ((ret = rpc_read_token(fd, "NEED", &n_need)) != 0) {
+        return ret;
+    }
+    rs_trace("mrccd needs %u of %u files", n_need, n_files);
+    for (i = 0; i < n_need; i++) {
+        if ((ret = rpc_read_token(fd, "FIDX", &idx)) != 0) {
+            return ret;
+        }
+        if (idx >= n_files) {
+            rs_log_error("mrccd wants file %u of %u", idx, n_files);
+            return EXIT_PROTOCOL_ERROR;
+        }
+        if ((ifd = open(files[idx], O_RDONLY|O_BINARY)) == -1) {
+            rs_log_error("failed to open %s: %s", files[idx], strerror(errno));
+            return EXIT_IO_ERROR;
+        }
+        ret = tcp_send_input(fd, "HDRC", ifd, compr, sent);
+        close(ifd);
+        if (ret == 0) {
+            ret = rpc_xmit_chunk(fd, "HDRC", NULL, 0);
+        }
+        if (ret != 0) {
+            return ret;
+        }
+    }
+    return 0;
+}
+
+/*
+ * send the request of pump mode to mrccd on fd: the compiler command
+ * as given, the directory to run it in, and the source and headers in
+ * files, for mrccd to preprocess itself
+ */
+static int tcp_send_pump_request(int fd, char** argv, char* input_fname,
+        char** files, char* output_fname, long long* sent)
+{
+    char* outputs[2];
+    char cwd[PATH_MAX];
+    enum compress compr = compress_from_env();
+    enum protover protover;
+    int ret;
+
+    /* protocol version 3 comes with compression */
+    if (compr == MRCC_COMPRESS_NONE) {
+        compr = MRCC_COMPRESS_LZ4;
+    }
+    if (get_protover_from_features(compr, MRCC_CPP_ON_SERVER,
+                                   &protover) <= 0) {
+        return EXIT_PROTOCOL_ERROR;
+    }
+    if (getcwd(cwd, sizeof cwd) == NULL) {
+        rs_log_error("getcwd failed: %s", strerror(errno));
+        return EXIT_IO_ERROR;
+    }
+    outputs[0] = output_fname;
+    outputs[1] = NULL;
+
+    if ((ret = rpc_xmit_token(fd, "MRCC", protover)) != 0
+            || (ret = rpc_xmit_argv(fd, "ARGC", "ARGV", argv)) != 0
+            || (ret = rpc_xmit_string(fd, "CDIR", cwd)) != 0
+            || (ret = rpc_xmit_string(fd, "INPT", input_fname)) != 0
+            || (ret = rpc_xmit_argv(fd, "OUTC", "OUTP", outputs)) != 0) {
+        return ret;
+    }
+    return tcp_send_files(fd, files, compr, sent);
+}
+
+/*
+ * read the reply of mrccd on fd: the compiler's wait status into
+ * *status, its stderr into server_stderr_fname, its stdout onto our
+ * stdout, and the object into output_fname
+ */
+static int tcp_read_reply(int fd, char* output_fname,
+        char* server_stderr_fname, int* status)
+{
+    char* stdout_fname = NULL;
+    unsigned protover, wait_status;
+    int ret;
+
+    if ((ret = rpc_read_token(fd, "DONE", &protover)) != 0
+            || (ret = rpc_read_token(fd, "STAT", &wait_status)) != 0) {
+        event_end(EVENT_REMOTE, 0, ret);
+        return ret;
+    }
+    *status = (int) wait_status;
+    event_end(EVENT_REMOTE, 0, 0);
+    event_begin(EVENT_DOWNLOAD);
+
+    ret = rpc_read_file(fd, "SERR", server_stderr_fname);
+    if (ret != 0 && ret != EXIT_NO_SUCH_FILE) {
+        return ret;
+    }
+    if ((ret = make_tmpmem("mrcc_server_stdout", ".txt", &stdout_fname)) != 0) {
+        return ret;
+    }
+    ret = rpc_read_file(fd, "SOUT", stdout_fname);
+    if (ret == 0) {
+        ret = copy_file_to_fd(stdout_fname, STDOUT_FILENO);
+    } else if (ret == EXIT_NO_SUCH_FILE) {
+        ret = 0;
+    }
+    free(stdout_fname);
+    if (ret != 0) {
+        return ret;
+    }
+
+    ret = rpc_read_file(fd, "FILE", output_fname);
+    if (ret == EXIT_NO_SUCH_FILE) {
+        if (*status == 0) {
+            rs_log_error("mrccd compiled no \"%s\"", output_fname);
+            return EXIT_PROTOCOL_ERROR;
+        }
+        ret = 0;
+    }
+    return ret;
+}
+
+/*
+ * Send the compile to an mrccd host, rather than through MapReduce:
+ * connect, and send the request and its input.  The reply is left for
+ * tcp_wait().
+ */
+static int tcp_submit(struct backend_job* job)
+{
+    char** new_argv = NULL;
+    long remote_ms;
+    long long sent = 0;
+    int i, ret;
+
+    if (job->host == NULL || job->host->mode != MRCC_MODE_TCP) {
+        rs_log_error("the tcp backend needs a host of MRCC_HOSTS");
+        ret = EXIT_MRCC_FAILED;
+        goto out;
+    }
+
+    /* a connection is all that mrccd needs to take the job */
+    event_begin(EVENT_SUBMIT);
+    ret = sock_connect(job->host->hostname, job->host->port, &job->fd);
+    event_end(EVENT_SUBMIT, 0, ret);
+    if (ret != 0) {
+        job->fd = -1;
+        goto out;
+    }
+    deadline_start(DEADLINE_UPLOAD);
+    event_begin(EVENT_UPLOAD);
+    sock_set_timeout(job->fd, deadline_io_timeout(300));
+    sock_nodelay(job->fd);
+
+    if (job->files) {
+        *job->status = 0;
+        ret = tcp_send_pump_request(job->fd, job->argv, job->input_fname,
+                                    job->files, job->output_fname, &sent);
+        if (ret != 0) {
+            goto out;
+        }
+        goto sent;
+    }
+
+    /* mrccd compiles the preprocessed source, not the source */
+    if (copy_argv(job->argv, &new_argv, 0) != 0) {
+        ret = EXIT_OUT_OF_MEMORY;
+        goto out;
+    }
+    for (i = 0; new_argv[i]; i++) {
+        if (str_equal(new_argv[i], job->input_fname)) {
+            free(new_argv[i]);
+            if ((new_argv[i] = strdup(job->cpp_fname)) == NULL) {
+                ret = EXIT_OUT_OF_MEMORY;
+                goto out;
+            }
+        }
+    }
+
+    ret = tcp_send_request(job->fd, new_argv, job->input_fname,
+                           job->cpp_fname, job->output_fname, job->cpp_pid,
+                           job->cpp_fd, job->status, &sent);
+    job->cpp_fd = -1;
+
+    /* We are done with local preprocessing. */
+    if (job->local_cpu_lock_fd != -1) {
+        mrcc_unlock(job->local_cpu_lock_fd);
+        job->local_cpu_lock_fd = -1;
+    }
+    if (ret == 0 && *job->status != 0) {
+        /* cpp failed; nothing was asked of mrccd */
+        job->state = BACKEND_DONE;
+    }
+    if (ret != 0 || *job->status != 0) {
+        goto out;
+    }
+
+sent:
+    event_end(EVENT_UPLOAD, sent, 0);
+    event_begin(EVENT_REMOTE);
+    /* mrccd says nothing until it is done, so one timeout covers both */
+    remote_ms = deadline_limit_ms(DEADLINE_REMOTE);
+    if (remote_ms > 0 && deadline_limit_ms(DEADLINE_DOWNLOAD) > 0) {
+        remote_ms += deadline_limit_ms(DEADLINE_DOWNLOAD);
+        sock_set_timeout(job->fd, (int) ((remote_ms + 999) / 1000));
+    } else {
+        sock_set_timeout(job->fd, 0);
+    }
+    deadline_stop();
+    job->state = BACKEND_RUNNING;
+
+out:
+    event_end(EVENT_UPLOAD, sent, ret);
+    if (job->cpp_fd != -1) {
+        close(job->cpp_fd);
+        job->cpp_fd = -1;
+        wait_for_cpp(job->cpp_pid, job->status, job->input_fname);
+    }
+    if (job->local_cpu_lock_fd != -1) {
+        mrcc_unlock(job->local_cpu_lock_fd);
+        job->local_cpu_lock_fd = -1;
+    }
+    if (job->state != BACKEND_RUNNING && job->fd != -1) {
+        close(job->fd);
+        job->fd = -1;
+    }
+    if (new_argv) {
+        free_argv(new_argv);
+    }
+    return ret;
+}
+
+/*
+ * Read the reply of mrccd to tcp_submit(), and publish the object in
+ * the shared cache.  The connection is closed.
+ */
+static int tcp_wait(struct backend_job* job)
+{
+    char* fsname;
+    int ret;
+
+    if (job->state == BACKEND_DONE) {
+        return 0;
+    }
+    ret = tcp_read_reply(job->fd, job->output_fname,
+                         job->server_stderr_fname, job->status);
+    event_end(EVENT_DOWNLOAD, file_bytes(job->output_fname), ret);
+    close(job->fd);
+    job->fd = -1;
+    job->state = BACKEND_DONE;
+    if (ret != 0) {
+        rs_log_error("compile on %s failed", job->host->hostdef_string);
+        return ret;
+    }
+
+    // others may want it too
+    if (*job->status == 0 && job->cache_key && fscache_enabled()) {
+        if ((fsname = fscache_name(job->cache_key)) != NULL) {
+            if (fscache_publish(job->output_fname, fsname) != 0) {
+                rs_log_warning("publish \"%s\" to shared cache failed",
+                               job->output_fname);
+            }
+            free(fsname);
+        }
+    }
+    return 0;
+}
+
+/* mrccd gives up on the compile once the connection is gone. */
+static int tcp_cancel(struct backend_job* job)
+{
+    if (job->fd != -1) {
+        close(job->fd);
+        job->fd = -1;
+    }
+    job->state = BACKEND_IDLE;
+    return 0;
+}
+
+/* The job is done once the reply, or the end of it, can be read. */
+static enum backend_state tcp_status(struct backend_job* job)
+{
+    struct pollfd pfd;
+
+    if (job->state != BACKEND_RUNNING || job->fd == -1) {
+        return job->state;
+    }
+    pfd.fd = job->fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    return poll(&pfd, 1, 0) > 0 ? BACKEND_DONE : BACKEND_RUNNING;
+}
+
+// mrccd, see backend.c
+const struct backend backend_tcp = {
+    "tcp", BACKEND_CAP_CANCEL,
+    tcp_submit, tcp_wait, tcp_cancel, tcp_status
+};
+
 /**
  * Pass a compilation across the network.
  *
@@ -372,9 +920,16 @@ int clean_up_outdir_fs(char* cpp_fname)
  *
  * @param output_fname File that the object code should be delivered to.
  *
+ * @param cache_key If not NULL, the key of the compile's result in the
+ * shared object cache.  The cache is looked up first, and the mapper
+ * publishes what it compiles under this key.
+ *
  * @param cpp_pid If nonzero, the pid of the preprocessor.  Must be
  * allowed to complete before we send the input file.
  *
+ * @param cpp_fd If not -1, cpp writes into this pipe rather than into
+ * @p cpp_fname, and its output is streamed to the fs as it comes.
+ *
  * @param local_cpu_lock_fd If != -1, file descriptor for the lock file.
  * Should be != -1 iff (host->cpp_where != CPP_ON_SERVER).
  * If != -1, the lock must be held on entry to this function,
@@ -392,15 +947,19 @@ int clean_up_outdir_fs(char* cpp_fname)
 int compile_remote(char **argv,
                        char *input_fname,
                        char *cpp_fname,
-                       char **files, /* no use */
+                       char **files,
                        char *output_fname,
                        char *deps_fname, /* no use */
                        char *server_stderr_fname, /* no use by now */
+                       char *cache_key,
                        pid_t cpp_pid,
+                       int cpp_fd,
                        int local_cpu_lock_fd,
                        struct hostdef *host,
                        int *status)
 {
+    const struct backend* b = backend_for(host);
+    struct backend_job job;
     int ret = 0;
     struct timeval before;
 
@@ -409,37 +968,80 @@ int compile_remote(char **argv,
 
     note_execution(host, argv);
     // note_state(PHASE_CONNECT, input_fname, host->hostname);
+    backend_job_init(&job);
 
-    // copy the preprocessed file to network and put the configuration files
-    // when we wait for the cpp to finish if it has not finished
-    note_info_time("begin put_cpp_config_fs");
-    if (put_cpp_config_fs(argv, input_fname, cpp_fname, output_fname,
-            cpp_pid, local_cpu_lock_fd, host, status) != 0) {
-        rs_log_error("put_cpp_config_fs failed!");
-        ret = -1;
-        goto out;
+    // somebody may have compiled exactly this before
+    if (cache_key && fscache_enabled()) {
+        if (fscache_fetch(cache_key, output_fname) == 0) {
+            *status = 0;
+            goto out;
+        }
+    }
+
+    job.argv = argv;
+    job.input_fname = input_fname;
+    job.cpp_fname = cpp_fname;
+    job.files = files;
+    job.output_fname = output_fname;
+    job.server_stderr_fname = server_stderr_fname;
+    job.cache_key = cache_key;
+    job.cpp_pid = cpp_pid;
+    job.cpp_fd = cpp_fd;
+    job.local_cpu_lock_fd = local_cpu_lock_fd;
+    job.host = host;
+    job.status = status;
+    rs_trace("compiling %s with the %s backend", input_fname, b->name);
+
+    if (b->caps & BACKEND_CAP_NETFS) {
+        // copy the preprocessed file to network and put the configuration
+        // files when we wait for the cpp to finish if it has not finished
+        if (put_cpp_config_fs(argv, input_fname, cpp_fname, output_fname,
+                cpp_pid, cpp_fd, local_cpu_lock_fd, host, status) != 0) {
+            rs_log_error("put_cpp_config_fs failed!");
+            ret = -1;
+            goto out;
+        }
+        if ((ret = backend_map_job(&job)) != 0)
+            goto out;
+        // the backend tells when the job was submitted
+        deadline_start(DEADLINE_REMOTE);
+        event_begin(EVENT_SUBMIT);
+    }
+
+    ret = b->submit(&job);
+    if (ret == 0)
+        ret = b->wait(&job);
+    if (ret != 0 && (b->caps & BACKEND_CAP_CANCEL)
+            && b->status(&job) == BACKEND_RUNNING) {
+        rs_log_error("taking the job back from the %s backend", b->name);
+        b->cancel(&job);
     }
-    note_info_time("finish put_cpp_config_fs");
-    // call the mapper
-    note_info_time("begin call_mapper");
-    if (call_mapper(argv, input_fname, cpp_fname, output_fname) != 0) {
-        rs_log_error("call_mapper failed!");
+    if (!(b->caps & BACKEND_CAP_NETFS))
+        goto out;
+
+    event_end(EVENT_SUBMIT, 0, ret);
+    event_end(EVENT_REMOTE, 0, ret);
+    if (ret != 0) {
+        rs_log_error("the %s backend failed!", b->name);
         ret = -1;
         goto out;
     }
-    note_info_time("finish call_mapper");
 
     // get the output file from network and put it to the right place
     // and do the net fs cleanup works at the same time
-    note_info_time("begin get_result_fs");
-    if (get_result_fs(cpp_fname, output_fname) != 0) {
+    deadline_start(DEADLINE_DOWNLOAD);
+    event_begin(EVENT_DOWNLOAD);
+    ret = get_result_fs(cpp_fname, output_fname);
+    event_end(EVENT_DOWNLOAD, file_bytes(output_fname), ret);
+    if (ret != 0) {
         rs_log_error("get_result_fs failed!");
         ret = -1;
         goto out;
     }
-    note_info_time("finish get_result-fs");
 
 out:
+    backend_job_free(&job);
+    deadline_stop();
     return ret;
 }
 
@@ -9,12 +9,18 @@ int compile_remote(char **argv,
                        char *output_fname,
                        char *deps_fname,
                        char *server_stderr_fname,
+                       char *cache_key,
                        pid_t cpp_pid,
+                       int cpp_fd,
                        int local_cpu_lock_fd,
                        struct hostdef *host,
                        int *status);
 
+int wait_for_cpp(pid_t cpp_pid, int *status, const char *input_fname);
+
 int put_cpp_fs(char* cpp_fname);
+int stream_cpp_fs(int cpp_fd, char* cpp_fname, pid_t cpp_pid, int* status,
+        const char* input_fname);
 int put_config_fs(char** argv,
         const char* input_fname,
         const char* cpp_fname,
@@ -0,0 +1,306 @@
+// mrcc - A C Compiler system on MapReduce
+// Zhiqiang Ma, https://www.ericzma.com
+
+#include <stdarg.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <string.h>
+#include <time.h>
+#include <ctype.h>
+#include <assert.h>
+#include <fcntl.h>
+
+#include <sys/fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "utils.h"
+#include "trace.h"
+#include "io.h"
+#include "rpc.h"
+
+/**
+ * @file
+ * @brief Framing of the protocol between mrcc and mrccd.
+ *
+ * Everything on the wire is a token: four printable characters naming
+ * what follows, and a 32-bit big-endian parameter.  The parameter is
+ * either a plain number, such as an exit status, or the length of the
+ * bytes that come right after the token.  Files of unknown length go
+ * as a series of chunks with the same token, ended by an empty one.
+ *
+ * A missing file is sent as the token "NOFL" instead of its own token,
+ * so the receiver can tell it from an empty file.
+ **/
+
+static const char rpc_no_file[] = "NOFL";
+
+static void rpc_put_token(unsigned char *buf, const char *token, unsigned param)
+{
+    memcpy(buf, token, 4);
+    buf[4] = (unsigned char) (param >> 24);
+    buf[5] = (unsigned char) (param >> 16);
+    buf[6] = (unsigned char) (param >> 8);
+    buf[7] = (unsigned char) param;
+}
+
+/**
+ * @brief Send a token and its parameter.
+ * @return 0 on success, or error return code.
+ */
+int rpc_xmit_token(int fd, const char *token, unsigned param)
+{
+    unsigned char buf[RPC_TOKEN_LEN];
+
+    rpc_put_token(buf, token, param);
+    return writex(fd, buf, sizeof buf);
+}
+
+/* Read any token; @p got receives its four characters. */
+static int rpc_read_any_token(int fd, char got[5], unsigned *param)
+{
+    unsigned char buf[RPC_TOKEN_LEN];
+    int ret;
+
+    if ((ret = readx(fd, buf, sizeof buf)))
+        return ret;
+    memcpy(got, buf, 4);
+    got[4] = '\0';
+    *param = ((unsigned) buf[4] << 24) | ((unsigned) buf[5] << 16)
+        | ((unsigned) buf[6] << 8) | (unsigned) buf[7];
+    return 0;
+}
+
+/* Complain that @p got came where @p token was expected. */
+static int rpc_bad_token(const char *token, const char *got)
+{
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        if (!isprint((unsigned char) got[i])) {
+            rs_log_error("protocol derailment: expected token \"%s\"", token);
+            return EXIT_PROTOCOL_ERROR;
+        }
+    }
+    rs_log_error("protocol derailment: expected token \"%s\", got \"%s\"",
+                 token, got);
+    return EXIT_PROTOCOL_ERROR;
+}
+
+/**
+ * @brief Read a token, which must be @p token.
+ * @param param receives its parameter.
+ * @return 0 on success, EXIT_PROTOCOL_ERROR if another token came, or
+ * error return code.
+ */
+int rpc_read_token(int fd, const char *token, unsigned *param)
+{
+    char got[5];
+    int ret;
+
+    if ((ret = rpc_read_any_token(fd, got, param)))
+        return ret;
+    if (memcmp(got, token, 4))
+        return rpc_bad_token(token, got);
+    return 0;
+}
+
+/**
+ * @brief Send a string as a token giving its length, then its bytes.
+ * @return 0 on success, or error return code.
+ */
+int rpc_xmit_string(int fd, const char *token, const char *s)
+{
+    size_t len = strlen(s);
+    int ret;
+
+    if ((ret = rpc_xmit_token(fd, token, (unsigned) len)))
+        return ret;
+    return writex(fd, s, len);
+}
+
+/**
+ * @brief Read a string sent by rpc_xmit_string().
+ * @param s receives the string, to be free()d by the caller.
+ * @return 0 on success, or error return code.
+ */
+int rpc_read_string(int fd, const char *token, char **s)
+{
+    unsigned len;
+    char *buf;
+    int ret;
+
+    if ((ret = rpc_read_token(fd, token, &len)))
+        return ret;
+    if (len > RPC_MAX_STRING) {
+        rs_log_error("\"%s\" string of %u bytes is too long", token, len);
+        return EXIT_PROTOCOL_ERROR;
+    }
+    if ((buf = malloc(len + 1)) == NULL)
+        return EXIT_OUT_OF_MEMORY;
+    if ((ret = readx(fd, buf, len))) {
+        free(buf);
+        return ret;
+    }
+    buf[len] = '\0';
+    *s = buf;
+    return 0;
+}
+
+/**
+ * @brief Send an argument vector: its length as @p count_token, then
+ * every argument as a @p token string.
+ * @return 0 on success, or error return code.
+ */
+int rpc_xmit_argv(int fd, const char *count_token, const char *token,
+                  char **argv)
+{
+    int argc, i;
+    int ret;
+
+    for (argc = 0; argv[argc]; argc++)
+        ;
+    if ((ret = rpc_xmit_token(fd, count_token, argc)))
+        return ret;
+    for (i = 0; i < argc; i++) {
+        if ((ret = rpc_xmit_string(fd, token, argv[i])))
+            return ret;
+    }
+    return 0;
+}
+
+/**
+ * @brief Read an argument vector sent by rpc_xmit_argv().
+ * @param argv receives a NULL-terminated vector, to be given to
+ * free_argv() by the caller.
+ * @return 0 on success, or error return code.
+ */
+int rpc_read_argv(int fd, const char *count_token, const char *token,
+                  char ***argv)
+{
+    unsigned argc, i;
+    char **a;
+    int ret;
+
+    if ((ret = rpc_read_token(fd, count_token, &argc)))
+        return ret;
+    if (argc > RPC_MAX_STRING / sizeof *a) {
+        rs_log_error("%u arguments are too many", argc);
+        return EXIT_PROTOCOL_ERROR;
+    }
+    if ((a = calloc(argc + 1, sizeof *a)) == NULL)
+        return EXIT_OUT_OF_MEMORY;
+    for (i = 0; i < argc; i++) {
+        if ((ret = rpc_read_string(fd, token, &a[i]))) {
+            while (i > 0)
+                free(a[--i]);
+            free(a);
+            return ret;
+        }
+    }
+    *argv = a;
+    return 0;
+}
+
+/**
+ * @brief Send a whole file as a token giving its length, then its
+ * bytes.  If the file does not exist, "NOFL" goes instead.
+ * @return 0 on success, or error return code.
+ */
+int rpc_xmit_file(int fd, const char *token, const char *fname)
+{
+    off_t size;
+    int ifd;
+    int ret;
+
+    if ((ret = open_read(fname, &ifd, &size)))
+        return ret;
+    if (ifd == -1)
+        return rpc_xmit_token(fd, rpc_no_file, 0);
+    if (size > (off_t) 0xffffffffU) {
+        rs_log_error("\"%s\" is too big to send", fname);
+        close(ifd);
+        return EXIT_IO_ERROR;
+    }
+    ret = rpc_xmit_token(fd, token, (unsigned) size);
+    if (ret == 0 && size > 0)
+        ret = pump_copy(fd, ifd, (size_t) size);
+    close(ifd);
+    return ret;
+}
+
+/**
+ * @brief Receive a file sent by rpc_xmit_file() into @p fname.
+ * @return 0 on success, EXIT_NO_SUCH_FILE if the sender had no such
+ * file, in which case none is created, or error return code.
+ */
+int rpc_read_file(int fd, const char *token, const char *fname)
+{
+    char got[5];
+    unsigned len;
+    int ofd;
+    int ret;
+
+    if ((ret = rpc_read_any_token(fd, got, &len)))
+        return ret;
+    if (!memcmp(got, rpc_no_file, 4))
+        return EXIT_NO_SUCH_FILE;
+    if (memcmp(got, token, 4))
+        return rpc_bad_token(token, got);
+
+    ofd = open(fname, O_WRONLY|O_CREAT|O_TRUNC|O_BINARY, 0666);
+    if (ofd == -1) {
+        rs_log_error("failed to create %s: %s", fname, strerror(errno));
+        return EXIT_IO_ERROR;
+    }
+    ret = len ? pump_copy(ofd, fd, len) : 0;
+    if (mrcc_close(ofd) && ret == 0)
+        ret = EXIT_IO_ERROR;
+    return ret;
+}
+
+/**
+ * @brief Send one chunk of a file of unknown length.
+ * A chunk of @p n == 0 ends the file.
+ * @return 0 on success, or error return code.
+ */
+int rpc_xmit_chunk(int fd, const char *token, const void *buf, size_t n)
+{
+    unsigned char hdr[RPC_TOKEN_LEN];
+    int ret;
+
+    rpc_put_token(hdr, token, (unsigned) n);
+    if ((ret = writex(fd, hdr, sizeof hdr)))
+        return ret;
+    return n ? writex(fd, buf, n) : 0;
+}
+
+/**
+ * @brief Receive chunks sent by rpc_xmit_chunk() into @p fname, up to
+ * and including the empty one.
+ * @return 0 on success, or error return code.
+ */
+int rpc_read_chunks(int fd, const char *token, const char *fname)
+{
+    unsigned len;
+    int ofd;
+    int ret;
+
+    ofd = open(fname, O_WRONLY|O_CREAT|O_TRUNC|O_BINARY, 0666);
+    if (ofd == -1) {
+        rs_log_error("failed to create %s: %s", fname, strerror(errno));
+        return EXIT_IO_ERROR;
+    }
+    while ((ret = rpc_read_token(fd, token, &len)) == 0 && len > 0) {
+        if ((ret = pump_copy(ofd, fd, len)))
+            break;
+    }
+    if (mrcc_close(ofd) && ret == 0)
+        ret = EXIT_IO_ERROR;
+    return ret;
+}
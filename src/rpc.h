@@ -0,0 +1,28 @@
+// mrcc - A C Compiler system on MapReduce
+// Zhiqiang Ma, https://www.ericzma.com
+#pragma once
+
+#include <stddef.h>
+
+// bytes of a token: four characters and a 32-bit big-endian parameter
+#define RPC_TOKEN_LEN 8
+
+// longest string accepted from the other end
+#define RPC_MAX_STRING (1024 * 1024)
+
+int rpc_xmit_token(int fd, const char *token, unsigned param);
+int rpc_read_token(int fd, const char *token, unsigned *param);
+
+int rpc_xmit_string(int fd, const char *token, const char *s);
+int rpc_read_string(int fd, const char *token, char **s);
+
+int rpc_xmit_argv(int fd, const char *count_token, const char *token,
+                  char **argv);
+int rpc_read_argv(int fd, const char *count_token, const char *token,
+                  char ***argv);
+
+int rpc_xmit_file(int fd, const char *token, const char *fname);
+int rpc_read_file(int fd, const char *token, const char *fname);
+
+int rpc_xmit_chunk(int fd, const char *token, const void *buf, size_t n);
+int rpc_read_chunks(int fd, const char *token, const char *fname);
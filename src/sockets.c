@@ -0,0 +1,207 @@
+// mrcc - A C Compiler system on MapReduce
+// Zhiqiang Ma, https://www.ericzma.com
+
+#include <stdarg.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <string.h>
+#include <time.h>
+#include <ctype.h>
+#include <assert.h>
+#include <fcntl.h>
+
+#include <sys/fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <signal.h>
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <sys/poll.h>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+
+#include "utils.h"
+#include "trace.h"
+#include "sockets.h"
+
+/**
+ * @brief Open a TCP connection to @p host on @p port.
+ * Every address returned by the resolver is tried in turn.
+ * @param host host name or numeric address.
+ * @param port TCP port number.
+ * @param fd_ret pointer to an int to receive the connected socket.
+ * @return 0 on success, or EXIT_CONNECT_FAILED.
+ */
+int sock_connect(const char *host, int port, int *fd_ret)
+{
+    struct addrinfo hints, *res, *ai;
+    char port_str[16];
+    int fd = -1;
+    int ret;
+
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(port_str, sizeof port_str, "%d", port);
+
+    ret = getaddrinfo(host, port_str, &hints, &res);
+    if (ret != 0) {
+        rs_log_error("failed to look up host \"%s\": %s", host, gai_strerror(ret));
+        return EXIT_CONNECT_FAILED;
+    }
+
+    for (ai = res; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd == -1)
+            continue;
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+            break;
+        rs_trace("connect to %s port %d failed: %s", host, port, strerror(errno));
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+
+    if (fd == -1) {
+        rs_log_error("failed to connect to %s port %d", host, port);
+        return EXIT_CONNECT_FAILED;
+    }
+
+    rs_trace("connected to %s port %d on fd%d", host, port, fd);
+    *fd_ret = fd;
+    return 0;
+}
+
+/**
+ * @brief Open a listening TCP socket bound to @p addr and @p port.
+ * @param addr local address to bind, or NULL for all addresses.
+ * @param port TCP port number.
+ * @param fd_ret pointer to an int to receive the listening socket.
+ * @return 0 on success, or EXIT_BIND_FAILED.
+ */
+int sock_listen(const char *addr, int port, int *fd_ret)
+{
+    struct addrinfo hints, *res, *ai;
+    char port_str[16];
+    int fd = -1;
+    int one = 1;
+    int ret;
+
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    snprintf(port_str, sizeof port_str, "%d", port);
+
+    ret = getaddrinfo(addr, port_str, &hints, &res);
+    if (ret != 0) {
+        rs_log_error("failed to look up address \"%s\": %s",
+                     addr ? addr : "*", gai_strerror(ret));
+        return EXIT_BIND_FAILED;
+    }
+
+    for (ai = res; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd == -1)
+            continue;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+        if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0
+                && listen(fd, 128) == 0)
+            break;
+        rs_trace("bind to port %d failed: %s", port, strerror(errno));
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+
+    if (fd == -1) {
+        rs_log_error("failed to listen on %s port %d", addr ? addr : "*", port);
+        return EXIT_BIND_FAILED;
+    }
+
+    rs_trace("listening on %s port %d as fd%d", addr ? addr : "*", port, fd);
+    *fd_ret = fd;
+    return 0;
+}
+
+/**
+ * @brief Bound every blocking send and receive on @p fd.
+ * @param fd socket.
+ * @param timeout timeout in seconds; 0 means wait forever.
+ * @return 0 on success, or EXIT_IO_ERROR.
+ */
+int sock_set_timeout(int fd, int timeout)
+{
+    struct timeval tv;
+
+    tv.tv_sec = timeout;
+    tv.tv_usec = 0;
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv) == -1
+            || setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof tv) == -1) {
+        rs_log_warning("failed to set timeout on fd%d: %s", fd, strerror(errno));
+        return EXIT_IO_ERROR;
+    }
+    return 0;
+}
+
+/**
+ * @brief Disable Nagle's algorithm, so that small request headers are
+ * not held back waiting for the body.
+ */
+int sock_nodelay(int fd)
+{
+    int one = 1;
+
+    if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one) == -1) {
+        rs_trace("failed to set TCP_NODELAY on fd%d: %s", fd, strerror(errno));
+        return EXIT_IO_ERROR;
+    }
+    return 0;
+}
+
+/**
+ * @brief Split "HOST:PORT" (or just "HOST") into its parts.
+ * Caller is responsible for free()ing the returned host.
+ * @param spec string to parse.
+ * @param default_port port to use if @p spec has none.
+ * @param host_ret pointer to a string to receive the host.
+ * @param port_ret pointer to an int to receive the port.
+ * @return 0 on success, or EXIT_BAD_HOSTSPEC.
+ */
+int parse_host_port(const char *spec, int default_port, char **host_ret, int *port_ret)
+{
+    const char *colon;
+    char *end;
+    long port = default_port;
+
+    colon = strrchr(spec, ':');
+    if (colon) {
+        port = strtol(colon + 1, &end, 10);
+        if (*end != '\0' || port <= 0 || port > 65535) {
+            rs_log_error("bad port in \"%s\"", spec);
+            return EXIT_BAD_HOSTSPEC;
+        }
+        *host_ret = strndup(spec, colon - spec);
+    } else {
+        *host_ret = strdup(spec);
+    }
+    if (*host_ret == NULL)
+        return EXIT_OUT_OF_MEMORY;
+    if ((*host_ret)[0] == '\0') {
+        rs_log_error("missing host name in \"%s\"", spec);
+        free(*host_ret);
+        return EXIT_BAD_HOSTSPEC;
+    }
+    *port_ret = (int) port;
+    return 0;
+}
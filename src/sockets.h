@@ -0,0 +1,10 @@
+// mrcc - A C Compiler system on MapReduce
+// Zhiqiang Ma, https://www.ericzma.com
+#pragma once
+
+int sock_connect(const char *host, int port, int *fd_ret);
+int sock_listen(const char *addr, int port, int *fd_ret);
+int sock_set_timeout(int fd, int timeout);
+int sock_nodelay(int fd);
+
+int parse_host_port(const char *spec, int default_port, char **host_ret, int *port_ret);
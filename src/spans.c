@@ -0,0 +1,225 @@
+// mrcc - A C Compiler system on MapReduce
+// Zhiqiang Ma, https://www.ericzma.com
+
+#include <stdarg.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <string.h>
+#include <time.h>
+#include <ctype.h>
+#include <assert.h>
+#include <fcntl.h>
+
+#include <sys/fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "utils.h"
+#include "trace.h"
+#include "stringutils.h"
+#include "tempfile.h"
+#include "spans.h"
+
+/**
+ * @file
+ * @brief A ring of trace spans shared by all the mrcc of a build.
+ *
+ * Under make -j every compile is its own short-lived process, and what
+ * they log says nothing about how they line up.  With MRCC_TRACE=1
+ * each mrcc also puts its events (see events.c) into the fixed-size
+ * file $MRCC_DIR/state/trace, from which "mrcc-stats --chrome" makes
+ * a Chrome/Perfetto trace of the whole build.
+ *
+ * The file is a header and SPAN_RING_SLOTS slots of one struct span,
+ * mapped shared by every writer.  A writer takes the next number with
+ * an atomic add on the header, so no lock is needed, and the slot is
+ * that number modulo the size; when the ring is full the oldest spans
+ * are written over.  The seq of a slot is 0 while it is written and
+ * the number + 1 once it is complete, so a reader skips what is torn
+ * or already written over.  Remove the file to start afresh.
+ **/
+
+struct span_ring_head {
+    char magic[8];
+    uint32_t slots;
+    uint32_t span_size;
+    uint64_t next;          // spans ever taken
+    char pad[sizeof(struct span) - 24];
+};
+
+static struct span_ring_head *span_head = NULL;
+static struct span *span_slots = NULL;
+
+/**
+ * @brief Name of the span ring of this machine.
+ * @param fname_ret receives it, dynamically allocated.
+ */
+int span_ring_name(char **fname_ret)
+{
+    char *state;
+
+    if (get_state_dir(&state) != 0)
+        return EXIT_IO_ERROR;
+    if (asprintf(fname_ret, "%s/trace", state) == -1)
+        return EXIT_OUT_OF_MEMORY;
+    return 0;
+}
+
+/* Map the ring @p fd, @p writable or not, making it first if @p
+ * writable and it is empty. */
+static int span_ring_map(int fd, const char *fname, int writable,
+                         struct span_ring_head **head_ret, size_t *len_ret)
+{
+    struct span_ring_head *head;
+    struct stat st;
+    size_t len;
+    uint32_t slots;
+
+    if (fstat(fd, &st) == -1) {
+        rs_log_error("failed to stat %s: %s", fname, strerror(errno));
+        return EXIT_IO_ERROR;
+    }
+    if (st.st_size == 0 && writable) {
+        /* whoever gets here first, they all make the same ring */
+        len = sizeof(*head) + (size_t) SPAN_RING_SLOTS * sizeof(struct span);
+        if (ftruncate(fd, len) == -1) {
+            rs_log_error("failed to size %s: %s", fname, strerror(errno));
+            return EXIT_IO_ERROR;
+        }
+    } else if ((size_t) st.st_size < sizeof(*head)) {
+        rs_log_error("%s is not a span ring", fname);
+        return EXIT_PROTOCOL_ERROR;
+    } else {
+        len = st.st_size;
+    }
+
+    head = mmap(NULL, len, writable ? PROT_READ|PROT_WRITE : PROT_READ,
+                MAP_SHARED, fd, 0);
+    if (head == MAP_FAILED) {
+        rs_log_error("failed to map %s: %s", fname, strerror(errno));
+        return EXIT_IO_ERROR;
+    }
+    if (writable && head->magic[0] == '\0') {
+        head->slots = SPAN_RING_SLOTS;
+        head->span_size = sizeof(struct span);
+        memcpy(head->magic, SPAN_RING_MAGIC, sizeof(head->magic));
+    }
+    slots = head->slots;
+    if (memcmp(head->magic, SPAN_RING_MAGIC, sizeof(head->magic)) != 0
+            || head->span_size != sizeof(struct span) || slots == 0
+            || len < sizeof(*head) + (size_t) slots * sizeof(struct span)) {
+        rs_log_error("%s is not a span ring", fname);
+        munmap(head, len);
+        return EXIT_PROTOCOL_ERROR;
+    }
+    *head_ret = head;
+    *len_ret = len;
+    return 0;
+}
+
+/**
+ * @brief Have span_ring_add() write into the ring @p fname, or the one
+ * of span_ring_name() if NULL.
+ * @return 0 on success, otherwise error return code.
+ */
+int span_ring_open(const char *fname)
+{
+    char *name = NULL;
+    size_t len;
+    int fd, ret;
+
+    if (fname == NULL) {
+        if ((ret = span_ring_name(&name)) != 0)
+            return ret;
+        fname = name;
+    }
+    fd = open(fname, O_RDWR|O_CREAT|O_CLOEXEC, 0666);
+    if (fd == -1) {
+        rs_log_warning("failed to open %s: %s", fname, strerror(errno));
+        free(name);
+        return EXIT_IO_ERROR;
+    }
+    ret = span_ring_map(fd, fname, 1, &span_head, &len);
+    close(fd);
+    free(name);
+    if (ret == 0)
+        span_slots = (struct span *) (span_head + 1);
+    return ret;
+}
+
+/**
+ * @brief Put a span into the ring opened by span_ring_open(), if any.
+ * The arguments are the fields of struct span.
+ */
+void span_ring_add(int64_t start_us, int64_t dur_us, int64_t bytes,
+                   int id, int phase, int result, const char *input)
+{
+    struct span *s;
+    uint64_t n;
+
+    if (span_head == NULL)
+        return;
+    n = __atomic_fetch_add(&span_head->next, 1, __ATOMIC_SEQ_CST);
+    s = &span_slots[n % span_head->slots];
+
+    __atomic_store_n(&s->seq, 0, __ATOMIC_SEQ_CST);
+    s->start_us = start_us;
+    s->dur_us = dur_us;
+    s->bytes = bytes;
+    s->id = id;
+    s->pid = (int32_t) getpid();
+    s->phase = phase;
+    s->result = result;
+    strncpy(s->input, input, sizeof(s->input) - 1);
+    s->input[sizeof(s->input) - 1] = '\0';
+    __atomic_store_n(&s->seq, n + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Hand the complete spans in the ring @p fname to @p fn, oldest
+ * first, until it returns nonzero.
+ * @return 0, what @p fn returned, or error return code.
+ */
+int span_ring_read(const char *fname,
+                   int (*fn)(void *arg, const struct span *s), void *arg)
+{
+    struct span_ring_head *head;
+    struct span *slots;
+    struct span s;
+    uint64_t next, n;
+    size_t len;
+    int fd, ret;
+
+    fd = open(fname, O_RDONLY|O_CLOEXEC);
+    if (fd == -1) {
+        rs_log_error("failed to open %s: %s", fname, strerror(errno));
+        return EXIT_NO_SUCH_FILE;
+    }
+    ret = span_ring_map(fd, fname, 0, &head, &len);
+    close(fd);
+    if (ret)
+        return ret;
+    slots = (struct span *) (head + 1);
+
+    next = __atomic_load_n(&head->next, __ATOMIC_ACQUIRE);
+    n = next > head->slots ? next - head->slots : 0;
+    for (; n < next && ret == 0; n++) {
+        memcpy(&s, &slots[n % head->slots], sizeof(s));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        /* written over, or still being written, since */
+        if (s.seq != n + 1
+                || __atomic_load_n(&slots[n % head->slots].seq,
+                                   __ATOMIC_ACQUIRE) != n + 1)
+            continue;
+        s.input[sizeof(s.input) - 1] = '\0';
+        ret = fn(arg, &s);
+    }
+    munmap(head, len);
+    return ret;
+}
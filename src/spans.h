@@ -0,0 +1,31 @@
+// mrcc - A C Compiler system on MapReduce
+// Zhiqiang Ma, https://www.ericzma.com
+#pragma once
+
+#include <stdint.h>
+
+// first bytes of a span ring, see spans.c
+#define SPAN_RING_MAGIC "mrccspn1"
+
+// spans kept in a new ring
+#define SPAN_RING_SLOTS 16384
+
+// one phase of one compile, as in the event log
+struct span {
+    uint64_t seq;           // number of the span + 1, 0 while written
+    int64_t start_us;       // CLOCK_MONOTONIC
+    int64_t dur_us;
+    int64_t bytes;
+    int32_t id;             // pid of the mrcc it is about
+    int32_t pid;            // pid that wrote it
+    int32_t phase;          // enum event_phase
+    int32_t result;
+    char input[80];
+};
+
+int span_ring_open(const char *fname);
+void span_ring_add(int64_t start_us, int64_t dur_us, int64_t bytes,
+                   int id, int phase, int result, const char *input);
+int span_ring_name(char **fname_ret);
+int span_ring_read(const char *fname,
+                   int (*fn)(void *arg, const struct span *s), void *arg);
@@ -25,6 +25,9 @@
 #include <sys/wait.h>
 #include <sys/poll.h>
 
+#include <dirent.h>
+#include <sys/syscall.h>
+
 #include "utils.h"
 #include "trace.h"
 
@@ -129,6 +132,91 @@ int make_tmpnam(const char *prefix, const char *suffix, char **name_ret)
     return 0;
 }
 
+#ifndef MFD_CLOEXEC
+#  define MFD_CLOEXEC 0x0001U
+#endif
+
+/* An anonymous file in memory, or -1 if there can be none here. */
+static int tmpmem_open(const char *prefix)
+{
+    int fd = -1;
+
+#ifdef SYS_memfd_create
+    fd = (int) syscall(SYS_memfd_create, prefix, MFD_CLOEXEC);
+    if (fd != -1)
+        return fd;
+    rs_trace("memfd_create failed: %s", strerror(errno));
+#endif
+#ifdef O_TMPFILE
+    {
+        const char *tempdir;
+
+        /* on tmpfs that is memory too, elsewhere at least no name */
+        if (get_tmp_top(&tempdir) == 0)
+            fd = open(tempdir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    }
+#else
+    MRCC_UNUSED(prefix);
+#endif
+    return fd;
+}
+
+/**
+ * Like make_tmpnam(), for a file only mrcc and its children use.
+ *
+ * With $MRCC_MEMFD set to 1, the file is kept in memory rather than in
+ * TMPDIR, and the name returned is that of its descriptor in /proc.
+ * That can be opened by this process and its children, for as long as
+ * this one lives; it cannot be renamed, and does not keep @p suffix.
+ * Cleaning it up closes the descriptor.
+ **/
+int make_tmpmem(const char *prefix, const char *suffix, char **name_ret)
+{
+    char *s = NULL;
+    int fd;
+    int ret;
+
+    if (!getenv_bool("MRCC_MEMFD", 0)
+            || (fd = tmpmem_open(prefix)) == -1)
+        return make_tmpnam(prefix, suffix, name_ret);
+
+    if (asprintf(&s, "/proc/%ld/fd/%d", (long) getpid(), fd) == -1) {
+        close(fd);
+        return EXIT_OUT_OF_MEMORY;
+    }
+    ret = add_cleanup(s);
+    if (ret) {
+        close(fd);
+        free(s);
+        return ret;
+    }
+
+    *name_ret = s;
+    return 0;
+}
+
+/**
+ * If @p name came from make_tmpmem() and is in memory, return its
+ * descriptor; otherwise -1.  Safe in signal handlers.
+ **/
+int tmpmem_fd(const char *name)
+{
+    const char *p = name;
+    int fd = 0;
+
+    if (strncmp(p, "/proc/", 6) != 0)
+        return -1;
+    for (p += 6; *p >= '0' && *p <= '9'; p++)
+        ;
+    if (p == name + 6 || strncmp(p, "/fd/", 4) != 0)
+        return -1;
+    for (p += 4; *p >= '0' && *p <= '9'; p++)
+        fd = fd * 10 + (*p - '0');
+    if (*p != '\0' || p[-1] == '/')
+        return -1;
+    return fd;
+}
+
 /**
  * @brief Return a static string holding MRCC_DIR, or ~/.mrcc.
  * The directory is created if it does not exist.
@@ -194,6 +282,68 @@ mrcc_mkdir(const char *path)
     return 0;
 }
 
+/**
+ * @brief Create the directory @p path and any missing parents.
+ * @param path path name of directory to create.
+ * @return 0 on success, or EXIT_IO_ERROR.
+ */
+int
+mrcc_mkdir_p(const char *path)
+{
+    char *dir, *p;
+    int ret;
+
+    dir = strdup(path);
+    if (dir == NULL)
+        return EXIT_OUT_OF_MEMORY;
+    for (p = dir + 1; (p = strchr(p, '/')) != NULL; p++) {
+        *p = '\0';
+        ret = mrcc_mkdir(dir);
+        *p = '/';
+        if (ret) {
+            free(dir);
+            return ret;
+        }
+    }
+    free(dir);
+    return mrcc_mkdir(path);
+}
+
+/**
+ * @brief Remove @p path and, if it is a directory, everything below it.
+ * @return 0 on success, or -1 with errno set.
+ */
+int
+mrcc_remove_tree(const char *path)
+{
+    struct dirent *de;
+    struct stat st;
+    char *child;
+    DIR *dir;
+    int ret = 0;
+
+    if (lstat(path, &st) == -1)
+        return -1;
+    if (!S_ISDIR(st.st_mode))
+        return unlink(path);
+
+    if ((dir = opendir(path)) == NULL)
+        return -1;
+    while (ret == 0 && (de = readdir(dir)) != NULL) {
+        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+            continue;
+        child = NULL;
+        if (asprintf(&child, "%s/%s", path, de->d_name) == -1) {
+            ret = -1;
+            break;
+        }
+        ret = mrcc_remove_tree(child);
+        free(child);
+    }
+    closedir(dir);
+    return ret ? ret : rmdir(path);
+}
+
 /**
  * @brief Return a subdirectory of the MRCC_DIR of the given name,
  *        making sure that the directory exists.
@@ -5,11 +5,17 @@
 int get_tmp_top(const char **p_ret);
 
 int make_tmpnam(const char *prefix, const char *suffix, char **name_ret);
+int make_tmpmem(const char *prefix, const char *suffix, char **name_ret);
+int tmpmem_fd(const char *name);
 
 int get_top_dir(char **path_ret);
 
 int mrcc_mkdir(const char *path);
 
+int mrcc_mkdir_p(const char *path);
+
+int mrcc_remove_tree(const char *path);
+
 int get_subdir(const char *name, char **dir_ret);
 
 
@@ -299,16 +299,16 @@ int get_protover_from_features(enum compress compr, enum cpp_where cpp_where, en
 	*protover = MRCC_VER_1;
     }
 
-    if (compr == MRCC_COMPRESS_LZO1X && cpp_where == MRCC_CPP_ON_SERVER) {
+    if (compr != MRCC_COMPRESS_NONE && cpp_where == MRCC_CPP_ON_SERVER) {
 	*protover = MRCC_VER_3;
     }
 
-    if (compr == MRCC_COMPRESS_LZO1X && cpp_where == MRCC_CPP_ON_CLIENT) {
+    if (compr != MRCC_COMPRESS_NONE && cpp_where == MRCC_CPP_ON_CLIENT) {
 	*protover = MRCC_VER_2;
     }
 
     if (compr == MRCC_COMPRESS_NONE && cpp_where == MRCC_CPP_ON_SERVER) {
-	rs_log_error("pump mode (',cpp') requires compression (',lzo')");
+	rs_log_error("pump mode (',cpp') requires compression (',lzo' or ',lz4')");
     }
 
     return *protover;
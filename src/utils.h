@@ -77,7 +77,7 @@ struct hostdef {
 
 enum protover {
     MRCC_VER_1   = 1,            /**< vanilla */
-    MRCC_VER_2   = 2,            /**< LZO sprinkles */
+    MRCC_VER_2   = 2,            /**< compressed preprocessed source */
     MRCC_VER_3   = 3             /**< server-side cpp */
 };
 
@@ -85,7 +85,8 @@ enum protover {
 enum compress {
     /* wierd values to catch errors */
     MRCC_COMPRESS_NONE     = 69,
-    MRCC_COMPRESS_LZO1X
+    MRCC_COMPRESS_LZO1X,
+    MRCC_COMPRESS_LZ4
 };
 
 
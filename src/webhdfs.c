@@ -0,0 +1,551 @@
+// mrcc - A C Compiler system on MapReduce
+// Zhiqiang Ma, https://www.ericzma.com
+
+#include <stdarg.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <string.h>
+#include <time.h>
+#include <ctype.h>
+#include <assert.h>
+#include <fcntl.h>
+
+#include <sys/fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <signal.h>
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <sys/poll.h>
+
+#include "utils.h"
+#include "trace.h"
+#include "io.h"
+#include "sockets.h"
+#include "http.h"
+#include "stringutils.h"
+#include "netfsutils.h"
+#include "webhdfs.h"
+#include "deadline.h"
+
+/**
+ * @file
+ * @brief In-process client for the WebHDFS REST protocol.
+ *
+ * Every "hadoop dfs" command starts a shell and a JVM, which costs far
+ * more than moving a few megabytes over the network.  This module talks
+ * HTTP to the namenode directly instead.  It is used when $MRCC_WEBHDFS
+ * is set to the "HOST[:PORT]" of the namenode's http server.
+ *
+ * Relative file system names are resolved against /user/$MRCC_WEBHDFS_USER
+ * (or /user/$USER), exactly as the hadoop shell does.
+ *
+ * Only what mrcc needs is implemented: one request per connection, the
+ * namenode-to-datanode redirect of CREATE and OPEN, and response bodies
+ * framed by Content-Length, chunked encoding or connection close.
+ **/
+
+#define WEBHDFS_PREFIX "/webhdfs/v1"
+
+// timeout for all network IO with the file system, in seconds
+static const int webhdfs_io_timeout = 300;
+
+/**
+ * @brief Whether file system operations should go through WebHDFS.
+ * @return 1 if $MRCC_WEBHDFS is set, otherwise 0.
+ */
+int webhdfs_enabled(void)
+{
+    const char *e = getenv("MRCC_WEBHDFS");
+    return e != NULL && e[0] != '\0';
+}
+
+/* Look up the namenode address, once per process. */
+static int webhdfs_namenode(const char **host, int *port)
+{
+    static char *cached_host;
+    static int cached_port;
+    const char *spec;
+    int ret;
+
+    if (cached_host == NULL) {
+        spec = getenv("MRCC_WEBHDFS");
+        if (spec == NULL || spec[0] == '\0') {
+            rs_log_error("MRCC_WEBHDFS is not set");
+            return EXIT_BAD_HOSTSPEC;
+        }
+        ret = parse_host_port(spec, WEBHDFS_DEFAULT_PORT,
+                              &cached_host, &cached_port);
+        if (ret)
+            return ret;
+    }
+    *host = cached_host;
+    *port = cached_port;
+    return 0;
+}
+
+static const char *webhdfs_user(void)
+{
+    const char *user;
+
+    if ((user = getenv("MRCC_WEBHDFS_USER")) && user[0])
+        return user;
+    if ((user = getenv("USER")) && user[0])
+        return user;
+    if ((user = getenv("LOGNAME")) && user[0])
+        return user;
+    return "mrcc";
+}
+
+/**
+ * Percent-encode @p s for use in a URL.  Slashes are kept when
+ * @p keep_slash is set, so that a path stays a path.
+ */
+static char *webhdfs_escape(const char *s, int keep_slash)
+{
+    static const char hex[] = "0123456789ABCDEF";
+    char *out, *o;
+
+    out = o = malloc(strlen(s) * 3 + 1);
+    if (out == NULL)
+        return NULL;
+
+    for (; *s; s++) {
+        unsigned char c = (unsigned char) *s;
+        if (isalnum(c) || c == '-' || c == '_' || c == '.' || c == '~'
+                || (keep_slash && c == '/')) {
+            *o++ = c;
+        } else {
+            *o++ = '%';
+            *o++ = hex[c >> 4];
+            *o++ = hex[c & 15];
+        }
+    }
+    *o = '\0';
+    return out;
+}
+
+/* Resolve a file system name to an absolute path, as the hadoop shell does. */
+static char *webhdfs_abspath(const char *fsname)
+{
+    char *abs = NULL;
+
+    if (fsname[0] == '/')
+        return strdup(fsname);
+    if (asprintf(&abs, "/user/%s/%s", webhdfs_user(), fsname) == -1)
+        return NULL;
+    return abs;
+}
+
+/**
+ * Build the request target for operation @p op on @p fsname.
+ * @p extra is appended to the query string as given.
+ * Caller is responsible for free()ing the returned string.
+ */
+static char *webhdfs_target(const char *fsname, const char *op, const char *extra)
+{
+    char *abs, *escaped, *user, *target = NULL;
+
+    abs = webhdfs_abspath(fsname);
+    if (abs == NULL)
+        return NULL;
+    escaped = webhdfs_escape(abs, 1);
+    user = webhdfs_escape(webhdfs_user(), 0);
+    free(abs);
+    if (escaped == NULL || user == NULL) {
+        free(escaped);
+        free(user);
+        return NULL;
+    }
+
+    if (asprintf(&target, "%s%s?op=%s&user.name=%s%s",
+                 WEBHDFS_PREFIX, escaped, op, user, extra ? extra : "") == -1)
+        target = NULL;
+    free(escaped);
+    free(user);
+    return target;
+}
+
+
+/* Log the server's complaint and map the status to an exit code. */
+static int webhdfs_failed(struct http_conn *c, const char *op, const char *fsname)
+{
+    char *msg = NULL;
+    int status = c->status;
+
+    http_read_body(c, -1, &msg, NULL);
+    rs_log_error("webhdfs %s \"%s\" failed with http status %d%s%s",
+                 op, fsname, status, msg ? ": " : "", msg ? msg : "");
+    free(msg);
+    return status == 404 ? EXIT_NO_SUCH_FILE : EXIT_IO_ERROR;
+}
+
+/**
+ * Send the head of a WebHDFS request, following a redirect to a
+ * datanode if the namenode sends one.
+ *
+ * On success @p c is left open.  If it was redirected, c->status is 0
+ * and the caller is to send the body, if any, and read the response;
+ * otherwise the namenode's response head has been read already.
+ *
+ * @param body_len body length for the datanode, HTTP_CHUNKED or
+ * HTTP_NO_BODY.
+ * @return 0 on success, or error return code.
+ */
+static int webhdfs_start(struct http_conn *c, const char *method,
+                         const char *fsname, const char *op,
+                         const char *extra, off_t body_len)
+{
+    const char *nn_host;
+    int nn_port;
+    char *target, *host = NULL, *redirect_target = NULL;
+    int port;
+    int ret;
+
+    if ((ret = webhdfs_namenode(&nn_host, &nn_port)))
+        return ret;
+    if ((target = webhdfs_target(fsname, op, extra)) == NULL)
+        return EXIT_OUT_OF_MEMORY;
+
+    /* The namenode never takes the data itself; it redirects us. */
+    ret = http_send_request(c, nn_host, nn_port, method, target,
+                            strcmp(method, "PUT") ? HTTP_NO_BODY : 0,
+                            deadline_io_timeout(webhdfs_io_timeout));
+    free(target);
+    if (ret)
+        goto fail;
+    if ((ret = http_read_response(c)))
+        goto fail;
+
+    if (c->status == 307 && c->location) {
+        ret = http_parse_url(c->location, &host, &port, &redirect_target);
+        http_close(c);
+        if (ret)
+            return ret;
+
+        ret = http_send_request(c, host, port, method, redirect_target,
+                                body_len,
+                                deadline_io_timeout(webhdfs_io_timeout));
+        free(host);
+        free(redirect_target);
+        if (ret)
+            goto fail;
+        c->status = 0;
+    } else if (body_len != HTTP_NO_BODY && c->status / 100 == 2) {
+        rs_log_error("webhdfs %s \"%s\": namenode did not redirect", op, fsname);
+        ret = EXIT_PROTOCOL_ERROR;
+        goto fail;
+    }
+    return 0;
+
+fail:
+    http_close(c);
+    return ret;
+}
+
+/**
+ * Run one WebHDFS operation, following a redirect to a datanode if
+ * the namenode sends one.
+ *
+ * @param method HTTP method.
+ * @param fsname file system name to operate on.
+ * @param op WebHDFS operation name, e.g. "CREATE".
+ * @param extra more query parameters, starting with '&', or NULL.
+ * @param body_fd if not -1, send @p body_len bytes from it as the body.
+ * @param out_fd if not -1, write the response body here.
+ * @param mem if not NULL, receives the response body when @p out_fd is -1.
+ * @return 0 on success, or error return code.
+ */
+static int webhdfs_op(const char *method, const char *fsname, const char *op,
+                      const char *extra, int body_fd, off_t body_len,
+                      int out_fd, char **mem)
+{
+    struct http_conn c;
+    int ret;
+
+    ret = webhdfs_start(&c, method, fsname, op, extra,
+                        body_fd != -1 ? body_len : HTTP_NO_BODY);
+    if (ret)
+        return ret;
+
+    if (c.status == 0) {
+        if (body_fd != -1 && (ret = http_send_body(&c, body_fd, body_len)))
+            goto out;
+        if ((ret = http_read_response(&c)))
+            goto out;
+    }
+
+    if (c.status / 100 != 2) {
+        ret = webhdfs_failed(&c, op, fsname);
+        goto out;
+    }
+    ret = http_read_body(&c, out_fd, mem, NULL);
+
+out:
+    http_close(&c);
+    return ret;
+}
+
+
+/**********************************************************************
+ * File operations
+ **********************************************************************/
+
+/**
+ * @brief Put a local file to the file system, replacing any old copy.
+ * @param localsrc local source filename.
+ * @param dst destination filename on the file system.
+ * @return 0 on success, or error return code.
+ */
+int webhdfs_put(const char *localsrc, const char *dst)
+{
+    int fd;
+    off_t len;
+    int ret;
+
+    ret = open_read(localsrc, &fd, &len);
+    if (ret)
+        return ret;
+    if (fd == -1) {
+        rs_log_error("\"%s\" does not exist", localsrc);
+        return EXIT_NO_SUCH_FILE;
+    }
+
+    ret = webhdfs_op("PUT", dst, "CREATE", "&overwrite=true", fd, len, -1, NULL);
+    close(fd);
+    if (ret == 0)
+        rs_trace("put %s to %s: %lld bytes", localsrc, dst, (long long) len);
+    return ret;
+}
+
+/**
+ * @brief Start putting a file of yet unknown length to the file system.
+ * The data is then sent with http_send_chunk() and the upload completed
+ * with webhdfs_create_finish(), or abandoned with http_close().
+ * @param dst destination filename on the file system.
+ * @param c receives the connection to send the data over.
+ * @return 0 on success, or error return code.
+ */
+int webhdfs_create(const char *dst, struct http_conn *c)
+{
+    int ret;
+
+    ret = webhdfs_start(c, "PUT", dst, "CREATE", "&overwrite=true",
+                        HTTP_CHUNKED);
+    if (ret == 0 && c->status != 0) {
+        ret = webhdfs_failed(c, "CREATE", dst);
+        http_close(c);
+    }
+    return ret;
+}
+
+/**
+ * @brief Complete an upload started by webhdfs_create().
+ * @param c the connection, which is closed.
+ * @param dst destination filename on the file system.
+ * @return 0 if the file was stored, or error return code.
+ */
+int webhdfs_create_finish(struct http_conn *c, const char *dst)
+{
+    int ret;
+
+    if ((ret = http_send_chunk(c, NULL, 0)))
+        goto out;
+    if ((ret = http_read_response(c)))
+        goto out;
+    if (c->status / 100 != 2) {
+        ret = webhdfs_failed(c, "CREATE", dst);
+        goto out;
+    }
+    ret = http_read_body(c, -1, NULL, NULL);
+
+out:
+    http_close(c);
+    return ret;
+}
+
+/**
+ * @brief Get a file from the file system.
+ * The data is written to a temporary file next to @p localdst, which is
+ * renamed into place once complete, so that a failed transfer never
+ * leaves a truncated file behind.
+ * @param src source filename on the file system.
+ * @param localdst local destination filename.
+ * @return 0 on success, or error return code.
+ */
+int webhdfs_get(const char *src, const char *localdst)
+{
+    char *tmp = NULL;
+    mode_t mask;
+    int fd;
+    int ret;
+
+    mask = umask(0);
+    umask(mask);
+
+    if (asprintf(&tmp, "%s.mrcc_XXXXXX", localdst) == -1)
+        return EXIT_OUT_OF_MEMORY;
+    fd = mkstemp(tmp);
+    if (fd == -1) {
+        rs_log_error("failed to create \"%s\": %s", tmp, strerror(errno));
+        free(tmp);
+        return EXIT_IO_ERROR;
+    }
+
+    ret = webhdfs_op("GET", src, "OPEN", NULL, -1, 0, fd, NULL);
+    if (ret == 0 && fchmod(fd, 0666 & ~mask) == -1)
+        rs_log_warning("fchmod \"%s\" failed: %s", tmp, strerror(errno));
+    if (mrcc_close(fd) != 0 && ret == 0)
+        ret = EXIT_IO_ERROR;
+    if (ret == 0 && rename(tmp, localdst) == -1) {
+        rs_log_error("failed to rename \"%s\" to \"%s\": %s",
+                     tmp, localdst, strerror(errno));
+        ret = EXIT_IO_ERROR;
+    }
+    if (ret)
+        unlink(tmp);
+    free(tmp);
+    return ret;
+}
+
+/**
+ * @brief Delete a file or a directory tree from the file system.
+ * @param path filename on the file system.
+ * @return 0 on success, EXIT_NO_SUCH_FILE if nothing was deleted, or
+ * another error return code.
+ */
+int webhdfs_delete(const char *path)
+{
+    char *reply = NULL;
+    int ret;
+
+    ret = webhdfs_op("DELETE", path, "DELETE", "&recursive=true",
+                     -1, 0, -1, &reply);
+    if (ret == 0 && (reply == NULL || strstr(reply, "true") == NULL)) {
+        rs_trace("webhdfs delete \"%s\": nothing deleted", path);
+        ret = EXIT_NO_SUCH_FILE;
+    }
+    free(reply);
+    return ret;
+}
+
+/**
+ * @brief Rename a file on the file system.
+ * @param src current filename on the file system.
+ * @param dst new filename; its parent directory must exist.
+ * @return 0 on success, EXIT_BUSY if the file system refused (for
+ * example because @p dst exists), or another error return code.
+ */
+int webhdfs_rename(const char *src, const char *dst)
+{
+    char *abs, *escaped = NULL, *extra = NULL, *reply = NULL;
+    int ret;
+
+    abs = webhdfs_abspath(dst);
+    if (abs)
+        escaped = webhdfs_escape(abs, 1);
+    free(abs);
+    if (escaped == NULL || asprintf(&extra, "&destination=%s", escaped) == -1) {
+        free(escaped);
+        return EXIT_OUT_OF_MEMORY;
+    }
+    free(escaped);
+
+    ret = webhdfs_op("PUT", src, "RENAME", extra, -1, 0, -1, &reply);
+    if (ret == 0 && (reply == NULL || strstr(reply, "true") == NULL)) {
+        rs_trace("webhdfs rename \"%s\" to \"%s\" refused", src, dst);
+        ret = EXIT_BUSY;
+    }
+    free(extra);
+    free(reply);
+    return ret;
+}
+
+/* Find "key": in the JSON object between @p p and @p end. */
+static const char *webhdfs_json_field(const char *p, const char *end,
+                                      const char *key)
+{
+    size_t len = strlen(key);
+
+    for (; p && p < end; p++) {
+        p = strchr(p, '"');
+        if (p == NULL || p >= end)
+            return NULL;
+        if (!strncmp(p + 1, key, len) && p[len + 1] == '"') {
+            p += len + 2;
+            while (*p == ' ' || *p == ':')
+                p++;
+            return p < end ? p : NULL;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief List a directory on the file system.
+ * @param dir directory name on the file system.
+ * @param entries_ret receives a malloc'd array, to be released with
+ * free_fs_entries().
+ * @param n_ret receives the number of entries.
+ * @return 0 on success, EXIT_NO_SUCH_FILE if @p dir does not exist, or
+ * another error return code.
+ */
+int webhdfs_list(const char *dir, struct fs_entry **entries_ret, int *n_ret)
+{
+    struct fs_entry *entries = NULL, *e;
+    char *reply = NULL;
+    const char *p, *end, *v;
+    int n = 0, size = 0;
+    int ret;
+
+    ret = webhdfs_op("GET", dir, "LISTSTATUS", NULL, -1, 0, -1, &reply);
+    if (ret)
+        return ret;
+
+    p = reply ? strstr(reply, "\"FileStatus\"") : NULL;
+    while (p && (p = strchr(p, '{')) != NULL && (end = strchr(p, '}')) != NULL) {
+        if (n == size) {
+            size = size ? size * 2 : 64;
+            e = realloc(entries, size * sizeof *entries);
+            if (e == NULL) {
+                ret = EXIT_OUT_OF_MEMORY;
+                break;
+            }
+            entries = e;
+        }
+        e = &entries[n];
+        memset(e, 0, sizeof *e);
+        if ((v = webhdfs_json_field(p, end, "length")))
+            e->size = strtoll(v, NULL, 10);
+        if ((v = webhdfs_json_field(p, end, "modificationTime")))
+            e->mtime = strtoll(v, NULL, 10) / 1000;
+        if ((v = webhdfs_json_field(p, end, "accessTime")))
+            e->atime = strtoll(v, NULL, 10) / 1000;
+        if ((v = webhdfs_json_field(p, end, "type")))
+            e->is_dir = !strncmp(v, "\"DIRECTORY\"", 11);
+        if ((v = webhdfs_json_field(p, end, "pathSuffix")) && *v == '"')
+            e->name = strndup(v + 1, strcspn(v + 1, "\""));
+        if (e->name == NULL) {
+            ret = EXIT_PROTOCOL_ERROR;
+            break;
+        }
+        n++;
+        p = end + 1;
+    }
+    free(reply);
+
+    if (ret) {
+        free_fs_entries(entries, n);
+        return ret;
+    }
+    *entries_ret = entries;
+    *n_ret = n;
+    return 0;
+}
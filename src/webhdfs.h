@@ -0,0 +1,19 @@
+// mrcc - A C Compiler system on MapReduce
+// Zhiqiang Ma, https://www.ericzma.com
+#pragma once
+
+// default port of the namenode's http server
+#define WEBHDFS_DEFAULT_PORT 50070
+
+struct fs_entry;
+struct http_conn;
+
+int webhdfs_enabled(void);
+
+int webhdfs_put(const char *localsrc, const char *dst);
+int webhdfs_create(const char *dst, struct http_conn *c);
+int webhdfs_create_finish(struct http_conn *c, const char *dst);
+int webhdfs_get(const char *src, const char *localdst);
+int webhdfs_delete(const char *path);
+int webhdfs_rename(const char *src, const char *dst);
+int webhdfs_list(const char *dir, struct fs_entry **entries_ret, int *n_ret);
@@ -0,0 +1,45 @@
+// mrcc - A C Compiler system on MapReduce
+// Zhiqiang Ma, https://www.ericzma.com
+#pragma once
+
+#include <stdio.h>
+#include <string.h>
+
+/**
+ * @file
+ * @brief What the unit tests in this directory share.
+ *
+ * A test is a program that checks one source of mrcclib and exits
+ * nonzero if any check failed; ctest and "make check" run them all.
+ **/
+
+// what trace.c logs as, see the programs in src/
+const char *rs_program_name = "mrcc-test";
+
+// number of checks that failed so far
+static int check_failures = 0;
+
+// note a failure unless @p cond holds, and go on
+#define CHECK(cond)                                                     \
+    do {                                                                \
+        if (!(cond)) {                                                  \
+            fprintf(stderr, "%s:%d: check failed: %s\n",                \
+                    __FILE__, __LINE__, #cond);                         \
+            check_failures++;                                           \
+        }                                                               \
+    } while (0)
+
+// CHECK() that two strings are equal, showing both if they are not
+#define CHECK_STR(got, want)                                            \
+    do {                                                                \
+        const char *got_ = (got), *want_ = (want);                      \
+        if (got_ == NULL || strcmp(got_, want_) != 0) {                 \
+            fprintf(stderr, "%s:%d: %s is \"%s\", not \"%s\"\n",        \
+                    __FILE__, __LINE__, #got,                           \
+                    got_ ? got_ : "(null)", want_);                     \
+            check_failures++;                                           \
+        }                                                               \
+    } while (0)
+
+// what main() returns
+#define CHECK_RESULT() (check_failures ? 1 : 0)
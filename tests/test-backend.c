@@ -0,0 +1,94 @@
+// mrcc - A C Compiler system on MapReduce
+// Zhiqiang Ma, https://www.ericzma.com
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "stringutils.h"
+#include "backend.h"
+#include "check.h"
+
+/**
+ * @file
+ * @brief Tests of the command templates of the cmd backend, backend.c.
+ **/
+
+/* Check that /bin/sh splits the quoted @p argv back into @p argv. */
+static void check_shell_words(char **argv)
+{
+    char *quoted, *line = NULL;
+    char buf[256];
+    FILE *f;
+    int i;
+
+    quoted = backend_cmd_quote(argv);
+    CHECK(quoted != NULL);
+    if (quoted == NULL)
+        return;
+    /* one word per line, with a mark so that empty words show */
+    if (asprintf(&line, "printf '<%%s>\\n' %s", quoted) == -1)
+        goto out;
+    if ((f = popen(line, "r")) == NULL)
+        goto out;
+    for (i = 0; fgets(buf, sizeof buf, f); i++) {
+        buf[strcspn(buf, "\n")] = '\0';
+        CHECK(argv[i] != NULL);
+        if (argv[i] == NULL)
+            break;
+        CHECK(buf[0] == '<' && buf[strlen(buf) - 1] == '>');
+        buf[strlen(buf) - 1] = '\0';
+        CHECK_STR(buf + 1, argv[i]);
+    }
+    CHECK(argv[i] == NULL);
+    CHECK(pclose(f) == 0);
+
+out:
+    free(line);
+    free(quoted);
+}
+
+int main(void)
+{
+    char *plain[] = {"/usr/bin/mrcc-map", "-c", "m.i", NULL};
+    char *odd[] = {"it's", "a b", "$HOME", "`id`", "\"q\"", "\\", "", NULL};
+    struct backend_job job;
+    char *line;
+
+    line = backend_cmd_quote(plain);
+    CHECK_STR(line, "'/usr/bin/mrcc-map' '-c' 'm.i'");
+    free(line);
+    line = backend_cmd_quote(odd);
+    CHECK(line && strncmp(line, "'it'\\''s' 'a b' ", 16) == 0);
+    free(line);
+
+    check_shell_words(plain);
+    check_shell_words(odd);
+
+    backend_job_init(&job);
+    job.name = "mrcc-42";
+
+    line = backend_cmd_expand("srun -J %j %c", &job, "'mrcc-map' 'm.i'");
+    CHECK_STR(line, "srun -J mrcc-42 'mrcc-map' 'm.i'");
+    free(line);
+
+    line = backend_cmd_expand("echo 100%% %j%j", &job, NULL);
+    CHECK_STR(line, "echo 100% mrcc-42mrcc-42");
+    free(line);
+
+    /* without a command, as for MRCC_BACKEND_CANCEL, %c stays */
+    line = backend_cmd_expand("scancel -n %j %c", &job, NULL);
+    CHECK_STR(line, "scancel -n mrcc-42 %c");
+    free(line);
+
+    /* other escapes and a % at the end are left alone */
+    line = backend_cmd_expand("%x %c %", &job, "cc");
+    CHECK_STR(line, "%x cc %");
+    free(line);
+
+    line = backend_cmd_expand("", &job, "cc");
+    CHECK_STR(line, "");
+    free(line);
+
+    return CHECK_RESULT();
+}
@@ -0,0 +1,79 @@
+// mrcc - A C Compiler system on MapReduce
+// Zhiqiang Ma, https://www.ericzma.com
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils.h"
+#include "batch.h"
+#include "check.h"
+
+/**
+ * @file
+ * @brief Tests of the line codec of batch.c.
+ **/
+
+/* Encode @p argv, check the line is @p want, and decode it back. */
+static void check_round_trip(char **argv, const char *want)
+{
+    char *line, **got = NULL;
+    int i;
+
+    line = batch_argv_toline(argv);
+    CHECK(line != NULL);
+    if (line == NULL)
+        return;
+    if (want)
+        CHECK_STR(line, want);
+    CHECK(strchr(line, '\n') == NULL);
+
+    CHECK(batch_line_toargv(line, &got) == 0);
+    if (got == NULL)
+        goto out;
+    for (i = 0; argv[i] && got[i]; i++)
+        CHECK_STR(got[i], argv[i]);
+    CHECK(argv[i] == NULL && got[i] == NULL);
+
+out:
+    free(got);
+    free(line);
+}
+
+int main(void)
+{
+    char *plain[] = {"gcc", "-O2", "-c", "m.c", "-o", "m.o", NULL};
+    char *spaces[] = {"gcc", "-DMSG=\"a b\"", "-c", "dir with space/m.c", NULL};
+    char *odd[] = {"cc", "-D50%", "tab\there", "new\nline", "\x7f\x01", NULL};
+    char *empty[] = {NULL};
+    char bad1[] = "gcc -D%4";
+    char bad2[] = "gcc -D%zz";
+    char spaced[] = "  gcc   -c  m.c ";
+    char **got = NULL;
+
+    check_round_trip(plain, "gcc -O2 -c m.c -o m.o");
+    check_round_trip(spaces, "gcc -DMSG=\"a%20b\" -c dir%20with%20space/m.c");
+    check_round_trip(odd, "cc -D50%25 tab%09here new%0aline %7f%01");
+    check_round_trip(empty, "");
+
+    /* escapes are decoded in either case */
+    {
+        char upper[] = "a%2Fb";
+        CHECK(batch_line_toargv(upper, &got) == 0);
+        CHECK_STR(got[0], "a/b");
+        CHECK(got[1] == NULL);
+        free(got);
+    }
+
+    /* runs of blanks do not make empty words */
+    CHECK(batch_line_toargv(spaced, &got) == 0);
+    CHECK_STR(got[0], "gcc");
+    CHECK_STR(got[1], "-c");
+    CHECK_STR(got[2], "m.c");
+    CHECK(got[3] == NULL);
+    free(got);
+
+    CHECK(batch_line_toargv(bad1, &got) == EXIT_PROTOCOL_ERROR);
+    CHECK(batch_line_toargv(bad2, &got) == EXIT_PROTOCOL_ERROR);
+
+    return CHECK_RESULT();
+}
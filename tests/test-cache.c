@@ -0,0 +1,100 @@
+// mrcc - A C Compiler system on MapReduce
+// Zhiqiang Ma, https://www.ericzma.com
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "utils.h"
+#include "hash.h"
+#include "cache.h"
+#include "check.h"
+
+/**
+ * @file
+ * @brief Tests of the content-addressed keys of cache.c.
+ **/
+
+/* Write @p text to @p fname, replacing what was there. */
+static int write_text(const char *fname, const char *text)
+{
+    FILE *f = fopen(fname, "w");
+
+    if (f == NULL)
+        return -1;
+    fputs(text, f);
+    return fclose(f);
+}
+
+/* The hex SHA-256 of @p s. */
+static void hash_hex(const char *s, char hex[HASH_HEX_LEN + 1])
+{
+    struct hash_ctx ctx;
+
+    hash_init(&ctx);
+    hash_update(&ctx, s, strlen(s));
+    hash_final_hex(&ctx, hex);
+}
+
+int main(void)
+{
+    char cpp_fname[] = "/tmp/mrcc-test-cache-XXXXXX";
+    char *argv[] = {"/bin/sh", "-O2", "-c", "a.c", "-o", "a.o", NULL};
+    char *moved[] = {"/bin/sh", "-O2", "-c", "b/b.c", "-o", "b/b.o", NULL};
+    char *other[] = {"/bin/sh", "-O0", "-c", "a.c", "-o", "a.o", NULL};
+    char *missing[] = {"/nonexistent/cc", "-c", "a.c", "-o", "a.o", NULL};
+    char key[HASH_HEX_LEN + 1], again[HASH_HEX_LEN + 1];
+    char hex[HASH_HEX_LEN + 1];
+    char *long_text;
+    int fd;
+
+    /* the digest is SHA-256 (FIPS 180-2 examples) */
+    hash_hex("abc", hex);
+    CHECK_STR(hex, "ba7816bf8f01cfea414140de5dae2223"
+                   "b00361a396177a9cb410ff61f20015ad");
+    hash_hex("", hex);
+    CHECK_STR(hex, "e3b0c44298fc1c149afbf4c8996fb924"
+                   "27ae41e4649b934ca495991b7852b855");
+    long_text = malloc(1000001);
+    memset(long_text, 'a', 1000000);
+    long_text[1000000] = '\0';
+    hash_hex(long_text, hex);
+    CHECK_STR(hex, "cdc76e5c9914fb9281a1c7e284d73e67"
+                   "f1809a48a497200e046d39ccc7112cd0");
+    free(long_text);
+
+    if ((fd = mkstemp(cpp_fname)) == -1) {
+        perror(cpp_fname);
+        return 1;
+    }
+    close(fd);
+    CHECK(write_text(cpp_fname, "int a(void) { return 1; }\n") == 0);
+
+    CHECK(cache_key(argv, "a.c", cpp_fname, "a.o", key) == 0);
+    CHECK(strlen(key) == HASH_HEX_LEN);
+    CHECK(strspn(key, "0123456789abcdef") == HASH_HEX_LEN);
+
+    /* the same compile always has the same key */
+    CHECK(cache_key(argv, "a.c", cpp_fname, "a.o", again) == 0);
+    CHECK_STR(again, key);
+
+    /* where the source and the object are does not matter */
+    CHECK(cache_key(moved, "b/b.c", cpp_fname, "b/b.o", again) == 0);
+    CHECK_STR(again, key);
+
+    /* the options do */
+    CHECK(cache_key(other, "a.c", cpp_fname, "a.o", again) == 0);
+    CHECK(strcmp(again, key) != 0);
+
+    /* and so does the preprocessed source */
+    CHECK(write_text(cpp_fname, "int a(void) { return 2; }\n") == 0);
+    CHECK(cache_key(argv, "a.c", cpp_fname, "a.o", again) == 0);
+    CHECK(strcmp(again, key) != 0);
+
+    CHECK(cache_key(missing, "a.c", cpp_fname, "a.o", again)
+          == EXIT_COMPILER_MISSING);
+
+    unlink(cpp_fname);
+    return CHECK_RESULT();
+}
@@ -0,0 +1,359 @@
+// mrcc - A C Compiler system on MapReduce
+// Zhiqiang Ma, https://www.ericzma.com
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+
+#include "utils.h"
+#include "stringutils.h"
+#include "compress.h"
+#include "check.h"
+
+/**
+ * @file
+ * @brief Tests of the LZ4 codec and the file framing of compress.c.
+ **/
+
+// bytes after the room given to the compressor that it must not touch
+#define GUARD 16
+
+// what fills the guard
+#define GUARD_BYTE 0xa5
+
+// the literal and match lengths seen in compressed blocks, up to 300
+static int seen_lit[301], seen_ml[301];
+
+/* Same bytes every run, but without any redundancy to find. */
+static void fill_random(unsigned char *p, size_t n)
+{
+    static uint32_t x = 2463534242U;
+
+    while (n--) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        *p++ = (unsigned char) x;
+    }
+}
+
+/* Note the lengths of the sequences of a block in seen_lit and seen_ml. */
+static void note_lengths(const unsigned char *p, size_t n)
+{
+    const unsigned char *end = p + n;
+    size_t lit, ml;
+
+    while (p < end) {
+        lit = *p >> 4;
+        ml = *p++ & 15;
+        if (lit == 15)
+            do lit += *p; while (*p++ == 255);
+        if (lit <= 300)
+            seen_lit[lit] = 1;
+        p += lit;
+        if (p >= end)
+            break;
+        p += 2;
+        if (ml == 15)
+            do ml += *p; while (*p++ == 255);
+        if (ml <= 300)
+            seen_ml[ml] = 1;
+    }
+}
+
+/*
+ * Compress @p n bytes of @p src into @p cap bytes, check that nothing
+ * past them is touched and that what comes out decompresses to @p src.
+ * Return the compressed length, 0 if it did not fit.
+ */
+static size_t check_block(const unsigned char *src, size_t n, size_t cap)
+{
+    unsigned char *dst = malloc(cap + GUARD), *raw = malloc(n + 1);
+    size_t len, i;
+
+    memset(dst, GUARD_BYTE, cap + GUARD);
+    len = lz4_compress_block(src, n, dst, cap);
+    CHECK(len <= cap);
+    for (i = cap; i < cap + GUARD; i++) {
+        if (dst[i] != GUARD_BYTE) {
+            fprintf(stderr, "n=%zu cap=%zu: wrote past cap\n", n, cap);
+            CHECK(dst[i] == GUARD_BYTE);
+            break;
+        }
+    }
+    if (len) {
+        note_lengths(dst, len);
+        CHECK(lz4_decompress_block(dst, len, raw, n) == 0);
+        CHECK(memcmp(raw, src, n) == 0);
+    }
+    free(dst);
+    free(raw);
+    return len;
+}
+
+/*
+ * @p lit_len random bytes, a repeat of them @p match_len long and
+ * @p tail_len more random bytes; returns the length of it all.
+ */
+static size_t make_sequence(unsigned char *buf, size_t lit_len,
+                            size_t match_len, size_t tail_len)
+{
+    size_t i;
+
+    fill_random(buf, lit_len ? lit_len : 1);
+    for (i = 0; i < match_len; i++)
+        buf[lit_len + i] = buf[i % (lit_len ? lit_len : 1)];
+    fill_random(buf + lit_len + match_len, tail_len);
+    return lit_len + match_len + tail_len;
+}
+
+static void test_blocks(void)
+{
+    static const size_t long_lens[] = {
+        260, 265, 268, 269, 270, 271, 272, 275, 280, 530, 1000
+    };
+    unsigned char *buf = malloc(COMPRESS_BLOCK_SIZE);
+    size_t lit, ml, n, len, cap, i, j;
+
+    /* empty */
+    fill_random(buf, 4096);
+    CHECK(check_block(buf, 0, 16) == 1);
+    CHECK(check_block(buf, 0, 0) == 0);
+
+    /* incompressible data does not fit into less than its size */
+    CHECK(check_block(buf, 4096, 4096 - 4096 / 16) == 0);
+    CHECK(check_block(buf, 4096, lz4_compress_bound(4096)) > 0);
+
+    /* long runs compress well */
+    memset(buf, 'x', COMPRESS_BLOCK_SIZE);
+    len = check_block(buf, COMPRESS_BLOCK_SIZE,
+                      lz4_compress_bound(COMPRESS_BLOCK_SIZE));
+    CHECK(len > 0 && len < COMPRESS_BLOCK_SIZE / 200);
+
+    /* every room around short sequences */
+    for (lit = 0; lit <= 20; lit++) {
+        for (ml = 4; ml <= 24; ml++) {
+            n = make_sequence(buf, lit, ml, 8);
+            len = check_block(buf, n, lz4_compress_bound(n));
+            CHECK(len > 0);
+            for (cap = 0; cap <= len + 1; cap++)
+                check_block(buf, n, cap);
+        }
+    }
+
+    /* lengths that take one and two more bytes */
+    for (i = 0; i < sizeof long_lens / sizeof *long_lens; i++) {
+        for (j = 0; j < sizeof long_lens / sizeof *long_lens; j++) {
+            n = make_sequence(buf, long_lens[i], long_lens[j], 8);
+            len = check_block(buf, n, lz4_compress_bound(n));
+            CHECK(len > 0);
+            for (cap = len > 3 ? len - 3 : 0; cap <= len + 1; cap++)
+                check_block(buf, n, cap);
+        }
+        for (ml = 4; ml <= 24; ml++) {
+            n = make_sequence(buf, long_lens[i], ml, 8);
+            check_block(buf, n, lz4_compress_bound(n));
+            n = make_sequence(buf, ml - 4, long_lens[i], 8);
+            check_block(buf, n, lz4_compress_bound(n));
+        }
+    }
+    CHECK(seen_lit[14] && seen_lit[15] && seen_lit[16]);
+    /* long literal runs end where skipping through them lands */
+    CHECK(seen_lit[267] && seen_lit[270] && seen_lit[273]);
+    CHECK(seen_ml[14] && seen_ml[15] && seen_ml[16]);
+    CHECK(seen_ml[269] && seen_ml[270] && seen_ml[271]);
+
+    /* a sequence that ends right at the room left */
+    n = make_sequence(buf, 15, 19, 5);
+    for (cap = 0; cap <= 40; cap++)
+        check_block(buf, n, cap);
+
+    free(buf);
+}
+
+static void test_corrupt_blocks(void)
+{
+    /* 3 literals, then a match of 4 at offset 3 */
+    unsigned char good[] = {0x30, 'a', 'b', 'c', 3, 0};
+    unsigned char bad[sizeof good];
+    unsigned char raw[16];
+
+    CHECK(lz4_decompress_block(good, sizeof good, raw, 7) == 0);
+    CHECK(memcmp(raw, "abcabca", 7) == 0);
+
+    /* the output must have exactly the given length */
+    CHECK(lz4_decompress_block(good, sizeof good, raw, 6) == EXIT_PROTOCOL_ERROR);
+    CHECK(lz4_decompress_block(good, sizeof good, raw, 8) == EXIT_PROTOCOL_ERROR);
+
+    /* literals past the end of the input */
+    memcpy(bad, good, sizeof good);
+    bad[0] = 0x90;
+    CHECK(lz4_decompress_block(bad, 4, raw, 9) == EXIT_PROTOCOL_ERROR);
+
+    /* offsets of 0 and back past the start */
+    bad[0] = 0x30;
+    bad[4] = 0;
+    CHECK(lz4_decompress_block(bad, sizeof bad, raw, 7) == EXIT_PROTOCOL_ERROR);
+    bad[4] = 4;
+    CHECK(lz4_decompress_block(bad, sizeof bad, raw, 7) == EXIT_PROTOCOL_ERROR);
+
+    /* half an offset, and a length that never ends */
+    CHECK(lz4_decompress_block(good, 5, raw, 7) == EXIT_PROTOCOL_ERROR);
+    bad[0] = 0xf0;
+    bad[1] = 255;
+    CHECK(lz4_decompress_block(bad, 2, raw, 16) == EXIT_PROTOCOL_ERROR);
+}
+
+/* Write @p n bytes of @p p to @p fname. */
+static void write_bytes(const char *fname, const void *p, size_t n)
+{
+    FILE *f = fopen(fname, "wb");
+
+    CHECK(f != NULL);
+    if (f == NULL)
+        return;
+    CHECK(fwrite(p, 1, n, f) == n);
+    CHECK(fclose(f) == 0);
+}
+
+/* Read all of @p fname; its length goes to @p n. */
+static unsigned char *read_bytes(const char *fname, size_t *n)
+{
+    unsigned char *p;
+    FILE *f = fopen(fname, "rb");
+    long len;
+
+    *n = 0;
+    if (f == NULL)
+        return NULL;
+    fseek(f, 0, SEEK_END);
+    len = ftell(f);
+    rewind(f);
+    if ((p = malloc(len + 1)) != NULL)
+        *n = fread(p, 1, len, f);
+    fclose(f);
+    return p;
+}
+
+/* Compress @p n bytes of @p p through files and back. */
+static void check_file(const unsigned char *p, size_t n, const char *dir)
+{
+    char *raw_fname, *packed_fname, *out_fname;
+    unsigned char *out;
+    size_t out_len;
+
+    CHECK(asprintf(&raw_fname, "%s/raw", dir) != -1);
+    CHECK(asprintf(&packed_fname, "%s/packed", dir) != -1);
+    CHECK(asprintf(&out_fname, "%s/out", dir) != -1);
+
+    write_bytes(raw_fname, p, n);
+    CHECK(compress_file(MRCC_COMPRESS_LZ4, raw_fname, packed_fname) == 0);
+    CHECK(is_compressed_file(packed_fname));
+    CHECK(decompress_file(packed_fname, out_fname) == 0);
+    out = read_bytes(out_fname, &out_len);
+    CHECK(out_len == n && memcmp(out, p, n) == 0);
+
+    free(out);
+    free(raw_fname);
+    free(packed_fname);
+    free(out_fname);
+}
+
+static void test_files(const char *dir)
+{
+    size_t n = COMPRESS_BLOCK_SIZE * 2 + 1000, packed_len, len;
+    unsigned char *p = malloc(n), *packed, *bad;
+    char *raw_fname, *packed_fname, *bad_fname, *out_fname;
+
+    CHECK(asprintf(&raw_fname, "%s/raw", dir) != -1);
+    CHECK(asprintf(&packed_fname, "%s/packed", dir) != -1);
+    CHECK(asprintf(&bad_fname, "%s/bad", dir) != -1);
+    CHECK(asprintf(&out_fname, "%s/out", dir) != -1);
+
+    check_file(p, 0, dir);
+    memset(p, 'x', n);
+    check_file(p, n, dir);
+
+    /* random data goes in stored blocks */
+    fill_random(p, n);
+    check_file(p, n, dir);
+    packed = read_bytes(packed_fname, &packed_len);
+    CHECK(packed_len == 8 + 3 * 8 + n + 8);
+    CHECK(packed[12] & 0x80);
+
+    /* cut anywhere, a file is truncated */
+    memset(p + COMPRESS_BLOCK_SIZE, 'y', COMPRESS_BLOCK_SIZE);
+    check_file(p, n, dir);
+    free(packed);
+    packed = read_bytes(packed_fname, &packed_len);
+    for (len = 0; len < packed_len;
+         len += len < 64 || packed_len - len < 64 ? 1 : 4099) {
+        write_bytes(bad_fname, packed, len);
+        CHECK(decompress_file(bad_fname, out_fname)
+              == (len < 8 ? EXIT_PROTOCOL_ERROR : EXIT_TRUNCATED));
+    }
+
+    bad = malloc(packed_len);
+
+    /* not ours, or of another version */
+    memcpy(bad, packed, packed_len);
+    bad[0] = 'X';
+    write_bytes(bad_fname, bad, packed_len);
+    CHECK(decompress_file(bad_fname, out_fname) == EXIT_PROTOCOL_ERROR);
+    memcpy(bad, packed, packed_len);
+    bad[4] = 2;
+    write_bytes(bad_fname, bad, packed_len);
+    CHECK(decompress_file(bad_fname, out_fname) == EXIT_PROTOCOL_ERROR);
+
+    /* a block larger than any made */
+    memcpy(bad, packed, packed_len);
+    bad[8] = 0x7f;
+    write_bytes(bad_fname, bad, packed_len);
+    CHECK(decompress_file(bad_fname, out_fname) == EXIT_PROTOCOL_ERROR);
+
+    /* a stored block that is not as long as its data */
+    memcpy(bad, packed, packed_len);
+    bad[15]++;
+    write_bytes(bad_fname, bad, packed_len);
+    CHECK(decompress_file(bad_fname, out_fname) == EXIT_PROTOCOL_ERROR);
+
+    /* a compressed block that does not give the length it says */
+    len = 8 + 8 + COMPRESS_BLOCK_SIZE;
+    memcpy(bad, packed, packed_len);
+    CHECK(!(bad[len + 4] & 0x80));
+    bad[len + 2] = 1000 >> 8;
+    bad[len + 3] = 1000 & 255;
+    write_bytes(bad_fname, bad, packed_len);
+    CHECK(decompress_file(bad_fname, out_fname) == EXIT_PROTOCOL_ERROR);
+
+    unlink(raw_fname);
+    unlink(packed_fname);
+    unlink(bad_fname);
+    unlink(out_fname);
+    free(bad);
+    free(packed);
+    free(p);
+    free(raw_fname);
+    free(packed_fname);
+    free(bad_fname);
+    free(out_fname);
+}
+
+int main(void)
+{
+    char dir[] = "/tmp/mrcc-test-compress-XXXXXX";
+
+    test_blocks();
+    test_corrupt_blocks();
+
+    if (mkdtemp(dir) == NULL) {
+        perror(dir);
+        return 1;
+    }
+    test_files(dir);
+    rmdir(dir);
+
+    return CHECK_RESULT();
+}
@@ -0,0 +1,50 @@
+// mrcc - A C Compiler system on MapReduce
+// Zhiqiang Ma, https://www.ericzma.com
+
+#include <stdlib.h>
+#include <limits.h>
+
+#include "fscache.h"
+#include "check.h"
+
+/**
+ * @file
+ * @brief Tests of the shared object cache settings of fscache.c.
+ **/
+
+int main(void)
+{
+    char* name;
+
+    CHECK(fscache_parse_size("1") == 1);
+    CHECK(fscache_parse_size("4096") == 4096);
+    CHECK(fscache_parse_size("1k") == 1024);
+    CHECK(fscache_parse_size("512M") == 512LL << 20);
+    CHECK(fscache_parse_size("10G") == 10LL << 30);
+    CHECK(fscache_parse_size("2t") == 2LL << 40);
+
+    CHECK(fscache_parse_size("") == -1);
+    CHECK(fscache_parse_size("0") == -1);
+    CHECK(fscache_parse_size("-5M") == -1);
+    CHECK(fscache_parse_size("M") == -1);
+    CHECK(fscache_parse_size("10MB") == -1);
+    CHECK(fscache_parse_size("1.5G") == -1);
+    CHECK(fscache_parse_size("10 G") == -1);
+
+    /* too big to be counted in bytes */
+    CHECK(fscache_parse_size("8388607T") == 8388607LL << 40);
+    CHECK(fscache_parse_size("8388608T") == -1);
+    CHECK(fscache_parse_size("9999999T") == -1);
+    CHECK(fscache_parse_size("9999999999999G") == -1);
+    CHECK(fscache_parse_size("9223372036854775807") == LLONG_MAX);
+    CHECK(fscache_parse_size("9223372036854775808") == -1);
+    CHECK(fscache_parse_size("99999999999999999999K") == -1);
+
+    /* objects are spread over directories by the start of their key */
+    setenv("MRCC_SHARED_CACHE_DIR", "/mrcc/objcache", 1);
+    name = fscache_name("ab12cd");
+    CHECK_STR(name, "/mrcc/objcache/ab/ab12cd.o");
+    free(name);
+
+    return CHECK_RESULT();
+}
@@ -0,0 +1,41 @@
+// mrcc - A C Compiler system on MapReduce
+// Zhiqiang Ma, https://www.ericzma.com
+
+#include "fsgc.h"
+#include "check.h"
+
+/**
+ * @file
+ * @brief Tests of the names and times fsgc.c goes by.
+ **/
+
+int main(void)
+{
+    CHECK(fsgc_hour("t1700000000") == 1700000000LL);
+    CHECK(fsgc_hour("t0") == 0);
+
+    /* anything else under fs_top_dir is not an hour */
+    CHECK(fsgc_hour("t") == -1);
+    CHECK(fsgc_hour("t-3600") == -1);
+    CHECK(fsgc_hour("t 3600") == -1);
+    CHECK(fsgc_hour("t3600x") == -1);
+    CHECK(fsgc_hour("x3600") == -1);
+    CHECK(fsgc_hour("3600") == -1);
+    CHECK(fsgc_hour("objcache") == -1);
+    CHECK(fsgc_hour("") == -1);
+
+    CHECK(fsgc_parse_ttl("0") == 0);
+    CHECK(fsgc_parse_ttl("90") == 90);
+    CHECK(fsgc_parse_ttl("90s") == 90);
+    CHECK(fsgc_parse_ttl("30m") == 30 * 60);
+    CHECK(fsgc_parse_ttl("12h") == 12 * 3600);
+    CHECK(fsgc_parse_ttl("2d") == FSGC_DEFAULT_TTL);
+
+    CHECK(fsgc_parse_ttl("") == -1);
+    CHECK(fsgc_parse_ttl("h") == -1);
+    CHECK(fsgc_parse_ttl("-1h") == -1);
+    CHECK(fsgc_parse_ttl("12H") == -1);
+    CHECK(fsgc_parse_ttl("1w") == -1);
+
+    return CHECK_RESULT();
+}
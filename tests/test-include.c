@@ -0,0 +1,212 @@
+// mrcc - A C Compiler system on MapReduce
+// Zhiqiang Ma, https://www.ericzma.com
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "utils.h"
+#include "stringutils.h"
+#include "args.h"
+#include "include.h"
+#include "check.h"
+
+/**
+ * @file
+ * @brief Tests of the include scanner of include.c, on a tree made in
+ * a temporary directory.
+ **/
+
+// where the tree is, the current directory while testing
+static char top[4096];
+
+/*
+ * Write @p text to @p fname under top, always with the same old mtime,
+ * so that the cache takes it.
+ */
+static void put_file(const char *fname, const char *text)
+{
+    struct timeval tv[2];
+    char *p, *dir;
+    FILE *f;
+
+    dir = strdup(fname);
+    for (p = strchr(dir, '/'); p; p = strchr(p + 1, '/')) {
+        *p = '\0';
+        mkdir(dir, 0777);
+        *p = '/';
+    }
+    free(dir);
+
+    f = fopen(fname, "w");
+    CHECK(f != NULL);
+    if (f == NULL)
+        return;
+    fputs(text, f);
+    CHECK(fclose(f) == 0);
+
+    tv[0].tv_sec = 1500000000;
+    tv[0].tv_usec = 0;
+    tv[1] = tv[0];
+    CHECK(utimes(fname, tv) == 0);
+}
+
+/*
+ * Scan @p input_fname with the options of @p argv and check that the
+ * files found are @p want, in order, relative to top.
+ */
+static void check_files(char **argv, const char *input_fname,
+                        const char *const *want)
+{
+    char **files = NULL, *path;
+    int i;
+
+    CHECK(approximate_includes(argv, input_fname, &files) == 0);
+    if (files == NULL)
+        return;
+    for (i = 0; want[i] && files[i]; i++) {
+        if (asprintf(&path, "%s/%s", top, want[i]) == -1)
+            break;
+        CHECK_STR(files[i], path);
+        free(path);
+    }
+    if (want[i] || files[i]) {
+        fprintf(stderr, "found %s, wanted %s\n",
+                files[i] ? files[i] : "no more",
+                want[i] ? want[i] : "no more");
+        check_failures++;
+    }
+    free_argv(files);
+}
+
+/* Make the tree; every name is a header in every directory it is in. */
+static void make_tree(void)
+{
+    put_file("src/m.c",
+             "#include \"h0.h\"\n"
+             "#include \"h1.h\"\n"
+             "  #  include \"h2.h\"\n"
+             "#include \"h3.h\"\n"
+             "#include \"h4.h\"\n"
+             "#include <h5.h>\n"
+             "#include <stdio.h>\n"
+             "#if 0\n"
+             "#include \"dead.h\"\n"
+             "#endif\n"
+             "#include \"sub/p.h\"\n"
+             "// #include \"not.h\"\n"
+             "int main(void) { return 0; }\n");
+    put_file("src/h0.h", "");
+    put_file("iq/h0.h", "");
+    put_file("iq/h1.h", "");
+    put_file("inc/h1.h", "");
+    put_file("sys/h1.h", "");
+    put_file("after/h1.h", "");
+    put_file("inc/h2.h", "");
+    put_file("sys/h2.h", "");
+    put_file("after/h2.h", "");
+    put_file("sys/h3.h", "");
+    put_file("after/h3.h", "");
+    put_file("after/h4.h", "");
+    put_file("src/h5.h", "");
+    put_file("iq/h5.h", "");
+    put_file("inc/h5.h", "");
+    put_file("src/dead.h", "");
+    put_file("src/sub/p.h", "#include \"./../q.h\"\n");
+    put_file("src/q.h", "");
+    put_file("src/not.h", "");
+
+    put_file("src/t.c",
+             "#include_next <n.h>\n"
+             "#if __has_include(\"hi.h\")\n"
+             "#elif defined(X) && __has_include_next(<hn.h>)\n"
+             "#endif\n");
+    put_file("inc/n.h", "");
+    put_file("sys/n.h", "");
+    put_file("after/n.h", "");
+    put_file("src/hi.h", "");
+    put_file("iq/hi.h", "");
+    put_file("inc/hn.h", "");
+    put_file("after/hn.h", "");
+
+    put_file("src/c.c",
+             "#include \"h0.h\"\n"
+             "#define H \"h1.h\"\n"
+             "#include H\n");
+}
+
+/* The size of @p fname, or -1. */
+static long long file_size(const char *fname)
+{
+    struct stat st;
+
+    return stat(fname, &st) == 0 ? (long long) st.st_size : -1;
+}
+
+int main(void)
+{
+    /* -I comes before -isystem and -idirafter whatever their order */
+    char *argv[] = {
+        "cc", "-idirafter", "after", "-isystem", "sys", "-Iinc",
+        "-iquote", "iq", "-c", "src/m.c", NULL
+    };
+    static const char *const m_files[] = {
+        "src/m.c", "src/h0.h", "iq/h1.h", "inc/h2.h", "sys/h3.h",
+        "after/h4.h", "inc/h5.h", "src/dead.h", "src/sub/p.h", "src/q.h",
+        NULL
+    };
+    static const char *const t_files[] = {
+        "src/t.c", "inc/n.h", "sys/n.h", "after/n.h", "src/hi.h", "iq/hi.h",
+        "inc/hn.h", "after/hn.h", NULL
+    };
+    char dir[] = "/tmp/mrcc-test-include-XXXXXX";
+    char *cache_fname = NULL, *rm = NULL, **files = NULL;
+    int fd;
+
+    if (mkdtemp(dir) == NULL || chdir(dir) == -1
+            || getcwd(top, sizeof top) == NULL) {
+        perror(dir);
+        return 1;
+    }
+    mkdir("mrcc", 0777);
+    setenv("MRCC_DIR", "mrcc", 1);
+    CHECK(asprintf(&cache_fname, "%s/mrcc/state/includes", top) != -1);
+    make_tree();
+
+    /* cold, then warm */
+    check_files(argv, "src/m.c", m_files);
+    CHECK(file_size(cache_fname) > 0);
+    check_files(argv, "src/m.c", m_files);
+
+    /* the warm scan used the cache: a file of the same size and mtime
+     * is not read again */
+    put_file("src/sub/p.h", "#include \"./../r.h\"\n");
+    put_file("src/r.h", "");
+    check_files(argv, "./src/../src/m.c", m_files);
+
+    check_files(argv, "src/t.c", t_files);
+    check_files(argv, "src/t.c", t_files);
+
+    /* what a computed #include reads cannot be known, cached or not */
+    CHECK(approximate_includes(argv, "src/c.c", &files) == EXIT_MRCC_FAILED);
+    CHECK(approximate_includes(argv, "src/c.c", &files) == EXIT_MRCC_FAILED);
+
+    /* a cache too big to read is started over */
+    fd = open(cache_fname, O_WRONLY);
+    CHECK(fd != -1 && ftruncate(fd, 65LL << 20) == 0);
+    close(fd);
+    put_file("src/t.c", "#include_next <n.h>\n");
+    check_files(argv, "src/t.c", (const char *const[]) {
+        "src/t.c", "inc/n.h", "sys/n.h", "after/n.h", NULL
+    });
+    CHECK(file_size(cache_fname) > 0 && file_size(cache_fname) < 4096);
+
+    CHECK(asprintf(&rm, "rm -rf '%s'", top) != -1 && system(rm) == 0);
+    free(rm);
+    free(cache_fname);
+    return CHECK_RESULT();
+}
@@ -0,0 +1,85 @@
+// mrcc - A C Compiler system on MapReduce
+// Zhiqiang Ma, https://www.ericzma.com
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "utils.h"
+#include "io.h"
+#include "check.h"
+
+/**
+ * @file
+ * @brief Tests of pump_copy() of io.c between files.
+ **/
+
+/* Open a new, empty file in @p dir for reading and writing. */
+static int open_temp(const char *dir, const char *name, int flags)
+{
+    char fname[4096];
+
+    snprintf(fname, sizeof fname, "%s/%s", dir, name);
+    return open(fname, O_RDWR|O_CREAT|O_TRUNC|flags, 0600);
+}
+
+/* Check that @p fd holds exactly the @p n bytes of @p want. */
+static void check_content(int fd, const char *want, size_t n)
+{
+    char *buf = malloc(n + 1);
+
+    CHECK(lseek(fd, 0, SEEK_END) == (off_t) n);
+    CHECK(pread(fd, buf, n, 0) == (ssize_t) n && !memcmp(buf, want, n));
+    free(buf);
+}
+
+int main(void)
+{
+    char dir[] = "/tmp/mrcc-test-io-XXXXXX";
+    size_t n = 3 * 4096 + 100, i;
+    char *data = malloc(n);
+    int ifd, ofd, afd;
+
+    if (mkdtemp(dir) == NULL) {
+        perror(dir);
+        return 1;
+    }
+    for (i = 0; i < n; i++)
+        data[i] = (char) (i * 7 + i / 251);
+
+    ifd = open_temp(dir, "in", 0);
+    ofd = open_temp(dir, "out", 0);
+    afd = open_temp(dir, "append", O_APPEND);
+    CHECK(ifd != -1 && ofd != -1 && afd != -1);
+    CHECK(write(ifd, data, n) == (ssize_t) n);
+
+    /* the whole file, both offsets moving on */
+    CHECK(lseek(ifd, 0, SEEK_SET) == 0);
+    CHECK(pump_copy(ofd, ifd, n) == 0);
+    CHECK(lseek(ifd, 0, SEEK_CUR) == (off_t) n);
+    check_content(ofd, data, n);
+
+    /* part of it from the middle, to a file others append to, which
+     * copy_file_range() and sendfile() refuse */
+    CHECK(lseek(ifd, 4096 + 10, SEEK_SET) == 4096 + 10);
+    CHECK(pump_copy(afd, ifd, 4096) == 0);
+    check_content(afd, data + 4096 + 10, 4096);
+
+    /* more than the file has left, as when it shrank */
+    CHECK(ftruncate(afd, 0) == 0);
+    CHECK(lseek(ifd, 4096, SEEK_SET) == 4096);
+    CHECK(pump_copy(afd, ifd, n) == EXIT_TRUNCATED);
+    check_content(afd, data + 4096, n - 4096);
+    CHECK(ftruncate(afd, 0) == 0);
+    CHECK(pump_copy(afd, ifd, 1) == EXIT_TRUNCATED);
+
+    close(ifd);
+    close(ofd);
+    close(afd);
+    free(data);
+    CHECK(chdir(dir) == 0 && unlink("in") == 0 && unlink("out") == 0
+          && unlink("append") == 0 && chdir("/") == 0 && rmdir(dir) == 0);
+    return CHECK_RESULT();
+}